@@ -90,6 +90,7 @@ librdf_init_hash(librdf_world *world)
 #endif
   /* Always have hash in memory implementation available */
   librdf_init_hash_memory(world);
+  librdf_init_hash_memory_flat(world);
 }
 
 
@@ -128,10 +129,110 @@ librdf_delete_hash_factories(librdf_world *world)
 
 /* hash datums structures */
 
+#ifdef WITH_THREADS
+/* Free datums a thread may keep before returning half to the world */
+#define LIBRDF_HASH_DATUM_CACHE_SIZE 64
+
+/*
+ * Per-thread cache of free datums for one world.  Datums are taken
+ * from and returned to it without locking; hash_datums_mutex is only
+ * taken to move half a cache of datums to or from the world list.
+ */
+struct librdf_hash_datum_cache_s {
+  librdf_world* world;
+  librdf_hash_datum* list;
+  int count;
+
+  /* list of all caches of the world, so they can be freed with it */
+  struct librdf_hash_datum_cache_s* prev;
+  struct librdf_hash_datum_cache_s* next;
+};
+
+typedef struct librdf_hash_datum_cache_s librdf_hash_datum_cache;
+
+
+/* called with the world hash_datums_mutex held */
+static void
+librdf_hash_datum_cache_unlink(librdf_hash_datum_cache* cache)
+{
+  if(cache->prev)
+    cache->prev->next = cache->next;
+  else
+    cache->world->hash_datum_caches = cache->next;
+  if(cache->next)
+    cache->next->prev = cache->prev;
+}
+
+
+/* thread exit destructor: give the cached datums back to the world */
+static void
+librdf_hash_datum_cache_finished(void* data)
+{
+  librdf_hash_datum_cache* cache = (librdf_hash_datum_cache*)data;
+  librdf_world* world = cache->world;
+  librdf_hash_datum *datum;
+
+  pthread_mutex_lock(world->hash_datums_mutex);
+
+  while((datum = cache->list)) {
+    cache->list = datum->next;
+    datum->next = world->hash_datums_list;
+    world->hash_datums_list = datum;
+  }
+  librdf_hash_datum_cache_unlink(cache);
+
+  pthread_mutex_unlock(world->hash_datums_mutex);
+
+  LIBRDF_FREE(librdf_hash_datum_cache, cache);
+}
+
+
+/* get the calling thread's cache, or NULL to use the locked world list */
+static librdf_hash_datum_cache*
+librdf_hash_datum_get_cache(librdf_world *world)
+{
+  librdf_hash_datum_cache* cache;
+
+  if(!world->hash_datums_key_created)
+    return NULL;
+
+  cache = (librdf_hash_datum_cache*)pthread_getspecific(world->hash_datums_key);
+  if(cache)
+    return cache;
+
+  cache = LIBRDF_CALLOC(librdf_hash_datum_cache*, 1, sizeof(*cache));
+  if(!cache)
+    return NULL;
+
+  cache->world = world;
+  if(pthread_setspecific(world->hash_datums_key, cache)) {
+    LIBRDF_FREE(librdf_hash_datum_cache, cache);
+    return NULL;
+  }
+
+  pthread_mutex_lock(world->hash_datums_mutex);
+  cache->next = world->hash_datum_caches;
+  if(cache->next)
+    cache->next->prev = cache;
+  world->hash_datum_caches = cache;
+  pthread_mutex_unlock(world->hash_datums_mutex);
+
+  return cache;
+}
+#endif
+
+
 static void
 librdf_init_hash_datums(librdf_world *world)
 {
   world->hash_datums_list=NULL;
+
+#ifdef WITH_THREADS
+  world->hash_datum_caches = NULL;
+  world->hash_datums_key_created =
+    !pthread_key_create(&world->hash_datums_key,
+                        librdf_hash_datum_cache_finished);
+#endif
 }
 
 
@@ -139,10 +240,28 @@ static void
 librdf_free_hash_datums(librdf_world *world)
 {
   librdf_hash_datum *datum, *next;
+#ifdef WITH_THREADS
+  librdf_hash_datum_cache* cache;
+#endif
   
 #ifdef WITH_THREADS
+  /* no more thread exit destructors; free the caches of all threads */
+  if(world->hash_datums_key_created) {
+    pthread_key_delete(world->hash_datums_key);
+    world->hash_datums_key_created = 0;
+  }
+
   if(world->hash_datums_mutex)
     pthread_mutex_lock(world->hash_datums_mutex);
+
+  while((cache = world->hash_datum_caches)) {
+    world->hash_datum_caches = cache->next;
+    for(datum = cache->list; datum; datum = next) {
+      next = datum->next;
+      LIBRDF_FREE(librdf_hash_datum, datum);
+    }
+    LIBRDF_FREE(librdf_hash_datum_cache, cache);
+  }
 #endif
 
   for(datum = world->hash_datums_list; datum; datum = next) {
@@ -172,26 +291,51 @@ librdf_hash_datum*
 librdf_new_hash_datum(librdf_world *world, void *data, size_t size)
 {
   librdf_hash_datum *datum;
+#ifdef WITH_THREADS
+  librdf_hash_datum_cache* cache;
+#endif
 
   librdf_world_open(world);
 
 #ifdef WITH_THREADS
-  pthread_mutex_lock(world->hash_datums_mutex);
-#endif
+  cache = librdf_hash_datum_get_cache(world);
+  if(cache) {
+    if(!cache->list) {
+      /* refill half the cache from the world list */
+      pthread_mutex_lock(world->hash_datums_mutex);
+      while(cache->count < LIBRDF_HASH_DATUM_CACHE_SIZE / 2 &&
+            (datum = world->hash_datums_list)) {
+        world->hash_datums_list = datum->next;
+        datum->next = cache->list;
+        cache->list = datum;
+        cache->count++;
+      }
+      pthread_mutex_unlock(world->hash_datums_mutex);
+    }
 
-  /* get one from free list, or allocate new one */ 
-  if((datum = world->hash_datums_list)) {
-    world->hash_datums_list = datum->next;
+    if((datum = cache->list)) {
+      cache->list = datum->next;
+      cache->count--;
+    }
   } else {
+    pthread_mutex_lock(world->hash_datums_mutex);
+    if((datum = world->hash_datums_list))
+      world->hash_datums_list = datum->next;
+    pthread_mutex_unlock(world->hash_datums_mutex);
+  }
+#else
+  /* get one from free list */ 
+  if((datum = world->hash_datums_list))
+    world->hash_datums_list = datum->next;
+#endif
+
+  /* or allocate new one */ 
+  if(!datum) {
     datum = LIBRDF_CALLOC(librdf_hash_datum*, 1, sizeof(*datum));
     if(datum)
       datum->world = world;
   }
 
-#ifdef WITH_THREADS
-   pthread_mutex_unlock(world->hash_datums_mutex);
-#endif
-
   if(datum) {
     datum->data = data;
     datum->size = size;
@@ -211,6 +355,12 @@ librdf_new_hash_datum(librdf_world *world, void *data, size_t size)
 void
 librdf_free_hash_datum(librdf_hash_datum *datum) 
 {
+  librdf_world *world;
+#ifdef WITH_THREADS
+  librdf_hash_datum_cache* cache;
+  librdf_hash_datum* moved;
+#endif
+
   if(!datum)
     return;
   
@@ -222,15 +372,38 @@ librdf_free_hash_datum(librdf_hash_datum *datum)
     datum->data = NULL;
   }
 
+  world = datum->world;
+
 #ifdef WITH_THREADS
-  pthread_mutex_lock(datum->world->hash_datums_mutex);
+  cache = librdf_hash_datum_get_cache(world);
+  if(cache) {
+    datum->next = cache->list;
+    cache->list = datum;
+    cache->count++;
+
+    if(cache->count > LIBRDF_HASH_DATUM_CACHE_SIZE) {
+      /* return half the cache to the world list */
+      pthread_mutex_lock(world->hash_datums_mutex);
+      while(cache->count > LIBRDF_HASH_DATUM_CACHE_SIZE / 2) {
+        moved = cache->list;
+        cache->list = moved->next;
+        cache->count--;
+        moved->next = world->hash_datums_list;
+        world->hash_datums_list = moved;
+      }
+      pthread_mutex_unlock(world->hash_datums_mutex);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(world->hash_datums_mutex);
 #endif
 
-  datum->next = datum->world->hash_datums_list;
-  datum->world->hash_datums_list = datum;
+  datum->next = world->hash_datums_list;
+  world->hash_datums_list = datum;
 
 #ifdef WITH_THREADS
-  pthread_mutex_unlock(datum->world->hash_datums_mutex);
+  pthread_mutex_unlock(world->hash_datums_mutex);
 #endif
 }
 
@@ -1878,11 +2051,38 @@ librdf_hash_interpret_template(const unsigned char* template_string,
 int main(int argc, char *argv[]);
 
 
+#ifdef WITH_THREADS
+#define TEST_DATUM_THREADS 4
+#define TEST_DATUM_COUNT 200
+
+static void*
+test_hash_datum_thread(void* arg)
+{
+  librdf_world* world = (librdf_world*)arg;
+  librdf_hash_datum* datums[TEST_DATUM_COUNT];
+  int round;
+  int i;
+
+  for(round = 0; round < 1000; round++) {
+    for(i = 0; i < TEST_DATUM_COUNT; i++) {
+      datums[i] = librdf_new_hash_datum(world, NULL, 0);
+      if(!datums[i])
+        return arg;
+    }
+    for(i = 0; i < TEST_DATUM_COUNT; i++)
+      librdf_free_hash_datum(datums[i]);
+  }
+
+  return NULL;
+}
+#endif
+
+
 int
 main(int argc, char *argv[]) 
 {
   librdf_hash *h, *h2, *ch;
-  const char *test_hash_types[]={"bdb", "memory", NULL};
+  const char *test_hash_types[]={"bdb", "memory", "memory-flat", NULL};
   const char *test_hash_values[]={"colour","yellow", /* Made in UK, can you guess? */
 			    "age", "new",
 			    "size", "large",
@@ -2142,6 +2342,25 @@ main(int argc, char *argv[])
 
   librdf_free_hash(h2);
 
+
+#ifdef WITH_THREADS
+  if(1) {
+    pthread_t threads[TEST_DATUM_THREADS];
+    void* result;
+    
+    fprintf(stdout, "%s: Recycling hash datums in %d threads\n", program,
+            TEST_DATUM_THREADS);
+    for(i = 0; i < TEST_DATUM_THREADS; i++)
+      pthread_create(&threads[i], NULL, test_hash_datum_thread, world);
+    for(i = 0; i < TEST_DATUM_THREADS; i++) {
+      pthread_join(threads[i], &result);
+      if(result) {
+        fprintf(stdout, "%s: Failed to allocate a hash datum\n", program);
+        exit(1);
+      }
+    }
+  }
+#endif
    
   librdf_free_world(world);
   
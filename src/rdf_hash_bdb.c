@@ -46,6 +46,10 @@
 #include <db.h>
 #endif
 
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
 #include <redland.h>
 #include <rdf_hash.h>
 
@@ -59,8 +63,21 @@ typedef struct
   /* for BerkeleyDB only */
   DB* db;
   char* file_name;
+#ifdef WITH_THREADS
+  /* serialises reads through the DB handle, which is not opened
+   * DB_THREAD, for concurrent model readers; writers are exclusive */
+  pthread_mutex_t mutex;
+#endif
 } librdf_hash_bdb_context;
 
+#ifdef WITH_THREADS
+#define BDB_LOCK(hcontext) pthread_mutex_lock(&(hcontext)->mutex)
+#define BDB_UNLOCK(hcontext) pthread_mutex_unlock(&(hcontext)->mutex)
+#else
+#define BDB_LOCK(hcontext)
+#define BDB_UNLOCK(hcontext)
+#endif
+
 
 /* Implementing the hash cursor */
 static int librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context);
@@ -102,6 +119,9 @@ librdf_hash_bdb_create(librdf_hash* hash, void* context)
   librdf_hash_bdb_context* hcontext=(librdf_hash_bdb_context*)context;
 
   hcontext->hash=hash;
+#ifdef WITH_THREADS
+  pthread_mutex_init(&hcontext->mutex, NULL);
+#endif
   return 0;
 }
 
@@ -117,7 +137,11 @@ librdf_hash_bdb_create(librdf_hash* hash, void* context)
 static int
 librdf_hash_bdb_destroy(void* context) 
 {
-  /* NOP */
+#ifdef WITH_THREADS
+  librdf_hash_bdb_context* hcontext=(librdf_hash_bdb_context*)context;
+
+  pthread_mutex_destroy(&hcontext->mutex);
+#endif
   return 0;
 }
 
@@ -335,6 +359,9 @@ librdf_hash_bdb_clone(librdf_hash *hash, void* context, char *new_identifier,
   
   /* copy data fields that might change */
   hcontext->hash=hash;
+#ifdef WITH_THREADS
+  pthread_mutex_init(&hcontext->mutex, NULL);
+#endif
 
   /* Note: The options are not used at present, so no need to make a copy 
    */
@@ -414,25 +441,28 @@ librdf_hash_bdb_cursor_init(void *cursor_context, void *hash_context)
   librdf_hash_bdb_cursor_context *cursor=(librdf_hash_bdb_cursor_context*)cursor_context;
 #ifdef HAVE_BDB_CURSOR
   DB* db;
+  int ret;
 #endif
 
   cursor->hash=(librdf_hash_bdb_context*)hash_context;
 
 #ifdef HAVE_BDB_CURSOR
   db=cursor->hash->db;
+  BDB_LOCK(cursor->hash);
 #ifdef HAVE_BDB_CURSOR_4_ARGS
   /* V3 prototype:
    * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp, u_int32_t flags);
    */
-  if(db->cursor(db, NULL, &cursor->cursor, 0))
-    return 1;
+  ret=db->cursor(db, NULL, &cursor->cursor, 0);
 #else
   /* V2 prototype:
    * int DB->cursor(DB *db, DB_TXN *txnid, DBC **cursorp);
    */
-  if(db->cursor(db, NULL, &cursor->cursor))
-    return 1;
+  ret=db->cursor(db, NULL, &cursor->cursor);
 #endif
+  BDB_UNLOCK(cursor->hash);
+  if(ret)
+    return 1;
 #endif
 
   return 0;
@@ -485,6 +515,7 @@ librdf_hash_bdb_cursor_get(void* context,
   db=cursor->hash->db;
 #endif
   
+  BDB_LOCK(cursor->hash);
   switch(flags) {
     case LIBRDF_HASH_CURSOR_SET:
 
@@ -575,11 +606,13 @@ librdf_hash_bdb_cursor_get(void* context,
       break;
       
     default:
+      BDB_UNLOCK(cursor->hash);
       librdf_log(cursor->hash->hash->world,
                  0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
                  "Unknown hash method flag %d", flags);
       return 1;
   }
+  BDB_UNLOCK(cursor->hash);
 
 
   /* Free previous key and values */
@@ -656,8 +689,11 @@ librdf_hash_bdb_cursor_finish(void* context)
 
 #ifdef HAVE_BDB_CURSOR
   /* BDB V2/V3 */
-  if(cursor->cursor)
+  if(cursor->cursor) {
+    BDB_LOCK(cursor->hash);
     cursor->cursor->c_close(cursor->cursor);
+    BDB_UNLOCK(cursor->hash);
+  }
 #endif
   if(cursor->last_key)
     LIBRDF_FREE(char*, cursor->last_key);
@@ -755,6 +791,7 @@ librdf_hash_bdb_exists(void* context, librdf_hash_datum *key,
     bdb_value.size = LIBRDF_BAD_CAST(u_int32_t, value->size);
   }
 	
+  BDB_LOCK(bdb_context);
 #ifdef HAVE_BDB_DB_TXN
 #ifdef DB_GET_BOTH
   /* later V2 (sigh)/V3 */
@@ -860,6 +897,7 @@ librdf_hash_bdb_exists(void* context, librdf_hash_datum *key,
   }
   
 #endif
+  BDB_UNLOCK(bdb_context);
 
   return ret;
 }
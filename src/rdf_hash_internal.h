@@ -176,6 +176,7 @@ int librdf_hash_cursor_get_next(librdf_hash_cursor *cursor, librdf_hash_datum *k
 void librdf_init_hash_bdb(librdf_world *world);
 #endif
 void librdf_init_hash_memory(librdf_world *world);
+void librdf_init_hash_memory_flat(librdf_world *world);
 
 
 #ifdef __cplusplus
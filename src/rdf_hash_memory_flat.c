@@ -0,0 +1,1196 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_hash_memory_flat.c - RDF Hash In Memory open addressing Implementation
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+/*
+ * The "memory-flat" hash keeps every key in one open addressing table
+ * split into groups of LIBRDF_HASH_MEMORY_FLAT_GROUP_WIDTH slots.
+ * Each slot has a one byte control entry holding either EMPTY, DELETED
+ * or 7 bits of the key hash, so a probe of a group compares all its
+ * control bytes at once (with SSE2 when available) and only touches
+ * slots whose control byte matches.  Key and value bytes are copied
+ * into large arena blocks that are freed all at once when the hash
+ * is destroyed; space from deleted entries is reclaimed when the table
+ * is rebuilt.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <sys/types.h>
+
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LIBRDF_HASH_MEMORY_FLAT_SSE2 1
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/* slots per probe group - MUST BE 16 for the SSE2 group match */
+#define LIBRDF_HASH_MEMORY_FLAT_GROUP_WIDTH 16
+
+/* starting capacity in slots - MUST BE POWER OF 2 and >= group width */
+#define LIBRDF_HASH_MEMORY_FLAT_INITIAL_CAPACITY 16
+
+/* maximum load (keys + deleted slots) out of 8 before rebuilding */
+#define LIBRDF_HASH_MEMORY_FLAT_MAX_LOAD 7
+
+/* size of an arena block; larger entries get a block of their own */
+#define LIBRDF_HASH_MEMORY_FLAT_ARENA_BLOCK_SIZE 65536
+
+/* control byte values; anything else is 7 bits of hash (0x00-0x7f) */
+#define LIBRDF_HASH_MEMORY_FLAT_CTRL_EMPTY   0x80
+#define LIBRDF_HASH_MEMORY_FLAT_CTRL_DELETED 0xFE
+
+
+/* private structures */
+
+/* one block of the bump allocator arena */
+struct librdf_hash_memory_flat_block_s
+{
+  struct librdf_hash_memory_flat_block_s* next;
+  size_t size;
+  size_t used;
+  /* block data follows this header */
+};
+typedef struct librdf_hash_memory_flat_block_s librdf_hash_memory_flat_block;
+
+
+/* one value of a key, allocated in the arena, bytes follow the header */
+struct librdf_hash_memory_flat_value_s
+{
+  struct librdf_hash_memory_flat_value_s* next;
+  size_t value_len;
+};
+typedef struct librdf_hash_memory_flat_value_s librdf_hash_memory_flat_value;
+
+#define LIBRDF_HASH_MEMORY_FLAT_VALUE_DATA(v) ((unsigned char*)((v) + 1))
+
+
+typedef struct
+{
+  u64 hash_key;
+  unsigned char *key; /* in arena */
+  size_t key_len;
+  librdf_hash_memory_flat_value *values;
+  int values_count;
+} librdf_hash_memory_flat_slot;
+
+
+typedef struct
+{
+  /* the hash object */
+  librdf_hash* hash;
+  /* control bytes, one per slot */
+  unsigned char *ctrl;
+  /* slots */
+  librdf_hash_memory_flat_slot *slots;
+  /* total slots - power of 2, multiple of group width (or 0) */
+  size_t capacity;
+  /* this many keys */
+  size_t keys;
+  /* this many slots marked deleted */
+  size_t deleted;
+  /* this many values */
+  int values;
+
+  /* arena of key and value bytes */
+  librdf_hash_memory_flat_block *blocks;
+  /* bytes in the arena still referenced / no longer referenced */
+  size_t live_bytes;
+  size_t dead_bytes;
+} librdf_hash_memory_flat_context;
+
+
+typedef struct {
+  librdf_hash_memory_flat_context* hash;
+  size_t current_slot;
+  librdf_hash_memory_flat_value *current_value;
+  int have_slot;
+} librdf_hash_memory_flat_cursor_context;
+
+
+/* prototypes for local functions */
+static u64 librdf_hash_memory_flat_hash_bytes(const unsigned char *p, size_t len);
+static void* librdf_hash_memory_flat_arena_alloc(librdf_hash_memory_flat_context* hash, size_t size);
+static int librdf_hash_memory_flat_find_slot(librdf_hash_memory_flat_context* hash, const void *key, size_t key_len, u64 hash_key, size_t *slot_p);
+static int librdf_hash_memory_flat_rebuild(librdf_hash_memory_flat_context* hash, size_t new_capacity);
+
+/* Implementing the hash cursor */
+static int librdf_hash_memory_flat_cursor_init(void *cursor_context, void *hash_context);
+static int librdf_hash_memory_flat_cursor_get(void* context, librdf_hash_datum* key, librdf_hash_datum* value, unsigned int flags);
+static void librdf_hash_memory_flat_cursor_finish(void* context);
+
+
+/* functions implementing the API */
+
+static int librdf_hash_memory_flat_create(librdf_hash* new_hash, void* context);
+static int librdf_hash_memory_flat_destroy(void* context);
+static int librdf_hash_memory_flat_open(void* context, const char *identifier, int mode, int is_writable, int is_new, librdf_hash* options);
+static int librdf_hash_memory_flat_close(void* context);
+static int librdf_hash_memory_flat_clone(librdf_hash* new_hash, void *new_context, char *new_identifier, void* old_context);
+static int librdf_hash_memory_flat_values_count(void *context);
+static int librdf_hash_memory_flat_put(void* context, librdf_hash_datum *key, librdf_hash_datum *data);
+static int librdf_hash_memory_flat_exists(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_memory_flat_delete_key(void* context, librdf_hash_datum *key);
+static int librdf_hash_memory_flat_delete_key_value(void* context, librdf_hash_datum *key, librdf_hash_datum *value);
+static int librdf_hash_memory_flat_sync(void* context);
+static int librdf_hash_memory_flat_get_fd(void* context);
+
+static void librdf_hash_memory_flat_register_factory(librdf_hash_factory *factory);
+
+
+
+/* helper functions */
+
+#define LIBRDF_HASH_MEMORY_FLAT_PRIME1 ((u64)0x9E3779B185EBCA87ULL)
+#define LIBRDF_HASH_MEMORY_FLAT_PRIME2 ((u64)0xC2B2AE3D27D4EB4FULL)
+#define LIBRDF_HASH_MEMORY_FLAT_PRIME3 ((u64)0x165667B19E3779F9ULL)
+#define LIBRDF_HASH_MEMORY_FLAT_PRIME4 ((u64)0x85EBCA77C2B2AE63ULL)
+#define LIBRDF_HASH_MEMORY_FLAT_PRIME5 ((u64)0x27D4EB2F165667C5ULL)
+
+#define LIBRDF_HASH_MEMORY_FLAT_ROTL64(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+
+/*
+ * librdf_hash_memory_flat_hash_bytes:
+ * @p: bytes
+ * @len: length of bytes
+ *
+ * INTERNAL - 64 bit hash of a byte string, following the XXH64 single
+ * lane mixing: 8 bytes at a time, then 4, then single bytes, followed
+ * by a final avalanche.
+ *
+ * Return value: hash value
+ */
+static u64
+librdf_hash_memory_flat_hash_bytes(const unsigned char *p, size_t len)
+{
+  const unsigned char *end = p + len;
+  u64 h = LIBRDF_HASH_MEMORY_FLAT_PRIME5 + (u64)len;
+
+  while(p + 8 <= end) {
+    u64 k;
+
+    memcpy(&k, p, 8);
+    k *= LIBRDF_HASH_MEMORY_FLAT_PRIME2;
+    k = LIBRDF_HASH_MEMORY_FLAT_ROTL64(k, 31);
+    k *= LIBRDF_HASH_MEMORY_FLAT_PRIME1;
+    h ^= k;
+    h = LIBRDF_HASH_MEMORY_FLAT_ROTL64(h, 27) * LIBRDF_HASH_MEMORY_FLAT_PRIME1 + LIBRDF_HASH_MEMORY_FLAT_PRIME4;
+    p += 8;
+  }
+
+  if(p + 4 <= end) {
+    u32 k;
+
+    memcpy(&k, p, 4);
+    h ^= (u64)k * LIBRDF_HASH_MEMORY_FLAT_PRIME1;
+    h = LIBRDF_HASH_MEMORY_FLAT_ROTL64(h, 23) * LIBRDF_HASH_MEMORY_FLAT_PRIME2 + LIBRDF_HASH_MEMORY_FLAT_PRIME3;
+    p += 4;
+  }
+
+  while(p < end) {
+    h ^= (u64)(*p++) * LIBRDF_HASH_MEMORY_FLAT_PRIME5;
+    h = LIBRDF_HASH_MEMORY_FLAT_ROTL64(h, 11) * LIBRDF_HASH_MEMORY_FLAT_PRIME1;
+  }
+
+  h ^= h >> 33;
+  h *= LIBRDF_HASH_MEMORY_FLAT_PRIME2;
+  h ^= h >> 29;
+  h *= LIBRDF_HASH_MEMORY_FLAT_PRIME3;
+  h ^= h >> 32;
+
+  return h;
+}
+
+
+/* the slot position part of the hash (h1) and the control byte (h2) */
+#define LIBRDF_HASH_MEMORY_FLAT_H1(h) ((size_t)((h) >> 7))
+#define LIBRDF_HASH_MEMORY_FLAT_H2(h) ((unsigned char)((h) & 0x7f))
+
+
+/*
+ * librdf_hash_memory_flat_group_match:
+ * @ctrl: first control byte of the group
+ * @byte: control byte to look for
+ *
+ * INTERNAL - Find the slots of a group with a given control byte.
+ *
+ * Return value: bitmask with bit i set if control byte i matches
+ */
+static unsigned int
+librdf_hash_memory_flat_group_match(const unsigned char *ctrl,
+                                    unsigned char byte)
+{
+#ifdef LIBRDF_HASH_MEMORY_FLAT_SSE2
+  __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+  __m128i match = _mm_set1_epi8((char)byte);
+
+  return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, match));
+#else
+  unsigned int mask = 0;
+  int i;
+
+  for(i = 0; i < LIBRDF_HASH_MEMORY_FLAT_GROUP_WIDTH; i++) {
+    if(ctrl[i] == byte)
+      mask |= (1U << i);
+  }
+  return mask;
+#endif
+}
+
+
+/* index of lowest set bit of a non-0 group mask */
+static int
+librdf_hash_memory_flat_mask_first(unsigned int mask)
+{
+#if defined(__GNUC__)
+  return __builtin_ctz(mask);
+#else
+  int i = 0;
+
+  while(!(mask & 1)) {
+    mask >>= 1;
+    i++;
+  }
+  return i;
+#endif
+}
+
+
+/*
+ * librdf_hash_memory_flat_arena_alloc:
+ * @hash: the flat hash context
+ * @size: bytes wanted
+ *
+ * INTERNAL - Allocate bytes from the arena, aligned for a pointer.
+ *
+ * Return value: pointer to the bytes or NULL on failure
+ */
+static void*
+librdf_hash_memory_flat_arena_alloc(librdf_hash_memory_flat_context* hash,
+                                    size_t size)
+{
+  librdf_hash_memory_flat_block* block = hash->blocks;
+  unsigned char *p;
+  const size_t align = sizeof(void*);
+
+  size = (size + align - 1) & ~(align - 1);
+
+  if(!block || block->size - block->used < size) {
+    size_t block_size = LIBRDF_HASH_MEMORY_FLAT_ARENA_BLOCK_SIZE;
+
+    if(size > block_size)
+      block_size = size;
+
+    block = LIBRDF_MALLOC(librdf_hash_memory_flat_block*,
+                          sizeof(*block) + block_size);
+    if(!block)
+      return NULL;
+
+    block->size = block_size;
+    block->used = 0;
+
+    if(hash->blocks && size == block_size) {
+      /* keep the partly used current block at the head for small entries */
+      block->next = hash->blocks->next;
+      hash->blocks->next = block;
+    } else {
+      block->next = hash->blocks;
+      hash->blocks = block;
+    }
+  }
+
+  p = (unsigned char*)(block + 1) + block->used;
+  block->used += size;
+  hash->live_bytes += size;
+
+  return p;
+}
+
+
+static void
+librdf_hash_memory_flat_free_blocks(librdf_hash_memory_flat_block* block)
+{
+  while(block) {
+    librdf_hash_memory_flat_block* next = block->next;
+
+    LIBRDF_FREE(librdf_hash_memory_flat_block, block);
+    block = next;
+  }
+}
+
+
+/* arena bytes used by an entry of this size (as rounded by arena_alloc) */
+#define LIBRDF_HASH_MEMORY_FLAT_ARENA_SIZE(size) \
+  (((size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+
+/*
+ * librdf_hash_memory_flat_find_slot:
+ * @hash: the flat hash context
+ * @key: key bytes
+ * @key_len: key length
+ * @hash_key: hash of the key
+ * @slot_p: pointer to store slot index
+ *
+ * INTERNAL - Find the slot for a key.
+ *
+ * If the key is present, the slot holding it is stored in *slot_p.
+ * Otherwise the first empty or deleted slot on the probe sequence,
+ * where the key would be inserted, is stored there.
+ *
+ * Return value: non 0 if the key was found
+ */
+static int
+librdf_hash_memory_flat_find_slot(librdf_hash_memory_flat_context* hash,
+                                  const void *key, size_t key_len,
+                                  u64 hash_key, size_t *slot_p)
+{
+  size_t groups_mask = (hash->capacity / LIBRDF_HASH_MEMORY_FLAT_GROUP_WIDTH) - 1;
+  size_t group = LIBRDF_HASH_MEMORY_FLAT_H1(hash_key) & groups_mask;
+  unsigned char h2 = LIBRDF_HASH_MEMORY_FLAT_H2(hash_key);
+  size_t stride = 0;
+  int have_insert_slot = 0;
+
+  while(1) {
+    size_t base = group * LIBRDF_HASH_MEMORY_FLAT_GROUP_WIDTH;
+    const unsigned char *ctrl = hash->ctrl + base;
+    unsigned int mask;
+    unsigned int empty_mask;
+
+    mask = librdf_hash_memory_flat_group_match(ctrl, h2);
+    while(mask) {
+      int i = librdf_hash_memory_flat_mask_first(mask);
+      librdf_hash_memory_flat_slot* slot = &hash->slots[base + i];
+
+      if(slot->hash_key == hash_key && slot->key_len == key_len &&
+         !memcmp(slot->key, key, key_len)) {
+        *slot_p = base + i;
+        return 1;
+      }
+      mask &= mask - 1;
+    }
+
+    empty_mask = librdf_hash_memory_flat_group_match(ctrl,
+                                                     LIBRDF_HASH_MEMORY_FLAT_CTRL_EMPTY);
+    if(!have_insert_slot) {
+      unsigned int free_mask = empty_mask |
+        librdf_hash_memory_flat_group_match(ctrl,
+                                            LIBRDF_HASH_MEMORY_FLAT_CTRL_DELETED);
+      if(free_mask) {
+        *slot_p = base + librdf_hash_memory_flat_mask_first(free_mask);
+        have_insert_slot = 1;
+      }
+    }
+
+    /* an empty slot in the group ends every probe sequence through it */
+    if(empty_mask)
+      return 0;
+
+    /* triangular probing visits every group of a power of 2 table */
+    stride++;
+    group = (group + stride) & groups_mask;
+  }
+}
+
+
+/*
+ * librdf_hash_memory_flat_rebuild:
+ * @hash: the flat hash context
+ * @new_capacity: new number of slots
+ *
+ * INTERNAL - Rebuild the table at a new size, dropping deleted slots.
+ *
+ * When more arena bytes are dead than live, the keys and values are
+ * also copied into a fresh arena and the old one is freed.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_hash_memory_flat_rebuild(librdf_hash_memory_flat_context* hash,
+                                size_t new_capacity)
+{
+  librdf_hash_memory_flat_context new_hash; /* on stack */
+  size_t i;
+  int compact;
+
+  memset(&new_hash, 0, sizeof(new_hash));
+  new_hash.hash = hash->hash;
+  new_hash.capacity = new_capacity;
+  new_hash.keys = hash->keys;
+  new_hash.values = hash->values;
+
+  new_hash.ctrl = LIBRDF_MALLOC(unsigned char*, new_capacity);
+  if(!new_hash.ctrl)
+    return 1;
+  memset(new_hash.ctrl, LIBRDF_HASH_MEMORY_FLAT_CTRL_EMPTY, new_capacity);
+
+  new_hash.slots = LIBRDF_CALLOC(librdf_hash_memory_flat_slot*, new_capacity,
+                                 sizeof(librdf_hash_memory_flat_slot));
+  if(!new_hash.slots) {
+    LIBRDF_FREE(char*, new_hash.ctrl);
+    return 1;
+  }
+
+  compact = (hash->dead_bytes > hash->live_bytes);
+  if(!compact) {
+    new_hash.blocks = hash->blocks;
+    new_hash.live_bytes = hash->live_bytes;
+    new_hash.dead_bytes = hash->dead_bytes;
+  }
+
+  for(i = 0; i < hash->capacity; i++) {
+    librdf_hash_memory_flat_slot* slot;
+    size_t new_slot;
+
+    if(hash->ctrl[i] & 0x80)
+      continue;
+
+    slot = &hash->slots[i];
+    librdf_hash_memory_flat_find_slot(&new_hash, slot->key, slot->key_len,
+                                      slot->hash_key, &new_slot);
+    new_hash.ctrl[new_slot] = hash->ctrl[i];
+    new_hash.slots[new_slot] = *slot;
+
+    if(compact) {
+      librdf_hash_memory_flat_slot* nslot = &new_hash.slots[new_slot];
+      librdf_hash_memory_flat_value *vnode;
+      librdf_hash_memory_flat_value *prev = NULL;
+
+      nslot->key = (unsigned char*)librdf_hash_memory_flat_arena_alloc(&new_hash, slot->key_len);
+      if(!nslot->key && slot->key_len)
+        goto failed;
+      memcpy(nslot->key, slot->key, slot->key_len);
+
+      nslot->values = NULL;
+      for(vnode = slot->values; vnode; vnode = vnode->next) {
+        librdf_hash_memory_flat_value *new_vnode;
+
+        new_vnode = (librdf_hash_memory_flat_value*)librdf_hash_memory_flat_arena_alloc(&new_hash, sizeof(*vnode) + vnode->value_len);
+        if(!new_vnode)
+          goto failed;
+        new_vnode->next = NULL;
+        new_vnode->value_len = vnode->value_len;
+        memcpy(LIBRDF_HASH_MEMORY_FLAT_VALUE_DATA(new_vnode),
+               LIBRDF_HASH_MEMORY_FLAT_VALUE_DATA(vnode), vnode->value_len);
+        if(prev)
+          prev->next = new_vnode;
+        else
+          nslot->values = new_vnode;
+        prev = new_vnode;
+      }
+    }
+  }
+
+  if(hash->ctrl)
+    LIBRDF_FREE(char*, hash->ctrl);
+  if(hash->slots)
+    LIBRDF_FREE(librdf_hash_memory_flat_slot, hash->slots);
+  if(compact)
+    librdf_hash_memory_flat_free_blocks(hash->blocks);
+
+  *hash = new_hash;
+  return 0;
+
+  failed:
+  if(compact)
+    librdf_hash_memory_flat_free_blocks(new_hash.blocks);
+  LIBRDF_FREE(char*, new_hash.ctrl);
+  LIBRDF_FREE(librdf_hash_memory_flat_slot, new_hash.slots);
+  return 1;
+}
+
+
+/*
+ * librdf_hash_memory_flat_lookup:
+ * @hash: the flat hash context
+ * @key: key datum
+ *
+ * INTERNAL - Find the slot holding a key.
+ *
+ * Return value: pointer to the slot or NULL if not present
+ */
+static librdf_hash_memory_flat_slot*
+librdf_hash_memory_flat_lookup(librdf_hash_memory_flat_context* hash,
+                               librdf_hash_datum *key)
+{
+  size_t slot;
+  u64 hash_key;
+
+  if(!hash->keys)
+    return NULL;
+
+  hash_key = librdf_hash_memory_flat_hash_bytes((const unsigned char*)key->data,
+                                                key->size);
+  if(!librdf_hash_memory_flat_find_slot(hash, key->data, key->size, hash_key,
+                                        &slot))
+    return NULL;
+
+  return &hash->slots[slot];
+}
+
+
+/*
+ * librdf_hash_memory_flat_remove_slot:
+ * @hash: the flat hash context
+ * @slot_index: slot of the key to remove
+ *
+ * INTERNAL - Remove a key, whose values have already gone, from the table.
+ */
+static void
+librdf_hash_memory_flat_remove_slot(librdf_hash_memory_flat_context* hash,
+                                    size_t slot_index)
+{
+  size_t base = slot_index & ~((size_t)LIBRDF_HASH_MEMORY_FLAT_GROUP_WIDTH - 1);
+  librdf_hash_memory_flat_slot* slot = &hash->slots[slot_index];
+
+  hash->dead_bytes += LIBRDF_HASH_MEMORY_FLAT_ARENA_SIZE(slot->key_len);
+  hash->live_bytes -= LIBRDF_HASH_MEMORY_FLAT_ARENA_SIZE(slot->key_len);
+  memset(slot, 0, sizeof(*slot));
+
+  /* A probe stops at a group with an empty slot, so no probe runs
+   * through this group and the slot can become empty rather than
+   * deleted.
+   */
+  if(librdf_hash_memory_flat_group_match(hash->ctrl + base,
+                                         LIBRDF_HASH_MEMORY_FLAT_CTRL_EMPTY))
+    hash->ctrl[slot_index] = LIBRDF_HASH_MEMORY_FLAT_CTRL_EMPTY;
+  else {
+    hash->ctrl[slot_index] = LIBRDF_HASH_MEMORY_FLAT_CTRL_DELETED;
+    hash->deleted++;
+  }
+
+  hash->keys--;
+}
+
+
+
+/* functions implementing hash api */
+
+/**
+ * librdf_hash_memory_flat_create:
+ * @hash: #librdf_hash hash
+ * @context: flat memory hash contxt
+ *
+ * Create a new flat memory hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_create(librdf_hash* hash, void* context)
+{
+  librdf_hash_memory_flat_context* hcontext=(librdf_hash_memory_flat_context*)context;
+
+  hcontext->hash=hash;
+  return librdf_hash_memory_flat_rebuild(hcontext,
+                                         LIBRDF_HASH_MEMORY_FLAT_INITIAL_CAPACITY);
+}
+
+
+/**
+ * librdf_hash_memory_flat_destroy:
+ * @context: flat memory hash context
+ *
+ * Destroy a flat memory hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_destroy(void* context)
+{
+  librdf_hash_memory_flat_context* hcontext=(librdf_hash_memory_flat_context*)context;
+
+  if(hcontext->ctrl)
+    LIBRDF_FREE(char*, hcontext->ctrl);
+  if(hcontext->slots)
+    LIBRDF_FREE(librdf_hash_memory_flat_slot, hcontext->slots);
+
+  /* all keys and values go at once */
+  librdf_hash_memory_flat_free_blocks(hcontext->blocks);
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_open:
+ * @context: flat memory hash context
+ * @identifier: identifier - not used
+ * @mode: access mode - not used
+ * @is_writable: is hash writable? - not used
+ * @is_new: is hash new? - not used
+ * @options: #librdf_hash of options - not used
+ *
+ * Open flat memory hash with given parameters.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_open(void* context, const char *identifier,
+                             int mode, int is_writable, int is_new,
+                             librdf_hash* options)
+{
+  /* NOP */
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_close:
+ * @context: flat memory hash context
+ *
+ * Close the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_close(void* context)
+{
+  /* NOP */
+  return 0;
+}
+
+
+static int
+librdf_hash_memory_flat_clone(librdf_hash *hash, void* context,
+                              char *new_identifer, void *old_context)
+{
+  librdf_hash_memory_flat_context* hcontext=(librdf_hash_memory_flat_context*)context;
+  librdf_hash_memory_flat_context* old_hcontext=(librdf_hash_memory_flat_context*)old_context;
+  size_t i;
+
+  hcontext->hash=hash;
+
+  /* Don't need to deal with new_identifier - not used for memory hashes */
+
+  /* Size the new table once rather than growing it while copying */
+  if(librdf_hash_memory_flat_rebuild(hcontext, old_hcontext->capacity))
+    return 1;
+
+  for(i=0; i < old_hcontext->capacity; i++) {
+    librdf_hash_memory_flat_slot* slot;
+    librdf_hash_memory_flat_value *vnode;
+    librdf_hash_datum key; /* on stack */
+
+    if(old_hcontext->ctrl[i] & 0x80)
+      continue;
+
+    slot=&old_hcontext->slots[i];
+    key.data=slot->key;
+    key.size=slot->key_len;
+
+    for(vnode=slot->values; vnode; vnode=vnode->next) {
+      librdf_hash_datum value; /* on stack */
+
+      value.data=LIBRDF_HASH_MEMORY_FLAT_VALUE_DATA(vnode);
+      value.size=vnode->value_len;
+      if(librdf_hash_memory_flat_put(hcontext, &key, &value))
+        return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_values_count:
+ * @context: flat memory hash cursor context
+ *
+ * Get the number of values in the hash.
+ *
+ * Return value: number of values in the hash or <0 on failure
+ **/
+static int
+librdf_hash_memory_flat_values_count(void *context)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+
+  return hash->values;
+}
+
+
+/**
+ * librdf_hash_memory_flat_cursor_init:
+ * @cursor_context: hash cursor context
+ * @hash_context: hash to operate over
+ *
+ * Initialise a new hash cursor.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_cursor_init(void *cursor_context, void *hash_context)
+{
+  librdf_hash_memory_flat_cursor_context *cursor=(librdf_hash_memory_flat_cursor_context*)cursor_context;
+
+  cursor->hash = (librdf_hash_memory_flat_context*)hash_context;
+  return 0;
+}
+
+
+/* move cursor to the first used slot at or after index; non 0 at end */
+static int
+librdf_hash_memory_flat_cursor_seek(librdf_hash_memory_flat_cursor_context *cursor,
+                                    size_t index)
+{
+  librdf_hash_memory_flat_context* hash=cursor->hash;
+
+  for(; index < hash->capacity; index++) {
+    if(!(hash->ctrl[index] & 0x80)) {
+      cursor->current_slot=index;
+      cursor->current_value=hash->slots[index].values;
+      cursor->have_slot=1;
+      return 0;
+    }
+  }
+
+  cursor->have_slot=0;
+  cursor->current_value=NULL;
+  return 1;
+}
+
+
+/**
+ * librdf_hash_memory_flat_cursor_get:
+ * @context: flat memory hash cursor context
+ * @key: pointer to key to use
+ * @value: pointer to value to use
+ * @flags: flags
+ *
+ * Retrieve a hash value for the given key.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_cursor_get(void* context,
+                                   librdf_hash_datum *key,
+                                   librdf_hash_datum *value,
+                                   unsigned int flags)
+{
+  librdf_hash_memory_flat_cursor_context *cursor=(librdf_hash_memory_flat_cursor_context*)context;
+  librdf_hash_memory_flat_value *vnode;
+  librdf_hash_memory_flat_slot *slot;
+
+  switch(flags) {
+    case LIBRDF_HASH_CURSOR_SET:
+      slot=librdf_hash_memory_flat_lookup(cursor->hash, key);
+      if(!slot) {
+        cursor->have_slot=0;
+        return 1;
+      }
+      cursor->current_slot=LIBRDF_GOOD_CAST(size_t, slot - cursor->hash->slots);
+      cursor->current_value=slot->values;
+      cursor->have_slot=1;
+
+      /* FALLTHROUGH */
+    case LIBRDF_HASH_CURSOR_NEXT_VALUE:
+      if(!cursor->have_slot || !cursor->current_value)
+        return 1;
+
+      vnode=cursor->current_value;
+      value->data=LIBRDF_HASH_MEMORY_FLAT_VALUE_DATA(vnode);
+      value->size=vnode->value_len;
+      cursor->current_value=vnode->next;
+      break;
+
+    case LIBRDF_HASH_CURSOR_FIRST:
+      if(librdf_hash_memory_flat_cursor_seek(cursor, 0))
+        return 1;
+
+      /* FALLTHROUGH */
+    case LIBRDF_HASH_CURSOR_NEXT:
+      if(!cursor->have_slot)
+        return 1;
+
+      slot=&cursor->hash->slots[cursor->current_slot];
+      key->data=slot->key;
+      key->size=slot->key_len;
+
+      /* if want values, walk through them */
+      if(value) {
+        vnode=cursor->current_value;
+        value->data=LIBRDF_HASH_MEMORY_FLAT_VALUE_DATA(vnode);
+        value->size=vnode->value_len;
+        cursor->current_value=vnode->next;
+
+        /* stop here if there are more values for this key */
+        if(cursor->current_value)
+          break;
+      }
+
+      /* otherwise move on to the next used slot */
+      librdf_hash_memory_flat_cursor_seek(cursor, cursor->current_slot + 1);
+      break;
+
+    default:
+      librdf_log(cursor->hash->hash->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_HASH, NULL,
+                 "Unknown hash method flag %d", flags);
+      return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_cursor_finished:
+ * @context: flat memory hash cursor context
+ *
+ * Finish the serialisation of the flat memory hash get.
+ *
+ **/
+static void
+librdf_hash_memory_flat_cursor_finish(void* context)
+{
+}
+
+
+/**
+ * librdf_hash_memory_flat_put:
+ * @context: flat memory hash context
+ * @key: pointer to key to store
+ * @value: pointer to value to store
+ *
+ * - Store a key/value pair in the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_put(void* context, librdf_hash_datum *key,
+                            librdf_hash_datum *value)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+  librdf_hash_memory_flat_slot *slot;
+  librdf_hash_memory_flat_value *vnode;
+  size_t slot_index;
+  u64 hash_key;
+  int found;
+
+  hash_key=librdf_hash_memory_flat_hash_bytes((const unsigned char*)key->data,
+                                              key->size);
+
+  /* reclaim the arena once deleted entries dominate it */
+  if(hash->dead_bytes > LIBRDF_HASH_MEMORY_FLAT_ARENA_BLOCK_SIZE &&
+     hash->dead_bytes > 2 * hash->live_bytes) {
+    if(librdf_hash_memory_flat_rebuild(hash, hash->capacity))
+      return 1;
+  }
+
+  found=librdf_hash_memory_flat_find_slot(hash, key->data, key->size,
+                                          hash_key, &slot_index);
+  if(!found) {
+    /* ensure there is room for one more key: double when full of keys,
+     * rebuild in place when mostly full of deleted slots
+     */
+    if((hash->keys + hash->deleted + 1) * 8 >
+       hash->capacity * LIBRDF_HASH_MEMORY_FLAT_MAX_LOAD) {
+      size_t new_capacity=hash->capacity;
+
+      if((hash->keys + 1) * 16 > hash->capacity * LIBRDF_HASH_MEMORY_FLAT_MAX_LOAD)
+        new_capacity <<= 1;
+
+      if(librdf_hash_memory_flat_rebuild(hash, new_capacity))
+        return 1;
+
+      librdf_hash_memory_flat_find_slot(hash, key->data, key->size,
+                                        hash_key, &slot_index);
+    }
+  }
+
+  /* always allocate new value */
+  vnode=(librdf_hash_memory_flat_value*)librdf_hash_memory_flat_arena_alloc(hash, sizeof(*vnode) + value->size);
+  if(!vnode)
+    return 1;
+  vnode->value_len=value->size;
+  memcpy(LIBRDF_HASH_MEMORY_FLAT_VALUE_DATA(vnode), value->data, value->size);
+
+  slot=&hash->slots[slot_index];
+
+  if(!found) {
+    unsigned char *new_key;
+
+    new_key=(unsigned char*)librdf_hash_memory_flat_arena_alloc(hash, key->size);
+    if(!new_key && key->size) {
+      hash->live_bytes -= LIBRDF_HASH_MEMORY_FLAT_ARENA_SIZE(sizeof(*vnode) + value->size);
+      hash->dead_bytes += LIBRDF_HASH_MEMORY_FLAT_ARENA_SIZE(sizeof(*vnode) + value->size);
+      return 1;
+    }
+    memcpy(new_key, key->data, key->size);
+
+    if(hash->ctrl[slot_index] == LIBRDF_HASH_MEMORY_FLAT_CTRL_DELETED)
+      hash->deleted--;
+    hash->ctrl[slot_index]=LIBRDF_HASH_MEMORY_FLAT_H2(hash_key);
+
+    slot->hash_key=hash_key;
+    slot->key=new_key;
+    slot->key_len=key->size;
+    slot->values=NULL;
+    slot->values_count=0;
+
+    hash->keys++;
+  }
+
+  /* put new value node in list */
+  vnode->next=slot->values;
+  slot->values=vnode;
+  slot->values_count++;
+
+  hash->values++;
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_exists:
+ * @context: flat memory hash context
+ * @key: key
+ * @value: value
+ *
+ * Test the existence of a key in the hash.
+ *
+ * Return value: >0 if the key/value exists in the hash, 0 if not, <0 on failure
+ **/
+static int
+librdf_hash_memory_flat_exists(void* context,
+                               librdf_hash_datum *key, librdf_hash_datum *value)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+  librdf_hash_memory_flat_slot* slot;
+  librdf_hash_memory_flat_value *vnode;
+
+  slot=librdf_hash_memory_flat_lookup(hash, key);
+  /* key not found */
+  if(!slot)
+    return 0;
+
+  /* no value wanted */
+  if(!value)
+    return 1;
+
+  /* search for value in list of values */
+  for(vnode=slot->values; vnode; vnode=vnode->next) {
+    if(value->size == vnode->value_len &&
+       !memcmp(value->data, LIBRDF_HASH_MEMORY_FLAT_VALUE_DATA(vnode),
+               value->size))
+      break;
+  }
+
+  return (vnode != NULL);
+}
+
+
+/**
+ * librdf_hash_memory_flat_delete_key_value:
+ * @context: flat memory hash context
+ * @key: pointer to key to delete
+ * @value: pointer to value to delete
+ *
+ * - Delete a key/value pair from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_delete_key_value(void* context, librdf_hash_datum *key,
+                                         librdf_hash_datum *value)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+  librdf_hash_memory_flat_slot* slot;
+  librdf_hash_memory_flat_value *vnode, *vprev;
+
+  slot=librdf_hash_memory_flat_lookup(hash, key);
+  /* key not found anywhere */
+  if(!slot)
+    return 1;
+
+  /* search for value in list of values */
+  vnode=slot->values;
+  vprev=NULL;
+  while(vnode) {
+    if(value->size == vnode->value_len &&
+       !memcmp(value->data, LIBRDF_HASH_MEMORY_FLAT_VALUE_DATA(vnode),
+               value->size))
+      break;
+    vprev=vnode;
+    vnode=vnode->next;
+  }
+
+  /* key/value combination not found */
+  if(!vnode)
+    return 1;
+
+  /* found - delete it from list, the bytes stay in the arena */
+  if(!vprev)
+    slot->values=vnode->next;
+  else
+    vprev->next=vnode->next;
+
+  hash->live_bytes -= LIBRDF_HASH_MEMORY_FLAT_ARENA_SIZE(sizeof(*vnode) + vnode->value_len);
+  hash->dead_bytes += LIBRDF_HASH_MEMORY_FLAT_ARENA_SIZE(sizeof(*vnode) + vnode->value_len);
+
+  slot->values_count--;
+  hash->values--;
+
+  /* last value was removed so remove the key too */
+  if(!slot->values)
+    librdf_hash_memory_flat_remove_slot(hash,
+                                        LIBRDF_GOOD_CAST(size_t, slot - hash->slots));
+
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_delete_key:
+ * @context: flat memory hash context
+ * @key: pointer to key to delete
+ *
+ * - Delete a key and all its values from the hash.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_hash_memory_flat_delete_key(void* context, librdf_hash_datum *key)
+{
+  librdf_hash_memory_flat_context* hash=(librdf_hash_memory_flat_context*)context;
+  librdf_hash_memory_flat_slot* slot;
+  librdf_hash_memory_flat_value *vnode;
+
+  slot=librdf_hash_memory_flat_lookup(hash, key);
+  /* not found anywhere */
+  if(!slot)
+    return 1;
+
+  for(vnode=slot->values; vnode; vnode=vnode->next) {
+    hash->live_bytes -= LIBRDF_HASH_MEMORY_FLAT_ARENA_SIZE(sizeof(*vnode) + vnode->value_len);
+    hash->dead_bytes += LIBRDF_HASH_MEMORY_FLAT_ARENA_SIZE(sizeof(*vnode) + vnode->value_len);
+  }
+
+  hash->values -= slot->values_count;
+  librdf_hash_memory_flat_remove_slot(hash,
+                                      LIBRDF_GOOD_CAST(size_t, slot - hash->slots));
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_sync:
+ * @context: flat memory hash context
+ *
+ * Flush the hash to disk.
+ *
+ * Not used
+ *
+ * Return value: 0
+ **/
+static int
+librdf_hash_memory_flat_sync(void* context)
+{
+  /* Not applicable */
+  return 0;
+}
+
+
+/**
+ * librdf_hash_memory_flat_get_fd:
+ * @context: flat memory hash context
+ *
+ * Get the file descriptor representing the hash.
+ *
+ * Not used
+ *
+ * Return value: -1
+ **/
+static int
+librdf_hash_memory_flat_get_fd(void* context)
+{
+  /* Not applicable */
+  return -1;
+}
+
+
+/* local function to register flat memory hash functions */
+
+/**
+ * librdf_hash_memory_flat_register_factory:
+ * @factory: hash factory prototype
+ *
+ * Register the flat memory hash module with the hash factory.
+ *
+ **/
+static void
+librdf_hash_memory_flat_register_factory(librdf_hash_factory *factory)
+{
+  factory->context_length = sizeof(librdf_hash_memory_flat_context);
+  factory->cursor_context_length = sizeof(librdf_hash_memory_flat_cursor_context);
+
+  factory->create  = librdf_hash_memory_flat_create;
+  factory->destroy = librdf_hash_memory_flat_destroy;
+
+  factory->open    = librdf_hash_memory_flat_open;
+  factory->close   = librdf_hash_memory_flat_close;
+  factory->clone   = librdf_hash_memory_flat_clone;
+
+  factory->values_count = librdf_hash_memory_flat_values_count;
+
+  factory->put     = librdf_hash_memory_flat_put;
+  factory->exists  = librdf_hash_memory_flat_exists;
+  factory->delete_key  = librdf_hash_memory_flat_delete_key;
+  factory->delete_key_value  = librdf_hash_memory_flat_delete_key_value;
+  factory->sync    = librdf_hash_memory_flat_sync;
+  factory->get_fd  = librdf_hash_memory_flat_get_fd;
+
+  factory->cursor_init   = librdf_hash_memory_flat_cursor_init;
+  factory->cursor_get    = librdf_hash_memory_flat_cursor_get;
+  factory->cursor_finish = librdf_hash_memory_flat_cursor_finish;
+}
+
+/**
+ * librdf_init_hash_memory_flat:
+ * @world: redland world object
+ *
+ * INTERNAL - Initialise the flat memory hash module.
+ **/
+void
+librdf_init_hash_memory_flat(librdf_world *world)
+{
+  librdf_hash_register_factory(world,
+                               "memory-flat",
+                               &librdf_hash_memory_flat_register_factory);
+}
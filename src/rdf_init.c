@@ -275,6 +275,106 @@ librdf_world_init_mutex(librdf_world* world)
 }
 
 
+#ifdef WITH_THREADS
+/* serialises changes to reference counts, see librdf_references_lock() */
+static pthread_mutex_t librdf_references_mutex;
+static pthread_once_t librdf_references_once = PTHREAD_ONCE_INIT;
+/* set once a concurrent model has been created, never cleared */
+static volatile int librdf_references_shared = 0;
+
+/* guards the opened state of worlds while they are opened, see
+ * librdf_world_open() */
+static pthread_mutex_t librdf_world_open_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t librdf_world_open_cond = PTHREAD_COND_INITIALIZER;
+
+
+static void
+librdf_references_init(void)
+{
+  pthread_mutexattr_t attr;
+
+  /* error checking so that a thread which skipped the lock before
+   * sharing was turned on gets EPERM from the unlock and nothing else */
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+  pthread_mutex_init(&librdf_references_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+
+  librdf_references_shared = 1;
+}
+
+
+/**
+ * librdf_references_share:
+ *
+ * INTERNAL - Start locking the reference counts of shared objects.
+ *
+ * Called when a concurrent model is created, before it can be handed
+ * to other threads, and when node interning is enabled, since threads
+ * then share nodes even through separate models.  Until then
+ * librdf_references_lock() does nothing so programs that never share
+ * objects do not pay for the lock.
+ */
+void
+librdf_references_share(void)
+{
+  pthread_once(&librdf_references_once, librdf_references_init);
+}
+
+
+/**
+ * librdf_references_lock:
+ *
+ * INTERNAL - Lock the reference counts of shared objects.
+ *
+ * Nodes, URIs and statements are Raptor objects with plain reference
+ * counts and Raptor URIs are interned per world, so readers of a
+ * concurrent model copying the same terms must do so one at a time.
+ * This is held only while a count changes or an object is created or
+ * freed, never while calling back into user code.
+ */
+void
+librdf_references_lock(void)
+{
+  if(librdf_references_shared)
+    pthread_mutex_lock(&librdf_references_mutex);
+}
+
+
+/**
+ * librdf_references_unlock:
+ *
+ * INTERNAL - Unlock the reference counts of shared objects.
+ */
+void
+librdf_references_unlock(void)
+{
+  if(librdf_references_shared)
+    pthread_mutex_unlock(&librdf_references_mutex);
+}
+#endif
+
+
+/* values of world->opened */
+#define LIBRDF_WORLD_CLOSED  0
+#define LIBRDF_WORLD_OPENING 1
+#define LIBRDF_WORLD_OPEN    2
+
+/* The opened state is read without a lock once a world is open, so
+ * it is set last with release semantics and read with acquire */
+#if defined(WITH_THREADS) && defined(__GNUC__)
+#define LIBRDF_WORLD_GET_OPENED(world) __atomic_load_n(&(world)->opened, __ATOMIC_ACQUIRE)
+#define LIBRDF_WORLD_SET_OPENED(world, state) __atomic_store_n(&(world)->opened, state, __ATOMIC_RELEASE)
+#elif defined(WITH_THREADS)
+/* no atomics: always check under librdf_world_open_mutex */
+#define LIBRDF_WORLD_GET_OPENED(world) LIBRDF_WORLD_CLOSED
+#define LIBRDF_WORLD_SET_OPENED(world, state) (world)->opened = (state)
+#else
+#define LIBRDF_WORLD_GET_OPENED(world) (world)->opened
+#define LIBRDF_WORLD_SET_OPENED(world, state) (world)->opened = (state)
+#endif
+
+
 /**
  * librdf_world_open:
  * @world: redland world object
@@ -286,8 +386,29 @@ librdf_world_open(librdf_world *world)
 {
   int rc = 0;
   
-  if(world->opened++)
+  /* many constructors call this so an open world must cost no lock */
+  if(LIBRDF_WORLD_GET_OPENED(world) == LIBRDF_WORLD_OPEN)
+    return;
+
+#ifdef WITH_THREADS
+  /* Wait while another thread opens the world.  The initialisers
+   * below call here again from the opening thread, which returns. */
+  pthread_mutex_lock(&librdf_world_open_mutex);
+  while(world->opened == LIBRDF_WORLD_OPENING &&
+        !pthread_equal(world->open_thread, pthread_self()))
+    pthread_cond_wait(&librdf_world_open_cond, &librdf_world_open_mutex);
+  if(world->opened != LIBRDF_WORLD_CLOSED) {
+    pthread_mutex_unlock(&librdf_world_open_mutex);
     return;
+  }
+  world->open_thread = pthread_self();
+  LIBRDF_WORLD_SET_OPENED(world, LIBRDF_WORLD_OPENING);
+  pthread_mutex_unlock(&librdf_world_open_mutex);
+#else
+  if(world->opened != LIBRDF_WORLD_CLOSED)
+    return;
+  LIBRDF_WORLD_SET_OPENED(world, LIBRDF_WORLD_OPENING);
+#endif
   
   librdf_world_init_mutex(world);
 
@@ -316,10 +437,16 @@ librdf_world_open(librdf_world *world)
   if(rc)
     goto failed;
   
-  return;
-  
 failed:
   /* should return an error state */
+#ifdef WITH_THREADS
+  pthread_mutex_lock(&librdf_world_open_mutex);
+  LIBRDF_WORLD_SET_OPENED(world, LIBRDF_WORLD_OPEN);
+  pthread_cond_broadcast(&librdf_world_open_cond);
+  pthread_mutex_unlock(&librdf_world_open_mutex);
+#else
+  LIBRDF_WORLD_SET_OPENED(world, LIBRDF_WORLD_OPEN);
+#endif
   return;
 }
 
@@ -457,7 +584,20 @@ librdf_world_set_digest(librdf_world* world, const char *name)
 librdf_node*
 librdf_world_get_feature(librdf_world* world, librdf_uri *feature) 
 {
-  return NULL; /* none retrievable */
+  librdf_uri* intern_nodes;
+  librdf_node* value = NULL;
+
+  intern_nodes = librdf_new_uri(world,
+                                (const unsigned char*)LIBRDF_WORLD_FEATURE_INTERN_NODES);
+
+  if(librdf_uri_equals(feature, intern_nodes))
+    value = librdf_new_node_from_typed_literal(world,
+              (const unsigned char*)(librdf_node_get_interning(world) ? "1" : "0"),
+              NULL, NULL);
+
+  librdf_free_uri(intern_nodes);
+
+  return value;
 }
 
 
@@ -477,12 +617,15 @@ librdf_world_set_feature(librdf_world* world, librdf_uri* feature,
 {
   librdf_uri* genid_base;
   librdf_uri* genid_counter;
+  librdf_uri* intern_nodes;
   int rc= -1;
 
   genid_counter = librdf_new_uri(world,
                                  (const unsigned char*)LIBRDF_WORLD_FEATURE_GENID_COUNTER);
   genid_base = librdf_new_uri(world,
                               (const unsigned char*)LIBRDF_WORLD_FEATURE_GENID_BASE);
+  intern_nodes = librdf_new_uri(world,
+                                (const unsigned char*)LIBRDF_WORLD_FEATURE_INTERN_NODES);
 
   if(librdf_uri_equals(feature, genid_base)) {
     if(!librdf_node_is_resource(value))
@@ -518,10 +661,17 @@ librdf_world_set_feature(librdf_world* world, librdf_uri* feature,
 #endif
       rc = 0;
     }
+  } else if(librdf_uri_equals(feature, intern_nodes)) {
+    if(!librdf_node_is_literal(value))
+      rc = 1;
+    else
+      rc = librdf_node_set_interning(world,
+             atoi((const char*)librdf_node_get_literal_value(value)) != 0);
   }
 
   librdf_free_uri(genid_base);
   librdf_free_uri(genid_counter);
+  librdf_free_uri(intern_nodes);
 
   return rc;
 }
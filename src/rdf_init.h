@@ -101,6 +101,18 @@ void* librdf_calloc_memory(size_t nmemb, size_t size);
  */
 #define LIBRDF_WORLD_FEATURE_GENID_COUNTER "http://feature.librdf.org/genid-counter"
 
+/**
+ * LIBRDF_WORLD_FEATURE_INTERN_NODES:
+ *
+ * World feature to intern literal and blank nodes.
+ *
+ * When set to a literal "1", equal literal and blank nodes made by
+ * the node constructors are shared, so they compare equal by pointer
+ * and a repeated literal is stored once.  Setting "0" stops interning
+ * and releases the interned nodes no longer used elsewhere.
+ */
+#define LIBRDF_WORLD_FEATURE_INTERN_NODES "http://feature.librdf.org/intern-nodes"
+
 REDLAND_API
 librdf_node* librdf_world_get_feature(librdf_world* world, librdf_uri *feature);
 REDLAND_API
@@ -65,8 +65,12 @@ struct librdf_world_s
   librdf_hash* uris_hash;
   int uris_hash_allocated_here;
 
-  /* Node interning */
-  librdf_hash* nodes_hash[3]; /* resource, literal, blank */
+  /* Literal and blank node interning, see rdf_node.c.  The table
+   * is NULL unless enabled with LIBRDF_WORLD_FEATURE_INTERN_NODES
+   * and is guarded by nodes_mutex */
+  struct librdf_node_intern_entry_s** intern_buckets;
+  size_t intern_size;
+  size_t intern_count;
 
   /* Sequence of model factories */
   raptor_sequence* models;
@@ -121,7 +125,8 @@ struct librdf_world_s
   void* hash_datums_mutex_fake;
 #endif
 
-  /* non-0 if librdf_world_open() has been called */
+  /* 0 until librdf_world_open() is called, 1 while it runs and 2
+   * once the world is open */
   int opened;
 
   /* Sequence of storage modules
@@ -160,10 +165,32 @@ struct librdf_world_s
   void* rasqal_init_handler_user_data;
 
   librdf_uri* xsd_namespace_uri;
+
+#ifdef WITH_THREADS
+  /* per-thread caches of free librdf_hash_datums, see rdf_hash.c */
+  pthread_key_t hash_datums_key;
+  int hash_datums_key_created;
+  struct librdf_hash_datum_cache_s* hash_datum_caches;
+
+  /* thread running librdf_world_open() while opened is 1 */
+  pthread_t open_thread;
+#endif
 };
 
 unsigned char* librdf_world_get_genid(librdf_world* world);
 
+/* reference counts of objects shared between threads */
+#ifdef WITH_THREADS
+void librdf_references_share(void);
+void librdf_references_lock(void);
+void librdf_references_unlock(void);
+#define LIBRDF_REFERENCES_LOCK() librdf_references_lock()
+#define LIBRDF_REFERENCES_UNLOCK() librdf_references_unlock()
+#else
+#define LIBRDF_REFERENCES_LOCK()
+#define LIBRDF_REFERENCES_UNLOCK()
+#endif
+
 
 #ifdef __cplusplus
 }
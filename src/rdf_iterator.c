@@ -32,6 +32,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 
 #include <redland.h>
 
@@ -89,11 +90,10 @@ librdf_new_iterator(librdf_world *world,
 }
 
 
-/* helper function for deleting list map */
+/* helper function for deleting a map */
 static void
-librdf_iterator_free_iterator_map(void *list_data, void *user_data) 
+librdf_iterator_free_iterator_map(librdf_iterator_map* map)
 {
-  librdf_iterator_map* map=(librdf_iterator_map*)list_data;
   if(map->free_context)
     map->free_context(map->context);
   LIBRDF_FREE(librdf_iterator_map, map);
@@ -111,16 +111,18 @@ librdf_iterator_free_iterator_map(void *list_data, void *user_data)
 void
 librdf_free_iterator(librdf_iterator* iterator) 
 {
+  int i;
+
   if(!iterator)
     return;
   
   if(iterator->finished_method)
     iterator->finished_method(iterator->context);
 
-  if(iterator->map_list) {
-    librdf_list_foreach(iterator->map_list,
-                        librdf_iterator_free_iterator_map, NULL);
-    librdf_free_list(iterator->map_list);
+  if(iterator->maps) {
+    for(i = 0; i < iterator->maps_count; i++)
+      librdf_iterator_free_iterator_map(iterator->maps[i]);
+    LIBRDF_FREE(librdf_iterator_map**, iterator->maps);
   }
   
   LIBRDF_FREE(librdf_iterator, iterator);
@@ -150,32 +152,18 @@ librdf_iterator_update_current_element(librdf_iterator* iterator)
   
   /* find next element subject to map */
   while(!iterator->is_end_method(iterator->context)) {
-    librdf_iterator* map_iterator; /* Iterator over iterator->map_list librdf_list */
+    int i;
+
     element=iterator->get_method(iterator->context, 
                                  LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT);
     if(!element)
       break;
 
-    if(!iterator->map_list || !librdf_list_size(iterator->map_list))
-      break;
-    
-    map_iterator=librdf_list_get_iterator(iterator->map_list);
-    if(!map_iterator)
-      break;
-    
-    while(!librdf_iterator_end(map_iterator)) {
-      librdf_iterator_map *map=(librdf_iterator_map*)librdf_iterator_get_object(map_iterator);
-      if(!map)
-        break;
-      
-      /* apply the map to the element  */
+    /* apply the maps to the element */
+    for(i = 0; element && i < iterator->maps_count; i++) {
+      librdf_iterator_map *map=iterator->maps[i];
       element=map->fn(iterator, map->context, element);
-      if(!element)
-        break;
-
-      librdf_iterator_next(map_iterator);
     }
-    librdf_free_iterator(map_iterator);
     
 
     /* found something, return it */
@@ -390,10 +378,19 @@ librdf_iterator_add_map(librdf_iterator* iterator,
 {
   librdf_iterator_map *map;
   
-  if(!iterator->map_list) {
-    iterator->map_list=librdf_new_list(iterator->world);
-    if(!iterator->map_list)
+  if(iterator->maps_count == iterator->maps_size) {
+    int new_size=iterator->maps_size ? iterator->maps_size * 2 : 2;
+    librdf_iterator_map **new_maps;
+
+    new_maps=LIBRDF_MALLOC(librdf_iterator_map**, new_size * sizeof(*new_maps));
+    if(!new_maps)
       return 1;
+    if(iterator->maps) {
+      memcpy(new_maps, iterator->maps, iterator->maps_count * sizeof(*new_maps));
+      LIBRDF_FREE(librdf_iterator_map**, iterator->maps);
+    }
+    iterator->maps=new_maps;
+    iterator->maps_size=new_size;
   }
 
   map = LIBRDF_CALLOC(librdf_iterator_map*, 1, sizeof(*map));
@@ -404,10 +401,7 @@ librdf_iterator_add_map(librdf_iterator* iterator,
   map->free_context=free_context;
   map->context=map_context;
 
-  if(librdf_list_add(iterator->map_list, map)) {
-    LIBRDF_FREE(librdf_iterator_map, map);
-    return 1;
-  }
+  iterator->maps[iterator->maps_count++]=map;
   
   return 0;
 }
@@ -31,7 +31,7 @@
 extern "C" {
 #endif
 
-/* used in map_list below */
+/* used in maps below */
 typedef struct {
   void *context; /* context to pass on to map */
   librdf_iterator_map_handler fn;
@@ -47,7 +47,9 @@ struct librdf_iterator_s {
 
   /* Used when mapping */
   void *current;            /* stores current element */
-  librdf_list *map_list; /* non-empty means there is a list of maps */
+  librdf_iterator_map **maps; /* maps applied in order */
+  int maps_count;
+  int maps_size;
   
   int (*is_end_method)(void*);
   int (*next_method)(void*);
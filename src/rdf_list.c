@@ -409,6 +409,8 @@ static void
 librdf_list_add_iterator_context(librdf_list* list, 
                                  librdf_list_iterator_context* node)
 {
+  /* iterators are made by concurrent readers of a shared model */
+  LIBRDF_REFERENCES_LOCK();
   if(list->last_iterator) {
     node->prev_ic=list->last_iterator;
     list->last_iterator->next_ic=node;
@@ -424,6 +426,7 @@ librdf_list_add_iterator_context(librdf_list* list,
   LIBRDF_DEBUG4("Added iterator %p to list %p giving %d iterators\n",
                 node->iterator, list, list->iterator_count);
 #endif
+  LIBRDF_REFERENCES_UNLOCK();
 }
 
 
@@ -431,6 +434,7 @@ static void
 librdf_list_remove_iterator_context(librdf_list* list,
                                     librdf_list_iterator_context* node)
 {
+  LIBRDF_REFERENCES_LOCK();
   if(node == list->first_iterator)
     list->first_iterator=node->next_ic;
   if(node->prev_ic)
@@ -446,6 +450,7 @@ librdf_list_remove_iterator_context(librdf_list* list,
   LIBRDF_DEBUG4("Removed iterator %p from list %p leaving %d iterators\n",
                 node->iterator, list, list->iterator_count);
 #endif
+  LIBRDF_REFERENCES_UNLOCK();
 }
 
 
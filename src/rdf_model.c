@@ -41,6 +41,15 @@
 
 #ifndef STANDALONE
 
+static int librdf_model_add_statements_in_batches(librdf_model* model, librdf_node* context, librdf_stream* stream);
+static void librdf_model_read_lock(librdf_model* model);
+static void librdf_model_write_lock(librdf_model* model);
+static void librdf_model_unlock(librdf_model* model);
+static void librdf_model_drop_snapshot(librdf_model* model);
+static librdf_stream* librdf_model_read_locked_stream(librdf_model* model, librdf_stream* stream);
+static librdf_iterator* librdf_model_read_locked_iterator(librdf_model* model, librdf_iterator* iterator);
+
+
 /**
  * librdf_init_model:
  * @world: redland world object
@@ -306,7 +315,17 @@ librdf_new_model (librdf_world *world,
  * 
  * Constructor - Create a new #librdf_model with storage.
  *
- * Options are presently not used.
+ * Options:
+ *   concurrent: if 'yes' the model may be shared between threads,
+ *     many reading at once and one writing at a time.  Reads
+ *     (size, contains, find and the other queries of the model) hold
+ *     a read lock of the model and the #librdf_stream and
+ *     #librdf_iterator they return hold it until freed, so these must
+ *     be freed by the thread that got them.  Changes (add, remove,
+ *     sync) wait for the write lock, so a thread must not change the
+ *     model while it holds a stream or iterator of it.  Needs thread
+ *     support (--with-threads) and a storage safe for concurrent
+ *     readers: hashes (memory and bdb), trees, memory and sqlite.
  *
  * Return value: a new #librdf_model object or NULL on failure
  **/
@@ -355,8 +374,28 @@ librdf_new_model_with_options(librdf_world *world,
     librdf_free_uri(uri);
   }
 
+  model->transaction_batch_size=LIBRDF_MODEL_TRANSACTION_BATCH_SIZE;
+
   model->usage=1;
 
+  if(options && librdf_hash_get_as_boolean(options, "concurrent") > 0) {
+#ifdef WITH_THREADS
+    model->lock = LIBRDF_MALLOC(pthread_rwlock_t*, sizeof(*model->lock));
+    if(!model->lock || pthread_rwlock_init(model->lock, NULL)) {
+      if(model->lock) {
+        LIBRDF_FREE(pthread_rwlock_t, model->lock);
+        model->lock = NULL;
+      }
+      librdf_free_model(model);
+      return NULL;
+    }
+    librdf_references_share();
+#else
+    librdf_log(world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_MODEL, NULL,
+               "Concurrent models need thread support, option ignored");
+#endif
+  }
+
   return model;
 }
 
@@ -382,7 +421,23 @@ librdf_new_model_from_model(librdf_model* model)
   new_model=model->factory->clone(model);
   if(new_model) {
     new_model->supports_contexts=model->supports_contexts;
+    new_model->transaction_batch_size=model->transaction_batch_size;
     new_model->usage=1;
+#ifdef WITH_THREADS
+    /* the copy has a lock of its own */
+    if(model->lock) {
+      new_model->lock = LIBRDF_MALLOC(pthread_rwlock_t*,
+                                      sizeof(*new_model->lock));
+      if(!new_model->lock || pthread_rwlock_init(new_model->lock, NULL)) {
+        if(new_model->lock) {
+          LIBRDF_FREE(pthread_rwlock_t, new_model->lock);
+          new_model->lock = NULL;
+        }
+        librdf_free_model(new_model);
+        return NULL;
+      }
+    }
+#endif
   }
   return new_model;
 }
@@ -400,15 +455,22 @@ librdf_free_model(librdf_model *model)
 {
   librdf_iterator* iterator;
   librdf_model* m;
+  int usage;
 
   if(!model)
     return;
   
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN(model, librdf_model);
 
-  if(--model->usage)
+  LIBRDF_REFERENCES_LOCK();
+  usage = --model->usage;
+  LIBRDF_REFERENCES_UNLOCK();
+  if(usage)
     return;
   
+  if(model->snapshot)
+    librdf_free_model(model->snapshot);
+
   if(model->sub_models) {
     iterator=librdf_list_get_iterator(model->sub_models);
     if(iterator) {
@@ -426,6 +488,13 @@ librdf_free_model(librdf_model *model)
   }
   LIBRDF_FREE(data, model->context);
 
+#ifdef WITH_THREADS
+  if(model->lock) {
+    pthread_rwlock_destroy(model->lock);
+    LIBRDF_FREE(pthread_rwlock_t, model->lock);
+  }
+#endif
+
   LIBRDF_FREE(librdf_model, model);
 }
 
@@ -433,13 +502,207 @@ librdf_free_model(librdf_model *model)
 void
 librdf_model_add_reference(librdf_model *model)
 {
+  LIBRDF_REFERENCES_LOCK();
   model->usage++;
+  LIBRDF_REFERENCES_UNLOCK();
 }
 
 void
 librdf_model_remove_reference(librdf_model *model)
 {
+  LIBRDF_REFERENCES_LOCK();
   model->usage--;
+  LIBRDF_REFERENCES_UNLOCK();
+}
+
+
+/*
+ * librdf_model_read_lock:
+ * @model: the model object
+ *
+ * INTERNAL - Wait for a read lock of a concurrent model.
+ */
+static void
+librdf_model_read_lock(librdf_model* model)
+{
+#ifdef WITH_THREADS
+  if(model->lock)
+    pthread_rwlock_rdlock(model->lock);
+#endif
+}
+
+
+/*
+ * librdf_model_write_lock:
+ * @model: the model object
+ *
+ * INTERNAL - Wait for the write lock of a concurrent model.
+ */
+static void
+librdf_model_write_lock(librdf_model* model)
+{
+#ifdef WITH_THREADS
+  if(model->lock)
+    pthread_rwlock_wrlock(model->lock);
+#endif
+  model->modifications++;
+  /* a change is coming so the snapshot will be out of date */
+  if(model->snapshot)
+    librdf_model_drop_snapshot(model);
+}
+
+
+/*
+ * librdf_model_unlock:
+ * @model: the model object
+ *
+ * INTERNAL - Release a read or write lock of a concurrent model.
+ */
+static void
+librdf_model_unlock(librdf_model* model)
+{
+#ifdef WITH_THREADS
+  if(model->lock)
+    pthread_rwlock_unlock(model->lock);
+#endif
+}
+
+
+/*
+ * librdf_model_drop_snapshot:
+ * @model: the model object
+ *
+ * INTERNAL - Forget the snapshot of the current version after a change.
+ * Readers holding it keep it until they free it.
+ */
+static void
+librdf_model_drop_snapshot(librdf_model* model)
+{
+  librdf_model* snapshot;
+
+  LIBRDF_REFERENCES_LOCK();
+  snapshot=model->snapshot;
+  model->snapshot=NULL;
+  LIBRDF_REFERENCES_UNLOCK();
+
+  if(snapshot)
+    librdf_free_model(snapshot);
+}
+
+
+/*
+ * librdf_model_get_modifications:
+ * @model: the model object
+ *
+ * INTERNAL - Get the number of changes made to the model so far.
+ *
+ * Return value: change count
+ */
+unsigned long
+librdf_model_get_modifications(librdf_model* model)
+{
+  unsigned long modifications;
+
+  librdf_model_read_lock(model);
+  modifications=model->modifications;
+  librdf_model_unlock(model);
+
+  return modifications;
+}
+
+
+#ifdef WITH_THREADS
+static librdf_statement*
+librdf_model_read_lock_stream_map(librdf_stream *stream, void* context,
+                                  librdf_statement* statement)
+{
+  return statement;
+}
+
+
+static void*
+librdf_model_read_lock_iterator_map(librdf_iterator *iterator, void* context,
+                                    void* item)
+{
+  return item;
+}
+
+
+static void
+librdf_model_read_lock_finished(void* context)
+{
+  librdf_model_unlock((librdf_model*)context);
+}
+#endif
+
+
+/*
+ * librdf_model_read_locked_stream:
+ * @model: the model object
+ * @stream: stream got with a read lock of @model or NULL
+ *
+ * INTERNAL - Keep the read lock of a concurrent model until a stream
+ * of it is freed.
+ *
+ * Return value: @stream or NULL on failure, when the lock is released
+ */
+static librdf_stream*
+librdf_model_read_locked_stream(librdf_model* model, librdf_stream* stream)
+{
+#ifdef WITH_THREADS
+  if(!model->lock)
+    return stream;
+
+  if(!stream) {
+    librdf_model_unlock(model);
+    return NULL;
+  }
+
+  /* the map free releases the lock, also on failure */
+  if(librdf_stream_add_map(stream, &librdf_model_read_lock_stream_map,
+                           &librdf_model_read_lock_finished, model)) {
+    librdf_model_read_lock(model);
+    librdf_free_stream(stream);
+    librdf_model_unlock(model);
+    return NULL;
+  }
+#endif
+  return stream;
+}
+
+
+/*
+ * librdf_model_read_locked_iterator:
+ * @model: the model object
+ * @iterator: iterator got with a read lock of @model or NULL
+ *
+ * INTERNAL - Keep the read lock of a concurrent model until an
+ * iterator of it is freed.
+ *
+ * Return value: @iterator or NULL on failure, when the lock is released
+ */
+static librdf_iterator*
+librdf_model_read_locked_iterator(librdf_model* model,
+                                  librdf_iterator* iterator)
+{
+#ifdef WITH_THREADS
+  if(!model->lock)
+    return iterator;
+
+  if(!iterator) {
+    librdf_model_unlock(model);
+    return NULL;
+  }
+
+  if(librdf_iterator_add_map(iterator, &librdf_model_read_lock_iterator_map,
+                             &librdf_model_read_lock_finished, model)) {
+    librdf_model_read_lock(model);
+    librdf_free_iterator(iterator);
+    librdf_model_unlock(model);
+    return NULL;
+  }
+#endif
+  return iterator;
 }
 
 
@@ -459,9 +722,14 @@ librdf_model_remove_reference(librdf_model *model)
 int
 librdf_model_size(librdf_model* model)
 {
+  int size;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, -1);
 
-  return model->factory->size(model);
+  librdf_model_read_lock(model);
+  size = model->factory->size(model);
+  librdf_model_unlock(model);
+  return size;
 }
 
 
@@ -488,13 +756,18 @@ librdf_model_size(librdf_model* model)
 int
 librdf_model_add_statement(librdf_model* model, librdf_statement* statement)
 {
+  int status;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
   if(!librdf_statement_is_complete(statement))
     return 1;
 
-  return model->factory->add_statement(model, statement);
+  librdf_model_write_lock(model);
+  status = model->factory->add_statement(model, statement);
+  librdf_model_unlock(model);
+  return status;
 }
 
 
@@ -520,7 +793,7 @@ librdf_model_add_statements(librdf_model* model, librdf_stream* statement_stream
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement_stream, librdf_statement, 1);
 
-  return model->factory->add_statements(model, statement_stream);
+  return librdf_model_add_statements_in_batches(model, NULL, statement_stream);
 }
 
 
@@ -702,13 +975,18 @@ librdf_model_add_string_literal_statement(librdf_model* model,
 int
 librdf_model_remove_statement(librdf_model* model, librdf_statement* statement)
 {
+  int status;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
   if(!librdf_statement_is_complete(statement))
     return 1;
 
-  return model->factory->remove_statement(model, statement);
+  librdf_model_write_lock(model);
+  status = model->factory->remove_statement(model, statement);
+  librdf_model_unlock(model);
+  return status;
 }
 
 
@@ -734,13 +1012,18 @@ librdf_model_remove_statement(librdf_model* model, librdf_statement* statement)
 int
 librdf_model_contains_statement(librdf_model* model, librdf_statement* statement)
 {
+  int result;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
   if(!librdf_statement_is_complete(statement))
     return 1;
 
-  return model->factory->contains_statement(model, statement) ? -1 : 0;
+  librdf_model_read_lock(model);
+  result = model->factory->contains_statement(model, statement);
+  librdf_model_unlock(model);
+  return result ? -1 : 0;
 }
 
 
@@ -757,7 +1040,9 @@ librdf_model_as_stream(librdf_model* model)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
 
-  return model->factory->serialise(model);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_stream(model,
+                                         model->factory->serialise(model));
 }
 
 
@@ -778,7 +1063,9 @@ librdf_model_serialise(librdf_model* model)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
 
-  return model->factory->serialise(model);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_stream(model,
+                                         model->factory->serialise(model));
 }
 #endif
 
@@ -804,7 +1091,9 @@ librdf_model_find_statements(librdf_model* model,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, NULL);
 
-  return model->factory->find_statements(model, statement);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_stream(model,
+                                         model->factory->find_statements(model, statement));
 }
 
 
@@ -829,7 +1118,9 @@ librdf_model_get_sources(librdf_model *model,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(arc, librdf_node, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(target, librdf_node, NULL);
 
-  return model->factory->get_sources(model, arc, target);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_iterator(model,
+                                           model->factory->get_sources(model, arc, target));
 }
 
 
@@ -854,7 +1145,9 @@ librdf_model_get_arcs(librdf_model *model,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(source, librdf_node, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(target, librdf_node, NULL);
 
-  return model->factory->get_arcs(model, source, target);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_iterator(model,
+                                           model->factory->get_arcs(model, source, target));
 }
 
 
@@ -879,7 +1172,9 @@ librdf_model_get_targets(librdf_model *model,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(source, librdf_node, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(arc, librdf_node, NULL);
 
-  return model->factory->get_targets(model, source, arc);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_iterator(model,
+                                           model->factory->get_targets(model, source, arc));
 }
 
 
@@ -1069,7 +1364,9 @@ librdf_model_get_arcs_in(librdf_model *model, librdf_node *node)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
 
-  return model->factory->get_arcs_in(model, node);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_iterator(model,
+                                           model->factory->get_arcs_in(model, node));
 }
 
 
@@ -1088,7 +1385,9 @@ librdf_model_get_arcs_out(librdf_model *model, librdf_node *node)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
 
-  return model->factory->get_arcs_out(model, node);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_iterator(model,
+                                           model->factory->get_arcs_out(model, node));
 }
 
 
@@ -1106,11 +1405,16 @@ int
 librdf_model_has_arc_in(librdf_model *model, librdf_node *node, 
                         librdf_node *property) 
 {
+  int result;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(property, librdf_node, 0);
 
-  return model->factory->has_arc_in(model, node, property);
+  librdf_model_read_lock(model);
+  result = model->factory->has_arc_in(model, node, property);
+  librdf_model_unlock(model);
+  return result;
 }
 
 
@@ -1128,11 +1432,16 @@ int
 librdf_model_has_arc_out(librdf_model *model, librdf_node *node,
                          librdf_node *property) 
 {
+  int result;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, 0);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(property, librdf_node, 0);
 
-  return model->factory->has_arc_out(model, node, property);
+  librdf_model_read_lock(model);
+  result = model->factory->has_arc_out(model, node, property);
+  librdf_model_unlock(model);
+  return result;
 }
 
 
@@ -1237,6 +1546,8 @@ librdf_model_context_add_statement(librdf_model* model,
                                    librdf_node* context,
                                    librdf_statement* statement) 
 {
+  int status;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
@@ -1249,7 +1560,10 @@ librdf_model_context_add_statement(librdf_model* model,
     return 1;
   }
 
-  return model->factory->context_add_statement(model, context, statement);
+  librdf_model_write_lock(model);
+  status = model->factory->context_add_statement(model, context, statement);
+  librdf_model_unlock(model);
+  return status;
 }
 
 
@@ -1286,7 +1600,7 @@ librdf_model_context_add_statements(librdf_model* model,
   }
 
   if(model->factory->context_add_statements)
-    return model->factory->context_add_statements(model, context, stream);
+    return librdf_model_add_statements_in_batches(model, context, stream);
 
   while(!librdf_stream_end(stream)) {
     librdf_statement* statement=librdf_stream_get_object(stream);
@@ -1323,6 +1637,8 @@ librdf_model_context_remove_statement(librdf_model* model,
                                       librdf_node* context,
                                       librdf_statement* statement) 
 {
+  int status;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
@@ -1335,7 +1651,10 @@ librdf_model_context_remove_statement(librdf_model* model,
     return 1;
   }
 
-  return model->factory->context_remove_statement(model, context, statement);
+  librdf_model_write_lock(model);
+  status = model->factory->context_remove_statement(model, context, statement);
+  librdf_model_unlock(model);
+  return status;
 }
 
 
@@ -1353,6 +1672,7 @@ librdf_model_context_remove_statements(librdf_model* model,
                                        librdf_node* context) 
 {
   librdf_stream *stream;
+  int status;
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(context, librdf_node, 1);
@@ -1363,8 +1683,12 @@ librdf_model_context_remove_statements(librdf_model* model,
     return 1;
   }
 
-  if(model->factory->context_remove_statements)
-    return model->factory->context_remove_statements(model, context);
+  if(model->factory->context_remove_statements) {
+    librdf_model_write_lock(model);
+    status = model->factory->context_remove_statements(model, context);
+    librdf_model_unlock(model);
+    return status;
+  }
 
   stream=librdf_model_context_as_stream(model, context);
   if(!stream)
@@ -1403,7 +1727,9 @@ librdf_model_context_as_stream(librdf_model* model, librdf_node* context)
     return NULL;
   }
 
-  return model->factory->context_serialize(model, context);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_stream(model,
+                                         model->factory->context_serialize(model, context));
 }
 
 
@@ -1432,7 +1758,9 @@ librdf_model_context_serialize(librdf_model* model, librdf_node* context)
     return NULL;
   }
 
-  return model->factory->context_serialize(model, context);
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_stream(model,
+                                         model->factory->context_serialize(model, context));
 }
 #endif
 
@@ -1470,12 +1798,17 @@ librdf_model_query_execute(librdf_model* model, librdf_query* query)
 int
 librdf_model_sync(librdf_model* model) 
 {
+  int status = 0;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, 1);
 
-  if(model->factory->sync)
-    return model->factory->sync(model);
+  if(model->factory->sync) {
+    librdf_model_write_lock(model);
+    status = model->factory->sync(model);
+    librdf_model_unlock(model);
+  }
 
-  return 0;
+  return status;
 }
 
 
@@ -1503,6 +1836,123 @@ librdf_model_get_storage(librdf_model *model)
 }
 
 
+/**
+ * librdf_model_snapshot:
+ * @model: #librdf_model object
+ *
+ * Get a read-only model of the statements of a model as they are now.
+ *
+ * The snapshot is a copy in memory that later changes to @model do
+ * not touch, so a long running query can read it while other threads
+ * change @model.  Reads of the snapshot take no locks and it may be
+ * shared between threads.  While @model is unchanged each call returns
+ * the same snapshot; each version is freed when the last holder frees
+ * it with librdf_free_model().
+ *
+ * Changes through the model methods and transaction commits and
+ * rollbacks start a new version; changes made directly to the
+ * storage are not noticed.  Taking a new version copies the whole
+ * model, under the read lock of a concurrent model.
+ *
+ * Return value: new reference to a #librdf_model or NULL on failure
+ **/
+librdf_model*
+librdf_model_snapshot(librdf_model *model)
+{
+#ifdef STORAGE_SNAPSHOT
+  librdf_storage* storage;
+  librdf_model* snapshot;
+  librdf_model* old_snapshot;
+#endif
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
+
+#ifdef STORAGE_SNAPSHOT
+  librdf_model_read_lock(model);
+
+  LIBRDF_REFERENCES_LOCK();
+  snapshot=model->snapshot;
+  if(snapshot)
+    snapshot->usage++;
+  LIBRDF_REFERENCES_UNLOCK();
+  if(snapshot) {
+    librdf_model_unlock(model);
+    return snapshot;
+  }
+
+  storage=librdf_model_get_storage(model);
+  if(!storage) {
+    librdf_model_unlock(model);
+    librdf_log(model->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_MODEL, NULL,
+               "Cannot take a snapshot of a model without a storage");
+    return NULL;
+  }
+
+  storage=librdf_new_storage_memory_snapshot(storage);
+  if(!storage) {
+    librdf_model_unlock(model);
+    return NULL;
+  }
+  snapshot=librdf_new_model_with_options(model->world, storage, NULL);
+  librdf_free_storage(storage);
+  if(!snapshot) {
+    librdf_model_unlock(model);
+    return NULL;
+  }
+
+  /* keep it for the next callers until the model changes */
+  LIBRDF_REFERENCES_LOCK();
+  old_snapshot=model->snapshot;
+  model->snapshot=snapshot;
+  snapshot->usage++;
+  LIBRDF_REFERENCES_UNLOCK();
+
+  librdf_model_unlock(model);
+
+  if(old_snapshot)
+    librdf_free_model(old_snapshot);
+
+  return snapshot;
+#else
+  librdf_log(model->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_MODEL, NULL,
+             "Model snapshots need the snapshot storage");
+  return NULL;
+#endif
+}
+
+
+/**
+ * librdf_model_estimate_statements:
+ * @model: #librdf_model object
+ * @statement: #librdf_statement partial statement pattern or NULL for all
+ * @distinct: 0 or a #librdf_statement_part
+ *
+ * Estimate the size of the answer to a triple pattern without running it.
+ *
+ * See librdf_storage_estimate_statements() for the details.
+ *
+ * Return value: estimated count or < 0 if it cannot be estimated
+ **/
+int
+librdf_model_estimate_statements(librdf_model *model,
+                                 librdf_statement* statement, int distinct)
+{
+  librdf_storage* storage;
+  int estimate;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, -1);
+
+  storage=librdf_model_get_storage(model);
+  if(!storage)
+    return -1;
+
+  librdf_model_read_lock(model);
+  estimate = librdf_storage_estimate_statements(storage, statement, distinct);
+  librdf_model_unlock(model);
+  return estimate;
+}
+
+
 /**
  * librdf_model_find_statements_in_context:
  * @model: #librdf_model object
@@ -1532,8 +1982,11 @@ librdf_model_find_statements_in_context(librdf_model* model, librdf_statement* s
     return NULL;
   }
 
-  if(model->factory->find_statements_in_context)
-    return model->factory->find_statements_in_context(model, statement, context_node);
+  if(model->factory->find_statements_in_context) {
+    librdf_model_read_lock(model);
+    return librdf_model_read_locked_stream(model,
+                                           model->factory->find_statements_in_context(model, statement, context_node));
+  }
 
   statement=librdf_new_statement_from_statement(statement);
   if(!statement)
@@ -1575,10 +2028,12 @@ librdf_model_get_contexts(librdf_model* model)
     return NULL;
   }
 
-  if(model->factory->get_contexts)
-    return model->factory->get_contexts(model);
-  else
+  if(!model->factory->get_contexts)
     return NULL;
+
+  librdf_model_read_lock(model);
+  return librdf_model_read_locked_iterator(model,
+                                           model->factory->get_contexts(model));
 }
 
 
@@ -1598,6 +2053,16 @@ librdf_model_get_feature(librdf_model* model, librdf_uri* feature)
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(model, librdf_model, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(feature, librdf_uri, NULL);
 
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_MODEL_FEATURE_TRANSACTION_BATCH_SIZE)) {
+    char intbuffer[20];
+
+    sprintf(intbuffer, "%d", model->transaction_batch_size);
+    return librdf_new_node_from_typed_literal(model->world,
+                                              (const unsigned char*)intbuffer,
+                                              NULL, NULL);
+  }
+
   if(model->factory->get_feature)
     return model->factory->get_feature(model, feature);
   return NULL;
@@ -1622,6 +2087,15 @@ librdf_model_set_feature(librdf_model* model, librdf_uri* feature,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(feature, librdf_uri, -1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(value, librdf_node, -1);
 
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_MODEL_FEATURE_TRANSACTION_BATCH_SIZE)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    model->transaction_batch_size=atoi((const char*)librdf_node_get_literal_value(value));
+    return 0;
+  }
+
   if(model->factory->set_feature)
     return model->factory->set_feature(model, feature, value);
   return -1;
@@ -1659,9 +2133,11 @@ librdf_model_find_statements_with_options(librdf_model* model,
     return NULL;
   }
 
-  if(model->factory->find_statements_with_options)
-    return model->factory->find_statements_with_options(model, statement, context_node, options);
-  else
+  if(model->factory->find_statements_with_options) {
+    librdf_model_read_lock(model);
+    return librdf_model_read_locked_stream(model,
+                                           model->factory->find_statements_with_options(model, statement, context_node, options));
+  } else
     return librdf_model_find_statements_in_context(model, statement, context_node);
 }
 
@@ -1851,6 +2327,7 @@ librdf_model_transaction_start_with_handle(librdf_model* model, void* handle)
 int
 librdf_model_transaction_commit(librdf_model* model) 
 {
+  librdf_model_drop_snapshot(model);
   if(model->factory->transaction_commit)
     return model->factory->transaction_commit(model);
   else
@@ -1869,6 +2346,9 @@ librdf_model_transaction_commit(librdf_model* model)
 int
 librdf_model_transaction_rollback(librdf_model* model) 
 {
+  /* changes made in the transaction are undone */
+  model->modifications++;
+  librdf_model_drop_snapshot(model);
   if(model->factory->transaction_rollback)
     return model->factory->transaction_rollback(model);
   else
@@ -1893,6 +2373,216 @@ librdf_model_transaction_get_handle(librdf_model* model)
     return NULL;
 }
 
+
+/**
+ * librdf_model_batch_start:
+ * @model: the model object
+ *
+ * INTERNAL - Start grouping the statements of a bulk add into transactions.
+ *
+ * A transaction is only started when the batch size feature is not 0,
+ * the model supports transactions and no transaction is already active;
+ * otherwise the statements are added as usual.
+ *
+ * Return value: non-0 if a batch transaction was started
+ **/
+int
+librdf_model_batch_start(librdf_model* model)
+{
+  if(model->transaction_batch_size <= 0 || model->batch_in_transaction)
+    return 0;
+
+  /* leave a transaction started by the caller alone */
+  if(librdf_model_transaction_get_handle(model))
+    return 0;
+
+  if(librdf_model_transaction_start(model))
+    return 0;
+
+  model->batch_in_transaction=1;
+  model->batch_count=0;
+  return 1;
+}
+
+
+/**
+ * librdf_model_batch_added:
+ * @model: the model object
+ *
+ * INTERNAL - Count a statement added in a batch, committing every batch size statements.
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_model_batch_added(librdf_model* model)
+{
+  if(!model->batch_in_transaction)
+    return 0;
+
+  if(++model->batch_count < model->transaction_batch_size)
+    return 0;
+
+  model->batch_count=0;
+  if(librdf_model_transaction_commit(model)) {
+    model->batch_in_transaction=0;
+    return 1;
+  }
+
+  /* carry on without transactions if a new one cannot start */
+  if(librdf_model_transaction_start(model))
+    model->batch_in_transaction=0;
+
+  return 0;
+}
+
+
+/**
+ * librdf_model_batch_end:
+ * @model: the model object
+ * @failed: non-0 if the bulk add failed
+ *
+ * INTERNAL - End a batch, committing the current transaction or rolling it back if @failed.
+ *
+ * Statements in batches already committed stay in the model.
+ *
+ * Return value: non-0 on failure
+ **/
+int
+librdf_model_batch_end(librdf_model* model, int failed)
+{
+  if(!model->batch_in_transaction)
+    return 0;
+
+  model->batch_in_transaction=0;
+  if(failed)
+    return librdf_model_transaction_rollback(model);
+  return librdf_model_transaction_commit(model);
+}
+
+
+typedef struct {
+  librdf_model* model;
+  librdf_stream* stream;
+} librdf_model_batch_stream_context;
+
+
+static int
+librdf_model_batch_stream_end_of_stream(void* context)
+{
+  librdf_model_batch_stream_context* scontext=(librdf_model_batch_stream_context*)context;
+
+  return librdf_stream_end(scontext->stream);
+}
+
+
+static int
+librdf_model_batch_stream_next_statement(void* context)
+{
+  librdf_model_batch_stream_context* scontext=(librdf_model_batch_stream_context*)context;
+  int rc;
+
+  /* the current statement has been added */
+  rc=librdf_stream_next(scontext->stream);
+  librdf_model_batch_added(scontext->model);
+  return rc;
+}
+
+
+static void*
+librdf_model_batch_stream_get_statement(void* context, int flags)
+{
+  librdf_model_batch_stream_context* scontext=(librdf_model_batch_stream_context*)context;
+
+  switch(flags) {
+    case LIBRDF_STREAM_GET_METHOD_GET_OBJECT:
+      return librdf_stream_get_object(scontext->stream);
+
+    case LIBRDF_STREAM_GET_METHOD_GET_CONTEXT:
+      return librdf_stream_get_context2(scontext->stream);
+
+    default:
+      librdf_log(scontext->model->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_MODEL, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_model_batch_stream_finished(void* context)
+{
+  librdf_model_batch_stream_context* scontext=(librdf_model_batch_stream_context*)context;
+
+  LIBRDF_FREE(librdf_model_batch_stream_context, scontext);
+}
+
+
+/*
+ * librdf_model_add_statements_in_batches:
+ * @model: the model object
+ * @context: context node or NULL to add @stream with librdf_model_add_statements()
+ * @stream: stream of statements
+ *
+ * INTERNAL - Add a stream of statements with the model factory, committing every batch size statements.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_model_add_statements_in_batches(librdf_model* model,
+                                       librdf_node* context,
+                                       librdf_stream* stream)
+{
+  librdf_model_batch_stream_context* scontext;
+  librdf_stream* batch_stream;
+  int status;
+
+  librdf_model_write_lock(model);
+
+  if(!librdf_model_batch_start(model)) {
+    if(context)
+      status=model->factory->context_add_statements(model, context, stream);
+    else
+      status=model->factory->add_statements(model, stream);
+    librdf_model_unlock(model);
+    return status;
+  }
+
+  scontext=LIBRDF_CALLOC(librdf_model_batch_stream_context*, 1,
+                         sizeof(*scontext));
+  if(!scontext) {
+    librdf_model_batch_end(model, 1);
+    librdf_model_unlock(model);
+    return 1;
+  }
+  scontext->model=model;
+  scontext->stream=stream;
+
+  batch_stream=librdf_new_stream(model->world, scontext,
+                                 &librdf_model_batch_stream_end_of_stream,
+                                 &librdf_model_batch_stream_next_statement,
+                                 &librdf_model_batch_stream_get_statement,
+                                 &librdf_model_batch_stream_finished);
+  if(!batch_stream) {
+    librdf_model_batch_stream_finished(scontext);
+    librdf_model_batch_end(model, 1);
+    librdf_model_unlock(model);
+    return 1;
+  }
+
+  if(context)
+    status=model->factory->context_add_statements(model, context, batch_stream);
+  else
+    status=model->factory->add_statements(model, batch_stream);
+  librdf_free_stream(batch_stream);
+
+  if(librdf_model_batch_end(model, status) && !status)
+    status=1;
+
+  librdf_model_unlock(model);
+  return status;
+}
+
 #endif
 
 
@@ -1928,6 +2618,7 @@ int main(int argc, char *argv[]);
 "</rdf:RDF>"
 
 int test_model_cloning(char const *program, librdf_world *);
+int test_model_snapshot(char const *program, librdf_world *);
 int test_model(librdf_world *world, const char *program,
     const char *storage_type, const char *storage_name, const char* storage_options);
 
@@ -1951,6 +2642,11 @@ main(int argc, char *argv[])
     goto tidy;
   }
 
+  if(test_model_snapshot(program, world)) {
+    status = 1;
+    goto tidy;
+  }
+
   /* Get storage configuration */
   storage_type=getenv("REDLAND_TEST_STORAGE_TYPE");
   storage_name=getenv("REDLAND_TEST_STORAGE_NAME");
@@ -1965,9 +2661,16 @@ main(int argc, char *argv[])
 #else
       "hashes", "test", "hash-type='memory',write='yes',new='yes',contexts='yes'",
 #endif
+      "hashes", "test-indexed", "hash-type='memory',write='yes',new='yes',index-predicates='yes',index-subjects='yes',index-objects='yes',statistics='yes'",
+      "hashes", "test-dictionary", "hash-type='memory',write='yes',new='yes',contexts='yes',dictionary='yes'",
+      "hashes", "test-bulk", "hash-type='memory',write='yes',new='yes',bulk-load='yes',statistics='yes'",
 #endif
 #ifdef STORAGE_TREES
-      "trees", "test", "contexts='yes'",
+      "trees", "test", "contexts='yes',statistics='yes'",
+      "trees", "test-adaptive", "index-adaptive='yes',index-build-threshold='1',index-drop-after='2'",
+#endif
+#ifdef STORAGE_SORTED
+      "sorted", NULL, "delta-size='4'",
 #endif
 #ifdef STORAGE_FILE
       "file", "test.rdf", NULL,
@@ -2032,6 +2735,14 @@ test_model(librdf_world *world, const char *program,
   raptor_iostream* iostr;
   librdf_node* literal_node;
   char literal[6];
+  librdf_storage* storage2;
+  librdf_model* model2;
+  int size;
+  librdf_statement* batch[4];
+  librdf_node* batch_contexts[4];
+  int batch_count;
+  librdf_uri* batch_uri;
+  librdf_node* batch_node;
 
   iostr = raptor_new_iostream_to_file_handle(world->raptor_world_ptr, stderr);
 
@@ -2164,6 +2875,128 @@ test_model(librdf_world *world, const char *program,
     status=1;
   }
 
+  /* add a stream of all the similar statements back: only the 3
+   * removed ones are new (hashes never stores duplicates) */
+  fprintf(stderr, "%s: Adding stream of similar statements\n", program);
+  size=librdf_model_size(model);
+  storage2=librdf_new_storage(world, "memory", NULL, NULL);
+  model2=librdf_new_model(world, storage2, NULL);
+  strncpy(literal, "DaveX", 6);
+  for(i=0; i<TEST_SIMILAR_COUNT; i++) {
+    literal[4]='0'+i;
+    statement=librdf_new_statement(world);
+    librdf_statement_set_subject(statement, librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/"));
+    librdf_statement_set_predicate(statement, librdf_new_node_from_uri_string(world, (const unsigned char*)"http://purl.org/dc/elements/1.1/creator"));
+    librdf_statement_set_object(statement, librdf_new_node_from_literal(world, (const unsigned char*)literal, NULL, 0));
+    librdf_model_add_statement(model2, statement);
+    librdf_free_statement(statement);
+  }
+  /* commit every 3 statements on storages with transactions */
+  batch_uri=librdf_new_uri(world, (const unsigned char*)LIBRDF_MODEL_FEATURE_TRANSACTION_BATCH_SIZE);
+  batch_node=librdf_new_node_from_literal(world, (const unsigned char*)"3", NULL, 0);
+  if(librdf_model_set_feature(model, batch_uri, batch_node)) {
+    fprintf(stderr, "%s: Failed to set transaction batch size\n", program);
+    status=1;
+  }
+  librdf_free_node(batch_node);
+  batch_node=librdf_model_get_feature(model, batch_uri);
+  if(!batch_node ||
+     strcmp((const char*)librdf_node_get_literal_value(batch_node), "3")) {
+    fprintf(stderr, "%s: Transaction batch size is not 3\n", program);
+    status=1;
+  }
+  if(batch_node)
+    librdf_free_node(batch_node);
+  librdf_free_uri(batch_uri);
+
+  stream=librdf_model_as_stream(model2);
+  if(librdf_model_add_statements(model, stream)) {
+    fprintf(stderr, "%s: librdf_model_add_statements failed\n", program);
+    status=1;
+  }
+  librdf_free_stream(stream);
+
+  /* every batch must have been committed */
+  if(librdf_model_transaction_get_handle(model)) {
+    fprintf(stderr, "%s: transaction left open after adding stream\n", program);
+    status=1;
+  }
+  stream=librdf_model_as_stream(model2);
+  while(!librdf_stream_end(stream)) {
+    if(!librdf_model_contains_statement(model, librdf_stream_get_object(stream))) {
+      fprintf(stderr, "%s: statement added in a batch is missing\n", program);
+      status=1;
+      break;
+    }
+    librdf_stream_next(stream);
+  }
+  librdf_free_stream(stream);
+  librdf_free_model(model2);
+  librdf_free_storage(storage2);
+
+  /* committed statements stay in the model, rolled back ones do not */
+  if(!librdf_model_transaction_start(model)) {
+    literal_node=librdf_new_node_from_literal(world, (const unsigned char*)"committed", NULL, 0);
+    statement=librdf_new_statement_from_nodes(world,
+      librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/"),
+      librdf_new_node_from_uri_string(world, (const unsigned char*)"http://purl.org/dc/elements/1.1/creator"),
+      literal_node);
+    librdf_model_add_statement(model, statement);
+    if(librdf_model_transaction_commit(model)) {
+      fprintf(stderr, "%s: librdf_model_transaction_commit failed\n", program);
+      status=1;
+    } else if(!librdf_model_contains_statement(model, statement)) {
+      fprintf(stderr, "%s: committed statement is missing\n", program);
+      status=1;
+    }
+    librdf_free_statement(statement);
+
+    if(!librdf_model_transaction_start(model)) {
+      literal_node=librdf_new_node_from_literal(world, (const unsigned char*)"rolled back", NULL, 0);
+      statement=librdf_new_statement_from_nodes(world,
+        librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/"),
+        librdf_new_node_from_uri_string(world, (const unsigned char*)"http://purl.org/dc/elements/1.1/creator"),
+        literal_node);
+      librdf_model_add_statement(model, statement);
+      if(librdf_model_transaction_rollback(model)) {
+        fprintf(stderr, "%s: librdf_model_transaction_rollback failed\n", program);
+        status=1;
+      } else if(librdf_model_contains_statement(model, statement)) {
+        fprintf(stderr, "%s: rolled back statement is still present\n", program);
+        status=1;
+      }
+      librdf_free_statement(statement);
+    } else {
+      fprintf(stderr, "%s: second librdf_model_transaction_start failed\n", program);
+      status=1;
+    }
+  }
+
+  if(!strcmp(storage_type, "hashes") && size >= 0 &&
+     librdf_model_size(model) != size + 3) {
+    fprintf(stderr, "%s: model has %d statements after adding stream, expected %d\n", program, librdf_model_size(model), size + 3);
+    status=1;
+  }
+
+  /* storages keeping statistics must agree with the size */
+  count=librdf_model_estimate_statements(model, NULL, 0);
+  if(count >= 0 && count != librdf_model_size(model)) {
+    fprintf(stderr, "%s: model estimates %d statements, size is %d\n", program, count, librdf_model_size(model));
+    status=1;
+  }
+
+  /* reading the model in batches must see every statement */
+  stream=librdf_model_as_stream(model);
+  count=0;
+  while((batch_count=librdf_stream_next_batch(stream, batch, batch_contexts, 4)) > 0)
+    count += batch_count;
+  librdf_free_stream(stream);
+  if(batch_count < 0 ||
+     (librdf_model_size(model) >= 0 && count != librdf_model_size(model))) {
+    fprintf(stderr, "%s: batch read %d statements, size is %d\n", program, count, librdf_model_size(model));
+    status=1;
+  }
+
   librdf_free_node(n1);
   librdf_free_node(n2);
 
@@ -2462,5 +3295,104 @@ test_model_cloning(char const *program, librdf_world *world)
   return status;
 }
 
+
+static librdf_statement*
+test_model_snapshot_statement(librdf_world *world, const char *object)
+{
+  return librdf_new_statement_from_nodes(world,
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s"),
+    librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p"),
+    librdf_new_node_from_literal(world, (const unsigned char*)object, NULL, 0));
+}
+
+
+int
+test_model_snapshot(char const *program, librdf_world *world)
+{
+  int status = 0;
+  librdf_storage *storage;
+  librdf_model *model = NULL;
+  librdf_model *snapshot1 = NULL;
+  librdf_model *snapshot2 = NULL;
+  librdf_statement *statement1;
+  librdf_statement *statement2;
+
+  fprintf(stderr, "%s: Testing model snapshots\n", program);
+
+  storage = librdf_new_storage(world, "hashes", "test-snapshot",
+                               "hash-type='memory',contexts='yes'");
+  if(!storage) {
+    fprintf(stderr, "%s: Failed to create new hashes storage\n", program);
+    return 1;
+  }
+  model = librdf_new_model(world, storage, "concurrent='yes'");
+  if(!model) {
+    fprintf(stderr, "%s: Failed to create new model\n", program);
+    librdf_free_storage(storage);
+    return 1;
+  }
+
+  statement1 = test_model_snapshot_statement(world, "one");
+  statement2 = test_model_snapshot_statement(world, "two");
+  librdf_model_add_statement(model, statement1);
+
+  snapshot1 = librdf_model_snapshot(model);
+  if(!snapshot1) {
+    fprintf(stderr, "%s: Failed to take a snapshot\n", program);
+    status = 1;
+    goto tidy;
+  }
+
+  /* unchanged model gives the same version */
+  snapshot2 = librdf_model_snapshot(model);
+  if(snapshot2 != snapshot1) {
+    fprintf(stderr, "%s: Snapshot of unchanged model is a new version\n",
+            program);
+    status = 1;
+    goto tidy;
+  }
+  librdf_free_model(snapshot2);
+  snapshot2 = NULL;
+
+  librdf_model_add_statement(model, statement2);
+  librdf_model_remove_statement(model, statement1);
+
+  if(librdf_model_size(snapshot1) != 1 ||
+     !librdf_model_contains_statement(snapshot1, statement1) ||
+     librdf_model_contains_statement(snapshot1, statement2)) {
+    fprintf(stderr, "%s: Snapshot changed with the model\n", program);
+    status = 1;
+    goto tidy;
+  }
+
+  if(!librdf_model_add_statement(snapshot1, statement2)) {
+    fprintf(stderr, "%s: Adding to a snapshot unexpectedly succeeded\n",
+            program);
+    status = 1;
+    goto tidy;
+  }
+
+  snapshot2 = librdf_model_snapshot(model);
+  if(!snapshot2 || snapshot2 == snapshot1 ||
+     librdf_model_size(snapshot2) != 1 ||
+     !librdf_model_contains_statement(snapshot2, statement2)) {
+    fprintf(stderr, "%s: Snapshot after a change is wrong\n", program);
+    status = 1;
+    goto tidy;
+  }
+
+  tidy:
+  if(snapshot2)
+    librdf_free_model(snapshot2);
+  if(snapshot1)
+    librdf_free_model(snapshot1);
+  librdf_free_statement(statement2);
+  librdf_free_statement(statement1);
+  librdf_free_model(model);
+  librdf_free_storage(storage);
+
+  return status;
+}
+
 #endif
 
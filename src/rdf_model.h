@@ -178,6 +178,10 @@ int librdf_model_sync(librdf_model* model);
 
 REDLAND_API
 librdf_storage* librdf_model_get_storage(librdf_model *model);
+REDLAND_API
+librdf_model* librdf_model_snapshot(librdf_model *model);
+REDLAND_API
+int librdf_model_estimate_statements(librdf_model *model, librdf_statement* statement, int distinct);
 
 REDLAND_API
 int librdf_model_load(librdf_model* model, librdf_uri *uri, const char *name, const char *mime_type, librdf_uri *type_uri);
@@ -214,6 +218,19 @@ void* librdf_model_transaction_get_handle(librdf_model* model);
  */
 #define LIBRDF_MODEL_FEATURE_CONTEXTS "http://feature.librdf.org/model-contexts"
 
+/**
+ * LIBRDF_MODEL_FEATURE_TRANSACTION_BATCH_SIZE:
+ *
+ * Model feature transaction batch size.
+ *
+ * When the model supports transactions and none is active, bulk adds
+ * (librdf_model_add_statements() and parsing into the model) are
+ * grouped into transactions committed every this many statements;
+ * if the add fails, the current transaction is rolled back.
+ * 0 disables this.
+ */
+#define LIBRDF_MODEL_FEATURE_TRANSACTION_BATCH_SIZE "http://feature.librdf.org/model-transaction-batch-size"
+
 /* features */
 REDLAND_API
 librdf_node* librdf_model_get_feature(librdf_model* model, librdf_uri* feature);
@@ -31,6 +31,13 @@
 extern "C" {
 #endif
 
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+/* default statements per transaction in bulk adds */
+#define LIBRDF_MODEL_TRANSACTION_BATCH_SIZE 10000
+
 struct librdf_model_s {
   librdf_world *world;
 
@@ -48,6 +55,27 @@ struct librdf_model_s {
   /* supports_contexts : does the storage model support redland contexts? */
   int supports_contexts;
 
+  /* statements per transaction in bulk adds, 0 for none */
+  int transaction_batch_size;
+  /* statements added in the current batch transaction */
+  int batch_count;
+  /* non-0 while a batch transaction is active */
+  int batch_in_transaction;
+
+#ifdef WITH_THREADS
+  /* readers-writer lock when created with the concurrent option or
+   * NULL; streams and iterators hold a read lock until freed */
+  pthread_rwlock_t* lock;
+#endif
+
+  /* snapshot of the current version from librdf_model_snapshot() or
+   * NULL; dropped by the next change */
+  librdf_model* snapshot;
+
+  /* number of changes so far, so remembered answers can tell when
+   * they are out of date */
+  unsigned long modifications;
+
   /* context : model implementation user data */
   void *context;
 
@@ -186,6 +214,12 @@ librdf_model_factory* librdf_get_model_factory(librdf_world* world, const char *
 void librdf_model_add_reference(librdf_model *model);
 void librdf_model_remove_reference(librdf_model *model);
 
+int librdf_model_batch_start(librdf_model* model);
+int librdf_model_batch_added(librdf_model* model);
+int librdf_model_batch_end(librdf_model* model, int failed);
+
+unsigned long librdf_model_get_modifications(librdf_model* model);
+
 
 /* model storage factory initialise (the only model factory at present) */
 void librdf_init_model_storage(librdf_world *world);
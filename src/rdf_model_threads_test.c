@@ -0,0 +1,261 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_model_threads_test.c - RDF Model concurrent readers stress test
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include <redland.h>
+
+/* one prototype needed */
+int main(int argc, char *argv[]);
+
+
+#ifdef WITH_THREADS
+
+#define BASE_COUNT 200
+#define ADDED_COUNT 400
+#define READER_COUNT 4
+#define READER_ROUNDS 50
+
+#define EX "http://example.org/"
+
+static const char* const storages[][3]={
+  { "memory",  "test-threads", NULL },
+  { "hashes",  "test-threads", "hash-type='memory'" },
+  { "hashes",  "test-threads", "hash-type='bdb',dir='.',new='yes'" },
+  { "trees",   "test-threads", NULL },
+  { "sqlite",  "test-threads.db", "new='yes'" },
+  { NULL, NULL, NULL }
+};
+
+typedef struct {
+  librdf_world* world;
+  librdf_model* model;
+  int seed;
+  int failures;
+} thread_data;
+
+
+static librdf_statement*
+make_statement(librdf_world* world, const char* predicate, int i)
+{
+  char buffer[64];
+  librdf_node *subject, *object;
+
+  sprintf(buffer, EX "s%d", i);
+  subject=librdf_new_node_from_uri_string(world, (const unsigned char*)buffer);
+  sprintf(buffer, "v%d", i);
+  object=librdf_new_node_from_literal(world, (const unsigned char*)buffer,
+                                      NULL, 0);
+  return librdf_new_statement_from_nodes(world, subject,
+           librdf_new_node_from_uri_string(world,
+                                           (const unsigned char*)predicate),
+           object);
+}
+
+
+/* Readers check that the base statements stay put while the writer
+ * adds and removes others */
+static void*
+reader(void* arg)
+{
+  thread_data* data=(thread_data*)arg;
+  librdf_world* world=data->world;
+  int round;
+
+  for(round=0; round < READER_ROUNDS; round++) {
+    librdf_statement *partial, *statement;
+    librdf_stream* stream;
+    int count=0;
+
+    partial=librdf_new_statement_from_nodes(world, NULL,
+              librdf_new_node_from_uri_string(world,
+                                              (const unsigned char*)EX "p"),
+              NULL);
+    stream=librdf_model_find_statements(data->model, partial);
+    if(!stream) {
+      data->failures++;
+      librdf_free_statement(partial);
+      break;
+    }
+    while(!librdf_stream_end(stream)) {
+      count++;
+      librdf_stream_next(stream);
+    }
+    librdf_free_stream(stream);
+    librdf_free_statement(partial);
+
+    if(count != BASE_COUNT) {
+      fprintf(stderr, "reader found %d base statements, expected %d\n",
+              count, BASE_COUNT);
+      data->failures++;
+    }
+
+    statement=make_statement(world, EX "p",
+                             (data->seed + round * 7) % BASE_COUNT);
+    if(!librdf_model_contains_statement(data->model, statement)) {
+      fprintf(stderr, "reader did not find a base statement\n");
+      data->failures++;
+    }
+    librdf_free_statement(statement);
+  }
+
+  return NULL;
+}
+
+
+/* The writer adds ADDED_COUNT statements and removes every other one */
+static void*
+writer(void* arg)
+{
+  thread_data* data=(thread_data*)arg;
+  int i;
+
+  for(i=0; i < ADDED_COUNT; i++) {
+    librdf_statement* statement=make_statement(data->world, EX "q", i);
+
+    if(librdf_model_add_statement(data->model, statement))
+      data->failures++;
+    librdf_free_statement(statement);
+
+    if(i % 2) {
+      statement=make_statement(data->world, EX "q", i - 1);
+      if(librdf_model_remove_statement(data->model, statement))
+        data->failures++;
+      librdf_free_statement(statement);
+    }
+  }
+
+  return NULL;
+}
+
+
+static int
+test_storage(librdf_world* world, const char* program,
+             const char* const *config)
+{
+  librdf_storage* storage;
+  librdf_model* model;
+  pthread_t threads[READER_COUNT + 1];
+  thread_data data[READER_COUNT + 1];
+  int failures=0;
+  int i;
+  int size;
+
+  storage=librdf_new_storage(world, config[0], config[1], config[2]);
+  if(!storage) {
+    fprintf(stderr, "%s: Skipping storage %s - not available\n", program,
+            config[0]);
+    return 0;
+  }
+
+  model=librdf_new_model(world, storage, "concurrent='yes'");
+  if(!model) {
+    fprintf(stderr, "%s: FAILED to create concurrent model for storage %s\n",
+            program, config[0]);
+    librdf_free_storage(storage);
+    return 1;
+  }
+
+  for(i=0; i < BASE_COUNT; i++) {
+    librdf_statement* statement=make_statement(world, EX "p", i);
+    librdf_model_add_statement(model, statement);
+    librdf_free_statement(statement);
+  }
+
+  fprintf(stderr, "%s: Running %d readers and a writer on storage %s %s\n",
+          program, READER_COUNT, config[0], config[2] ? config[2] : "");
+
+  for(i=0; i <= READER_COUNT; i++) {
+    data[i].world=world;
+    data[i].model=model;
+    data[i].seed=i * 31;
+    data[i].failures=0;
+    if(pthread_create(&threads[i], NULL, (i < READER_COUNT) ? reader : writer,
+                      &data[i])) {
+      fprintf(stderr, "%s: FAILED to create thread\n", program);
+      failures++;
+      break;
+    }
+  }
+  while(--i >= 0) {
+    pthread_join(threads[i], NULL);
+    failures += data[i].failures;
+  }
+
+  size=librdf_model_size(model);
+  if(size >= 0 && size != BASE_COUNT + ADDED_COUNT / 2) {
+    fprintf(stderr, "%s: FAILED storage %s has %d statements, expected %d\n",
+            program, config[0], size, BASE_COUNT + ADDED_COUNT / 2);
+    failures++;
+  }
+
+  if(failures)
+    fprintf(stderr, "%s: FAILED storage %s with %d failures\n", program,
+            config[0], failures);
+
+  librdf_free_model(model);
+  librdf_free_storage(storage);
+
+  return failures;
+}
+
+#endif
+
+
+int
+main(int argc, char *argv[])
+{
+  const char *program=librdf_basename((const char*)argv[0]);
+#ifdef WITH_THREADS
+  librdf_world* world;
+  int failures=0;
+  int i;
+
+  world=librdf_new_world();
+  librdf_world_open(world);
+
+  for(i=0; storages[i][0]; i++)
+    failures += test_storage(world, program, storages[i]);
+
+  librdf_free_world(world);
+
+  return failures;
+#else
+  fprintf(stderr, "%s: Skipping test - built without threads\n", program);
+  return 0;
+#endif
+}
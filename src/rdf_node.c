@@ -37,6 +37,7 @@
 #endif
 
 #include <redland.h>
+#include <rdf_types.h>
 /* needed for utf8 functions and definition of 'byte' */
 #include <rdf_utf8.h>
 
@@ -44,6 +45,317 @@
 
 #ifndef STANDALONE
 
+/*
+ * Literal and blank node interning.
+ *
+ * A chained hash table in the world maps literal and blank terms to
+ * one shared node.  The table holds a reference to each node and the
+ * 64-bit hash of its term, so probes and resizes compare hashes before
+ * terms and never rehash strings.  Nodes only the table still refers
+ * to are released when the table fills, before it is grown.
+ */
+
+typedef struct librdf_node_intern_entry_s librdf_node_intern_entry;
+
+struct librdf_node_intern_entry_s
+{
+  librdf_node* node;
+  u64 hash;
+  librdf_node_intern_entry* next;
+};
+
+/* initial number of buckets; a power of 2 */
+#define LIBRDF_NODE_INTERN_INITIAL_SIZE 256
+
+#ifdef WITH_THREADS
+#define NODE_INTERN_LOCK(world) pthread_mutex_lock((world)->nodes_mutex)
+#define NODE_INTERN_UNLOCK(world) pthread_mutex_unlock((world)->nodes_mutex)
+#else
+#define NODE_INTERN_LOCK(world)
+#define NODE_INTERN_UNLOCK(world)
+#endif
+
+
+/* FNV-1a over @len bytes, continuing from @hash */
+static u64
+librdf_node_intern_hash_bytes(u64 hash, const unsigned char *bytes,
+                              size_t len)
+{
+  /* 1099511628211, written so it needs no 64-bit constant suffix */
+  const u64 prime = ((u64)0x100UL << 32) | 0x1b3UL;
+
+  while(len--) {
+    hash ^= *bytes++;
+    hash *= prime;
+  }
+
+  return hash;
+}
+
+
+/* 64-bit hash of a literal or blank term */
+static u64
+librdf_node_intern_hash(librdf_node* node)
+{
+  u64 hash = ((u64)0xcbf29ce4UL << 32) | 0x84222325UL;
+  unsigned char type = (unsigned char)node->type;
+
+  hash = librdf_node_intern_hash_bytes(hash, &type, 1);
+
+  if(node->type == RAPTOR_TERM_TYPE_BLANK)
+    return librdf_node_intern_hash_bytes(hash, node->value.blank.string,
+                                         node->value.blank.string_len);
+
+  hash = librdf_node_intern_hash_bytes(hash, node->value.literal.string,
+                                       node->value.literal.string_len);
+  if(node->value.literal.language)
+    hash = librdf_node_intern_hash_bytes(hash, node->value.literal.language,
+                                         node->value.literal.language_len);
+  if(node->value.literal.datatype) {
+    const unsigned char* uri_string;
+    size_t uri_len;
+
+    uri_string = raptor_uri_as_counted_string(node->value.literal.datatype,
+                                              &uri_len);
+    hash = librdf_node_intern_hash_bytes(hash, uri_string, uri_len);
+  }
+
+  return hash;
+}
+
+
+/* exact equality of two literal or blank terms of the same type */
+static int
+librdf_node_intern_equals(librdf_node* node1, librdf_node* node2)
+{
+  if(node1->type == RAPTOR_TERM_TYPE_BLANK)
+    return (node1->value.blank.string_len == node2->value.blank.string_len &&
+            !memcmp(node1->value.blank.string, node2->value.blank.string,
+                    node1->value.blank.string_len));
+
+  if(node1->value.literal.string_len != node2->value.literal.string_len ||
+     node1->value.literal.language_len != node2->value.literal.language_len)
+    return 0;
+
+  if((node1->value.literal.datatype != NULL) !=
+     (node2->value.literal.datatype != NULL))
+    return 0;
+  if(node1->value.literal.datatype &&
+     !raptor_uri_equals(node1->value.literal.datatype,
+                        node2->value.literal.datatype))
+    return 0;
+
+  if(node1->value.literal.language_len &&
+     memcmp(node1->value.literal.language, node2->value.literal.language,
+            node1->value.literal.language_len))
+    return 0;
+
+  return !memcmp(node1->value.literal.string, node2->value.literal.string,
+                 node1->value.literal.string_len);
+}
+
+
+/*
+ * Release the nodes only the table refers to, or all nodes if @all.
+ * Called with the table locked.
+ */
+static void
+librdf_node_intern_sweep(librdf_world* world, int all)
+{
+  size_t i;
+
+  LIBRDF_REFERENCES_LOCK();
+  for(i = 0; i < world->intern_size; i++) {
+    librdf_node_intern_entry** entry_p = &world->intern_buckets[i];
+
+    while(*entry_p) {
+      librdf_node_intern_entry* entry = *entry_p;
+
+      if(!all && entry->node->usage > 1) {
+        entry_p = &entry->next;
+        continue;
+      }
+
+      *entry_p = entry->next;
+      raptor_free_term(entry->node);
+      LIBRDF_FREE(librdf_node_intern_entry, entry);
+      world->intern_count--;
+    }
+  }
+  LIBRDF_REFERENCES_UNLOCK();
+}
+
+
+/* Double the number of buckets.  Called with the table locked. */
+static int
+librdf_node_intern_grow(librdf_world* world)
+{
+  librdf_node_intern_entry** buckets;
+  size_t size = world->intern_size * 2;
+  size_t i;
+
+  buckets = LIBRDF_CALLOC(librdf_node_intern_entry**, size,
+                          sizeof(*buckets));
+  if(!buckets)
+    return 1;
+
+  for(i = 0; i < world->intern_size; i++) {
+    librdf_node_intern_entry* entry = world->intern_buckets[i];
+
+    while(entry) {
+      librdf_node_intern_entry* next = entry->next;
+      size_t bucket = (size_t)(entry->hash & (size - 1));
+
+      entry->next = buckets[bucket];
+      buckets[bucket] = entry;
+      entry = next;
+    }
+  }
+
+  LIBRDF_FREE(librdf_node_intern_entry**, world->intern_buckets);
+  world->intern_buckets = buckets;
+  world->intern_size = size;
+
+  return 0;
+}
+
+
+/**
+ * librdf_node_intern:
+ * @world: redland world object
+ * @node: new literal or blank node (or NULL)
+ *
+ * INTERNAL - Get the shared node equal to @node when interning is
+ * enabled.  Ownership of @node passes to this function.
+ *
+ * Return value: the shared node, @node itself or NULL if @node was NULL
+ **/
+librdf_node*
+librdf_node_intern(librdf_world* world, librdf_node* node)
+{
+  librdf_node_intern_entry* entry;
+  size_t bucket;
+  u64 hash;
+
+  /* unlocked test so that a world not interning takes no lock */
+  if(!node || !world->intern_buckets)
+    return node;
+
+  hash = librdf_node_intern_hash(node);
+
+  NODE_INTERN_LOCK(world);
+
+  if(!world->intern_buckets) {
+    /* disabled since checked above */
+    NODE_INTERN_UNLOCK(world);
+    return node;
+  }
+
+  bucket = (size_t)(hash & (world->intern_size - 1));
+  for(entry = world->intern_buckets[bucket]; entry; entry = entry->next) {
+    if(entry->hash == hash && entry->node->type == node->type &&
+       librdf_node_intern_equals(entry->node, node)) {
+      librdf_node* shared;
+
+      LIBRDF_REFERENCES_LOCK();
+      shared = raptor_term_copy(entry->node);
+      raptor_free_term(node);
+      LIBRDF_REFERENCES_UNLOCK();
+
+      NODE_INTERN_UNLOCK(world);
+      return shared;
+    }
+  }
+
+  if(world->intern_count >= world->intern_size) {
+    librdf_node_intern_sweep(world, 0);
+    if(world->intern_count >= world->intern_size / 2)
+      librdf_node_intern_grow(world);
+    bucket = (size_t)(hash & (world->intern_size - 1));
+  }
+
+  /* not interning this node on failure is harmless */
+  entry = LIBRDF_MALLOC(librdf_node_intern_entry*, sizeof(*entry));
+  if(entry) {
+    LIBRDF_REFERENCES_LOCK();
+    entry->node = raptor_term_copy(node);
+    LIBRDF_REFERENCES_UNLOCK();
+    entry->hash = hash;
+    entry->next = world->intern_buckets[bucket];
+    world->intern_buckets[bucket] = entry;
+    world->intern_count++;
+  }
+
+  NODE_INTERN_UNLOCK(world);
+
+  return node;
+}
+
+
+/**
+ * librdf_node_set_interning:
+ * @world: redland world object
+ * @enable: non 0 to intern literal and blank nodes
+ *
+ * INTERNAL - Start or stop interning nodes.  Stopping releases the
+ * table's references; nodes still used elsewhere stay valid.
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_node_set_interning(librdf_world* world, int enable)
+{
+  int rc = 0;
+
+  NODE_INTERN_LOCK(world);
+
+  if(enable && !world->intern_buckets) {
+#ifdef WITH_THREADS
+    /* threads using their own models now share interned nodes */
+    librdf_references_share();
+#endif
+    world->intern_buckets = LIBRDF_CALLOC(librdf_node_intern_entry**,
+                                          LIBRDF_NODE_INTERN_INITIAL_SIZE,
+                                          sizeof(librdf_node_intern_entry*));
+    if(world->intern_buckets) {
+      world->intern_size = LIBRDF_NODE_INTERN_INITIAL_SIZE;
+      world->intern_count = 0;
+    } else
+      rc = 1;
+  } else if(!enable && world->intern_buckets) {
+    librdf_node_intern_sweep(world, 1);
+    LIBRDF_FREE(librdf_node_intern_entry**, world->intern_buckets);
+    world->intern_buckets = NULL;
+    world->intern_size = 0;
+  }
+
+  NODE_INTERN_UNLOCK(world);
+
+  return rc;
+}
+
+
+/**
+ * librdf_node_get_interning:
+ * @world: redland world object
+ *
+ * INTERNAL - Check if literal and blank nodes are interned.
+ *
+ * Return value: non 0 if interning
+ **/
+int
+librdf_node_get_interning(librdf_world* world)
+{
+  int enabled;
+
+  NODE_INTERN_LOCK(world);
+  enabled = (world->intern_buckets != NULL);
+  NODE_INTERN_UNLOCK(world);
+
+  return enabled;
+}
+
+
 /**
  * librdf_init_node:
  * @world: redland world object
@@ -67,6 +379,7 @@ librdf_init_node(librdf_world* world)
 void
 librdf_finish_node(librdf_world* world)
 {
+  librdf_node_set_interning(world, 0);
 }
 
 
@@ -108,11 +421,16 @@ librdf_node*
 librdf_new_node_from_uri_string(librdf_world *world,
                                 const unsigned char *uri_string)
 {
+  librdf_node* node;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
 
   librdf_world_open(world);
 
-  return raptor_new_term_from_uri_string(world->raptor_world_ptr, uri_string);
+  LIBRDF_REFERENCES_LOCK();
+  node = raptor_new_term_from_uri_string(world->raptor_world_ptr, uri_string);
+  LIBRDF_REFERENCES_UNLOCK();
+  return node;
 }
 
 
@@ -131,12 +449,17 @@ librdf_new_node_from_counted_uri_string(librdf_world *world,
                                         const unsigned char *uri_string,
                                         size_t len) 
 {
+  librdf_node* node;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
 
   librdf_world_open(world);
 
-  return raptor_new_term_from_counted_uri_string(world->raptor_world_ptr, 
+  LIBRDF_REFERENCES_LOCK();
+  node = raptor_new_term_from_counted_uri_string(world->raptor_world_ptr, 
                                                  uri_string, len);
+  LIBRDF_REFERENCES_UNLOCK();
+  return node;
 }
 
 
@@ -154,11 +477,16 @@ librdf_new_node_from_counted_uri_string(librdf_world *world,
 librdf_node*
 librdf_new_node_from_uri(librdf_world *world, librdf_uri *uri)
 {
+  librdf_node* node;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
 
   librdf_world_open(world);
 
-  return raptor_new_term_from_uri(world->raptor_world_ptr, uri);
+  LIBRDF_REFERENCES_LOCK();
+  node = raptor_new_term_from_uri(world->raptor_world_ptr, uri);
+  LIBRDF_REFERENCES_UNLOCK();
+  return node;
 }
 
 
@@ -187,13 +515,17 @@ librdf_new_node_from_uri_local_name(librdf_world *world,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(uri, raptor_uri, NULL);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(local_name, string, NULL);
 
+  LIBRDF_REFERENCES_LOCK();
   new_uri = raptor_new_uri_from_uri_local_name(world->raptor_world_ptr,
                                                uri, local_name);
-  if(!new_uri)
+  if(!new_uri) {
+    LIBRDF_REFERENCES_UNLOCK();
     return NULL;
+  }
 
   node = raptor_new_term_from_uri(world->raptor_world_ptr, new_uri);
   raptor_free_uri(new_uri);
+  LIBRDF_REFERENCES_UNLOCK();
   return node;
 }
 
@@ -227,8 +559,10 @@ librdf_new_node_from_normalised_uri_string(librdf_world *world,
   if(!new_uri)
     return NULL;
 
+  LIBRDF_REFERENCES_LOCK();
   node = raptor_new_term_from_uri(world->raptor_world_ptr, new_uri);
   raptor_free_uri(new_uri);
+  LIBRDF_REFERENCES_UNLOCK();
   return node;
 }
 
@@ -312,11 +646,13 @@ librdf_node_normalize(librdf_world* world, librdf_node* node)
         /* Have to use Raptor constructor here since
          * librdf_new_node_from_typed_counted_literal() calls this
          */
+        LIBRDF_REFERENCES_LOCK();
         node = raptor_new_term_from_counted_literal(world->raptor_world_ptr,
                                                     value, value_len,
                                                     dt_uri,
                                                     (const unsigned char*)NULL,
                                                     (unsigned char)0);
+        LIBRDF_REFERENCES_UNLOCK();
       }
     }
 
@@ -360,10 +696,12 @@ librdf_new_node_from_literal(librdf_world *world,
 
   datatype_uri = (is_wf_xml ?  LIBRDF_RS_XMLLiteral_URI(world) : NULL);
 
+  LIBRDF_REFERENCES_LOCK();
   n = raptor_new_term_from_literal(world->raptor_world_ptr,
                                    string, datatype_uri,
                                    (const unsigned char*)xml_language);
-  return librdf_node_normalize(world, n);
+  LIBRDF_REFERENCES_UNLOCK();
+  return librdf_node_intern(world, librdf_node_normalize(world, n));
 }
 
 
@@ -394,10 +732,12 @@ librdf_new_node_from_typed_literal(librdf_world *world,
   
   librdf_world_open(world);
 
+  LIBRDF_REFERENCES_LOCK();
   n = raptor_new_term_from_literal(world->raptor_world_ptr,
                                    value, datatype_uri,
                                    (const unsigned char*)xml_language);
-  return librdf_node_normalize(world, n);
+  LIBRDF_REFERENCES_UNLOCK();
+  return librdf_node_intern(world, librdf_node_normalize(world, n));
 }
 
 
@@ -434,12 +774,14 @@ librdf_new_node_from_typed_counted_literal(librdf_world *world,
   
   librdf_world_open(world);
 
+  LIBRDF_REFERENCES_LOCK();
   n = raptor_new_term_from_counted_literal(world->raptor_world_ptr,
                                            value, value_len,
                                            datatype_uri,
                                            (const unsigned char*)xml_language,
                                            (unsigned char)xml_language_len);
-  return librdf_node_normalize(world, n);
+  LIBRDF_REFERENCES_UNLOCK();
+  return librdf_node_intern(world, librdf_node_normalize(world, n));
 }
 
 
@@ -461,12 +803,17 @@ librdf_new_node_from_counted_blank_identifier(librdf_world *world,
                                               const unsigned char *identifier,
                                               size_t identifier_len)
 {
+  librdf_node* node;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(world, librdf_world, NULL);
   
   librdf_world_open(world);
 
-  return raptor_new_term_from_counted_blank(world->raptor_world_ptr,
+  LIBRDF_REFERENCES_LOCK();
+  node = raptor_new_term_from_counted_blank(world->raptor_world_ptr,
                                             identifier, identifier_len);
+  LIBRDF_REFERENCES_UNLOCK();
+  return librdf_node_intern(world, node);
 }
 
 
@@ -496,12 +843,14 @@ librdf_new_node_from_blank_identifier(librdf_world *world,
   if(!identifier)
     blank = librdf_world_get_genid(world);
   
+  LIBRDF_REFERENCES_LOCK();
   node = raptor_new_term_from_blank(world->raptor_world_ptr, blank);
+  LIBRDF_REFERENCES_UNLOCK();
 
   if(!identifier)
     LIBRDF_FREE(char*, (char*)blank);
 
-  return node;
+  return librdf_node_intern(world, node);
 }
 
 
@@ -516,9 +865,14 @@ librdf_new_node_from_blank_identifier(librdf_world *world,
 librdf_node*
 librdf_new_node_from_node(librdf_node *node)
 {
+  librdf_node* new_node;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(node, librdf_node, NULL);
 
-  return raptor_term_copy(node);
+  LIBRDF_REFERENCES_LOCK();
+  new_node = raptor_term_copy(node);
+  LIBRDF_REFERENCES_UNLOCK();
+  return new_node;
 }
 
 
@@ -535,7 +889,9 @@ librdf_free_node(librdf_node *node)
   if(!node)
     return;
 
+  LIBRDF_REFERENCES_LOCK();
   raptor_free_term(node);
+  LIBRDF_REFERENCES_UNLOCK();
 }
 
 
@@ -713,11 +1069,13 @@ librdf_node_get_literal_value_is_wf_xml(librdf_node *node)
   if(!node->value.literal.datatype)
     return 0;
 
+  LIBRDF_REFERENCES_LOCK();
   rdf_xml_literal_uri = raptor_new_uri_for_rdf_concept(node->world,
                                                        (const unsigned char *)"XMLLiteral");
   
   rc = librdf_uri_equals(node->value.literal.datatype, rdf_xml_literal_uri);
   raptor_free_uri(rdf_xml_literal_uri);
+  LIBRDF_REFERENCES_UNLOCK();
 
   return rc;
 }
@@ -989,6 +1347,70 @@ librdf_node_encode(librdf_node *node,
 }
 
 
+/*
+ * librdf_node_encoded_length:
+ * @buffer: buffer holding a node made by librdf_node_encode()
+ * @length: buffer size
+ *
+ * INTERNAL - Get the size of an encoded node without decoding it.
+ *
+ * Return value: bytes used by the node or 0 on a bad encoding
+ */
+size_t
+librdf_node_encoded_length(const unsigned char *buffer, size_t length)
+{
+  size_t total_length;
+  size_t datatype_uri_length = 0;
+  size_t language_length;
+
+  if(length < 1)
+    return 0;
+
+  switch(buffer[0]) {
+    case 'R': /* URI / Resource */
+    case 'B': /* RAPTOR_TERM_TYPE_BLANK */
+      if(length < 3)
+        return 0;
+      total_length = 3 + LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]) + 1;
+      language_length = 0;
+      break;
+
+    case 'L': /* Old encoding form for Literal */
+      if(length < 6)
+        return 0;
+      total_length = 6 + LIBRDF_GOOD_CAST(size_t, (buffer[2] << 8) | buffer[3]) + 1;
+      language_length = buffer[5];
+      break;
+
+    case 'M': /* Literal for Redland 0.9.12+ */
+      if(length < 6)
+        return 0;
+      total_length = 6 + LIBRDF_GOOD_CAST(size_t, (buffer[1] << 8) | buffer[2]) + 1;
+      datatype_uri_length = LIBRDF_GOOD_CAST(size_t, (buffer[3] << 8) | buffer[4]);
+      language_length = buffer[5];
+      break;
+
+    case 'N': /* Literal for redland 1.0.5+ (long literal) */
+      if(length < 8)
+        return 0;
+      total_length = 8 + LIBRDF_GOOD_CAST(size_t, ((size_t)buffer[1] << 24) | (buffer[2] << 16) | (buffer[3] << 8) | buffer[4]) + 1;
+      datatype_uri_length = LIBRDF_GOOD_CAST(size_t, (buffer[5] << 8) | buffer[6]);
+      language_length = buffer[7];
+      break;
+
+    default:
+      return 0;
+  }
+
+  if(datatype_uri_length)
+    total_length += datatype_uri_length + 1;
+  if(language_length)
+    total_length += language_length + 1;
+
+  return (total_length <= length) ? total_length : 0;
+}
+
+
 /**
  * librdf_node_decode:
  * @world: librdf_world
@@ -1658,6 +2080,43 @@ main(int argc, char *argv[])
   LIBRDF_FREE(char*, buffer);
     
 
+  if(1) {
+    librdf_uri *feature;
+    librdf_node *value, *lit1, *lit2, *lit_en, *blank1, *blank2;
+
+    fprintf(stdout, "%s: Interning literal and blank nodes\n", program);
+    feature=librdf_new_uri(world, (const unsigned char*)LIBRDF_WORLD_FEATURE_INTERN_NODES);
+    value=librdf_new_node_from_literal(world, (const unsigned char*)"1", NULL, 0);
+    if(librdf_world_set_feature(world, feature, value)) {
+      fprintf(stderr, "%s: Failed to enable node interning\n", program);
+      return(1);
+    }
+    librdf_free_node(value);
+
+    lit1=librdf_new_node_from_literal(world, (const unsigned char*)lit_string, NULL, 0);
+    lit2=librdf_new_node_from_literal(world, (const unsigned char*)lit_string, NULL, 0);
+    lit_en=librdf_new_node_from_literal(world, (const unsigned char*)lit_string, "en", 0);
+    blank1=librdf_new_node_from_blank_identifier(world, (const unsigned char*)genid);
+    blank2=librdf_new_node_from_blank_identifier(world, (const unsigned char*)genid);
+    if(lit1 != lit2 || blank1 != blank2 || lit1 == lit_en ||
+       !librdf_node_equals(lit1, lit2)) {
+      fprintf(stderr, "%s: Interned nodes are not shared as expected\n",
+              program);
+      return(1);
+    }
+    librdf_free_node(blank2);
+    librdf_free_node(blank1);
+    librdf_free_node(lit_en);
+    librdf_free_node(lit2);
+    librdf_free_node(lit1);
+
+    value=librdf_new_node_from_literal(world, (const unsigned char*)"0", NULL, 0);
+    librdf_world_set_feature(world, feature, value);
+    librdf_free_node(value);
+    librdf_free_uri(feature);
+  }
+
+
   fprintf(stdout, "%s: Freeing nodes\n", program);
   librdf_free_node(node9);
   librdf_free_node(node8);
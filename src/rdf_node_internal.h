@@ -83,6 +83,13 @@ void librdf_finish_node(librdf_world* world);
 /* exported public in error but never usable */
 librdf_digest* librdf_node_get_digest(librdf_node* node);
 
+size_t librdf_node_encoded_length(const unsigned char *buffer, size_t length);
+
+/* literal and blank node interning */
+int librdf_node_set_interning(librdf_world* world, int enable);
+int librdf_node_get_interning(librdf_world* world);
+librdf_node* librdf_node_intern(librdf_world* world, librdf_node* node);
+
 #ifdef __cplusplus
 }
 #endif
@@ -698,6 +698,9 @@ librdf_parser_parse_file_handle_into_model(librdf_parser* parser, FILE *fh,
  *
  * Parse an iostream of content to a librdf_stream of statements.
  *
+ * The content is read and parsed as the stream is consumed, so
+ * @iostream must not be freed before the returned stream.
+ *
  * Return value: #librdf_stream of statements or NULL
  **/
 librdf_stream*
@@ -1029,6 +1032,11 @@ int main(int argc, char *argv[]);
 /* All the examples above give the same three triples */
 #define EXPECTED_TRIPLES_COUNT 3
 
+/* Distinct triples written for the threaded parse test */
+#define PARALLEL_TRIPLES_COUNT 2000
+/* enough lines for several blocks of the threaded parser */
+#define PARALLEL_FAILED_TRIPLES_COUNT 50000
+
 
 #define URI_STRING_COUNT 3
 static const char *test_parser_types[] = {
@@ -1292,6 +1300,178 @@ main(int argc, char *argv[])
   }
 
 
+  /* parse a line-based file into a model with several threads */
+  if(1) {
+    librdf_storage* storage;
+    librdf_model *model;
+    librdf_parser* parser;
+    librdf_uri* feature_uri;
+    librdf_node* value;
+    FILE *fh;
+    int size;
+    int i;
+
+    fprintf(stderr, "%s: Testing parsing ntriples file with threads\n",
+            program);
+    storage = librdf_new_storage(world, NULL, NULL, NULL);
+    model = librdf_new_model(world, storage, NULL);
+    parser = librdf_new_parser(world, "ntriples", NULL, NULL);
+    fh = tmpfile();
+    if(!storage || !model || !parser || !fh) {
+      fprintf(stderr, "%s: Failed to set up threaded parse test\n", program);
+      return(1);
+    }
+
+    feature_uri = librdf_new_uri(world,
+                                 (const unsigned char*)LIBRDF_PARSER_FEATURE_THREADS);
+    value = librdf_new_node_from_literal(world, (const unsigned char*)"4",
+                                         NULL, 0);
+    if(librdf_parser_set_feature(parser, feature_uri, value)) {
+      fprintf(stderr, "%s: Failed to set parser threads feature\n", program);
+      failures++;
+    }
+    librdf_free_node(value);
+    librdf_free_uri(feature_uri);
+
+    for(i = 0; i < PARALLEL_TRIPLES_COUNT; i++)
+      fprintf(fh, "<http://example.org/s%d> <http://example.org/p> _:b%d .\n",
+              i / 10, i);
+    rewind(fh);
+
+    if(librdf_parser_parse_file_handle_into_model(parser, fh, 1, NULL, model)) {
+      fprintf(stderr, "%s: Failed to parse ntriples file into model\n",
+              program);
+      failures++;
+    }
+
+    size = librdf_model_size(model);
+    if(size != PARALLEL_TRIPLES_COUNT) {
+      fprintf(stderr, "%s: Returned %d triples, not %d as expected\n",
+              program, size, PARALLEL_TRIPLES_COUNT);
+      failures++;
+    }
+    librdf_free_model(model);
+    librdf_free_storage(storage);
+
+    /* an error in the first block must stop the later blocks being
+     * added */
+    fprintf(stderr, "%s: Testing failed ntriples parse with threads\n",
+            program);
+    storage = librdf_new_storage(world, NULL, NULL, NULL);
+    model = librdf_new_model(world, storage, NULL);
+    fh = tmpfile();
+    if(!storage || !model || !fh) {
+      fprintf(stderr, "%s: Failed to set up threaded parse test\n", program);
+      return(1);
+    }
+
+    fputs("<http://example.org/s> this is not ntriples .\n", fh);
+    for(i = 0; i < PARALLEL_FAILED_TRIPLES_COUNT; i++)
+      fprintf(fh, "<http://example.org/s%d> <http://example.org/p> \"o%d\" .\n",
+              i, i);
+    rewind(fh);
+
+    if(!librdf_parser_parse_file_handle_into_model(parser, fh, 1, NULL,
+                                                   model)) {
+      fprintf(stderr, "%s: Parsing bad ntriples file into model succeeded\n",
+              program);
+      failures++;
+    }
+
+    size = librdf_model_size(model);
+    if(size != 0) {
+      fprintf(stderr, "%s: Failed parse added %d triples, expected none\n",
+              program, size);
+      failures++;
+    }
+
+    librdf_free_parser(parser);
+    librdf_free_model(model);
+    librdf_free_storage(storage);
+  }
+
+
+  /* parsing into a model keeps one node for equal literals and blanks
+   * when the world interns them */
+  if(1) {
+    librdf_storage* storage;
+    librdf_model *model;
+    librdf_parser* parser;
+    librdf_uri* feature_uri;
+    librdf_node* value;
+    librdf_node *s1, *s2, *p, *q;
+    librdf_node *literal1, *literal2, *blank1, *blank2;
+
+    fprintf(stderr, "%s: Testing parsing into a model with interned nodes\n",
+            program);
+    feature_uri = librdf_new_uri(world,
+                                 (const unsigned char*)LIBRDF_WORLD_FEATURE_INTERN_NODES);
+    value = librdf_new_node_from_literal(world, (const unsigned char*)"1",
+                                         NULL, 0);
+    if(librdf_world_set_feature(world, feature_uri, value)) {
+      fprintf(stderr, "%s: Failed to enable node interning\n", program);
+      return(1);
+    }
+    librdf_free_node(value);
+
+    storage = librdf_new_storage(world, NULL, NULL, NULL);
+    model = librdf_new_model(world, storage, NULL);
+    parser = librdf_new_parser(world, "ntriples", NULL, NULL);
+    if(!storage || !model || !parser) {
+      fprintf(stderr, "%s: Failed to set up interned parse test\n", program);
+      return(1);
+    }
+
+    if(librdf_parser_parse_string_into_model(parser,
+         (const unsigned char*)
+         "<http://example.org/s1> <http://example.org/p> \"shared\" .\n"
+         "<http://example.org/s2> <http://example.org/p> \"shared\" .\n"
+         "<http://example.org/s1> <http://example.org/q> _:b .\n"
+         "<http://example.org/s2> <http://example.org/q> _:b .\n",
+         uris[1], model)) {
+      fprintf(stderr, "%s: Failed to parse ntriples string into model\n",
+              program);
+      failures++;
+    }
+
+    s1 = librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s1");
+    s2 = librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s2");
+    p = librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p");
+    q = librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/q");
+    literal1 = librdf_model_get_target(model, s1, p);
+    literal2 = librdf_model_get_target(model, s2, p);
+    blank1 = librdf_model_get_target(model, s1, q);
+    blank2 = librdf_model_get_target(model, s2, q);
+    if(!literal1 || literal1 != literal2 || !blank1 || blank1 != blank2) {
+      fprintf(stderr, "%s: Parsed literal and blank nodes are not shared\n",
+              program);
+      failures++;
+    }
+    if(blank2)
+      librdf_free_node(blank2);
+    if(blank1)
+      librdf_free_node(blank1);
+    if(literal2)
+      librdf_free_node(literal2);
+    if(literal1)
+      librdf_free_node(literal1);
+    librdf_free_node(q);
+    librdf_free_node(p);
+    librdf_free_node(s2);
+    librdf_free_node(s1);
+
+    librdf_free_parser(parser);
+    librdf_free_model(model);
+    librdf_free_storage(storage);
+
+    value = librdf_new_node_from_literal(world, (const unsigned char*)"0",
+                                         NULL, 0);
+    librdf_world_set_feature(world, feature_uri, value);
+    librdf_free_node(value);
+    librdf_free_uri(feature_uri);
+  }
+
+
   fprintf(stderr, "%s: Freeing URIs\n", program);
   for (testi = 0; testi < URI_STRING_COUNT; testi++) {
     librdf_free_uri(uris[testi]);
@@ -101,6 +101,15 @@ librdf_uri_filter_func librdf_parser_get_uri_filter(librdf_parser* parser, void*
  */
 #define LIBRDF_PARSER_FEATURE_WARNING_COUNT "http://feature.librdf.org/parser-warning-count"
 
+/**
+ * LIBRDF_PARSER_FEATURE_THREADS:
+ *
+ * Parser feature URI string for the number of threads used to parse
+ * line-based syntaxes (N-Triples, N-Quads) from a file into a model.
+ * Values above 1 enable parallel parsing when built with threads.
+ */
+#define LIBRDF_PARSER_FEATURE_THREADS "http://feature.librdf.org/parser-threads"
+
 REDLAND_API
 librdf_node* librdf_parser_get_feature(librdf_parser* parser, librdf_uri *feature);
 REDLAND_API
@@ -39,6 +39,9 @@
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include <redland.h>
 
@@ -63,6 +66,8 @@ typedef struct {
 
   raptor_www *www;              /* raptor stream */
   void *stream_context;         /* librdf_parser_raptor_stream_context* */
+
+  int threads;                  /* parse-into-model threads for line-based syntaxes */
 } librdf_parser_raptor_context;
 
 
@@ -74,6 +79,14 @@ typedef struct {
   /* when true, this FH is closed on finish */
   int close_fh;
 
+  /* when reading from an iostream, not owned */
+  raptor_iostream *iostream;
+
+  /* when reading from a string; a copy owned by the stream */
+  unsigned char *string;
+  size_t string_length;
+  size_t string_offset;
+
   /* when finished */
   int finished;
 
@@ -87,6 +100,13 @@ typedef struct {
    */
   librdf_statement* current; /* current statement */
   librdf_list* statements;
+
+  /* xsd:boolean datatype URI; such literals must be normalized */
+  librdf_uri* boolean_datatype_uri;
+
+  /* non 0 if the world interned literal and blank nodes when
+   * parsing into a model started */
+  int intern;
 } librdf_parser_raptor_stream_context;
 
 
@@ -268,6 +288,8 @@ librdf_parser_raptor_new_statement_handler(void *context,
   if(scontext->model) {
     rc=librdf_model_add_statement(scontext->model, statement);
     librdf_free_statement(statement);
+    if(!rc)
+      librdf_model_batch_added(scontext->model);
   } else {
     rc=librdf_list_add(scontext->statements, statement);
     if(rc)
@@ -281,6 +303,72 @@ librdf_parser_raptor_new_statement_handler(void *context,
 }
 
 
+/*
+ * librdf_parser_raptor_model_statement_handler - helper callback function for raptor RDF when a new triple is asserted while parsing into a model
+ * @context: context for callback
+ * @statement: raptor_statement
+ *
+ * Adds the statement to the model, borrowing the Raptor terms.
+ *
+ * A #librdf_node is a raptor_term made in the same raptor world so
+ * the terms are passed to the model in a statement on the stack;
+ * storages copy the nodes they keep by reference count.  Only
+ * literals that need normalizing are rebuilt, by the general handler.
+ * When the world interns nodes, literal and blank terms are replaced
+ * by the shared nodes so the model keeps those.
+ */
+static void
+librdf_parser_raptor_model_statement_handler(void *context,
+                                             raptor_statement *rstatement)
+{
+  librdf_parser_raptor_stream_context* scontext=(librdf_parser_raptor_stream_context*)context;
+  librdf_world* world=scontext->pcontext->parser->world;
+  librdf_statement statement;
+  raptor_term* object=rstatement->object;
+  librdf_node* subject_node=NULL;
+  librdf_node* object_node=NULL;
+
+  /* the general handler reports term type errors */
+  if((rstatement->subject->type != RAPTOR_TERM_TYPE_BLANK &&
+      rstatement->subject->type != RAPTOR_TERM_TYPE_URI) ||
+     rstatement->predicate->type != RAPTOR_TERM_TYPE_URI ||
+     (object->type == RAPTOR_TERM_TYPE_LITERAL &&
+      object->value.literal.datatype &&
+      raptor_uri_equals(object->value.literal.datatype,
+                        scontext->boolean_datatype_uri))) {
+    librdf_parser_raptor_new_statement_handler(context, rstatement);
+    return;
+  }
+
+  librdf_statement_init(world, &statement);
+  statement.subject=rstatement->subject;
+  statement.predicate=rstatement->predicate;
+  statement.object=object;
+
+  if(scontext->intern) {
+    if(rstatement->subject->type == RAPTOR_TERM_TYPE_BLANK)
+      statement.subject=subject_node=librdf_node_intern(world, librdf_new_node_from_node(rstatement->subject));
+    if(object->type != RAPTOR_TERM_TYPE_URI)
+      statement.object=object_node=librdf_node_intern(world, librdf_new_node_from_node(object));
+  }
+
+  if(!statement.subject || !statement.object ||
+     librdf_model_add_statement(scontext->model, &statement)) {
+    librdf_log(world,
+               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+               "Cannot add statement to model");
+  } else
+    librdf_model_batch_added(scontext->model);
+
+  if(subject_node)
+    librdf_free_node(subject_node);
+  if(object_node)
+    librdf_free_node(object_node);
+
+  /* the other terms are still owned by raptor */
+}
+
+
 /*
  * librdf_parser_raptor_namespace_handler - helper callback function for raptor RDF when a namespace is seen
  * @context: context for callback
@@ -333,24 +421,51 @@ librdf_parser_raptor_namespace_handler(void* user_data,
  * librdf_parser_raptor_get_next_statement - helper function to get the next statement
  * @context: serialisation context
  *
+ * Feeds the parser one buffer of content at a time from the file
+ * handle, iostream or string until it returns statements, so only
+ * the statements from one buffer are queued however large the content.
+ *
  * Return value: >0 if a statement found, 0 at end of file, or <0 on error
  */
 static int
 librdf_parser_raptor_get_next_statement(librdf_parser_raptor_stream_context *context) {
   unsigned char buffer[RAPTOR_IO_BUFFER_LEN];
   int status=0;
+  int is_end=0;
 
-  if(context->finished || !context->fh)
+  if(context->finished ||
+     (!context->fh && !context->iostream && !context->string))
     return 0;
 
   context->current=NULL;
-  while(!feof(context->fh)) {
+  while(!is_end) {
+    const unsigned char *chunk=buffer;
     size_t len;
     int ret;
 
-    len = fread(buffer, 1, RAPTOR_IO_BUFFER_LEN, context->fh);
-    ret = raptor_parser_parse_chunk(context->pcontext->rdf_parser, buffer, len,
-                                    (len < RAPTOR_IO_BUFFER_LEN));
+    if(context->fh) {
+      len = fread(buffer, 1, RAPTOR_IO_BUFFER_LEN, context->fh);
+      is_end = (len < RAPTOR_IO_BUFFER_LEN);
+    } else if(context->iostream) {
+      ret = raptor_iostream_read_bytes(buffer, 1, RAPTOR_IO_BUFFER_LEN,
+                                       context->iostream);
+      if(ret < 0) {
+        status=(-1);
+        break;
+      }
+      len = (size_t)ret;
+      is_end = (!len || raptor_iostream_read_eof(context->iostream));
+    } else {
+      chunk = context->string + context->string_offset;
+      len = context->string_length - context->string_offset;
+      if(len > RAPTOR_IO_BUFFER_LEN)
+        len = RAPTOR_IO_BUFFER_LEN;
+      context->string_offset += len;
+      is_end = (context->string_offset == context->string_length);
+    }
+
+    ret = raptor_parser_parse_chunk(context->pcontext->rdf_parser, chunk, len,
+                                    is_end);
 
     if(ret) {
       status=(-1);
@@ -363,12 +478,9 @@ librdf_parser_raptor_get_next_statement(librdf_parser_raptor_stream_context *con
       status=1;
       break;
     }
-
-    if(len < RAPTOR_IO_BUFFER_LEN)
-      break;
   }
 
-  if(feof(context->fh) || status <1)
+  if(is_end || status <1)
     context->finished=1;
 
   return status;
@@ -659,27 +771,27 @@ librdf_parser_raptor_parse_as_stream_common(void *context, librdf_uri *uri,
 
     pcontext->www = NULL;
   } else if (string) {
-    status = raptor_parser_parse_start(pcontext->rdf_parser,
-                                       (raptor_uri*)base_uri);
-    if(status) {
-      librdf_parser_raptor_serialise_finished((void*)scontext);
-      return NULL;
-    }
-
     if(!length)
       length = strlen((const char*)string);
 
-    raptor_parser_parse_chunk(pcontext->rdf_parser, string, length, 1);
-  } else if (iostream) {
-    status = raptor_parser_parse_start(pcontext->rdf_parser, (raptor_uri*)base_uri);
+    /* parsed as the stream is read, so keep a copy the caller cannot free */
+    scontext->string = LIBRDF_MALLOC(unsigned char*, length + 1);
+    if(!scontext->string)
+      goto oom;
+    memcpy(scontext->string, string, length);
+    scontext->string[length] = '\0';
+    scontext->string_length = length;
+
+    status = raptor_parser_parse_start(pcontext->rdf_parser,
+                                       (raptor_uri*)base_uri);
     if(status) {
       librdf_parser_raptor_serialise_finished((void*)scontext);
       return NULL;
     }
+  } else if (iostream) {
+    scontext->iostream = iostream;
 
-    status = raptor_parser_parse_iostream(pcontext->rdf_parser,
-                                          iostream,
-                                          (raptor_uri*)base_uri);
+    status = raptor_parser_parse_start(pcontext->rdf_parser, (raptor_uri*)base_uri);
     if(status) {
       librdf_parser_raptor_serialise_finished((void*)scontext);
       return NULL;
@@ -691,8 +803,12 @@ librdf_parser_raptor_parse_as_stream_common(void *context, librdf_uri *uri,
   }
 
 
-  /* get first statement, else is empty */
-  scontext->current=(librdf_statement*)librdf_list_pop(scontext->statements);
+  if(uri)
+    /* get first statement, else is empty */
+    scontext->current=(librdf_statement*)librdf_list_pop(scontext->statements);
+  else
+    /* start parsing; initialises scontext->statements, scontext->current */
+    librdf_parser_raptor_get_next_statement(scontext);
 
   stream=librdf_new_stream(pcontext->parser->world,
                            (void*)scontext,
@@ -803,6 +919,702 @@ librdf_parser_raptor_parse_iostream_as_stream(void *context,
 }
 
 
+#ifdef WITH_THREADS
+
+/* Parallel loading of line-based syntaxes into a model.
+ *
+ * The calling thread reads the content in blocks cut at line ends and
+ * queues them as jobs.  Each worker thread parses jobs with its own
+ * raptor world, so no raptor state is shared, and encodes the statements
+ * into the job.  The calling thread then makes the nodes and adds the
+ * statements to the model in the order of the content.
+ */
+
+#define LIBRDF_PARSER_RAPTOR_PARALLEL_BLOCK_SIZE (1 << 20)
+
+typedef struct librdf_parser_raptor_parallel_job_s librdf_parser_raptor_parallel_job;
+
+struct librdf_parser_raptor_parallel_job_s {
+  librdf_parser_raptor_parallel_job* next;
+
+  /* content lines */
+  unsigned char *data;
+  size_t data_length;
+
+  /* encoded statements */
+  unsigned char *buffer;
+  size_t buffer_length;
+  size_t buffer_size;
+
+  int done;
+  int status;
+  int errors;
+  int warnings;
+  /* first error or warning message */
+  char *message;
+  int message_is_error;
+};
+
+
+typedef struct {
+  librdf_parser_raptor_context* pcontext;
+  librdf_model* model;
+
+  pthread_mutex_t mutex;
+  /* signalled when a job is queued or on finishing */
+  pthread_cond_t work_cond;
+  /* signalled when a job is done */
+  pthread_cond_t done_cond;
+
+  /* jobs in content order, oldest first */
+  librdf_parser_raptor_parallel_job* head;
+  librdf_parser_raptor_parallel_job* tail;
+  /* first job not yet started */
+  librdf_parser_raptor_parallel_job* pending;
+  int jobs_count;
+
+  int finishing;
+
+  pthread_t* threads;
+  int threads_count;
+
+  /* base URI for the worker parsers or NULL */
+  const unsigned char *base_uri_string;
+
+  /* last subject and predicate made, often repeated */
+  librdf_node* subject;
+  librdf_node* predicate;
+} librdf_parser_raptor_parallel_loader;
+
+
+/* per-thread parsing state */
+typedef struct {
+  librdf_parser_raptor_parallel_loader* loader;
+  raptor_world* world;
+  raptor_parser* rdf_parser;
+  raptor_uri* base_uri;
+  librdf_parser_raptor_parallel_job* job;
+  int genid_counter;
+} librdf_parser_raptor_parallel_worker;
+
+
+static int
+librdf_parser_raptor_parallel_append(librdf_parser_raptor_parallel_job* job,
+                                     const void* data, size_t length)
+{
+  if(job->buffer_length + length > job->buffer_size) {
+    size_t new_size=job->buffer_size ? job->buffer_size * 2 : 4096;
+    unsigned char *new_buffer;
+
+    while(new_size < job->buffer_length + length)
+      new_size *= 2;
+    new_buffer=LIBRDF_MALLOC(unsigned char*, new_size);
+    if(!new_buffer)
+      return 1;
+    if(job->buffer) {
+      memcpy(new_buffer, job->buffer, job->buffer_length);
+      LIBRDF_FREE(char*, job->buffer);
+    }
+    job->buffer=new_buffer;
+    job->buffer_size=new_size;
+  }
+
+  memcpy(job->buffer + job->buffer_length, data, length);
+  job->buffer_length += length;
+  return 0;
+}
+
+
+/* append a length-prefixed, NUL-terminated string, NULL as length 0 */
+static int
+librdf_parser_raptor_parallel_append_string(librdf_parser_raptor_parallel_job* job,
+                                            const unsigned char* string,
+                                            size_t length)
+{
+  if(!string)
+    length=0;
+
+  if(librdf_parser_raptor_parallel_append(job, &length, sizeof(length)))
+    return 1;
+  if(!length)
+    return 0;
+  return librdf_parser_raptor_parallel_append(job, string, length + 1);
+}
+
+
+static int
+librdf_parser_raptor_parallel_append_term(librdf_parser_raptor_parallel_job* job,
+                                          raptor_term* term)
+{
+  unsigned char type=(unsigned char)term->type;
+  const unsigned char *string;
+  size_t length;
+
+  if(librdf_parser_raptor_parallel_append(job, &type, 1))
+    return 1;
+
+  switch(term->type) {
+    case RAPTOR_TERM_TYPE_URI:
+      string=raptor_uri_as_counted_string(term->value.uri, &length);
+      return librdf_parser_raptor_parallel_append_string(job, string, length);
+
+    case RAPTOR_TERM_TYPE_BLANK:
+      return librdf_parser_raptor_parallel_append_string(job,
+                                                         term->value.blank.string,
+                                                         term->value.blank.string_len);
+
+    case RAPTOR_TERM_TYPE_LITERAL:
+      if(librdf_parser_raptor_parallel_append_string(job,
+                                                     term->value.literal.string,
+                                                     term->value.literal.string_len) ||
+         librdf_parser_raptor_parallel_append_string(job,
+                                                     term->value.literal.language,
+                                                     term->value.literal.language_len))
+        return 1;
+      string=NULL;
+      length=0;
+      if(term->value.literal.datatype)
+        string=raptor_uri_as_counted_string(term->value.literal.datatype,
+                                            &length);
+      return librdf_parser_raptor_parallel_append_string(job, string, length);
+
+    case RAPTOR_TERM_TYPE_UNKNOWN:
+    default:
+      return 1;
+  }
+}
+
+
+static void
+librdf_parser_raptor_parallel_statement_handler(void *user_data,
+                                                raptor_statement *rstatement)
+{
+  librdf_parser_raptor_parallel_worker* worker=(librdf_parser_raptor_parallel_worker*)user_data;
+  librdf_parser_raptor_parallel_job* job=worker->job;
+
+  if(job->status)
+    return;
+
+  if(librdf_parser_raptor_parallel_append_term(job, rstatement->subject) ||
+     librdf_parser_raptor_parallel_append_term(job, rstatement->predicate) ||
+     librdf_parser_raptor_parallel_append_term(job, rstatement->object))
+    job->status=1;
+}
+
+
+static void
+librdf_parser_raptor_parallel_log_handler(void *user_data,
+                                          raptor_log_message *message)
+{
+  librdf_parser_raptor_parallel_worker* worker=(librdf_parser_raptor_parallel_worker*)user_data;
+  librdf_parser_raptor_parallel_job* job=worker->job;
+  int is_error;
+
+  if(!job)
+    return;
+
+  if(message->level == RAPTOR_LOG_LEVEL_FATAL ||
+     message->level == RAPTOR_LOG_LEVEL_ERROR) {
+    job->errors++;
+    is_error=1;
+  } else if(message->level == RAPTOR_LOG_LEVEL_WARN) {
+    job->warnings++;
+    is_error=0;
+  } else
+    return;
+
+  /* log messages are relayed by the calling thread */
+  if(!job->message && message->text) {
+    size_t length=strlen(message->text);
+
+    job->message=LIBRDF_MALLOC(char*, length + 1);
+    if(job->message) {
+      memcpy(job->message, message->text, length + 1);
+      job->message_is_error=is_error;
+    }
+  }
+}
+
+
+/* keep the blank node identifiers of the content; the calling thread maps them */
+static unsigned char*
+librdf_parser_raptor_parallel_generate_id_handler(void *user_data,
+                                                  unsigned char *user_bnodeid)
+{
+  librdf_parser_raptor_parallel_worker* worker=(librdf_parser_raptor_parallel_worker*)user_data;
+  unsigned char *id;
+
+  if(user_bnodeid)
+    return user_bnodeid;
+
+  /* not used by line-based syntaxes */
+  id=(unsigned char*)raptor_alloc_memory(64);
+  if(id)
+    sprintf((char*)id, "genid%p_%d", (void*)worker, ++worker->genid_counter);
+  return id;
+}
+
+
+static void*
+librdf_parser_raptor_parallel_worker_run(void* arg)
+{
+  librdf_parser_raptor_parallel_worker* worker=(librdf_parser_raptor_parallel_worker*)arg;
+  librdf_parser_raptor_parallel_loader* loader=worker->loader;
+  librdf_parser_raptor_parallel_job* job;
+
+  worker->world=raptor_new_world();
+  if(worker->world) {
+    raptor_world_set_log_handler(worker->world, worker,
+                                 librdf_parser_raptor_parallel_log_handler);
+    raptor_world_set_generate_bnodeid_handler(worker->world, worker,
+                                              librdf_parser_raptor_parallel_generate_id_handler);
+    if(!raptor_world_open(worker->world)) {
+      worker->rdf_parser=raptor_new_parser(worker->world,
+                                           loader->pcontext->parser_name);
+      if(worker->rdf_parser)
+        raptor_parser_set_statement_handler(worker->rdf_parser, worker,
+                                            librdf_parser_raptor_parallel_statement_handler);
+      if(loader->base_uri_string)
+        worker->base_uri=raptor_new_uri(worker->world,
+                                        loader->base_uri_string);
+    }
+  }
+
+  pthread_mutex_lock(&loader->mutex);
+  while(1) {
+    while(!loader->pending && !loader->finishing)
+      pthread_cond_wait(&loader->work_cond, &loader->mutex);
+    if(!loader->pending)
+      break;
+
+    job=loader->pending;
+    loader->pending=job->next;
+    pthread_mutex_unlock(&loader->mutex);
+
+    worker->job=job;
+    if(!worker->rdf_parser ||
+       raptor_parser_parse_start(worker->rdf_parser, worker->base_uri) ||
+       raptor_parser_parse_chunk(worker->rdf_parser, job->data,
+                                 job->data_length, 1))
+      job->status=1;
+    worker->job=NULL;
+
+    pthread_mutex_lock(&loader->mutex);
+    job->done=1;
+    pthread_cond_broadcast(&loader->done_cond);
+  }
+  pthread_mutex_unlock(&loader->mutex);
+
+  if(worker->rdf_parser)
+    raptor_free_parser(worker->rdf_parser);
+  if(worker->base_uri)
+    raptor_free_uri(worker->base_uri);
+  if(worker->world)
+    raptor_free_world(worker->world);
+
+  return NULL;
+}
+
+
+static const unsigned char*
+librdf_parser_raptor_parallel_get_string(const unsigned char **p,
+                                         size_t *length_p)
+{
+  const unsigned char *string;
+
+  memcpy(length_p, *p, sizeof(*length_p));
+  *p += sizeof(*length_p);
+  if(!*length_p)
+    return NULL;
+
+  string=*p;
+  *p += *length_p + 1;
+  return string;
+}
+
+
+/* make a node from an encoded term, reusing @cache_p when it matches */
+static librdf_node*
+librdf_parser_raptor_parallel_get_node(librdf_world* world,
+                                       const unsigned char **p,
+                                       librdf_node** cache_p)
+{
+  unsigned char type=**p;
+  const unsigned char *string;
+  const unsigned char *language;
+  const unsigned char *datatype;
+  size_t length, language_length, datatype_length;
+  librdf_node* node=NULL;
+
+  (*p)++;
+  string=librdf_parser_raptor_parallel_get_string(p, &length);
+
+  if(type == RAPTOR_TERM_TYPE_URI) {
+    if(cache_p && *cache_p && librdf_node_is_resource(*cache_p)) {
+      size_t cache_length;
+      const unsigned char *cache_string;
+
+      cache_string=librdf_uri_as_counted_string(librdf_node_get_uri(*cache_p),
+                                                &cache_length);
+      if(cache_length == length && !memcmp(cache_string, string, length))
+        return librdf_new_node_from_node(*cache_p);
+    }
+    node=librdf_new_node_from_uri_string(world, string);
+  } else if(type == RAPTOR_TERM_TYPE_BLANK) {
+    unsigned char *mapped_id;
+
+    mapped_id=librdf_raptor_map_bnodeid(world, string);
+    if(mapped_id) {
+      node=librdf_new_node_from_blank_identifier(world, mapped_id);
+      LIBRDF_FREE(char*, mapped_id);
+    }
+  } else if(type == RAPTOR_TERM_TYPE_LITERAL) {
+    librdf_uri* datatype_uri=NULL;
+
+    language=librdf_parser_raptor_parallel_get_string(p, &language_length);
+    datatype=librdf_parser_raptor_parallel_get_string(p, &datatype_length);
+    if(datatype) {
+      datatype_uri=librdf_new_uri2(world, datatype, datatype_length);
+      if(!datatype_uri)
+        return NULL;
+    }
+    node=librdf_new_node_from_typed_counted_literal(world,
+                                                    string ? string : (const unsigned char*)"",
+                                                    length,
+                                                    (const char*)language,
+                                                    language_length,
+                                                    datatype_uri);
+    if(datatype_uri)
+      librdf_free_uri(datatype_uri);
+  }
+
+  if(node && cache_p) {
+    if(*cache_p)
+      librdf_free_node(*cache_p);
+    *cache_p=librdf_new_node_from_node(node);
+  }
+
+  return node;
+}
+
+
+/* add the statements of a done job to the model, relaying its messages */
+static int
+librdf_parser_raptor_parallel_write(librdf_parser_raptor_parallel_loader* loader,
+                                    librdf_parser_raptor_parallel_job* job)
+{
+  librdf_world* world=loader->pcontext->parser->world;
+  const unsigned char *p=job->buffer;
+  const unsigned char *end=job->buffer + job->buffer_length;
+  librdf_statement statement;
+  /* nothing of a job with errors is added */
+  int status=(job->status || job->errors);
+
+  loader->pcontext->errors += job->errors;
+  loader->pcontext->warnings += job->warnings;
+  if(job->message)
+    librdf_log(world, 0,
+               job->message_is_error ? LIBRDF_LOG_ERROR : LIBRDF_LOG_WARN,
+               LIBRDF_FROM_PARSER, NULL, "%s", job->message);
+
+  librdf_statement_init(world, &statement);
+  while(!status && p < end) {
+    statement.subject=librdf_parser_raptor_parallel_get_node(world, &p,
+                                                             &loader->subject);
+    statement.predicate=librdf_parser_raptor_parallel_get_node(world, &p,
+                                                               &loader->predicate);
+    statement.object=librdf_parser_raptor_parallel_get_node(world, &p, NULL);
+
+    if(!statement.subject || !statement.predicate || !statement.object) {
+      librdf_log(world,
+                 0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+                 "Cannot create statement nodes");
+      status=1;
+    } else if(librdf_model_add_statement(loader->model, &statement)) {
+      librdf_log(world,
+                 0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+                 "Cannot add statement to model");
+    } else
+      librdf_model_batch_added(loader->model);
+
+    librdf_statement_clear(&statement);
+  }
+
+  return status;
+}
+
+
+static void
+librdf_parser_raptor_parallel_free_job(librdf_parser_raptor_parallel_job* job)
+{
+  if(job->data)
+    LIBRDF_FREE(char*, job->data);
+  if(job->buffer)
+    LIBRDF_FREE(char*, job->buffer);
+  if(job->message)
+    LIBRDF_FREE(char*, job->message);
+  LIBRDF_FREE(librdf_parser_raptor_parallel_job, job);
+}
+
+
+/* wait for the oldest job, write it and free it */
+static int
+librdf_parser_raptor_parallel_write_head(librdf_parser_raptor_parallel_loader* loader)
+{
+  librdf_parser_raptor_parallel_job* job;
+  int status;
+
+  pthread_mutex_lock(&loader->mutex);
+  job=loader->head;
+  while(!job->done)
+    pthread_cond_wait(&loader->done_cond, &loader->mutex);
+  loader->head=job->next;
+  if(!loader->head)
+    loader->tail=NULL;
+  loader->jobs_count--;
+  pthread_mutex_unlock(&loader->mutex);
+
+  status=librdf_parser_raptor_parallel_write(loader, job);
+  librdf_parser_raptor_parallel_free_job(job);
+  return status;
+}
+
+
+/* after a failure, free the oldest job without writing it; jobs not
+ * yet started are never parsed and one being parsed is waited for */
+static void
+librdf_parser_raptor_parallel_discard_head(librdf_parser_raptor_parallel_loader* loader)
+{
+  librdf_parser_raptor_parallel_job* job;
+
+  pthread_mutex_lock(&loader->mutex);
+  for(job=loader->pending; job; job=job->next)
+    job->done=1;
+  loader->pending=NULL;
+
+  job=loader->head;
+  while(!job->done)
+    pthread_cond_wait(&loader->done_cond, &loader->mutex);
+  loader->head=job->next;
+  if(!loader->head)
+    loader->tail=NULL;
+  loader->jobs_count--;
+  pthread_mutex_unlock(&loader->mutex);
+
+  librdf_parser_raptor_parallel_free_job(job);
+}
+
+
+/* queue @data of @length as a job, taking ownership of it */
+static int
+librdf_parser_raptor_parallel_queue(librdf_parser_raptor_parallel_loader* loader,
+                                    unsigned char *data, size_t length)
+{
+  librdf_parser_raptor_parallel_job* job;
+
+  job=LIBRDF_CALLOC(librdf_parser_raptor_parallel_job*, 1, sizeof(*job));
+  if(!job) {
+    LIBRDF_FREE(char*, data);
+    return 1;
+  }
+  job->data=data;
+  job->data_length=length;
+
+  pthread_mutex_lock(&loader->mutex);
+  if(loader->tail)
+    loader->tail->next=job;
+  else
+    loader->head=job;
+  loader->tail=job;
+  if(!loader->pending)
+    loader->pending=job;
+  loader->jobs_count++;
+  pthread_cond_signal(&loader->work_cond);
+  pthread_mutex_unlock(&loader->mutex);
+
+  return 0;
+}
+
+
+/*
+ * librdf_parser_raptor_parse_parallel_into_model:
+ * @pcontext: parser context
+ * @fh: FILE* content source
+ * @base_uri: #librdf_uri URI of the content location or NULL
+ * @model: #librdf_model of model
+ *
+ * INTERNAL - Parse line-based content from @fh into @model with pcontext->threads threads.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_parser_raptor_parse_parallel_into_model(librdf_parser_raptor_context* pcontext,
+                                               FILE *fh,
+                                               librdf_uri *base_uri,
+                                               librdf_model* model)
+{
+  librdf_parser_raptor_parallel_loader loader;
+  librdf_parser_raptor_parallel_worker* workers;
+  unsigned char *carry=NULL;
+  size_t carry_length=0;
+  int status=0;
+  int is_end=0;
+  int i;
+
+  memset(&loader, 0, sizeof(loader));
+  loader.pcontext=pcontext;
+  loader.model=model;
+
+  workers=LIBRDF_CALLOC(librdf_parser_raptor_parallel_worker*,
+                        pcontext->threads, sizeof(*workers));
+  loader.threads=LIBRDF_CALLOC(pthread_t*, pcontext->threads,
+                               sizeof(pthread_t));
+  if(!workers || !loader.threads) {
+    status=-1;
+    goto tidy;
+  }
+
+  pthread_mutex_init(&loader.mutex, NULL);
+  pthread_cond_init(&loader.work_cond, NULL);
+  pthread_cond_init(&loader.done_cond, NULL);
+
+  pcontext->errors=0;
+  pcontext->warnings=0;
+
+  if(base_uri)
+    loader.base_uri_string=librdf_uri_as_string(base_uri);
+
+  librdf_model_batch_start(model);
+
+  for(i = 0; i < pcontext->threads; i++) {
+    workers[i].loader=&loader;
+    if(pthread_create(&loader.threads[i], NULL,
+                      librdf_parser_raptor_parallel_worker_run, &workers[i]))
+      break;
+    loader.threads_count++;
+  }
+  if(!loader.threads_count) {
+    status=-1;
+    goto finish;
+  }
+
+  while(!is_end && !status) {
+    unsigned char *block;
+    size_t length;
+    size_t read_length;
+
+    /* bound the memory in use */
+    while(loader.jobs_count >= 2 * loader.threads_count && !status)
+      status=librdf_parser_raptor_parallel_write_head(&loader);
+    if(status)
+      break;
+
+    block=LIBRDF_MALLOC(unsigned char*,
+                        carry_length + LIBRDF_PARSER_RAPTOR_PARALLEL_BLOCK_SIZE);
+    if(!block) {
+      status=-1;
+      break;
+    }
+    if(carry) {
+      memcpy(block, carry, carry_length);
+      LIBRDF_FREE(char*, carry);
+      carry=NULL;
+    }
+
+    read_length=fread(block + carry_length, 1,
+                      LIBRDF_PARSER_RAPTOR_PARALLEL_BLOCK_SIZE, fh);
+    length=carry_length + read_length;
+    carry_length=0;
+
+    if(read_length < LIBRDF_PARSER_RAPTOR_PARALLEL_BLOCK_SIZE) {
+      if(ferror(fh))
+        status=1;
+      is_end=1;
+    } else {
+      size_t line_end=length;
+
+      while(line_end > 0 && block[line_end - 1] != '\n')
+        line_end--;
+
+      if(!line_end) {
+        /* no line end yet: read more onto this block */
+        carry=block;
+        carry_length=length;
+        continue;
+      }
+
+      if(line_end < length) {
+        carry_length=length - line_end;
+        carry=LIBRDF_MALLOC(unsigned char*, carry_length);
+        if(!carry) {
+          LIBRDF_FREE(char*, block);
+          status=-1;
+          break;
+        }
+        memcpy(carry, block + line_end, carry_length);
+        length=line_end;
+      }
+    }
+
+    if(!length) {
+      LIBRDF_FREE(char*, block);
+      continue;
+    }
+
+    if(librdf_parser_raptor_parallel_queue(&loader, block, length))
+      status=-1;
+  }
+
+  /* write the remaining jobs in order until one fails; the rest are
+   * dropped so a failed parse adds nothing after the failure */
+  while(loader.head) {
+    if(status)
+      librdf_parser_raptor_parallel_discard_head(&loader);
+    else
+      status=librdf_parser_raptor_parallel_write_head(&loader);
+  }
+
+  finish:
+  pthread_mutex_lock(&loader.mutex);
+  loader.finishing=1;
+  pthread_cond_broadcast(&loader.work_cond);
+  pthread_mutex_unlock(&loader.mutex);
+
+  for(i = 0; i < loader.threads_count; i++)
+    pthread_join(loader.threads[i], NULL);
+
+  pthread_cond_destroy(&loader.done_cond);
+  pthread_cond_destroy(&loader.work_cond);
+  pthread_mutex_destroy(&loader.mutex);
+
+  tidy:
+  if(carry)
+    LIBRDF_FREE(char*, carry);
+  if(loader.subject)
+    librdf_free_node(loader.subject);
+  if(loader.predicate)
+    librdf_free_node(loader.predicate);
+  if(loader.threads)
+    LIBRDF_FREE(pthread_t*, loader.threads);
+  if(workers)
+    LIBRDF_FREE(librdf_parser_raptor_parallel_worker*, workers);
+
+  if(librdf_model_batch_end(model, status) && !status)
+    status = 1;
+
+  librdf_raptor_reset_bnode_hash(pcontext->parser->world);
+
+  if(status < 0)
+    librdf_log(pcontext->parser->world,
+               0, LIBRDF_LOG_FATAL, LIBRDF_FROM_PARSER, NULL,
+               "Out of memory");
+
+  return status;
+}
+
+#endif /* WITH_THREADS */
+
+
 /*
  * librdf_parser_raptor_parse_into_model_common:
  * @context: parser context
@@ -860,6 +1672,38 @@ librdf_parser_raptor_parse_into_model_common(void *context,
     return 1;
   }
 
+#ifdef WITH_THREADS
+  if(pcontext->threads > 1 &&
+     (fh || (uri && librdf_uri_is_file_uri(uri))) &&
+     (!strcmp(pcontext->parser_name, "ntriples") ||
+      !strcmp(pcontext->parser_name, "nquads"))) {
+    char* filename;
+
+    if(fh)
+      return librdf_parser_raptor_parse_parallel_into_model(pcontext, fh,
+                                                            base_uri, model);
+
+    filename=(char*)librdf_uri_to_filename(uri);
+    if(!filename)
+      return 1;
+
+    fh=fopen(filename, "r");
+    if(!fh) {
+      librdf_log(pcontext->parser->world, 0, LIBRDF_LOG_ERROR,
+                 LIBRDF_FROM_PARSER, NULL, "failed to open file '%s' - %s",
+                 filename, strerror(errno));
+      SYSTEM_FREE(filename);
+      return 1;
+    }
+
+    status=librdf_parser_raptor_parse_parallel_into_model(pcontext, fh,
+                                                          base_uri, model);
+    fclose(fh);
+    SYSTEM_FREE(filename);
+    return status;
+  }
+#endif
+
   pcontext->errors=0;
   pcontext->warnings=0;
 
@@ -884,13 +1728,21 @@ librdf_parser_raptor_parse_into_model_common(void *context,
   if(!pcontext->nspace_uris)
     goto oom;
 
+  scontext->boolean_datatype_uri = librdf_new_uri_from_uri_local_name(pcontext->parser->world->xsd_namespace_uri,
+                                                                      (const unsigned char*)"boolean");
+  if(!scontext->boolean_datatype_uri)
+    goto oom;
+
+  scontext->intern=librdf_node_get_interning(pcontext->parser->world);
+
   raptor_parser_set_statement_handler(pcontext->rdf_parser, scontext,
-                                      librdf_parser_raptor_new_statement_handler);
+                                      librdf_parser_raptor_model_statement_handler);
   raptor_parser_set_namespace_handler(pcontext->rdf_parser, pcontext,
                                       librdf_parser_raptor_namespace_handler);
 
-  /* direct into model */
+  /* direct into model, in transactions when the model supports them */
   scontext->model=model;
+  librdf_model_batch_start(model);
 
   if(pcontext->parser->uri_filter)
     raptor_parser_set_uri_filter(pcontext->rdf_parser,
@@ -918,6 +1770,9 @@ librdf_parser_raptor_parse_into_model_common(void *context,
 
   librdf_parser_raptor_serialise_finished((void*)scontext);
 
+  if(librdf_model_batch_end(model, status) && !status)
+    status = 1;
+
   return status;
 
   /* Clean up and report an error on OOM */
@@ -1162,9 +2017,15 @@ librdf_parser_raptor_serialise_finished(void* context)
       librdf_free_list(scontext->statements);
     }
 
+    if(scontext->boolean_datatype_uri)
+      librdf_free_uri(scontext->boolean_datatype_uri);
+
     if(scontext->fh && scontext->close_fh)
       fclose(scontext->fh);
 
+    if(scontext->string)
+      LIBRDF_FREE(char*, scontext->string);
+
     if(scontext->pcontext)
       scontext->pcontext->stream_context = NULL;
 
@@ -1197,6 +2058,10 @@ librdf_parser_raptor_get_feature(void* context, librdf_uri *feature)
     sprintf((char*)intbuffer, "%d", pcontext->warnings);
     return librdf_new_node_from_typed_literal(pcontext->parser->world,
                                               intbuffer, NULL, NULL);
+  } else if(!strcmp((const char*)uri_string, LIBRDF_PARSER_FEATURE_THREADS)) {
+    sprintf((char*)intbuffer, "%d", pcontext->threads);
+    return librdf_new_node_from_typed_literal(pcontext->parser->world,
+                                              intbuffer, NULL, NULL);
   } else {
     /* raptor2: try a raptor option */
     raptor_option feature_i;
@@ -1227,6 +2092,17 @@ librdf_parser_raptor_set_feature(void* context,
   if(!feature)
     return 1;
 
+  if(!strcmp((const char*)librdf_uri_as_string(feature),
+             LIBRDF_PARSER_FEATURE_THREADS)) {
+    if(!librdf_node_is_literal(value))
+      return 1;
+
+    pcontext->threads=atoi((const char*)librdf_node_get_literal_value(value));
+    if(pcontext->threads < 0)
+      pcontext->threads=0;
+    return 0;
+  }
+
   /* try a raptor feature */
   feature_i = raptor_world_get_option_from_uri(pcontext->parser->world->raptor_world_ptr, (raptor_uri*)feature);
   if((int)feature_i < 0)
@@ -792,6 +792,38 @@ main(int argc, char *argv[])
   librdf_free_query_results(results);
 
 
+  /* answers remembered by the query engine must not outlive a change */
+  if(1) {
+    librdf_statement* statement;
+    int count=0;
+
+    statement=librdf_new_statement_from_nodes(world,
+      librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/rex"),
+      librdf_new_node_from_uri_string(world, (const unsigned char*)"http://www.w3.org/1999/02/22-rdf-syntax-ns#type"),
+      librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/Dog"));
+    librdf_model_add_statement(model, statement);
+    librdf_free_statement(statement);
+
+    fprintf(stdout, "%s: Executing after adding a statement\n", program);
+    if(!(results=librdf_model_query_execute(model, query))) {
+      fprintf(stderr, "%s: Third query of model with '%s' failed\n", 
+              program, query_string);
+      return 1;
+    }
+    while(!librdf_query_results_finished(results)) {
+      count++;
+      librdf_query_results_next(results);
+    }
+    librdf_free_query_results(results);
+
+    if(count != 2) {
+      fprintf(stderr, "%s: Query after adding a statement returned %d results, expected 2\n",
+              program, count);
+      return 1;
+    }
+  }
+
+
   fprintf(stdout, "%s: Freeing query\n", program);
   librdf_free_query(query);
 
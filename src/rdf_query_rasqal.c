@@ -272,10 +272,42 @@ redland_node_to_rasqal_literal(librdf_world* world, librdf_node *node)
 }
 
 
+/* Maximum number of distinct bound-term keys remembered per triple pattern */
+#define LIBRDF_RASQAL_MATCH_CACHE_SIZE 64
+
+/* Maximum number of statements remembered for one key */
+#define LIBRDF_RASQAL_MATCH_CACHE_MAX_STATEMENTS 256
+
+/* answer of one triple pattern for one set of bound terms */
+typedef struct {
+  /* subject, predicate, object, origin query nodes; NULL when unbound */
+  librdf_node* key[4];
+  librdf_statement** statements;
+  librdf_node** contexts;
+  int size;
+  /* number of matches currently replaying this answer */
+  int users;
+  /* model change count the answer was recorded at */
+  unsigned long modifications;
+} rasqal_redland_match_result;
+
+typedef struct {
+  rasqal_triple* triple;
+  /* constant (non-variable) terms of the pattern converted once */
+  librdf_node* constants[4];
+  rasqal_redland_match_result results[LIBRDF_RASQAL_MATCH_CACHE_SIZE];
+  int results_count;
+  int next_victim;
+} rasqal_redland_triple_cache;
+
 typedef struct {
   librdf_world *world;
   librdf_query *query;
   librdf_model *model;
+  /* per triple pattern caches, grown on demand */
+  rasqal_redland_triple_cache** triples;
+  int triples_count;
+  int triples_size;
 } rasqal_redland_triples_source_user_data;
 
 
@@ -370,10 +402,155 @@ rasqal_redland_triple_present(rasqal_triples_source *rts, void *user_data,
 
 
 
+static void
+rasqal_redland_free_match_result(rasqal_redland_match_result* result)
+{
+  int i;
+
+  for(i=0; i < 4; i++) {
+    if(result->key[i])
+      librdf_free_node(result->key[i]);
+  }
+  for(i=0; i < result->size; i++) {
+    librdf_free_statement(result->statements[i]);
+    if(result->contexts[i])
+      librdf_free_node(result->contexts[i]);
+  }
+  if(result->statements)
+    LIBRDF_FREE(librdf_statement**, result->statements);
+  if(result->contexts)
+    LIBRDF_FREE(librdf_node**, result->contexts);
+  memset(result, 0, sizeof(*result));
+}
+
+
 static void
 rasqal_redland_free_triples_source(void *user_data)
 {
-  /* rasqal_redland_triples_source_user_data* rtsc=(rasqal_redland_triples_source_user_data*)user_data; */
+  rasqal_redland_triples_source_user_data* rtsc=(rasqal_redland_triples_source_user_data*)user_data;
+  int i;
+  int j;
+
+  for(i=0; i < rtsc->triples_count; i++) {
+    rasqal_redland_triple_cache* tc=rtsc->triples[i];
+
+    for(j=0; j < 4; j++) {
+      if(tc->constants[j])
+        librdf_free_node(tc->constants[j]);
+    }
+    for(j=0; j < tc->results_count; j++)
+      rasqal_redland_free_match_result(&tc->results[j]);
+    LIBRDF_FREE(rasqal_redland_triple_cache, tc);
+  }
+  if(rtsc->triples)
+    LIBRDF_FREE(rasqal_redland_triple_cache**, rtsc->triples);
+  rtsc->triples=NULL;
+  rtsc->triples_count=0;
+  rtsc->triples_size=0;
+}
+
+
+/*
+ * rasqal_redland_get_triple_cache:
+ * @rtsc: triples source user data
+ * @t: triple pattern
+ *
+ * INTERNAL - Get the cache for a triple pattern, creating it with the
+ * constant terms converted to nodes on first use.
+ *
+ * Return value: cache or NULL on failure
+ */
+static rasqal_redland_triple_cache*
+rasqal_redland_get_triple_cache(rasqal_redland_triples_source_user_data* rtsc,
+                                rasqal_triple* t)
+{
+  rasqal_redland_triple_cache* tc;
+  rasqal_literal* terms[4];
+  int i;
+
+  for(i=0; i < rtsc->triples_count; i++) {
+    if(rtsc->triples[i]->triple == t)
+      return rtsc->triples[i];
+  }
+
+  if(rtsc->triples_count == rtsc->triples_size) {
+    rasqal_redland_triple_cache** new_triples;
+    int new_size=rtsc->triples_size ? rtsc->triples_size << 1 : 8;
+
+    new_triples=LIBRDF_CALLOC(rasqal_redland_triple_cache**, new_size,
+                              sizeof(*new_triples));
+    if(!new_triples)
+      return NULL;
+    if(rtsc->triples) {
+      memcpy(new_triples, rtsc->triples,
+             rtsc->triples_count * sizeof(*new_triples));
+      LIBRDF_FREE(rasqal_redland_triple_cache**, rtsc->triples);
+    }
+    rtsc->triples=new_triples;
+    rtsc->triples_size=new_size;
+  }
+
+  tc=LIBRDF_CALLOC(rasqal_redland_triple_cache*, 1, sizeof(*tc));
+  if(!tc)
+    return NULL;
+  tc->triple=t;
+
+  terms[0]=t->subject;
+  terms[1]=t->predicate;
+  terms[2]=t->object;
+  terms[3]=t->origin;
+  for(i=0; i < 4; i++) {
+    if(terms[i] && !rasqal_literal_as_variable(terms[i]))
+      tc->constants[i]=rasqal_literal_to_redland_node(rtsc->world, terms[i]);
+  }
+
+  rtsc->triples[rtsc->triples_count++]=tc;
+  return tc;
+}
+
+
+static int
+rasqal_redland_match_key_equals(librdf_node* a, librdf_node* b)
+{
+  if(!a || !b)
+    return (a == b);
+  return librdf_node_equals(a, b);
+}
+
+
+/*
+ * rasqal_redland_find_match_result:
+ * @tc: triple pattern cache
+ * @key: subject, predicate, object, origin query nodes
+ * @modifications: current model change count
+ *
+ * INTERNAL - Find a remembered answer for the bound terms in @key that
+ * is still up to date with the model
+ *
+ * Return value: answer or NULL if not remembered
+ */
+static rasqal_redland_match_result*
+rasqal_redland_find_match_result(rasqal_redland_triple_cache* tc,
+                                 librdf_node* key[4],
+                                 unsigned long modifications)
+{
+  int i;
+  int j;
+
+  for(i=0; i < tc->results_count; i++) {
+    rasqal_redland_match_result* result=&tc->results[i];
+
+    if(result->modifications != modifications)
+      continue;
+    for(j=0; j < 4; j++) {
+      if(!rasqal_redland_match_key_equals(result->key[j], key[j]))
+        break;
+    }
+    if(j == 4)
+      return result;
+  }
+
+  return NULL;
 }
 
 
@@ -404,9 +581,216 @@ typedef struct {
   /* query statement, made from the nodes above (even when exact) */
   librdf_statement *qstatement;
   librdf_stream *stream;
+  librdf_model* model;
+  /* pattern cache this match reads from or records into */
+  rasqal_redland_triple_cache* cache;
+  /* model change count when the storage answer was asked for */
+  unsigned long modifications;
+  /* remembered answer being replayed or NULL */
+  rasqal_redland_match_result* replay;
+  int replay_offset;
+  /* statements seen so far while recording a storage answer */
+  int recording;
+  int complete;
+  librdf_statement** recorded;
+  librdf_node** recorded_contexts;
+  int recorded_count;
 } rasqal_redland_triples_match_context;
 
 
+static int
+rasqal_redland_replay_end_of_stream(void* context)
+{
+  rasqal_redland_triples_match_context* rtmc=(rasqal_redland_triples_match_context*)context;
+
+  return (rtmc->replay_offset >= rtmc->replay->size);
+}
+
+
+static int
+rasqal_redland_replay_next_statement(void* context)
+{
+  rasqal_redland_triples_match_context* rtmc=(rasqal_redland_triples_match_context*)context;
+
+  rtmc->replay_offset++;
+  return (rtmc->replay_offset >= rtmc->replay->size);
+}
+
+
+static void*
+rasqal_redland_replay_get_statement(void* context, int flags)
+{
+  rasqal_redland_triples_match_context* rtmc=(rasqal_redland_triples_match_context*)context;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return rtmc->replay->statements[rtmc->replay_offset];
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return rtmc->replay->contexts[rtmc->replay_offset];
+
+    default:
+      librdf_log(rtmc->stream->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_QUERY, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+rasqal_redland_replay_finished(void* context)
+{
+  rasqal_redland_triples_match_context* rtmc=(rasqal_redland_triples_match_context*)context;
+
+  rtmc->replay->users--;
+}
+
+
+static void
+rasqal_redland_free_recorded(rasqal_redland_triples_match_context* rtmc)
+{
+  int i;
+
+  for(i=0; i < rtmc->recorded_count; i++) {
+    librdf_free_statement(rtmc->recorded[i]);
+    if(rtmc->recorded_contexts[i])
+      librdf_free_node(rtmc->recorded_contexts[i]);
+  }
+  if(rtmc->recorded)
+    LIBRDF_FREE(librdf_statement**, rtmc->recorded);
+  if(rtmc->recorded_contexts)
+    LIBRDF_FREE(librdf_node**, rtmc->recorded_contexts);
+  rtmc->recorded=NULL;
+  rtmc->recorded_contexts=NULL;
+  rtmc->recorded_count=0;
+  rtmc->recording=0;
+}
+
+
+/*
+ * rasqal_redland_record_current:
+ * @rtmc: match context
+ *
+ * INTERNAL - Remember the current statement of the storage answer so
+ * the whole answer can be replayed for the next identical bindings.
+ * Recording stops once the answer gets too large to keep.
+ */
+static void
+rasqal_redland_record_current(rasqal_redland_triples_match_context* rtmc)
+{
+  librdf_statement* statement;
+  librdf_node* context_node;
+
+  if(!rtmc->recording)
+    return;
+
+  if(rtmc->recorded_count == LIBRDF_RASQAL_MATCH_CACHE_MAX_STATEMENTS) {
+    rasqal_redland_free_recorded(rtmc);
+    return;
+  }
+
+  if(!rtmc->recorded) {
+    rtmc->recorded=LIBRDF_CALLOC(librdf_statement**,
+                                 LIBRDF_RASQAL_MATCH_CACHE_MAX_STATEMENTS,
+                                 sizeof(librdf_statement*));
+    rtmc->recorded_contexts=LIBRDF_CALLOC(librdf_node**,
+                                          LIBRDF_RASQAL_MATCH_CACHE_MAX_STATEMENTS,
+                                          sizeof(librdf_node*));
+    if(!rtmc->recorded || !rtmc->recorded_contexts) {
+      rasqal_redland_free_recorded(rtmc);
+      return;
+    }
+  }
+
+  statement=librdf_stream_get_object(rtmc->stream);
+  if(!statement) {
+    rasqal_redland_free_recorded(rtmc);
+    return;
+  }
+  statement=librdf_new_statement_from_statement(statement);
+  if(!statement) {
+    rasqal_redland_free_recorded(rtmc);
+    return;
+  }
+
+  context_node=librdf_stream_get_context2(rtmc->stream);
+  if(context_node)
+    context_node=librdf_new_node_from_node(context_node);
+
+  rtmc->recorded[rtmc->recorded_count]=statement;
+  rtmc->recorded_contexts[rtmc->recorded_count]=context_node;
+  rtmc->recorded_count++;
+}
+
+
+/*
+ * rasqal_redland_store_recorded:
+ * @rtmc: match context
+ *
+ * INTERNAL - Move a completely recorded storage answer into the pattern
+ * cache, reusing an out of date answer or replacing the oldest
+ * remembered answer when it is full.  An answer read while the model
+ * changed is not kept.
+ */
+static void
+rasqal_redland_store_recorded(rasqal_redland_triples_match_context* rtmc)
+{
+  rasqal_redland_triple_cache* tc=rtmc->cache;
+  rasqal_redland_match_result* result=NULL;
+  unsigned long modifications;
+  int i;
+
+  modifications=librdf_model_get_modifications(rtmc->model);
+  if(modifications != rtmc->modifications)
+    return;
+
+  for(i=0; i < tc->results_count; i++) {
+    if(!tc->results[i].users &&
+       tc->results[i].modifications != modifications) {
+      result=&tc->results[i];
+      rasqal_redland_free_match_result(result);
+      break;
+    }
+  }
+
+  if(!result) {
+    if(tc->results_count < LIBRDF_RASQAL_MATCH_CACHE_SIZE)
+      result=&tc->results[tc->results_count++];
+    else {
+      result=&tc->results[tc->next_victim];
+      if(result->users)
+        return;
+      tc->next_victim=(tc->next_victim + 1) % LIBRDF_RASQAL_MATCH_CACHE_SIZE;
+      rasqal_redland_free_match_result(result);
+    }
+  }
+
+  result->key[0]=librdf_statement_get_subject(rtmc->qstatement);
+  result->key[1]=librdf_statement_get_predicate(rtmc->qstatement);
+  result->key[2]=librdf_statement_get_object(rtmc->qstatement);
+  result->key[3]=rtmc->origin;
+  if(result->key[0])
+    result->key[0]=librdf_new_node_from_node(result->key[0]);
+  if(result->key[1])
+    result->key[1]=librdf_new_node_from_node(result->key[1]);
+  if(result->key[2])
+    result->key[2]=librdf_new_node_from_node(result->key[2]);
+  if(result->key[3])
+    result->key[3]=librdf_new_node_from_node(result->key[3]);
+
+  result->statements=rtmc->recorded;
+  result->contexts=rtmc->recorded_contexts;
+  result->size=rtmc->recorded_count;
+  result->modifications=modifications;
+
+  rtmc->recorded=NULL;
+  rtmc->recorded_contexts=NULL;
+  rtmc->recorded_count=0;
+  rtmc->recording=0;
+}
+
+
 static rasqal_triple_parts
 rasqal_redland_bind_match(struct rasqal_triples_match_s* rtm,
                           void *user_data,
@@ -561,6 +945,7 @@ rasqal_redland_next_match(struct rasqal_triples_match_s* rtm,
 {
   rasqal_redland_triples_match_context* rtmc=(rasqal_redland_triples_match_context*)rtm->user_data;
 
+  rasqal_redland_record_current(rtmc);
   librdf_stream_next(rtmc->stream);
 }
 
@@ -569,8 +954,13 @@ rasqal_redland_is_end(struct rasqal_triples_match_s* rtm,
                       void *user_data)
 {
   rasqal_redland_triples_match_context* rtmc=(rasqal_redland_triples_match_context*)rtm->user_data;
+  int is_end;
+
+  is_end=librdf_stream_end(rtmc->stream);
+  if(is_end && rtmc->recording)
+    rtmc->complete=1;
 
-  return librdf_stream_end(rtmc->stream);
+  return is_end;
 }
 
 
@@ -585,8 +975,13 @@ rasqal_redland_finish_triples_match(struct rasqal_triples_match_s* rtm,
       librdf_free_stream(rtmc->stream);
       rtmc->stream=NULL;
     }
+    if(rtmc->recording && rtmc->complete)
+      rasqal_redland_store_recorded(rtmc);
+    rasqal_redland_free_recorded(rtmc);
     if(rtmc->qstatement)
       librdf_free_statement(rtmc->qstatement);
+    if(rtmc->origin)
+      librdf_free_node(rtmc->origin);
     LIBRDF_FREE(rasqal_redland_triples_match_context, rtmc);
   }
 }
@@ -599,7 +994,11 @@ rasqal_redland_init_triples_match(rasqal_triples_match* rtm,
 {
   rasqal_redland_triples_source_user_data* rtsc=(rasqal_redland_triples_source_user_data*)user_data;
   rasqal_redland_triples_match_context* rtmc;
+  rasqal_redland_triple_cache* tc;
+  rasqal_literal* terms[3];
+  librdf_node* key[4];
   rasqal_variable* var;
+  int i;
 
   rtm->bind_match=rasqal_redland_bind_match;
   rtm->next_match=rasqal_redland_next_match;
@@ -611,6 +1010,12 @@ rasqal_redland_init_triples_match(rasqal_triples_match* rtm,
     return 1;
 
   rtm->user_data=rtmc;
+  rtmc->model=rtsc->model;
+
+  tc=rasqal_redland_get_triple_cache(rtsc, t);
+  if(!tc)
+    return 1;
+  rtmc->cache=tc;
 
 
   /* at least one of the triple terms is a variable and we need to
@@ -618,47 +1023,33 @@ rasqal_redland_init_triples_match(rasqal_triples_match* rtm,
    *
    * redland find_statements will do the right thing and internally
    * pick the most efficient, indexed way to get the answer.
+   *
+   * Constant terms were converted once when the pattern was first
+   * seen; only variable values are converted per outer binding.
    */
 
-  if((var=rasqal_literal_as_variable(t->subject))) {
-    if(var->value)
-      rtmc->nodes[0]=rasqal_literal_to_redland_node(rtsc->world, var->value);
-    else
-      rtmc->nodes[0]=NULL;
-  } else
-    rtmc->nodes[0]=rasqal_literal_to_redland_node(rtsc->world, t->subject);
-
-  m->bindings[0]=var;
-  
-
-  if((var=rasqal_literal_as_variable(t->predicate))) {
-    if(var->value)
-      rtmc->nodes[1]=rasqal_literal_to_redland_node(rtsc->world, var->value);
-    else
-      rtmc->nodes[1]=NULL;
-  } else
-    rtmc->nodes[1]=rasqal_literal_to_redland_node(rtsc->world, t->predicate);
-
-  m->bindings[1]=var;
-  
+  terms[0]=t->subject;
+  terms[1]=t->predicate;
+  terms[2]=t->object;
+  for(i=0; i < 3; i++) {
+    if((var=rasqal_literal_as_variable(terms[i]))) {
+      if(var->value)
+        rtmc->nodes[i]=rasqal_literal_to_redland_node(rtsc->world, var->value);
+      else
+        rtmc->nodes[i]=NULL;
+    } else if(tc->constants[i])
+      rtmc->nodes[i]=librdf_new_node_from_node(tc->constants[i]);
 
-  if((var=rasqal_literal_as_variable(t->object))) {
-    if(var->value)
-      rtmc->nodes[2]=rasqal_literal_to_redland_node(rtsc->world, var->value);
-    else
-      rtmc->nodes[2]=NULL;
-  } else
-    rtmc->nodes[2]=rasqal_literal_to_redland_node(rtsc->world, t->object);
+    m->bindings[i]=var;
+  }
 
-  m->bindings[2]=var;
-  
 
   if(t->origin) {
     if((var=rasqal_literal_as_variable(t->origin))) {
       if(var->value)
         rtmc->origin=rasqal_literal_to_redland_node(rtsc->world, var->value);
-    } else
-      rtmc->origin=rasqal_literal_to_redland_node(rtsc->world, t->origin);
+    } else if(tc->constants[3])
+      rtmc->origin=librdf_new_node_from_node(tc->constants[3]);
     m->bindings[3]=var;
   }
 
@@ -679,6 +1070,30 @@ rasqal_redland_init_triples_match(rasqal_triples_match* rtm,
   }
   fputc('\n', stderr);
 #endif
+
+  /* The rasqal engine joins patterns as nested loops, asking for the
+   * same pattern again for every outer row.  Answers for bindings seen
+   * before are replayed from memory instead of going back to storage,
+   * as long as the model has not changed since.
+   */
+  key[0]=librdf_statement_get_subject(rtmc->qstatement);
+  key[1]=librdf_statement_get_predicate(rtmc->qstatement);
+  key[2]=librdf_statement_get_object(rtmc->qstatement);
+  key[3]=rtmc->origin;
+  rtmc->modifications=librdf_model_get_modifications(rtsc->model);
+  rtmc->replay=rasqal_redland_find_match_result(tc, key, rtmc->modifications);
+  if(rtmc->replay) {
+    rtmc->stream=librdf_new_stream(rtsc->world,
+                                   (void*)rtmc,
+                                   &rasqal_redland_replay_end_of_stream,
+                                   &rasqal_redland_replay_next_statement,
+                                   &rasqal_redland_replay_get_statement,
+                                   &rasqal_redland_replay_finished);
+    if(!rtmc->stream)
+      return 1;
+    rtmc->replay->users++;
+    return 0;
+  }
   
   if(rtmc->origin)
     rtmc->stream=librdf_model_find_statements_in_context(rtsc->model, 
@@ -690,6 +1105,8 @@ rasqal_redland_init_triples_match(rasqal_triples_match* rtm,
   if(!rtmc->stream)
     return 1;
 
+  rtmc->recording=1;
+
 #if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
   LIBRDF_DEBUG1("rasqal_init_triples_match done\n");
 #endif
@@ -135,6 +135,45 @@ librdf_raptor_reset_bnode_hash(librdf_world* world)
   return 0;
 }
 
+/**
+ * librdf_raptor_map_bnodeid:
+ * @world: librdf_world object
+ * @user_bnodeid: blank node identifier seen in the content being parsed
+ *
+ * INTERNAL - Map a parsed blank node identifier to a generated one.
+ *
+ * The same @user_bnodeid is mapped to the same identifier until the
+ * map is reset with librdf_raptor_reset_bnode_hash().
+ *
+ * Return value: new identifier or NULL on failure
+ **/
+unsigned char*
+librdf_raptor_map_bnodeid(librdf_world* world,
+                          const unsigned char *user_bnodeid)
+{
+  unsigned char *mapped_id;
+
+  if(!world->bnode_hash)
+    return librdf_world_get_genid(world);
+
+  mapped_id = (unsigned char*)librdf_hash_get(world->bnode_hash,
+                                              (const char*)user_bnodeid);
+  if(!mapped_id) {
+    mapped_id = librdf_world_get_genid(world);
+
+    if(mapped_id &&
+       librdf_hash_put_strings(world->bnode_hash,
+                               (const char*)user_bnodeid, (char*)mapped_id)) {
+      /* error -> free mapped_id and return NULL */
+      LIBRDF_FREE(char*, mapped_id);
+      mapped_id = NULL;
+    }
+  }
+
+  return mapped_id;
+}
+
+
 static unsigned char*
 librdf_raptor_generate_id_handler(void *user_data,
                                   unsigned char *user_bnodeid)
@@ -144,19 +183,8 @@ librdf_raptor_generate_id_handler(void *user_data,
   if(user_bnodeid && world->bnode_hash) {
     unsigned char *mapped_id;
 
-    mapped_id = (unsigned char*)librdf_hash_get(world->bnode_hash,
-                                                (const char*)user_bnodeid);
-    if(!mapped_id) {
-      mapped_id = librdf_world_get_genid(world);
-
-      if(mapped_id &&
-         librdf_hash_put_strings(world->bnode_hash,
-                                 (char*)user_bnodeid, (char*)mapped_id)) {
-        /* error -> free mapped_id and return NULL */
-        LIBRDF_FREE(char*, mapped_id);
-        mapped_id = NULL;
-      }
-    }
+    mapped_id = librdf_raptor_map_bnodeid(world, user_bnodeid);
+
     /* always free passed in bnodeid */
     raptor_free_memory(user_bnodeid);
 
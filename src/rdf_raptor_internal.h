@@ -35,6 +35,7 @@ void librdf_finish_raptor(librdf_world* world);
 
 int librdf_raptor_free_bnode_hash(librdf_world* world);
 int librdf_raptor_reset_bnode_hash(librdf_world* world);
+unsigned char* librdf_raptor_map_bnodeid(librdf_world* world, const unsigned char *user_bnodeid);
 
 #ifdef __cplusplus
 }
@@ -89,6 +89,7 @@ librdf_new_statement_from_statement(librdf_statement* statement)
   if(!statement)
     return NULL;
 
+  LIBRDF_REFERENCES_LOCK();
   subject = raptor_term_copy(statement->subject);
   if(statement->subject && !subject)
     goto err;
@@ -104,6 +105,7 @@ librdf_new_statement_from_statement(librdf_statement* statement)
   graph = raptor_term_copy(statement->graph);
   if(statement->graph && !graph)
     goto err;
+  LIBRDF_REFERENCES_UNLOCK();
 
   return raptor_new_statement_from_nodes(statement->world, subject, predicate, object, graph);
 
@@ -116,6 +118,7 @@ librdf_new_statement_from_statement(librdf_statement* statement)
     raptor_free_term(predicate);
   if(subject)
     raptor_free_term(subject);
+  LIBRDF_REFERENCES_UNLOCK();
   return NULL;
 }
 
@@ -132,12 +135,17 @@ librdf_new_statement_from_statement(librdf_statement* statement)
 librdf_statement*
 librdf_new_statement_from_statement2(librdf_statement* statement)
 {
+  librdf_statement* new_statement;
+
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, NULL);
 
   if(!statement)
     return NULL;
   
-  return raptor_statement_copy(statement);
+  LIBRDF_REFERENCES_LOCK();
+  new_statement = raptor_statement_copy(statement);
+  LIBRDF_REFERENCES_UNLOCK();
+  return new_statement;
 }
 
 
@@ -202,7 +210,9 @@ librdf_statement_clear(librdf_statement *statement)
 {
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN(statement, librdf_statement);
 
+  LIBRDF_REFERENCES_LOCK();
   raptor_statement_clear(statement);
+  LIBRDF_REFERENCES_UNLOCK();
 }
 
 
@@ -219,7 +229,9 @@ librdf_free_statement(librdf_statement* statement)
   if(!statement)
     return;
   
+  LIBRDF_REFERENCES_LOCK();
   raptor_free_statement(statement);
+  LIBRDF_REFERENCES_UNLOCK();
 }
 
 
@@ -93,6 +93,12 @@ librdf_init_storage(librdf_world *world)
   #ifdef STORAGE_TREES
     librdf_init_storage_trees(world);
   #endif
+  #ifdef STORAGE_SORTED
+    librdf_init_storage_sorted(world);
+  #endif
+  #ifdef STORAGE_SNAPSHOT
+    librdf_init_storage_snapshot(world);
+  #endif
   #ifdef STORAGE_MEMORY
     librdf_init_storage_list(world);
   #endif
@@ -713,10 +719,15 @@ librdf_new_storage_from_factory(librdf_world *world,
 void
 librdf_free_storage(librdf_storage* storage) 
 {
+  int usage;
+
   if(!storage)
     return;
   
-  if(--storage->usage)
+  LIBRDF_REFERENCES_LOCK();
+  usage = --storage->usage;
+  LIBRDF_REFERENCES_UNLOCK();
+  if(usage)
     return;
 
   if(storage->factory)
@@ -737,7 +748,9 @@ librdf_free_storage(librdf_storage* storage)
 void
 librdf_storage_add_reference(librdf_storage *storage)
 {
+  LIBRDF_REFERENCES_LOCK();
   storage->usage++;
+  LIBRDF_REFERENCES_UNLOCK();
 }
 
 
@@ -1978,6 +1991,372 @@ librdf_storage_transaction_get_handle(librdf_storage* storage)
 }
 
 
+/**
+ * librdf_storage_estimate_statements:
+ * @storage: #librdf_storage object
+ * @statement: #librdf_statement partial statement pattern or NULL for all
+ * @distinct: 0 to estimate matching statements, or one of
+ *   #LIBRDF_STATEMENT_SUBJECT, #LIBRDF_STATEMENT_PREDICATE or
+ *   #LIBRDF_STATEMENT_OBJECT to estimate the distinct nodes in that part
+ *   of the matching statements
+ *
+ * Estimate the size of the answer to a triple pattern without
+ * running it.
+ *
+ * The estimates come from counts the storage maintains as statements
+ * are added and removed; for example, with only the predicate given,
+ * the statement count is exact for storages keeping statistics and
+ * @distinct gives the number of distinct subjects or objects used
+ * with the predicate.  They are intended for choosing join orders and
+ * index strategies and may be approximate.  Contexts are not
+ * considered.
+ *
+ * Return value: estimated count or < 0 if the storage cannot estimate it
+ **/
+int
+librdf_storage_estimate_statements(librdf_storage* storage,
+                                   librdf_statement* statement,
+                                   int distinct)
+{
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, -1);
+
+  if(storage->factory->estimate_statements)
+    return storage->factory->estimate_statements(storage, statement, distinct);
+
+  /* without statistics only the total is known */
+  if(!distinct &&
+     (!statement || (!librdf_statement_get_subject(statement) &&
+                     !librdf_statement_get_predicate(statement) &&
+                     !librdf_statement_get_object(statement))))
+    return librdf_storage_size(storage);
+
+  return -1;
+}
+
+
+static int
+librdf_storage_statistics_predicate_compare(const void* data1,
+                                            const void* data2)
+{
+  librdf_storage_statistics_predicate* a=(librdf_storage_statistics_predicate*)data1;
+  librdf_storage_statistics_predicate* b=(librdf_storage_statistics_predicate*)data2;
+
+  return librdf_uri_compare(librdf_node_get_uri(a->predicate),
+                            librdf_node_get_uri(b->predicate));
+}
+
+
+static void
+librdf_storage_statistics_predicate_free(void* data)
+{
+  librdf_storage_statistics_predicate* ps=(librdf_storage_statistics_predicate*)data;
+
+  librdf_free_node(ps->predicate);
+  LIBRDF_FREE(librdf_storage_statistics_predicate, ps);
+}
+
+
+/**
+ * librdf_new_storage_statistics:
+ * @world: redland world
+ * @predicate_parts: distinct per predicate counts the storage will
+ *   maintain: OR of #LIBRDF_STATEMENT_SUBJECT and #LIBRDF_STATEMENT_OBJECT
+ * @global_parts: distinct store wide counts the storage will maintain,
+ *   as above
+ *
+ * INTERNAL - Create empty statement statistics for a storage module.
+ *
+ * The storage module calls librdf_storage_statistics_update() as
+ * statements are added and removed, telling it when a (subject,
+ * predicate) or (predicate, object) pair first appears or finally
+ * disappears, which the module can find from its indexes.
+ *
+ * Return value: new statistics or NULL on failure
+ **/
+librdf_storage_statistics*
+librdf_new_storage_statistics(librdf_world* world, int predicate_parts,
+                              int global_parts)
+{
+  librdf_storage_statistics* stats;
+
+  stats=LIBRDF_CALLOC(librdf_storage_statistics*, 1, sizeof(*stats));
+  if(!stats)
+    return NULL;
+
+  stats->world=world;
+  stats->predicate_parts=predicate_parts;
+  stats->global_parts=global_parts;
+  stats->predicates=raptor_new_avltree(librdf_storage_statistics_predicate_compare,
+                                       librdf_storage_statistics_predicate_free,
+                                       0);
+  if(!stats->predicates) {
+    LIBRDF_FREE(librdf_storage_statistics, stats);
+    return NULL;
+  }
+
+  return stats;
+}
+
+
+/**
+ * librdf_free_storage_statistics:
+ * @stats: statistics
+ *
+ * INTERNAL - Destructor
+ **/
+void
+librdf_free_storage_statistics(librdf_storage_statistics* stats)
+{
+  if(!stats)
+    return;
+
+  if(stats->predicates)
+    raptor_free_avltree(stats->predicates);
+  LIBRDF_FREE(librdf_storage_statistics, stats);
+}
+
+
+/**
+ * librdf_storage_statistics_clear:
+ * @stats: statistics
+ *
+ * INTERNAL - Reset all counts to those of an empty store.
+ **/
+void
+librdf_storage_statistics_clear(librdf_storage_statistics* stats)
+{
+  raptor_avltree* predicates;
+
+  predicates=raptor_new_avltree(librdf_storage_statistics_predicate_compare,
+                                librdf_storage_statistics_predicate_free,
+                                0);
+  if(predicates) {
+    raptor_free_avltree(stats->predicates);
+    stats->predicates=predicates;
+  } else {
+    /* keep the old tree but never trust it */
+    stats->stale=1;
+    return;
+  }
+
+  stats->statements=0;
+  stats->subjects=0;
+  stats->objects=0;
+  stats->predicate_subjects=0;
+  stats->predicate_objects=0;
+  stats->stale=0;
+}
+
+
+static librdf_storage_statistics_predicate*
+librdf_storage_statistics_get_predicate(librdf_storage_statistics* stats,
+                                        librdf_node* predicate)
+{
+  librdf_storage_statistics_predicate key;
+
+  key.predicate=predicate;
+  return (librdf_storage_statistics_predicate*)raptor_avltree_search(stats->predicates, &key);
+}
+
+
+/**
+ * librdf_storage_statistics_update:
+ * @stats: statistics
+ * @predicate: predicate of the added or removed statement
+ * @statements: +1 when a statement was added, -1 when removed
+ * @predicate_subjects: +1 if the (subject, predicate) pair is new,
+ *   -1 if it no longer appears, otherwise 0
+ * @predicate_objects: the same for the (predicate, object) pair
+ *
+ * INTERNAL - Record the addition or removal of a statement.
+ *
+ * Store wide distinct counts are adjusted directly in @stats by the
+ * storage module.
+ *
+ * Return value: non 0 on failure, after which the statistics are stale
+ **/
+int
+librdf_storage_statistics_update(librdf_storage_statistics* stats,
+                                 librdf_node* predicate,
+                                 int statements, int predicate_subjects,
+                                 int predicate_objects)
+{
+  librdf_storage_statistics_predicate* ps;
+
+  if(stats->stale)
+    return 0;
+
+  ps=librdf_storage_statistics_get_predicate(stats, predicate);
+  if(!ps) {
+    if(statements <= 0)
+      return 0;
+
+    ps=LIBRDF_CALLOC(librdf_storage_statistics_predicate*, 1, sizeof(*ps));
+    if(!ps) {
+      stats->stale=1;
+      return 1;
+    }
+    ps->predicate=librdf_new_node_from_node(predicate);
+    if(!ps->predicate || raptor_avltree_add(stats->predicates, ps)) {
+      if(ps->predicate)
+        librdf_free_node(ps->predicate);
+      LIBRDF_FREE(librdf_storage_statistics_predicate, ps);
+      stats->stale=1;
+      return 1;
+    }
+  }
+
+  ps->statements += statements;
+  ps->subjects += predicate_subjects;
+  ps->objects += predicate_objects;
+  stats->statements += statements;
+  stats->predicate_subjects += predicate_subjects;
+  stats->predicate_objects += predicate_objects;
+
+  if(ps->statements <= 0)
+    raptor_avltree_delete(stats->predicates, ps);
+
+  return 0;
+}
+
+
+/* count / distinct rounded up so a non-empty answer stays non-zero */
+static int
+librdf_storage_statistics_divide(int count, int distinct)
+{
+  if(count <= 0)
+    return 0;
+  if(distinct <= 1)
+    return count;
+  return (count + distinct - 1) / distinct;
+}
+
+
+/**
+ * librdf_storage_statistics_estimate_counts:
+ * @statement: partial statement pattern or NULL
+ * @distinct: 0 or a #librdf_statement_part
+ * @statements: statements with the predicate of @statement, or all
+ *   statements when it has none
+ * @subjects: distinct subjects of those statements
+ * @objects: distinct objects of those statements
+ * @predicates: distinct predicates of those statements
+ *
+ * INTERNAL - Estimate statements (or distinct nodes) matching a pattern
+ * from counts, for librdf_storage_estimate_statements()
+ *
+ * Bound subjects and objects are assumed to be spread evenly over the
+ * distinct subjects and objects.
+ *
+ * Return value: estimate or < 0 if @distinct is not known
+ **/
+int
+librdf_storage_statistics_estimate_counts(librdf_statement* statement,
+                                          int distinct, int statements,
+                                          int subjects, int objects,
+                                          int predicates)
+{
+  librdf_node *subject=NULL, *predicate=NULL, *object=NULL;
+  int count=statements;
+
+  if(statement) {
+    subject=librdf_statement_get_subject(statement);
+    predicate=librdf_statement_get_predicate(statement);
+    object=librdf_statement_get_object(statement);
+  }
+
+  if(subject)
+    count=librdf_storage_statistics_divide(count, subjects);
+  if(object)
+    count=librdf_storage_statistics_divide(count, objects);
+  if(subject && predicate && object && count > 1)
+    count=1;
+
+  switch(distinct) {
+    case 0:
+      return count;
+
+    case LIBRDF_STATEMENT_SUBJECT:
+      if(subject)
+        return (count > 0);
+      if(object)
+        return count;
+      return (subjects < count) ? subjects : count;
+
+    case LIBRDF_STATEMENT_PREDICATE:
+      if(predicate)
+        return (count > 0);
+      return (predicates < count) ? predicates : count;
+
+    case LIBRDF_STATEMENT_OBJECT:
+      if(object)
+        return (count > 0);
+      if(subject)
+        return count;
+      return (objects < count) ? objects : count;
+
+    default:
+      return -1;
+  }
+}
+
+
+/**
+ * librdf_storage_statistics_estimate:
+ * @stats: statistics
+ * @statement: partial statement pattern or NULL
+ * @distinct: 0 or a #librdf_statement_part
+ *
+ * INTERNAL - Estimate statements (or distinct nodes) matching a pattern
+ * from kept statistics.
+ *
+ * Where a distinct count is not maintained, the statement count (per
+ * predicate) or the sum of the per predicate counts (store wide)
+ * stands in for it.
+ *
+ * Return value: estimate or < 0 if the statistics are stale
+ **/
+int
+librdf_storage_statistics_estimate(librdf_storage_statistics* stats,
+                                   librdf_statement* statement,
+                                   int distinct)
+{
+  librdf_node* predicate=NULL;
+  librdf_storage_statistics_predicate* ps;
+  int subjects;
+  int objects;
+
+  if(stats->stale)
+    return -1;
+
+  if(statement)
+    predicate=librdf_statement_get_predicate(statement);
+
+  if(predicate) {
+    ps=librdf_storage_statistics_get_predicate(stats, predicate);
+    if(!ps)
+      return 0;
+
+    subjects=(stats->predicate_parts & LIBRDF_STATEMENT_SUBJECT) ?
+      ps->subjects : ps->statements;
+    objects=(stats->predicate_parts & LIBRDF_STATEMENT_OBJECT) ?
+      ps->objects : ps->statements;
+    return librdf_storage_statistics_estimate_counts(statement, distinct,
+                                                     ps->statements,
+                                                     subjects, objects, 1);
+  }
+
+  subjects=(stats->global_parts & LIBRDF_STATEMENT_SUBJECT) ?
+    stats->subjects : stats->predicate_subjects;
+  objects=(stats->global_parts & LIBRDF_STATEMENT_OBJECT) ?
+    stats->objects : stats->predicate_objects;
+  return librdf_storage_statistics_estimate_counts(statement, distinct,
+                                                   stats->statements,
+                                                   subjects, objects,
+                                                   raptor_avltree_size(stats->predicates));
+}
+
+
 #endif
 
 
@@ -1990,6 +2369,565 @@ librdf_storage_transaction_get_handle(librdf_storage* storage)
 int main(int argc, char *argv[]);
 
 
+#ifdef STORAGE_SNAPSHOT
+#define SNAPSHOT_TEST_FILE "test-snapshot.rdfs"
+
+/* Write a snapshot of a storage with contexts and read it back */
+static int
+librdf_storage_snapshot_test(librdf_world *world, const char *program)
+{
+  librdf_storage* storage;
+  librdf_storage* snapshot=NULL;
+  librdf_statement* statement;
+  librdf_node* context_node;
+  librdf_stream* stream;
+  librdf_iterator* iterator;
+  int count;
+  int status=1;
+
+  fprintf(stdout, "%s: Writing storage snapshot\n", program);
+  storage=librdf_new_storage(world, "memory", NULL, "contexts='yes'");
+  if(!storage || librdf_storage_open(storage, NULL)) {
+    fprintf(stderr, "%s: Failed to create memory storage\n", program);
+    if(storage)
+      librdf_free_storage(storage);
+    return 1;
+  }
+
+  context_node=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/graph");
+  statement=librdf_new_statement_from_nodes(world,
+                                            librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s"),
+                                            librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p"),
+                                            librdf_new_node_from_literal(world, (const unsigned char*)"o", NULL, 0));
+  librdf_storage_add_statement(storage, statement);
+  librdf_storage_context_add_statement(storage, context_node, statement);
+
+  if(librdf_storage_write_snapshot(storage, SNAPSHOT_TEST_FILE)) {
+    fprintf(stderr, "%s: Failed to write snapshot\n", program);
+    goto tidy;
+  }
+
+  snapshot=librdf_new_storage(world, "snapshot", SNAPSHOT_TEST_FILE, NULL);
+  if(!snapshot || librdf_storage_open(snapshot, NULL)) {
+    fprintf(stderr, "%s: Failed to open snapshot\n", program);
+    goto tidy;
+  }
+
+  if(librdf_storage_size(snapshot) != 2 ||
+     !librdf_storage_contains_statement(snapshot, statement)) {
+    fprintf(stderr, "%s: Snapshot has size %d, expected 2 with the statement\n",
+            program, librdf_storage_size(snapshot));
+    goto tidy;
+  }
+
+  count=0;
+  stream=librdf_storage_context_as_stream(snapshot, context_node);
+  for(; stream && !librdf_stream_end(stream); librdf_stream_next(stream)) {
+    if(librdf_statement_equals(librdf_stream_get_object(stream), statement))
+      count++;
+  }
+  if(stream)
+    librdf_free_stream(stream);
+
+  iterator=librdf_storage_get_contexts(snapshot);
+  for(; iterator && !librdf_iterator_end(iterator); librdf_iterator_next(iterator))
+    count++;
+  if(iterator)
+    librdf_free_iterator(iterator);
+
+  if(count != 2) {
+    fprintf(stderr, "%s: Snapshot context has wrong content\n", program);
+    goto tidy;
+  }
+
+  if(!librdf_storage_add_statement(snapshot, statement)) {
+    fprintf(stderr, "%s: Snapshot accepted a new statement\n", program);
+    goto tidy;
+  }
+
+  status=0;
+
+  tidy:
+  if(snapshot) {
+    librdf_storage_close(snapshot);
+    librdf_free_storage(snapshot);
+  }
+  remove(SNAPSHOT_TEST_FILE);
+  librdf_free_statement(statement);
+  librdf_free_node(context_node);
+  librdf_storage_close(storage);
+  librdf_free_storage(storage);
+
+  return status;
+}
+#endif
+
+
+/* Serialise a hashes storage where every statement shares a predicate
+ * and check the predicate comes from the decoded node cache */
+static int
+librdf_storage_node_cache_test(librdf_world *world, const char *program)
+{
+  librdf_storage* storage;
+  librdf_stream* stream;
+  librdf_uri* feature;
+  librdf_node* value;
+  int i;
+  int hits=0;
+
+  fprintf(stdout, "%s: Testing hashes storage node cache\n", program);
+  storage=librdf_new_storage(world, "hashes", "test-cache",
+                             "hash-type='memory',node-cache-size='16'");
+  if(!storage || librdf_storage_open(storage, NULL)) {
+    fprintf(stderr, "%s: Failed to create hashes storage\n", program);
+    if(storage)
+      librdf_free_storage(storage);
+    return 1;
+  }
+
+  for(i=0; i < 10; i++) {
+    char buffer[32];
+    librdf_statement* statement;
+
+    sprintf(buffer, "http://example.org/s%d", i);
+    statement=librdf_new_statement_from_nodes(world,
+                                              librdf_new_node_from_uri_string(world, (const unsigned char*)buffer),
+                                              librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p"),
+                                              librdf_new_node_from_literal(world, (const unsigned char*)"o", NULL, 0));
+    librdf_storage_add_statement(storage, statement);
+    librdf_free_statement(statement);
+  }
+
+  stream=librdf_storage_serialise(storage);
+  for(; stream && !librdf_stream_end(stream); librdf_stream_next(stream))
+    librdf_stream_get_object(stream);
+  if(stream)
+    librdf_free_stream(stream);
+
+  feature=librdf_new_uri(world, (const unsigned char*)LIBRDF_STORAGE_FEATURE_NODE_CACHE_HITS);
+  value=librdf_storage_get_feature(storage, feature);
+  if(value) {
+    hits=atoi((const char*)librdf_node_get_literal_value(value));
+    librdf_free_node(value);
+  }
+  librdf_free_uri(feature);
+
+  librdf_storage_close(storage);
+  librdf_free_storage(storage);
+
+  if(hits <= 0) {
+    fprintf(stderr, "%s: Node cache had %d hits, expected some\n", program,
+            hits);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+#if defined(STORAGE_SQLITE) && REDLAND_SQLITE_API == 3
+#include <sqlite3.h>
+
+#define SQLITE_UPGRADE_TEST_FILE "test-sqlite-upgrade.db"
+
+/* the original tables and indexes, with one statement with a literal */
+static const char sqlite_schema_0_test_sql[]=
+  "CREATE TABLE uris (id INTEGER PRIMARY KEY, uri TEXT);"
+  "CREATE TABLE blanks (id INTEGER PRIMARY KEY, blank TEXT);"
+  "CREATE TABLE literals (id INTEGER PRIMARY KEY, text TEXT, language TEXT, datatype INTEGER);"
+  "CREATE TABLE triples (subjectUri INTEGER, subjectBlank INTEGER, predicateUri INTEGER, objectUri INTEGER, objectBlank INTEGER, objectLiteral INTEGER, contextUri INTEGER);"
+  "CREATE INDEX spindex ON triples (subjectUri, subjectBlank, predicateUri);"
+  "CREATE INDEX uriindex ON uris (uri);"
+  "INSERT INTO uris VALUES (1, 'http://example.org/s');"
+  "INSERT INTO uris VALUES (2, 'http://example.org/p');"
+  "INSERT INTO literals VALUES (1, 'old', NULL, NULL);"
+  "INSERT INTO triples VALUES (1, NULL, 2, NULL, NULL, 1, NULL);"
+  "PRAGMA user_version = 0;";
+
+
+static int
+librdf_storage_sqlite_upgrade_test_pragma(void *arg, int argc, char **argv,
+                                          char **columns)
+{
+  char *buffer=(char*)arg;
+
+  if(argc > 0 && argv[0]) {
+    strncpy(buffer, argv[0], 15);
+    buffer[15]='\0';
+  }
+  return 0;
+}
+
+
+/* Open a database written with schema 0 with the journal-mode and
+ * checkpoint options and check it is upgraded with the literals it
+ * already had given hashes, so they are still found */
+static int
+librdf_storage_sqlite_upgrade_test(librdf_world *world, const char *program)
+{
+  librdf_storage* storage;
+  librdf_statement* statement;
+  sqlite3 *db;
+  char journal_mode[16];
+  char user_version[16];
+  int status=1;
+
+  fprintf(stdout, "%s: Testing sqlite storage schema 0 upgrade\n", program);
+
+  remove(SQLITE_UPGRADE_TEST_FILE);
+  if(sqlite3_open(SQLITE_UPGRADE_TEST_FILE, &db) != SQLITE_OK ||
+     sqlite3_exec(db, sqlite_schema_0_test_sql, NULL, NULL, NULL) != SQLITE_OK) {
+    fprintf(stderr, "%s: Failed to create a schema 0 sqlite database\n",
+            program);
+    sqlite3_close(db);
+    return 1;
+  }
+  sqlite3_close(db);
+
+  storage=librdf_new_storage(world, "sqlite", SQLITE_UPGRADE_TEST_FILE,
+                             "journal-mode='wal',checkpoint='0'");
+  if(!storage || librdf_storage_open(storage, NULL)) {
+    fprintf(stderr, "%s: Failed to open a schema 0 sqlite database\n",
+            program);
+    if(storage)
+      librdf_free_storage(storage);
+    return 1;
+  }
+
+  statement=librdf_new_statement_from_nodes(world,
+                                            librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s"),
+                                            librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p"),
+                                            librdf_new_node_from_literal(world, (const unsigned char*)"old", NULL, 0));
+  if(librdf_storage_contains_statement(storage, statement) <= 0) {
+    fprintf(stderr, "%s: Literal written before the upgrade was not found\n",
+            program);
+    goto tidy;
+  }
+
+  /* a literal not found would be added again as a new node */
+  librdf_storage_add_statement(storage, statement);
+  if(librdf_storage_size(storage) != 1) {
+    fprintf(stderr, "%s: Statement written before the upgrade was added again\n",
+            program);
+    goto tidy;
+  }
+
+  status=0;
+
+  tidy:
+  librdf_free_statement(statement);
+  librdf_storage_close(storage);
+  librdf_free_storage(storage);
+
+  if(status)
+    return status;
+
+  /* the upgrade and the journal mode are recorded in the database */
+  journal_mode[0]='\0';
+  user_version[0]='\0';
+  if(sqlite3_open(SQLITE_UPGRADE_TEST_FILE, &db) != SQLITE_OK ||
+     sqlite3_exec(db, "PRAGMA journal_mode;",
+                  librdf_storage_sqlite_upgrade_test_pragma, journal_mode,
+                  NULL) != SQLITE_OK ||
+     sqlite3_exec(db, "PRAGMA user_version;",
+                  librdf_storage_sqlite_upgrade_test_pragma, user_version,
+                  NULL) != SQLITE_OK)
+    status=1;
+  sqlite3_close(db);
+
+  if(status || strcmp(journal_mode, "wal") || strcmp(user_version, "1")) {
+    fprintf(stderr, "%s: Upgraded database has journal mode '%s' and schema version '%s', expected 'wal' and '1'\n",
+            program, journal_mode, user_version);
+    status=1;
+  }
+
+  return status;
+}
+#endif
+
+
+/* Check statements in contexts of a hashes storage are found, not
+ * duplicated and removed through the statement to contexts index */
+static int
+librdf_storage_statement_contexts_test(librdf_world *world,
+                                       const char *program)
+{
+  librdf_storage* storage;
+  librdf_statement* statement;
+  librdf_node *context1, *context2;
+  int status=1;
+
+  fprintf(stdout, "%s: Testing hashes storage statement contexts index\n",
+          program);
+  storage=librdf_new_storage(world, "hashes", "test-contexts",
+                             "hash-type='memory',contexts='yes'");
+  if(!storage || librdf_storage_open(storage, NULL)) {
+    fprintf(stderr, "%s: Failed to create hashes storage\n", program);
+    if(storage)
+      librdf_free_storage(storage);
+    return 1;
+  }
+
+  context1=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/graph1");
+  context2=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/graph2");
+  statement=librdf_new_statement_from_nodes(world,
+                                            librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s"),
+                                            librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p"),
+                                            librdf_new_node_from_literal(world, (const unsigned char*)"o", NULL, 0));
+
+  if(librdf_storage_contains_statement(storage, statement)) {
+    fprintf(stderr, "%s: Empty storage contains the statement\n", program);
+    goto tidy;
+  }
+
+  librdf_storage_context_add_statement(storage, context1, statement);
+  librdf_storage_context_add_statement(storage, context1, statement);
+  librdf_storage_context_add_statement(storage, context2, statement);
+  if(librdf_storage_size(storage) != 2 ||
+     !librdf_storage_contains_statement(storage, statement)) {
+    fprintf(stderr, "%s: Storage has size %d, expected 2 with the statement\n",
+            program, librdf_storage_size(storage));
+    goto tidy;
+  }
+
+  librdf_storage_context_remove_statement(storage, context1, statement);
+  if(!librdf_storage_contains_statement(storage, statement)) {
+    fprintf(stderr, "%s: Statement gone after removing it from one context\n",
+            program);
+    goto tidy;
+  }
+
+  if(!librdf_storage_context_remove_statement(storage, context1, statement)) {
+    fprintf(stderr, "%s: Removed a statement not in the context\n", program);
+    goto tidy;
+  }
+
+  librdf_storage_context_remove_statement(storage, context2, statement);
+  if(librdf_storage_contains_statement(storage, statement)) {
+    fprintf(stderr, "%s: Statement still present after removing it\n",
+            program);
+    goto tidy;
+  }
+
+  status=0;
+
+  tidy:
+  librdf_free_statement(statement);
+  librdf_free_node(context1);
+  librdf_free_node(context2);
+  librdf_storage_close(storage);
+  librdf_free_storage(storage);
+
+  return status;
+}
+
+
+/* Count and free an iterator */
+static int
+librdf_storage_test_iterator_count(librdf_iterator* iterator)
+{
+  int count=0;
+
+  if(!iterator)
+    return -1;
+  for(; !librdf_iterator_end(iterator); librdf_iterator_next(iterator))
+    count++;
+  librdf_free_iterator(iterator);
+
+  return count;
+}
+
+
+/* Check the arcs in and out of a node are distinct and has_arc finds
+ * arcs in the right direction only */
+static int
+librdf_storage_arcs_test(librdf_world *world, const char *program,
+                         const char *type, const char *options)
+{
+  librdf_storage* storage;
+  librdf_node *s, *p1, *p2, *o, *graph;
+  librdf_statement* statement;
+  int count;
+  int status=1;
+
+  fprintf(stdout, "%s: Testing %s storage arcs with %s\n", program, type,
+          options);
+  storage=librdf_new_storage(world, type, "test-arcs", options);
+  if(!storage || librdf_storage_open(storage, NULL)) {
+    fprintf(stderr, "%s: Failed to create %s storage\n", program, type);
+    if(storage)
+      librdf_free_storage(storage);
+    return 1;
+  }
+
+  s=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/s");
+  p1=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p1");
+  p2=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p2");
+  o=librdf_new_node_from_literal(world, (const unsigned char*)"o", NULL, 0);
+  graph=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/graph");
+
+  statement=librdf_new_statement_from_nodes(world,
+                                            librdf_new_node_from_node(s),
+                                            librdf_new_node_from_node(p1),
+                                            librdf_new_node_from_node(o));
+  librdf_storage_add_statement(storage, statement);
+  librdf_storage_context_add_statement(storage, graph, statement);
+  librdf_free_statement(statement);
+
+  statement=librdf_new_statement_from_nodes(world,
+                                            librdf_new_node_from_node(s),
+                                            librdf_new_node_from_node(p1),
+                                            librdf_new_node_from_literal(world, (const unsigned char*)"o2", NULL, 0));
+  librdf_storage_add_statement(storage, statement);
+  librdf_free_statement(statement);
+
+  statement=librdf_new_statement_from_nodes(world,
+                                            librdf_new_node_from_node(s),
+                                            librdf_new_node_from_node(p2),
+                                            librdf_new_node_from_node(o));
+  librdf_storage_context_add_statement(storage, graph, statement);
+  librdf_free_statement(statement);
+
+  count=librdf_storage_test_iterator_count(librdf_storage_get_arcs_out(storage, s));
+  if(count != 2) {
+    fprintf(stderr, "%s: Found %d arcs out, expected 2\n", program, count);
+    goto tidy;
+  }
+
+  count=librdf_storage_test_iterator_count(librdf_storage_get_arcs_in(storage, o));
+  if(count != 2) {
+    fprintf(stderr, "%s: Found %d arcs in, expected 2\n", program, count);
+    goto tidy;
+  }
+
+  count=librdf_storage_test_iterator_count(librdf_storage_get_arcs_out(storage, o));
+  if(count != 0) {
+    fprintf(stderr, "%s: Found %d arcs out of an object, expected 0\n",
+            program, count);
+    goto tidy;
+  }
+
+  if(!librdf_storage_has_arc_out(storage, s, p2) ||
+     librdf_storage_has_arc_out(storage, o, p2) ||
+     !librdf_storage_has_arc_in(storage, o, p2) ||
+     librdf_storage_has_arc_in(storage, s, p2)) {
+    fprintf(stderr, "%s: has_arc_in or has_arc_out gave the wrong answer\n",
+            program);
+    goto tidy;
+  }
+
+  status=0;
+
+  tidy:
+  librdf_free_node(s);
+  librdf_free_node(p1);
+  librdf_free_node(p2);
+  librdf_free_node(o);
+  librdf_free_node(graph);
+  librdf_storage_close(storage);
+  librdf_free_storage(storage);
+
+  return status;
+}
+
+
+#ifdef STORAGE_POSTGRESQL
+#define BULK_TEST_COUNT 25000
+
+/* Check a bulk load into a local PostgreSQL storage keeps every
+ * statement and node, including literals needing COPY escapes, and
+ * that loading the same nodes again is not a conflict */
+static int
+librdf_storage_postgresql_bulk_test(librdf_world *world, const char *program)
+{
+  librdf_storage *source, *storage;
+  librdf_stream* stream;
+  librdf_statement *statement, *partial;
+  librdf_node *p, *s;
+  const char tricky[]="tab\there\nnewline \\ backslash";
+  char buffer[64];
+  int i;
+  int size;
+  int status=1;
+
+  storage=librdf_new_storage(world, "postgresql", "test-bulk",
+                             "host='localhost',database='test',user='test',password='test',new='yes',bulk='yes'");
+  if(!storage) {
+    fprintf(stderr, "%s: WARNING: Skipping postgresql bulk test - no local database\n",
+            program);
+    return 0;
+  }
+
+  fprintf(stdout, "%s: Testing postgresql bulk load of %d statements\n",
+          program, BULK_TEST_COUNT);
+  source=librdf_new_storage(world, "memory", NULL, NULL);
+  p=librdf_new_node_from_uri_string(world, (const unsigned char*)"http://example.org/p");
+  for(i=0; i < BULK_TEST_COUNT; i++) {
+    /* Objects repeat so most nodes are staged only once */
+    sprintf(buffer, "http://example.org/s%d", i);
+    s=librdf_new_node_from_uri_string(world, (const unsigned char*)buffer);
+    sprintf(buffer, "o%d", i % 100);
+    statement=librdf_new_statement_from_nodes(world, s,
+                                              librdf_new_node_from_node(p),
+                                              librdf_new_node_from_literal(world, (const unsigned char*)buffer, "en", 0));
+    librdf_storage_add_statement(source, statement);
+    librdf_free_statement(statement);
+  }
+  s=librdf_new_node_from_blank_identifier(world, (const unsigned char*)"b1");
+  statement=librdf_new_statement_from_nodes(world, librdf_new_node_from_node(s),
+                                            librdf_new_node_from_node(p),
+                                            librdf_new_node_from_literal(world, (const unsigned char*)tricky, NULL, 0));
+  librdf_storage_add_statement(source, statement);
+  librdf_free_statement(statement);
+
+  for(i=0; i < 2; i++) {
+    stream=librdf_storage_serialise(source);
+    if(!stream || librdf_storage_add_statements(storage, stream)) {
+      fprintf(stderr, "%s: Bulk load %d failed\n", program, i + 1);
+      if(stream)
+        librdf_free_stream(stream);
+      goto tidy;
+    }
+    librdf_free_stream(stream);
+  }
+
+  /* Duplicate statements are not checked for in bulk mode */
+  size=librdf_storage_size(storage);
+  if(size != 2 * (BULK_TEST_COUNT + 1)) {
+    fprintf(stderr, "%s: Bulk loaded storage has %d statements, expected %d\n",
+            program, size, 2 * (BULK_TEST_COUNT + 1));
+    goto tidy;
+  }
+
+  partial=librdf_new_statement_from_nodes(world, librdf_new_node_from_node(s),
+                                          NULL, NULL);
+  stream=librdf_storage_find_statements(storage, partial);
+  librdf_free_statement(partial);
+  if(!stream || librdf_stream_end(stream) ||
+     strcmp((const char*)librdf_node_get_literal_value(librdf_statement_get_object(librdf_stream_get_object(stream))),
+            tricky)) {
+    fprintf(stderr, "%s: Bulk loaded literal was not found unchanged\n",
+            program);
+    if(stream)
+      librdf_free_stream(stream);
+    goto tidy;
+  }
+  librdf_free_stream(stream);
+
+  status=0;
+
+  tidy:
+  librdf_free_node(s);
+  librdf_free_node(p);
+  librdf_free_storage(source);
+  librdf_storage_close(storage);
+  librdf_free_storage(storage);
+
+  return status;
+}
+#endif
+
+
 int
 main(int argc, char *argv[]) 
 {
@@ -2008,6 +2946,9 @@ main(int argc, char *argv[])
     #ifdef STORAGE_TREES
 	    "trees", "test", "contexts='yes'",
     #endif
+    #ifdef STORAGE_SORTED
+	    "sorted", NULL, NULL,
+    #endif
     #ifdef STORAGE_FILE
       "file", "file://../redland.rdf", NULL,
 	    "uri", "http://librdf.org/redland.rdf", NULL,
@@ -2066,6 +3007,45 @@ main(int argc, char *argv[])
 
   }
   
+#ifdef STORAGE_SNAPSHOT
+  if(librdf_storage_snapshot_test(world, program))
+    ret++;
+#endif
+
+  if(librdf_storage_node_cache_test(world, program))
+    ret++;
+
+  if(librdf_storage_statement_contexts_test(world, program))
+    ret++;
+
+  if(librdf_storage_arcs_test(world, program, "hashes",
+                              "hash-type='memory',contexts='yes'"))
+    ret++;
+
+  if(librdf_storage_arcs_test(world, program, "hashes",
+                              "hash-type='memory',contexts='yes',index-subjects='yes',index-objects='yes'"))
+    ret++;
+
+#ifdef STORAGE_TREES
+  if(librdf_storage_arcs_test(world, program, "trees", "contexts='yes'"))
+    ret++;
+#endif
+
+#ifdef STORAGE_SQLITE
+  if(librdf_storage_arcs_test(world, program, "sqlite", "new='yes'"))
+    ret++;
+#endif
+
+#if defined(STORAGE_SQLITE) && REDLAND_SQLITE_API == 3
+  if(librdf_storage_sqlite_upgrade_test(world, program))
+    ret++;
+#endif
+
+#ifdef STORAGE_POSTGRESQL
+  if(librdf_storage_postgresql_bulk_test(world, program))
+    ret++;
+#endif
+
 
   librdf_free_world(world);
   
@@ -147,6 +147,26 @@ librdf_stream* librdf_storage_find_statements_in_context(librdf_storage* storage
 REDLAND_API
 librdf_iterator* librdf_storage_get_contexts(librdf_storage* storage);
 
+/**
+ * LIBRDF_STORAGE_FEATURE_NODE_CACHE_HITS:
+ *
+ * Storage feature decoded node cache hits.
+ *
+ * The number of stored terms returned from the storage's cache of
+ * decoded nodes rather than decoded again.
+ */
+#define LIBRDF_STORAGE_FEATURE_NODE_CACHE_HITS "http://feature.librdf.org/storage-node-cache-hits"
+
+/**
+ * LIBRDF_STORAGE_FEATURE_NODE_CACHE_MISSES:
+ *
+ * Storage feature decoded node cache misses.
+ *
+ * The number of stored terms that were not in the storage's cache of
+ * decoded nodes and had to be decoded.
+ */
+#define LIBRDF_STORAGE_FEATURE_NODE_CACHE_MISSES "http://feature.librdf.org/storage-node-cache-misses"
+
 /* features */
 REDLAND_API
 librdf_node* librdf_storage_get_feature(librdf_storage* storage, librdf_uri* feature);
@@ -164,6 +184,14 @@ int librdf_storage_transaction_rollback(librdf_storage* storage);
 REDLAND_API
 void* librdf_storage_transaction_get_handle(librdf_storage* storage);
 
+/* statistics */
+REDLAND_API
+int librdf_storage_estimate_statements(librdf_storage* storage, librdf_statement* statement, int distinct);
+
+/* snapshot files */
+REDLAND_API
+int librdf_storage_write_snapshot(librdf_storage* storage, const char *filename);
+
 #ifdef __cplusplus
 }
 #endif
@@ -38,10 +38,14 @@
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
 #endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 
 #include <redland.h>
 #include <rdf_storage.h>
+#include <rdf_types.h>
 
 
 typedef struct 
@@ -65,9 +69,27 @@ static const librdf_hash_descriptor librdf_storage_hashes_descriptions[]= {
   {"p2so", 
    LIBRDF_STATEMENT_PREDICATE,
    LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT},  /* For '(?, p, ?)' */
+  {"s2po", 
+   LIBRDF_STATEMENT_SUBJECT,
+   LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT},  /* For '(s, ?, ?)' */
+  {"o2sp", 
+   LIBRDF_STATEMENT_OBJECT,
+   LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE},  /* For '(?, ?, o)' */
   {"contexts",
    0L, /* for contexts - do not touch when storing statements! */
    0L},
+  {"spo2c",
+   LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT,
+   0L},  /* For 'contains' with contexts; value is only the context */
+  {"t2i",
+   0L, /* term dictionary, encoded term to id - not a statement index */
+   0L},
+  {"i2t",
+   0L, /* term dictionary, id to encoded term - not a statement index */
+   0L},
+  {"meta",
+   0L, /* state of the store itself - not a statement index */
+   0L},
   {NULL,0L,0L}
 };
 
@@ -89,6 +111,53 @@ librdf_storage_get_hash_description_by_name(const char *name)
 }
 
 
+/* one decoded node in the node cache */
+typedef struct
+{
+  /* encoded term (or dictionary term id) */
+  unsigned char *key;
+  size_t key_len;
+  size_t key_size;
+  unsigned long hash;
+  /* cache's own reference to the node or NULL if the entry is free */
+  librdf_node* node;
+  /* CLOCK bit; set when used, cleared as the hand passes */
+  int referenced;
+  /* next entry in the same bucket or -1 */
+  int next;
+} librdf_storage_hashes_node_cache_entry;
+
+
+/* bounded cache of nodes decoded from the hashes */
+typedef struct
+{
+  librdf_storage_hashes_node_cache_entry* entries;
+  int size;
+  int count;
+  /* bucket heads, indexes into entries or -1 */
+  int* buckets;
+  unsigned long buckets_mask;
+  /* CLOCK hand */
+  int hand;
+  unsigned long hits;
+  unsigned long misses;
+#ifdef WITH_THREADS
+  pthread_mutex_t mutex;
+#endif
+} librdf_storage_hashes_node_cache;
+
+#ifdef WITH_THREADS
+#define NODE_CACHE_LOCK(cache) pthread_mutex_lock(&(cache)->mutex)
+#define NODE_CACHE_UNLOCK(cache) pthread_mutex_unlock(&(cache)->mutex)
+#else
+#define NODE_CACHE_LOCK(cache)
+#define NODE_CACHE_UNLOCK(cache)
+#endif
+
+/* default number of nodes kept in the node cache */
+#define LIBRDF_STORAGE_HASHES_NODE_CACHE_SIZE 1024
+
+
 typedef struct
 {
   /* from init() argument */
@@ -114,21 +183,69 @@ typedef struct
   int targets_index;
 
   int p2so_index;
+  int s2po_index;
+  int o2sp_index;
 
   /* If this is non-0, contexts are being used */
   int index_contexts;
   int contexts_index;
+  /* statement to contexts index or -1 */
+  int statement_contexts_index;
 
   int all_statements_hash_index;
 
+  /* If this is non-0, index hashes hold term ids from the dictionary */
+  int dictionary;
+  int term2id_index;
+  int id2term_index;
+  /* id to give the next new term */
+  u64 next_term_id;
+  /* non 0 if next_term_id is the value stored in the meta hash */
+  int next_term_id_saved;
+
+  /* hash holding the state of the store under the meta keys below */
+  int meta_index;
+
+  /* If this is non-0, add_statements sorts before writing the indexes */
+  int bulk_load;
+  /* non 0 unless the store is known to have been empty since opened */
+  int may_have_statements;
+
+  /* statement counts for estimates or NULL if not kept */
+  librdf_storage_statistics* statistics;
+
+  /* decoded nodes by encoding or NULL if not kept */
+  librdf_storage_hashes_node_cache* node_cache;
+
   /* growing buffers used to en/decode keys/values */
   unsigned char *key_buffer;
   size_t key_buffer_len;
   unsigned char *value_buffer;
   size_t value_buffer_len;
+  unsigned char *term_buffer;
+  size_t term_buffer_len;
 } librdf_storage_hashes_instance;
 
 
+/* meta hash keys */
+/* "dictionary" or "plain", the way terms are written in the indexes */
+#define LIBRDF_STORAGE_HASHES_META_ENCODING "encoding"
+/* id to give the next new term, absent while ids are being given out */
+#define LIBRDF_STORAGE_HASHES_META_NEXT_TERM_ID "next-term-id"
+/* present only while the statement to contexts index is complete */
+#define LIBRDF_STORAGE_HASHES_META_STATEMENT_CONTEXTS "statement-contexts"
+/* present while, or after failing, writing a bulk load to the indexes */
+#define LIBRDF_STORAGE_HASHES_META_BULK_LOAD "bulk-load"
+
+
+/* size of a term id in the dictionary encoding */
+#define LIBRDF_STORAGE_HASHES_TERM_ID_SIZE 8
+
+/* largest dictionary encoding: 'X' + (type byte + id) for s, p, o, c */
+#define LIBRDF_STORAGE_HASHES_ID_ENCODING_MAX_SIZE \
+  (1 + 4 * (1 + LIBRDF_STORAGE_HASHES_TERM_ID_SIZE))
+
+
 
 /* helper function for implementing init and clone methods */
 static int librdf_storage_hashes_register(librdf_storage *storage, const char *name, const librdf_hash_descriptor *source_desc);
@@ -144,6 +261,7 @@ static int librdf_storage_hashes_close(librdf_storage* storage);
 static int librdf_storage_hashes_size(librdf_storage* storage);
 static int librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_hashes_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
+static int librdf_storage_hashes_bulk_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement);
 static librdf_stream* librdf_storage_hashes_serialise(librdf_storage* storage);
@@ -151,12 +269,37 @@ static librdf_stream* librdf_storage_hashes_find_statements(librdf_storage* stor
 static librdf_iterator* librdf_storage_hashes_find_sources(librdf_storage* storage, librdf_node* arc, librdf_node *target);
 static librdf_iterator* librdf_storage_hashes_find_arcs(librdf_storage* storage, librdf_node* source, librdf_node *target);
 static librdf_iterator* librdf_storage_hashes_find_targets(librdf_storage* storage, librdf_node* source, librdf_node *arc);
+static int librdf_storage_hashes_estimate_statements(librdf_storage* storage, librdf_statement* statement, int distinct);
+static int librdf_storage_hashes_has_arc_in(librdf_storage* storage, librdf_node* node, librdf_node* property);
+static int librdf_storage_hashes_has_arc_out(librdf_storage* storage, librdf_node* node, librdf_node* property);
+static librdf_iterator* librdf_storage_hashes_get_arcs_in(librdf_storage* storage, librdf_node* node);
+static librdf_iterator* librdf_storage_hashes_get_arcs_out(librdf_storage* storage, librdf_node* node);
+
+/* meta hash functions */
+static int librdf_storage_hashes_meta_get(librdf_storage_hashes_instance* context, const char *key, unsigned char *buffer, size_t *size_p);
+static int librdf_storage_hashes_meta_put(librdf_storage_hashes_instance* context, const char *key, const unsigned char *value, size_t size);
+static int librdf_storage_hashes_meta_open(librdf_storage* storage);
+
+/* term dictionary functions */
+static int librdf_storage_hashes_dictionary_open(librdf_storage* storage);
+static int librdf_storage_hashes_dictionary_save(librdf_storage* storage);
+static int librdf_storage_hashes_statement_contexts_open(librdf_storage* storage);
+static int librdf_storage_hashes_encode(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node, int fields, int add, unsigned char **buffer_p, size_t *buffer_len_p, size_t *length_p);
+static size_t librdf_storage_hashes_decode(librdf_storage* storage, librdf_statement* statement, librdf_node** context_node, int fields, unsigned char *buffer, size_t length);
+static int librdf_storage_hashes_encode_context(librdf_storage* storage, librdf_node* context_node, int add, unsigned char **buffer_p, size_t *buffer_len_p, size_t *length_p);
+static librdf_node* librdf_storage_hashes_decode_context(librdf_storage* storage, unsigned char *buffer, size_t length);
+
+/* decoded node cache functions */
+static librdf_storage_hashes_node_cache* librdf_storage_hashes_new_node_cache(int size);
+static void librdf_storage_hashes_free_node_cache(librdf_storage_hashes_node_cache* cache);
+static void librdf_storage_hashes_node_cache_flush(librdf_storage_hashes_node_cache* cache);
 
 /* serialising implementing functions */
 static int librdf_storage_hashes_serialise_end_of_stream(void* context);
 static int librdf_storage_hashes_serialise_next_statement(void* context);
 static void* librdf_storage_hashes_serialise_get_statement(void* context, int flags);
 static void librdf_storage_hashes_serialise_finished(void* context);
+static int librdf_storage_hashes_serialise_batch(void* context, librdf_statement** statements, librdf_node** contexts, int size);
 
 /* context functions */
 static int librdf_storage_hashes_context_add_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
@@ -180,6 +323,12 @@ static void librdf_storage_hashes_node_iterator_finished(void* iterator);
 /* common initialisation code for creating get sources, targets, arcs iterators */
 static librdf_iterator* librdf_storage_hashes_node_iterator_create(librdf_storage* storage, librdf_node* node1, librdf_node *node2, int hash_index, int want);
 
+/* arcs iterator implementing functions for get arcs in, arcs out methods */
+static int librdf_storage_hashes_arcs_is_end(void* iterator);
+static int librdf_storage_hashes_arcs_next_method(void* iterator);
+static void* librdf_storage_hashes_arcs_get_method(void* iterator, int flags);
+static void librdf_storage_hashes_arcs_finished(void* iterator);
+
 
 
 static int
@@ -242,8 +391,13 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   int i;
   int status=0;
   int index_predicates=0;
+  int index_subjects=0;
+  int index_objects=0;
   int index_contexts=0;
+  int index_statement_contexts=0;
+  int dictionary=0;
   int hash_count=0;
+  int node_cache_size;
   
   context = LIBRDF_CALLOC(librdf_storage_hashes_instance*, 1, sizeof(*context));
   if(!context)
@@ -262,8 +416,9 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   context->is_new=is_new;
   context->options=options;
 
-  /* Work out the number of hashes for allocating stuff below */
-  hash_count=3;
+  /* Work out the number of hashes for allocating stuff below;
+   * the three statement hashes and meta */
+  hash_count=4;
 
   if((index_contexts=librdf_hash_get_as_boolean(options, "contexts"))<0)
     index_contexts=0; /* default is no contexts */
@@ -272,12 +427,50 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
   if(index_contexts)
     hash_count++;
 
+  if((index_statement_contexts=librdf_hash_get_as_boolean(options, "index-statement-contexts"))<0)
+    index_statement_contexts=1; /* default is an index when using contexts */
+
+  if(index_contexts && index_statement_contexts)
+    hash_count++;
+
   if((index_predicates=librdf_hash_get_as_boolean(options, "index-predicates"))<0)
     index_predicates=0; /* default is NO index on properties */
   
   if(index_predicates)
     hash_count++;
 
+  if((index_subjects=librdf_hash_get_as_boolean(options, "index-subjects"))<0)
+    index_subjects=0; /* default is NO index on subjects */
+
+  if(index_subjects)
+    hash_count++;
+
+  if((index_objects=librdf_hash_get_as_boolean(options, "index-objects"))<0)
+    index_objects=0; /* default is NO index on objects */
+
+  if(index_objects)
+    hash_count++;
+
+  if((dictionary=librdf_hash_get_as_boolean(options, "dictionary"))<0)
+    dictionary=0; /* default is terms stored in full in every index */
+  context->dictionary=dictionary;
+  context->next_term_id=1;
+
+  if(dictionary)
+    hash_count += 2;
+
+  if((context->bulk_load=librdf_hash_get_as_boolean(options, "bulk-load"))<0)
+    context->bulk_load=0; /* default is adding statements one at a time */
+
+  node_cache_size=(int)librdf_hash_get_as_long(options, "node-cache-size");
+  if(node_cache_size < 0)
+    node_cache_size=LIBRDF_STORAGE_HASHES_NODE_CACHE_SIZE; /* default */
+  if(node_cache_size > 0) {
+    context->node_cache=librdf_storage_hashes_new_node_cache(node_cache_size);
+    if(!context->node_cache)
+      return 1;
+  }
+
 
   /* Start allocating the arrays */
   context->hashes = LIBRDF_CALLOC(librdf_hash**,
@@ -321,18 +514,50 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     status=librdf_storage_hashes_register(storage, name,
                                           librdf_storage_get_hash_description_by_name("p2so"));
 
+  if(index_subjects && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("s2po"));
+
+  if(index_objects && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("o2sp"));
+
   if(index_contexts && !status)
     librdf_storage_hashes_register(storage, name,
                                    librdf_storage_get_hash_description_by_name("contexts"));
 
+  if(index_contexts && index_statement_contexts && !status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("spo2c"));
+
+  if(dictionary && !status) {
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("t2i"));
+    if(!status)
+      status=librdf_storage_hashes_register(storage, name,
+                                            librdf_storage_get_hash_description_by_name("i2t"));
+  }
+
+  if(!status)
+    status=librdf_storage_hashes_register(storage, name,
+                                          librdf_storage_get_hash_description_by_name("meta"));
+
 
   /* find indexes for get targets, sources and arcs */
   context->sources_index= -1;
   context->arcs_index= -1;
   context->targets_index= -1;
   context->p2so_index= -1;
+  context->s2po_index= -1;
+  context->o2sp_index= -1;
   /* and index for contexts (no key or value fields) */
   context->contexts_index= -1;
+  context->statement_contexts_index= -1;
+  /* and the term dictionary */
+  context->term2id_index= -1;
+  context->id2term_index= -1;
+  /* and the state of the store */
+  context->meta_index= -1;
 
   context->all_statements_hash_index= -1;
 
@@ -346,6 +571,23 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     key_fields = context->hash_descriptions[i]->key_fields;
     value_fields = context->hash_descriptions[i]->value_fields;
 
+    if(!strcmp(context->hash_descriptions[i]->name, "t2i")) {
+      context->term2id_index=i;
+      continue;
+    }
+    if(!strcmp(context->hash_descriptions[i]->name, "i2t")) {
+      context->id2term_index=i;
+      continue;
+    }
+    if(!strcmp(context->hash_descriptions[i]->name, "spo2c")) {
+      context->statement_contexts_index=i;
+      continue;
+    }
+    if(!strcmp(context->hash_descriptions[i]->name, "meta")) {
+      context->meta_index=i;
+      continue;
+    }
+
     if(context->all_statements_hash_index <0 &&
        ((key_fields|value_fields)==(LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT))) {
       context->all_statements_hash_index=i;
@@ -363,11 +605,37 @@ librdf_storage_hashes_init_common(librdf_storage* storage, const char *name,
     } else if(key_fields == LIBRDF_STATEMENT_PREDICATE &&
               value_fields == (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT)) {
       context->p2so_index=i;
+    } else if(key_fields == LIBRDF_STATEMENT_SUBJECT &&
+              value_fields == (LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT)) {
+      context->s2po_index=i;
+    } else if(key_fields == LIBRDF_STATEMENT_OBJECT &&
+              value_fields == (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE)) {
+      context->o2sp_index=i;
     } else if(!key_fields || !value_fields) {
        context->contexts_index=i;
     }
   }
 
+  /* Statistics are kept if asked for; the distinct counts that can
+   * be maintained depend on which keys the indexes have */
+  if(!status && librdf_hash_get_as_boolean(options, "statistics") > 0) {
+    int predicate_parts=0;
+    int global_parts=0;
+
+    if(context->targets_index >= 0)
+      predicate_parts |= LIBRDF_STATEMENT_SUBJECT;
+    if(context->sources_index >= 0)
+      predicate_parts |= LIBRDF_STATEMENT_OBJECT;
+    if(context->s2po_index >= 0)
+      global_parts |= LIBRDF_STATEMENT_SUBJECT;
+    if(context->o2sp_index >= 0)
+      global_parts |= LIBRDF_STATEMENT_OBJECT;
+
+    context->statistics=librdf_new_storage_statistics(storage->world,
+                                                      predicate_parts,
+                                                      global_parts);
+  }
+
   return status;
 }
 
@@ -461,10 +729,18 @@ librdf_storage_hashes_terminate(librdf_storage* storage)
     LIBRDF_FREE(data, context->key_buffer);
   if(context->value_buffer)
     LIBRDF_FREE(data, context->value_buffer);
+  if(context->term_buffer)
+    LIBRDF_FREE(data, context->term_buffer);
 
   if(context->name)
     LIBRDF_FREE(char*, context->name);
 
+  if(context->statistics)
+    librdf_free_storage_statistics(context->statistics);
+
+  if(context->node_cache)
+    librdf_storage_hashes_free_node_cache(context->node_cache);
+
   LIBRDF_FREE(librdf_storage_hashes_instance, context);
 }
 
@@ -567,6 +843,29 @@ librdf_storage_hashes_open(librdf_storage* storage, librdf_model* model)
       break;
   }
 
+  if(!result)
+    result=librdf_storage_hashes_meta_open(storage);
+
+  if(!result && context->dictionary)
+    result=librdf_storage_hashes_dictionary_open(storage);
+
+  if(!result && context->statement_contexts_index >= 0)
+    result=librdf_storage_hashes_statement_contexts_open(storage);
+  else if(!result && context->is_writable)
+    /* writes will not update the statement to contexts index */
+    result=librdf_storage_hashes_meta_put(context,
+                                          LIBRDF_STORAGE_HASHES_META_STATEMENT_CONTEXTS,
+                                          NULL, 0);
+
+  /* a new store was truncated on open */
+  context->may_have_statements=!context->is_new;
+
+  /* counts for an existing store are rebuilt when first needed */
+  if(context->statistics) {
+    librdf_storage_statistics_clear(context->statistics);
+    context->statistics->stale=context->may_have_statements;
+  }
+
   return result;
 }
 
@@ -585,10 +884,17 @@ librdf_storage_hashes_close(librdf_storage* storage)
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   int i;
   
+  if(context->dictionary)
+    librdf_storage_hashes_dictionary_save(storage);
+
   for(i=0; i<context->hash_count; i++) {
     if(context->hashes[i])
       librdf_hash_close(context->hashes[i]);
   }
+
+  /* the hashes may be reopened with other content */
+  if(context->node_cache)
+    librdf_storage_hashes_node_cache_flush(context->node_cache);
   
   return 0;
 }
@@ -624,232 +930,2293 @@ librdf_storage_hashes_grow_buffer(unsigned char **buffer, size_t *len,
 }
 
 
-static int
-librdf_storage_hashes_add_remove_statement(librdf_storage* storage, 
-                                           librdf_statement* statement,
-                                           librdf_node* context_node,
-                                           int is_addition)
+/*
+ * librdf_storage_hashes_id_to_bytes:
+ * @id: term id
+ * @buffer: buffer of LIBRDF_STORAGE_HASHES_TERM_ID_SIZE bytes
+ *
+ * INTERNAL - Write a term id in big endian order so that ids sort the
+ * same way as their bytes.
+ */
+static void
+librdf_storage_hashes_id_to_bytes(u64 id, unsigned char *buffer)
 {
-  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   int i;
-  int status=0;
-  librdf_world* world = storage->world;
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-  if(is_addition)
-    LIBRDF_DEBUG1("Adding statement: ");
-  else
-    LIBRDF_DEBUG1("Removing statement: ");
-  librdf_statement_print(statement, stderr);
-  fputc('\n', stderr);
-#endif  
+  for(i=LIBRDF_STORAGE_HASHES_TERM_ID_SIZE-1; i>=0; i--) {
+    buffer[i]=(unsigned char)(id & 0xff);
+    id >>= 8;
+  }
+}
 
-  for(i=0; i<context->hash_count; i++) {
-    librdf_hash_datum hd_key, hd_value; /* on stack */
-    size_t key_len, value_len;
 
-    /* ENCODE KEY */
+static u64
+librdf_storage_hashes_bytes_to_id(const unsigned char *buffer)
+{
+  u64 id=0;
+  int i;
 
-    librdf_statement_part fields=(librdf_statement_part)context->hash_descriptions[i]->key_fields;
-    if(!fields)
-      continue;
-    
-    key_len = librdf_statement_encode_parts2(world, statement, NULL, NULL, 0,
-                                             fields);
-    if(!key_len)
-      return 1;
-    if(librdf_storage_hashes_grow_buffer(&context->key_buffer, 
-                                         &context->key_buffer_len, key_len)) {
-      status=1;
-      break;
-    }
-       
-    if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                       context->key_buffer,
-                                       context->key_buffer_len, fields)) {
-      status=1;
-      break;
-    }
+  for(i=0; i<LIBRDF_STORAGE_HASHES_TERM_ID_SIZE; i++)
+    id=(id << 8) | buffer[i];
 
-    
-    /* ENCODE VALUE */
-    
-    fields=(librdf_statement_part)context->hash_descriptions[i]->value_fields;
-    if(!fields)
-      continue;
-    
-    value_len=librdf_statement_encode_parts2(world, statement, context_node,
-                                             NULL, 0, fields);
-    if(!value_len) {
-      status=1;
-      break;
-    }
-    
-    if(librdf_storage_hashes_grow_buffer(&context->value_buffer, 
-                                         &context->value_buffer_len, value_len)) {
-      status=1;
-      break;
-    }
-       
-    if(!librdf_statement_encode_parts2(world, statement, context_node,
-                                       context->value_buffer,
-                                       context->value_buffer_len, fields)) {
-      status=1;
-      break;
-    }
+  return id;
+}
 
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-    LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[i]->name, key_len, value_len);
-#endif
+/*
+ * librdf_storage_hashes_meta_get:
+ * @context: storage instance
+ * @key: meta key
+ * @buffer: buffer for the value
+ * @size_p: pointer to the size of @buffer, set to the size of the value
+ *
+ * INTERNAL - Get the value of a key in the meta hash.
+ *
+ * At most the size of @buffer is copied; *@size_p may be set larger.
+ *
+ * Return value: 0 on success, non 0 if the key is not present
+ */
+static int
+librdf_storage_hashes_meta_get(librdf_storage_hashes_instance* context,
+                               const char *key, unsigned char *buffer,
+                               size_t *size_p)
+{
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  librdf_hash_cursor* cursor;
+  int status;
 
-    /* Finally, store / remove the sucker */
-    hd_key.data=context->key_buffer; hd_key.size=key_len;
-    hd_value.data=context->value_buffer; hd_value.size=value_len;
-    
-    if(is_addition)
-      status=librdf_hash_put(context->hashes[i], &hd_key, &hd_value);
-    else
-      status=librdf_hash_delete(context->hashes[i], &hd_key, &hd_value);
-    
-    if(status)
-      break;
+  hd_key.data=(void*)key; hd_key.size=strlen(key);
+  hd_value.data=NULL; hd_value.size=0;
+
+  cursor=librdf_new_hash_cursor(context->hashes[context->meta_index]);
+  if(!cursor)
+    return 1;
+  status=librdf_hash_cursor_set(cursor, &hd_key, &hd_value);
+  if(!status) {
+    memcpy(buffer, hd_value.data,
+           (hd_value.size < *size_p) ? hd_value.size : *size_p);
+    *size_p=hd_value.size;
   }
+  librdf_free_hash_cursor(cursor);
 
   return status;
 }
 
 
+/*
+ * librdf_storage_hashes_meta_put:
+ * @context: storage instance
+ * @key: meta key
+ * @value: value or NULL to remove the key
+ * @size: size of @value
+ *
+ * INTERNAL - Set or remove the value of a key in the meta hash.
+ *
+ * Return value: non 0 on failure
+ */
 static int
-librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_hashes_meta_put(librdf_storage_hashes_instance* context,
+                               const char *key, const unsigned char *value,
+                               size_t size)
 {
-  /* Do not add duplicate statements */
-  if(librdf_storage_hashes_contains_statement(storage, statement))
+  librdf_hash* hash=context->hashes[context->meta_index];
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  int status;
+
+  hd_key.data=(void*)key; hd_key.size=strlen(key);
+
+  /* the hash keeps duplicate values so the old one must go first */
+  status=librdf_hash_exists(hash, &hd_key, NULL);
+  if(status < 0)
+    return 1;
+  if(status > 0 && librdf_hash_delete_all(hash, &hd_key))
+    return 1;
+
+  if(!value)
     return 0;
 
-  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 1);
+  hd_value.data=(void*)value; hd_value.size=size;
+  return librdf_hash_put(hash, &hd_key, &hd_value);
 }
 
 
+/*
+ * librdf_storage_hashes_meta_open:
+ * @storage: the storage
+ *
+ * INTERNAL - Check the state recorded in the meta hash after opening.
+ *
+ * The encoding of the indexes is recorded when a store is first
+ * written, and an open with the other setting of the dictionary
+ * option fails rather than finding nothing.  A store with statements
+ * and no recorded encoding predates the dictionary so is plain.
+ * A store left partly written by a failed bulk load also fails to
+ * open.
+ *
+ * Return value: non 0 on failure
+ */
 static int
-librdf_storage_hashes_add_statements(librdf_storage* storage,
-                                     librdf_stream* statement_stream)
+librdf_storage_hashes_meta_open(librdf_storage* storage)
 {
-  int status=0;
-
-  while(!librdf_stream_end(statement_stream)) {
-    librdf_statement* statement=librdf_stream_get_object(statement_stream);
-
-    if(statement) {
-      status=librdf_storage_hashes_add_statement(storage, statement);
-    } else
-      status=1;
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  const char *encoding=context->dictionary ? "dictionary" : "plain";
+  unsigned char buffer[16];
+  size_t size=sizeof(buffer);
+
+  if(librdf_storage_hashes_meta_get(context, LIBRDF_STORAGE_HASHES_META_ENCODING,
+                                    buffer, &size)) {
+    int empty=1;
+
+    if(!context->is_new) {
+      librdf_hash_cursor* cursor;
+      librdf_hash_datum key; /* on stack */
+
+      cursor=librdf_new_hash_cursor(context->hashes[context->all_statements_hash_index]);
+      if(!cursor)
+        return 1;
+      key.data=NULL; key.size=0;
+      empty=librdf_hash_cursor_get_first(cursor, &key, NULL);
+      librdf_free_hash_cursor(cursor);
+    }
 
-    if(status)
-      break;
+    if(empty) {
+      size=strlen(encoding);
+      memcpy(buffer, encoding, size);
+    } else {
+      size=5;
+      memcpy(buffer, "plain", size);
+    }
 
-    librdf_stream_next(statement_stream);
+    if(context->is_writable &&
+       librdf_storage_hashes_meta_put(context,
+                                      LIBRDF_STORAGE_HASHES_META_ENCODING,
+                                      buffer, size))
+      return 1;
   }
 
-  return status;
-}
+  if(size != strlen(encoding) || memcmp(buffer, encoding, size)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Hashes storage %s was not written with dictionary='%s'",
+               context->name ? context->name : "", 
+               context->dictionary ? "yes" : "no");
+    return 1;
+  }
 
+  size=sizeof(buffer);
+  if(!librdf_storage_hashes_meta_get(context, LIBRDF_STORAGE_HASHES_META_BULK_LOAD,
+                                     buffer, &size)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Hashes storage %s was left partly written by a failed bulk load",
+               context->name ? context->name : "");
+    return 1;
+  }
 
-static int
-librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement)
-{
-  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 0);
+  return 0;
 }
 
 
+/*
+ * librdf_storage_hashes_dictionary_open:
+ * @storage: the storage
+ *
+ * INTERNAL - Find the next free term id after the dictionary is opened.
+ *
+ * The next id is kept in the meta hash and removed while new ids are
+ * given out, so a store that was not closed has the dictionary
+ * scanned instead.  Terms are never removed from the dictionary so
+ * the next id is then one more than the largest id stored.
+ *
+ * Return value: non 0 on failure
+ */
 static int
-librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_hashes_dictionary_open(librdf_storage* storage)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
-  librdf_hash_datum hd_key, hd_value; /* on stack */
-  unsigned char *key_buffer, *value_buffer;
-  size_t key_len, value_len;
-  int hash_index=context->all_statements_hash_index;
-  librdf_statement_part fields;
+  unsigned char id_buffer[LIBRDF_STORAGE_HASHES_TERM_ID_SIZE];
+  size_t size=sizeof(id_buffer);
+  librdf_hash_cursor* cursor;
+  librdf_hash_datum key; /* on stack */
   int status;
-  librdf_world* world = storage->world;
-  
-  if(context->index_contexts) {
-    /* When we have contexts, we have to use find_statements for contains
-     * since a statement is encoded in KEY/VALUE and the VALUE may
-     * contain some context node.
-     */
-    librdf_stream *stream=librdf_storage_hashes_find_statements(storage, statement);
-    
-    if(!stream)
-      return 0;
-    /* librdf_stream_end returns 0 if have more, non-0 at end */
-    status=!librdf_stream_end(stream);
-    /* convert to 0 if at end (not found) and non-zero otherwise (found) */
-    librdf_free_stream(stream);
-    return status;
-  }
 
-  /* ENCODE KEY */
-  fields=(librdf_statement_part)context->hash_descriptions[hash_index]->key_fields;
-  key_len = librdf_statement_encode_parts2(world, statement, NULL,
-                                           NULL, 0, fields);
-  if(!key_len)
-    return 1;
-  key_buffer = LIBRDF_MALLOC(unsigned char*, key_len);
-  if(!key_buffer)
-    return 1;
-       
-  if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                     key_buffer, key_len, fields)) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
-  }
+  context->next_term_id=1;
+  context->next_term_id_saved=0;
 
-  /* ENCODE VALUE */
-  fields=(librdf_statement_part)context->hash_descriptions[hash_index]->value_fields;
-  value_len = librdf_statement_encode_parts2(world, statement, NULL,
-                                             NULL, 0, fields);
-  if(!value_len) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
-  }
-    
-  value_buffer = LIBRDF_MALLOC(unsigned char*, value_len);
-  if(!value_buffer) {
-    LIBRDF_FREE(data, key_buffer);
-    return 1;
+  if(!librdf_storage_hashes_meta_get(context,
+                                     LIBRDF_STORAGE_HASHES_META_NEXT_TERM_ID,
+                                     id_buffer, &size) &&
+     size == sizeof(id_buffer)) {
+    context->next_term_id=librdf_storage_hashes_bytes_to_id(id_buffer);
+    context->next_term_id_saved=1;
+    return 0;
   }
 
-       
-  if(!librdf_statement_encode_parts2(world, statement, NULL,
-                                     value_buffer, value_len, fields)) {
-    LIBRDF_FREE(data, key_buffer);
-    LIBRDF_FREE(data, value_buffer);
+  cursor=librdf_new_hash_cursor(context->hashes[context->id2term_index]);
+  if(!cursor)
     return 1;
-  }
 
+  key.data=NULL; key.size=0;
+  for(status=librdf_hash_cursor_get_first(cursor, &key, NULL);
+      !status;
+      status=librdf_hash_cursor_get_next(cursor, &key, NULL)) {
+    u64 id;
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
-  LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[hash_index]->name, key_len, value_len);
-#endif
+    if(key.size != LIBRDF_STORAGE_HASHES_TERM_ID_SIZE)
+      continue;
+    id=librdf_storage_hashes_bytes_to_id((unsigned char*)key.data);
+    if(id >= context->next_term_id)
+      context->next_term_id=id+1;
+  }
 
-  hd_key.data=key_buffer; hd_key.size=key_len;
-  hd_value.data=value_buffer; hd_value.size=value_len;
-  status=librdf_hash_exists(context->hashes[hash_index], &hd_key, &hd_value);
-  
-  LIBRDF_FREE(data, key_buffer);
-  LIBRDF_FREE(data, value_buffer);
+  librdf_free_hash_cursor(cursor);
 
-  /* DO NOT free statement, ownership was not passed in */
-  return status;
+  /* record it now so the next open need not scan */
+  return librdf_storage_hashes_dictionary_save(storage);
 }
 
 
+/*
+ * librdf_storage_hashes_dictionary_save:
+ * @storage: the storage
+ *
+ * INTERNAL - Store the next free term id in the meta hash.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_dictionary_save(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  unsigned char id_buffer[LIBRDF_STORAGE_HASHES_TERM_ID_SIZE];
 
-typedef struct {
-  librdf_storage *storage;
-  librdf_storage_hashes_instance* hash_context;
+  if(context->next_term_id_saved || !context->is_writable)
+    return 0;
+
+  librdf_storage_hashes_id_to_bytes(context->next_term_id, id_buffer);
+  if(librdf_storage_hashes_meta_put(context,
+                                    LIBRDF_STORAGE_HASHES_META_NEXT_TERM_ID,
+                                    id_buffer, sizeof(id_buffer)))
+    return 1;
+
+  context->next_term_id_saved=1;
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_term_to_id:
+ * @storage: the storage
+ * @node: term to look up
+ * @add: non 0 to give the term a new id if it has none
+ * @id_p: pointer to store the term id
+ *
+ * INTERNAL - Map a term to its id in the term dictionary.
+ *
+ * Return value: 0 on success, <0 if the term has no id and @add is 0,
+ * >0 on failure
+ */
+static int
+librdf_storage_hashes_term_to_id(librdf_storage* storage, librdf_node* node,
+                                 int add, u64* id_p)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  unsigned char id_buffer[LIBRDF_STORAGE_HASHES_TERM_ID_SIZE];
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_cursor* cursor;
+  unsigned char *buffer;
+  size_t len;
+  int status;
+
+  len=librdf_node_encode(node, NULL, 0);
+  if(!len)
+    return 1;
+  if(add) {
+    if(librdf_storage_hashes_grow_buffer(&context->term_buffer,
+                                         &context->term_buffer_len, len))
+      return 1;
+    buffer=context->term_buffer;
+  } else {
+    /* lookups may run in concurrent readers so cannot share term_buffer */
+    buffer=LIBRDF_MALLOC(unsigned char*, len);
+    if(!buffer)
+      return 1;
+  }
+  if(!librdf_node_encode(node, buffer, len)) {
+    status=1;
+    goto done;
+  }
+
+  key.data=buffer; key.size=len;
+  value.data=NULL; value.size=0;
+
+  cursor=librdf_new_hash_cursor(context->hashes[context->term2id_index]);
+  if(!cursor) {
+    status=1;
+    goto done;
+  }
+  status=librdf_hash_cursor_set(cursor, &key, &value);
+  if(!status) {
+    if(value.size == LIBRDF_STORAGE_HASHES_TERM_ID_SIZE)
+      *id_p=librdf_storage_hashes_bytes_to_id((unsigned char*)value.data);
+    else
+      status=-1;
+  }
+  librdf_free_hash_cursor(cursor);
+
+  if(!status)
+    goto done;
+  if(status < 0) {
+    status=1; /* corrupt dictionary */
+    goto done;
+  }
+  if(!add) {
+    status=-1;
+    goto done;
+  }
+
+  /* new term - store both directions */
+  status=1;
+
+  /* the stored next id goes stale with this one until saved again */
+  if(context->next_term_id_saved) {
+    if(librdf_storage_hashes_meta_put(context,
+                                      LIBRDF_STORAGE_HASHES_META_NEXT_TERM_ID,
+                                      NULL, 0))
+      goto done;
+    context->next_term_id_saved=0;
+  }
+
+  librdf_storage_hashes_id_to_bytes(context->next_term_id, id_buffer);
+  value.data=id_buffer; value.size=sizeof(id_buffer);
+  if(librdf_hash_put(context->hashes[context->term2id_index], &key, &value))
+    goto done;
+  if(librdf_hash_put(context->hashes[context->id2term_index], &value, &key))
+    goto done;
+
+  *id_p=context->next_term_id++;
+  status=0;
+
+  done:
+  if(!add)
+    LIBRDF_FREE(data, buffer);
+  return status;
+}
+
+
+/*
+ * librdf_storage_hashes_id_to_term:
+ * @storage: the storage
+ * @id_bytes: encoded term id
+ *
+ * INTERNAL - Decode the term with the given id from the term dictionary.
+ *
+ * Return value: new #librdf_node or NULL on failure
+ */
+static librdf_node*
+librdf_storage_hashes_id_to_term(librdf_storage* storage,
+                                 unsigned char *id_bytes)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_cursor* cursor;
+  librdf_node* node=NULL;
+
+  key.data=id_bytes; key.size=LIBRDF_STORAGE_HASHES_TERM_ID_SIZE;
+  value.data=NULL; value.size=0;
+
+  cursor=librdf_new_hash_cursor(context->hashes[context->id2term_index]);
+  if(!cursor)
+    return NULL;
+  if(!librdf_hash_cursor_set(cursor, &key, &value))
+    node=librdf_node_decode(storage->world, NULL,
+                            (unsigned char*)value.data, value.size);
+  librdf_free_hash_cursor(cursor);
+
+  return node;
+}
+
+
+/*
+ * librdf_storage_hashes_new_node_cache:
+ * @size: number of nodes to keep
+ *
+ * INTERNAL - Create a cache of decoded nodes.
+ *
+ * Return value: new cache or NULL on failure
+ */
+static librdf_storage_hashes_node_cache*
+librdf_storage_hashes_new_node_cache(int size)
+{
+  librdf_storage_hashes_node_cache* cache;
+  unsigned long buckets_count=1;
+  unsigned long i;
+
+  cache=LIBRDF_CALLOC(librdf_storage_hashes_node_cache*, 1, sizeof(*cache));
+  if(!cache)
+    return NULL;
+
+  while(buckets_count < (unsigned long)size)
+    buckets_count <<= 1;
+
+  cache->size=size;
+  cache->buckets_mask=buckets_count - 1;
+  cache->entries=LIBRDF_CALLOC(librdf_storage_hashes_node_cache_entry*,
+                               LIBRDF_GOOD_CAST(size_t, size),
+                               sizeof(librdf_storage_hashes_node_cache_entry));
+  cache->buckets=LIBRDF_MALLOC(int*, buckets_count * sizeof(int));
+  if(!cache->entries || !cache->buckets) {
+    if(cache->entries)
+      LIBRDF_FREE(librdf_storage_hashes_node_cache_entry*, cache->entries);
+    if(cache->buckets)
+      LIBRDF_FREE(int*, cache->buckets);
+    LIBRDF_FREE(librdf_storage_hashes_node_cache, cache);
+    return NULL;
+  }
+
+  for(i=0; i < buckets_count; i++)
+    cache->buckets[i]= -1;
+
+#ifdef WITH_THREADS
+  pthread_mutex_init(&cache->mutex, NULL);
+#endif
+
+  return cache;
+}
+
+
+/*
+ * librdf_storage_hashes_node_cache_flush:
+ * @cache: node cache
+ *
+ * INTERNAL - Drop all nodes from the cache, keeping the hit and miss counts.
+ */
+static void
+librdf_storage_hashes_node_cache_flush(librdf_storage_hashes_node_cache* cache)
+{
+  int i;
+
+  NODE_CACHE_LOCK(cache);
+
+  for(i=0; i < cache->count; i++) {
+    librdf_storage_hashes_node_cache_entry* entry=&cache->entries[i];
+
+    if(entry->node) {
+      librdf_free_node(entry->node);
+      entry->node=NULL;
+    }
+    entry->referenced=0;
+    entry->next= -1;
+  }
+  for(i=0; (unsigned long)i <= cache->buckets_mask; i++)
+    cache->buckets[i]= -1;
+
+  cache->count=0;
+  cache->hand=0;
+
+  NODE_CACHE_UNLOCK(cache);
+}
+
+
+/*
+ * librdf_storage_hashes_free_node_cache:
+ * @cache: node cache
+ *
+ * INTERNAL - Destructor - free a node cache and the nodes it holds.
+ */
+static void
+librdf_storage_hashes_free_node_cache(librdf_storage_hashes_node_cache* cache)
+{
+  int i;
+
+  librdf_storage_hashes_node_cache_flush(cache);
+
+  for(i=0; i < cache->size; i++) {
+    if(cache->entries[i].key)
+      LIBRDF_FREE(data, cache->entries[i].key);
+  }
+
+#ifdef WITH_THREADS
+  pthread_mutex_destroy(&cache->mutex);
+#endif
+
+  LIBRDF_FREE(librdf_storage_hashes_node_cache_entry*, cache->entries);
+  LIBRDF_FREE(int*, cache->buckets);
+  LIBRDF_FREE(librdf_storage_hashes_node_cache, cache);
+}
+
+
+/* FNV-1a hash of an encoded term */
+static unsigned long
+librdf_storage_hashes_node_cache_hash(const unsigned char *key, size_t len)
+{
+  unsigned long hash=2166136261UL;
+
+  while(len--) {
+    hash ^= *key++;
+    hash *= 16777619UL;
+  }
+
+  return hash;
+}
+
+
+/* find an entry; called with the cache locked */
+static int
+librdf_storage_hashes_node_cache_find(librdf_storage_hashes_node_cache* cache,
+                                      const unsigned char *key, size_t len,
+                                      unsigned long hash)
+{
+  int i;
+
+  for(i=cache->buckets[hash & cache->buckets_mask]; i >= 0;
+      i=cache->entries[i].next) {
+    librdf_storage_hashes_node_cache_entry* entry=&cache->entries[i];
+
+    if(entry->hash == hash && entry->key_len == len &&
+       !memcmp(entry->key, key, len))
+      return i;
+  }
+
+  return -1;
+}
+
+
+/*
+ * librdf_storage_hashes_node_cache_get:
+ * @cache: node cache
+ * @key: encoded term
+ * @len: length of @key
+ *
+ * INTERNAL - Get a decoded node from the cache.
+ *
+ * Return value: new #librdf_node or NULL if not in the cache
+ */
+static librdf_node*
+librdf_storage_hashes_node_cache_get(librdf_storage_hashes_node_cache* cache,
+                                     const unsigned char *key, size_t len)
+{
+  unsigned long hash=librdf_storage_hashes_node_cache_hash(key, len);
+  librdf_node* node=NULL;
+  int i;
+
+  NODE_CACHE_LOCK(cache);
+
+  i=librdf_storage_hashes_node_cache_find(cache, key, len, hash);
+  if(i >= 0) {
+    cache->entries[i].referenced=1;
+    node=librdf_new_node_from_node(cache->entries[i].node);
+  }
+
+  if(node)
+    cache->hits++;
+  else
+    cache->misses++;
+
+  NODE_CACHE_UNLOCK(cache);
+
+  return node;
+}
+
+
+/*
+ * librdf_storage_hashes_node_cache_put:
+ * @cache: node cache
+ * @key: encoded term
+ * @len: length of @key
+ * @node: decoded node (shared)
+ *
+ * INTERNAL - Add a decoded node to the cache, evicting one that has
+ * not been used since the CLOCK hand last passed when the cache is full.
+ */
+static void
+librdf_storage_hashes_node_cache_put(librdf_storage_hashes_node_cache* cache,
+                                     const unsigned char *key, size_t len,
+                                     librdf_node* node)
+{
+  unsigned long hash=librdf_storage_hashes_node_cache_hash(key, len);
+  librdf_storage_hashes_node_cache_entry* entry;
+  int i;
+
+  NODE_CACHE_LOCK(cache);
+
+  /* another reader may have added it since the lookup missed */
+  if(librdf_storage_hashes_node_cache_find(cache, key, len, hash) >= 0)
+    goto done;
+
+  if(cache->count < cache->size)
+    i=cache->count++;
+  else {
+    int* prev;
+
+    while(cache->entries[cache->hand].referenced) {
+      cache->entries[cache->hand].referenced=0;
+      cache->hand=(cache->hand + 1) % cache->size;
+    }
+    i=cache->hand;
+    cache->hand=(cache->hand + 1) % cache->size;
+
+    entry=&cache->entries[i];
+    if(entry->node) {
+      for(prev=&cache->buckets[entry->hash & cache->buckets_mask];
+          *prev >= 0; prev=&cache->entries[*prev].next) {
+        if(*prev == i) {
+          *prev=entry->next;
+          break;
+        }
+      }
+      librdf_free_node(entry->node);
+      entry->node=NULL;
+    }
+  }
+
+  entry=&cache->entries[i];
+  if(librdf_storage_hashes_grow_buffer(&entry->key, &entry->key_size, len))
+    goto done;
+
+  memcpy(entry->key, key, len);
+  entry->key_len=len;
+  entry->hash=hash;
+  entry->node=librdf_new_node_from_node(node);
+  entry->referenced=1;
+  entry->next=cache->buckets[hash & cache->buckets_mask];
+  cache->buckets[hash & cache->buckets_mask]=i;
+
+  done:
+  NODE_CACHE_UNLOCK(cache);
+}
+
+
+/*
+ * librdf_storage_hashes_term_node:
+ * @storage: the storage
+ * @bytes: encoded term, or term id when using a term dictionary
+ * @len: length of @bytes
+ *
+ * INTERNAL - Get the node for a term stored in a hash key or value,
+ * from the node cache when it was decoded recently.
+ *
+ * Return value: new #librdf_node or NULL on failure
+ */
+static librdf_node*
+librdf_storage_hashes_term_node(librdf_storage* storage,
+                                unsigned char *bytes, size_t len)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_node* node;
+
+  if(context->node_cache) {
+    node=librdf_storage_hashes_node_cache_get(context->node_cache, bytes, len);
+    if(node)
+      return node;
+  }
+
+  if(context->dictionary)
+    node=librdf_storage_hashes_id_to_term(storage, bytes);
+  else
+    node=librdf_node_decode(storage->world, NULL, bytes, len);
+
+  if(node && context->node_cache)
+    librdf_storage_hashes_node_cache_put(context->node_cache, bytes, len, node);
+
+  return node;
+}
+
+
+/*
+ * librdf_storage_hashes_statement_ids:
+ * @storage: the storage
+ * @statement: statement (or NULL)
+ * @context_node: context node (or NULL)
+ * @fields: statement parts to look up
+ * @add: non 0 to give new terms ids
+ * @ids: array of 4 ids to fill in for subject, predicate, object, context
+ *
+ * INTERNAL - Look up the term ids of statement parts; 0 is used for
+ * parts that are absent or not wanted.
+ *
+ * Return value: 0 on success, <0 if a term has no id and @add is 0,
+ * >0 on failure
+ */
+static int
+librdf_storage_hashes_statement_ids(librdf_storage* storage,
+                                    librdf_statement* statement,
+                                    librdf_node* context_node,
+                                    int fields, int add, u64 *ids)
+{
+  librdf_node* nodes[4];
+  int i;
+
+  nodes[0]=nodes[1]=nodes[2]=NULL;
+  if(statement) {
+    if(fields & LIBRDF_STATEMENT_SUBJECT)
+      nodes[0]=librdf_statement_get_subject(statement);
+    if(fields & LIBRDF_STATEMENT_PREDICATE)
+      nodes[1]=librdf_statement_get_predicate(statement);
+    if(fields & LIBRDF_STATEMENT_OBJECT)
+      nodes[2]=librdf_statement_get_object(statement);
+  }
+  nodes[3]=context_node;
+
+  for(i=0; i<4; i++) {
+    ids[i]=0;
+    if(nodes[i]) {
+      int status=librdf_storage_hashes_term_to_id(storage, nodes[i], add,
+                                                  &ids[i]);
+      if(status)
+        return status;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_encode_ids:
+ * @ids: array of 4 ids for subject, predicate, object, context
+ * @fields: statement parts to encode
+ * @with_context: non 0 to encode the context id too
+ * @buffer: buffer of at least LIBRDF_STORAGE_HASHES_ID_ENCODING_MAX_SIZE
+ *
+ * INTERNAL - Write the dictionary encoding of statement parts: 'X' then
+ * for each part present, its type byte ('s', 'p', 'o', 'c') and id.
+ *
+ * Return value: number of bytes written
+ */
+static size_t
+librdf_storage_hashes_encode_ids(u64 *ids, int fields, int with_context,
+                                 unsigned char *buffer)
+{
+  static const char types[4]={'s', 'p', 'o', 'c'};
+  static const int parts[3]={LIBRDF_STATEMENT_SUBJECT,
+                             LIBRDF_STATEMENT_PREDICATE,
+                             LIBRDF_STATEMENT_OBJECT};
+  unsigned char *p=buffer;
+  int i;
+
+  *p++='X';
+  for(i=0; i<4; i++) {
+    if(!ids[i] || (i<3 && !(fields & parts[i])) || (i==3 && !with_context))
+      continue;
+    *p++=(unsigned char)types[i];
+    librdf_storage_hashes_id_to_bytes(ids[i], p);
+    p += LIBRDF_STORAGE_HASHES_TERM_ID_SIZE;
+  }
+
+  return LIBRDF_GOOD_CAST(size_t, p - buffer);
+}
+
+
+/*
+ * librdf_storage_hashes_encode:
+ * @storage: the storage
+ * @statement: statement to encode parts of (or NULL with a term dictionary)
+ * @context_node: context node to encode too (or NULL)
+ * @fields: statement parts to encode
+ * @add: non 0 when encoding a statement being added
+ * @buffer_p: pointer to growing buffer
+ * @buffer_len_p: pointer to growing buffer size
+ * @length_p: pointer to store the length of the encoding
+ *
+ * INTERNAL - Encode statement parts for a hash key or value.
+ *
+ * Without a term dictionary this is librdf_statement_encode_parts2().
+ * With one, parts are encoded as term ids and @add controls whether
+ * terms not yet in the dictionary are added.
+ *
+ * Return value: 0 on success, <0 if a term is not in the dictionary
+ * (so nothing using it can be stored), >0 on failure
+ */
+static int
+librdf_storage_hashes_encode(librdf_storage* storage,
+                             librdf_statement* statement,
+                             librdf_node* context_node,
+                             int fields, int add,
+                             unsigned char **buffer_p, size_t *buffer_len_p,
+                             size_t *length_p)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_world* world=storage->world;
+  size_t len;
+
+  if(context->dictionary) {
+    u64 ids[4];
+    int status;
+
+    status=librdf_storage_hashes_statement_ids(storage, statement,
+                                               context_node, fields, add, ids);
+    if(status)
+      return status;
+    if(librdf_storage_hashes_grow_buffer(buffer_p, buffer_len_p,
+                                         LIBRDF_STORAGE_HASHES_ID_ENCODING_MAX_SIZE))
+      return 1;
+    *length_p=librdf_storage_hashes_encode_ids(ids, fields, 1, *buffer_p);
+    return 0;
+  }
+
+  len=librdf_statement_encode_parts2(world, statement, context_node, NULL, 0,
+                                     (librdf_statement_part)fields);
+  if(!len)
+    return 1;
+  if(librdf_storage_hashes_grow_buffer(buffer_p, buffer_len_p, len))
+    return 1;
+  if(!librdf_statement_encode_parts2(world, statement, context_node,
+                                     *buffer_p, *buffer_len_p,
+                                     (librdf_statement_part)fields))
+    return 1;
+
+  *length_p=len;
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_decode:
+ * @storage: the storage
+ * @statement: the statement to decode into
+ * @context_node: pointer to store the context node (or NULL)
+ * @fields: statement parts wanted
+ * @buffer: encoded hash key or value
+ * @length: length of @buffer
+ *
+ * INTERNAL - Decode statement parts from a hash key or value.
+ *
+ * Only the parts in @fields (and the context node when @context_node
+ * is given) are turned back into nodes; the others are skipped.  With
+ * a term dictionary the skipped ids are never looked up.
+ *
+ * Return value: number of bytes used or 0 on failure
+ */
+static size_t
+librdf_storage_hashes_decode(librdf_storage* storage,
+                             librdf_statement* statement,
+                             librdf_node** context_node, int fields,
+                             unsigned char *buffer, size_t length)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  unsigned char *p=buffer;
+  unsigned char *end=buffer+length;
+
+  if(length < 1 || *p++ != (context->dictionary ? 'X' : 'x'))
+    return 0;
+
+  while(p < end) {
+    librdf_node* node;
+    unsigned char type=*p++;
+    size_t node_len;
+
+    if(context->dictionary) {
+      node_len=LIBRDF_STORAGE_HASHES_TERM_ID_SIZE;
+      if((size_t)(end - p) < node_len)
+        return 0;
+    } else {
+      node_len=librdf_node_encoded_length(p, LIBRDF_GOOD_CAST(size_t, end - p));
+      if(!node_len)
+        return 0;
+    }
+
+    switch(type) {
+      case 's': /* subject */
+      case 'p': /* predicate */
+      case 'o': /* object */
+        if(((type == 's') && !(fields & LIBRDF_STATEMENT_SUBJECT)) ||
+           ((type == 'p') && !(fields & LIBRDF_STATEMENT_PREDICATE)) ||
+           ((type == 'o') && !(fields & LIBRDF_STATEMENT_OBJECT)))
+          break;
+
+        node=librdf_storage_hashes_term_node(storage, p, node_len);
+        if(!node)
+          return 0;
+        if(type == 's')
+          librdf_statement_set_subject(statement, node);
+        else if(type == 'p')
+          librdf_statement_set_predicate(statement, node);
+        else
+          librdf_statement_set_object(statement, node);
+        break;
+
+      case 'c': /* context */
+        if(!context_node)
+          break;
+        node=librdf_storage_hashes_term_node(storage, p, node_len);
+        if(!node)
+          return 0;
+        *context_node=node;
+        break;
+
+      default:
+        return 0;
+    }
+
+    p += node_len;
+  }
+
+  return length;
+}
+
+
+
+/*
+ * librdf_storage_hashes_encode_context:
+ * @storage: the storage
+ * @context_node: context node
+ * @add: non 0 when encoding for an addition
+ * @buffer_p: pointer to growing buffer
+ * @buffer_len_p: pointer to growing buffer size
+ * @length_p: pointer to store the length of the encoding
+ *
+ * INTERNAL - Encode a context node as a key of the contexts hash.
+ *
+ * Return value: 0 on success, <0 if the node is not in the dictionary,
+ * >0 on failure
+ */
+static int
+librdf_storage_hashes_encode_context(librdf_storage* storage,
+                                     librdf_node* context_node, int add,
+                                     unsigned char **buffer_p,
+                                     size_t *buffer_len_p, size_t *length_p)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  size_t len;
+
+  if(context->dictionary)
+    return librdf_storage_hashes_encode(storage, NULL, context_node, 0, add,
+                                        buffer_p, buffer_len_p, length_p);
+
+  len=librdf_node_encode(context_node, NULL, 0);
+  if(!len)
+    return 1;
+  if(librdf_storage_hashes_grow_buffer(buffer_p, buffer_len_p, len))
+    return 1;
+  *length_p=librdf_node_encode(context_node, *buffer_p, *buffer_len_p);
+
+  return (*length_p == 0);
+}
+
+
+/*
+ * librdf_storage_hashes_decode_context:
+ * @storage: the storage
+ * @buffer: contexts hash key
+ * @length: length of @buffer
+ *
+ * INTERNAL - Decode a context node from a key of the contexts hash.
+ *
+ * Return value: new #librdf_node or NULL on failure
+ */
+static librdf_node*
+librdf_storage_hashes_decode_context(librdf_storage* storage,
+                                     unsigned char *buffer, size_t length)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_statement statement; /* on stack */
+  librdf_node* node=NULL;
+
+  if(!context->dictionary)
+    return librdf_storage_hashes_term_node(storage, buffer, length);
+
+  librdf_statement_init(storage->world, &statement);
+  if(!librdf_storage_hashes_decode(storage, &statement, &node, 0,
+                                   buffer, length) && node) {
+    librdf_free_node(node);
+    node=NULL;
+  }
+
+  return node;
+}
+
+
+/*
+ * librdf_storage_hashes_is_statement_index:
+ * @context: storage instance
+ * @hash_index: index of the hash
+ *
+ * INTERNAL - Check if a hash gets a record for every statement added,
+ * rather than being the contexts hash or part of the term dictionary.
+ *
+ * Return value: non 0 if the hash is a statement index
+ */
+static int
+librdf_storage_hashes_is_statement_index(librdf_storage_hashes_instance* context,
+                                         int hash_index)
+{
+  librdf_hash_descriptor* desc=context->hash_descriptions[hash_index];
+
+  if(!desc || !desc->key_fields)
+    return 0;
+
+  return (desc->value_fields || hash_index == context->statement_contexts_index);
+}
+
+
+/*
+ * librdf_storage_hashes_encode_record:
+ * @storage: the storage
+ * @statement: statement
+ * @context_node: context node (or NULL)
+ * @ids: term ids of @statement and @context_node from
+ *   librdf_storage_hashes_statement_ids() when using a term dictionary
+ * @hash_index: index of the hash to encode for
+ * @key_len_p: pointer to store key length
+ * @value_len_p: pointer to store value length
+ *
+ * INTERNAL - Encode the key and value of a statement for one index hash
+ * into the storage key and value buffers.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_encode_record(librdf_storage* storage,
+                                    librdf_statement* statement,
+                                    librdf_node* context_node,
+                                    u64 *ids, int hash_index,
+                                    size_t *key_len_p, size_t *value_len_p)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int key_fields=context->hash_descriptions[hash_index]->key_fields;
+  int value_fields=context->hash_descriptions[hash_index]->value_fields;
+
+  if(context->dictionary) {
+    if(librdf_storage_hashes_grow_buffer(&context->key_buffer,
+                                         &context->key_buffer_len,
+                                         LIBRDF_STORAGE_HASHES_ID_ENCODING_MAX_SIZE) ||
+       librdf_storage_hashes_grow_buffer(&context->value_buffer,
+                                         &context->value_buffer_len,
+                                         LIBRDF_STORAGE_HASHES_ID_ENCODING_MAX_SIZE))
+      return 1;
+
+    /* only the value has the context */
+    *key_len_p=librdf_storage_hashes_encode_ids(ids, key_fields, 0,
+                                                context->key_buffer);
+    *value_len_p=librdf_storage_hashes_encode_ids(ids, value_fields, 1,
+                                                  context->value_buffer);
+    return 0;
+  }
+
+  /* ENCODE KEY */
+  if(librdf_storage_hashes_encode(storage, statement, NULL, key_fields, 0,
+                                  &context->key_buffer,
+                                  &context->key_buffer_len, key_len_p))
+    return 1;
+
+  /* ENCODE VALUE */
+  return (librdf_storage_hashes_encode(storage, statement, context_node,
+                                       value_fields, 0,
+                                       &context->value_buffer,
+                                       &context->value_buffer_len,
+                                       value_len_p) != 0);
+}
+
+
+/* 
+ * Statistics: whether the key of an sp2o, po2s, s2po or o2sp index
+ * appears / disappears tells if the subject or object is new or gone
+ * for the predicate or for the whole store.
+ */
+#define LIBRDF_STORAGE_HASHES_STATISTICS_KEYS 4
+
+
+/*
+ * librdf_storage_hashes_statistics_key:
+ * @storage: the storage
+ * @hash_index: index the key is for
+ * @key: encoded key
+ * @key_changed: array of LIBRDF_STORAGE_HASHES_STATISTICS_KEYS flags
+ *
+ * INTERNAL - Record whether @key is absent from an index that the
+ * statistics care about.  Called before an addition and after a
+ * removal, so an absent key is one being added or removed.
+ */
+static void
+librdf_storage_hashes_statistics_key(librdf_storage* storage, int hash_index,
+                                     librdf_hash_datum* key, int *key_changed)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int slot;
+
+  if(hash_index == context->targets_index)
+    slot=0;
+  else if(hash_index == context->sources_index)
+    slot=1;
+  else if(hash_index == context->s2po_index)
+    slot=2;
+  else if(hash_index == context->o2sp_index)
+    slot=3;
+  else
+    return;
+
+  key_changed[slot]=(librdf_hash_exists(context->hashes[hash_index],
+                                        key, NULL) == 0);
+}
+
+
+static void
+librdf_storage_hashes_statistics_update(librdf_storage* storage,
+                                        librdf_statement* statement,
+                                        int delta, int *key_changed)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_statistics* stats=context->statistics;
+
+  if(stats->stale)
+    return;
+
+  if(context->s2po_index >= 0 && key_changed[2])
+    stats->subjects += delta;
+  if(context->o2sp_index >= 0 && key_changed[3])
+    stats->objects += delta;
+
+  librdf_storage_statistics_update(stats,
+                                   librdf_statement_get_predicate(statement),
+                                   delta,
+                                   (context->targets_index >= 0 && key_changed[0]) ? delta : 0,
+                                   (context->sources_index >= 0 && key_changed[1]) ? delta : 0);
+}
+
+
+/*
+ * librdf_storage_hashes_statistics_count_keys:
+ * @storage: the storage
+ * @hash_index: index with the predicate in the key or -1
+ * @predicate_part: part of the per predicate count to add to
+ *
+ * INTERNAL - Add one for every key of an index to the count of the
+ * predicate in that key.
+ *
+ * Return value: number of keys or <0 on failure
+ */
+static int
+librdf_storage_hashes_statistics_count_keys(librdf_storage* storage,
+                                            int hash_index,
+                                            int predicate_part)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum key;
+  librdf_iterator* iterator;
+  librdf_statement* statement;
+  int count=0;
+
+  statement=librdf_new_statement(storage->world);
+  if(!statement)
+    return -1;
+
+  memset(&key, 0, sizeof(key));
+  iterator=librdf_hash_keys(context->hashes[hash_index], &key);
+  if(!iterator) {
+    librdf_free_statement(statement);
+    return -1;
+  }
+
+  while(!librdf_iterator_end(iterator)) {
+    librdf_hash_datum* k=(librdf_hash_datum*)librdf_iterator_get_key(iterator);
+
+    if(!k) {
+      count= -1;
+      break;
+    }
+
+    if(predicate_part) {
+      if(!librdf_storage_hashes_decode(storage, statement, NULL,
+                                       LIBRDF_STATEMENT_PREDICATE,
+                                       (unsigned char*)k->data, k->size)) {
+        count= -1;
+        break;
+      }
+      librdf_storage_statistics_update(context->statistics,
+                                       librdf_statement_get_predicate(statement),
+                                       0,
+                                       (predicate_part == LIBRDF_STATEMENT_SUBJECT),
+                                       (predicate_part == LIBRDF_STATEMENT_OBJECT));
+      librdf_statement_clear(statement);
+    }
+
+    count++;
+    librdf_iterator_next(iterator);
+  }
+
+  librdf_free_iterator(iterator);
+  librdf_free_statement(statement);
+
+  return count;
+}
+
+
+/*
+ * librdf_storage_hashes_statistics_rebuild:
+ * @storage: the storage
+ *
+ * INTERNAL - Recount the statistics of a store opened with statements
+ * or after a bulk load, from the index keys and values.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_statistics_rebuild(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_statistics* stats=context->statistics;
+  librdf_hash_datum key, value;
+  librdf_iterator* iterator;
+  librdf_statement* statement;
+  int status=0;
+  int count;
+
+  /* the per predicate statement counts come from the sp2o values */
+  if(context->targets_index < 0)
+    return 1;
+
+  librdf_storage_statistics_clear(stats);
+  if(stats->stale)
+    return 1;
+
+  statement=librdf_new_statement(storage->world);
+  if(!statement)
+    return 1;
+
+  memset(&key, 0, sizeof(key));
+  memset(&value, 0, sizeof(value));
+  iterator=librdf_hash_get_all(context->hashes[context->targets_index],
+                               &key, &value);
+  if(!iterator) {
+    librdf_free_statement(statement);
+    return 1;
+  }
+
+  while(!librdf_iterator_end(iterator)) {
+    librdf_hash_datum* k=(librdf_hash_datum*)librdf_iterator_get_key(iterator);
+
+    if(!k ||
+       !librdf_storage_hashes_decode(storage, statement, NULL,
+                                     LIBRDF_STATEMENT_PREDICATE,
+                                     (unsigned char*)k->data, k->size)) {
+      status=1;
+      break;
+    }
+    librdf_storage_statistics_update(stats,
+                                     librdf_statement_get_predicate(statement),
+                                     1, 0, 0);
+    librdf_statement_clear(statement);
+    librdf_iterator_next(iterator);
+  }
+  librdf_free_iterator(iterator);
+  librdf_free_statement(statement);
+
+  if(!status &&
+     librdf_storage_hashes_statistics_count_keys(storage,
+                                                 context->targets_index,
+                                                 LIBRDF_STATEMENT_SUBJECT) < 0)
+    status=1;
+
+  if(!status && context->sources_index >= 0 &&
+     librdf_storage_hashes_statistics_count_keys(storage,
+                                                 context->sources_index,
+                                                 LIBRDF_STATEMENT_OBJECT) < 0)
+    status=1;
+
+  if(!status && context->s2po_index >= 0) {
+    count=librdf_storage_hashes_statistics_count_keys(storage,
+                                                      context->s2po_index, 0);
+    if(count < 0)
+      status=1;
+    else
+      stats->subjects=count;
+  }
+
+  if(!status && context->o2sp_index >= 0) {
+    count=librdf_storage_hashes_statistics_count_keys(storage,
+                                                      context->o2sp_index, 0);
+    if(count < 0)
+      status=1;
+    else
+      stats->objects=count;
+  }
+
+  if(status)
+    stats->stale=1;
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_hashes_hash_clear:
+ * @hash: hash
+ *
+ * INTERNAL - Delete every key of a hash.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_hash_clear(librdf_hash* hash)
+{
+  librdf_hash_datum key, first; /* on stack */
+  librdf_iterator* iterator;
+  librdf_hash_datum* k;
+  int status=0;
+
+  while(!status) {
+    memset(&key, 0, sizeof(key));
+    iterator=librdf_hash_keys(hash, &key);
+    if(!iterator)
+      return 1;
+    k=(librdf_hash_datum*)librdf_iterator_get_key(iterator);
+    if(librdf_iterator_end(iterator) || !k) {
+      librdf_free_iterator(iterator);
+      break;
+    }
+
+    /* the cursor must be gone before the key is deleted */
+    first.size=k->size;
+    first.data=LIBRDF_MALLOC(void*, first.size ? first.size : 1);
+    if(!first.data) {
+      librdf_free_iterator(iterator);
+      return 1;
+    }
+    memcpy(first.data, k->data, first.size);
+    librdf_free_iterator(iterator);
+
+    status=librdf_hash_delete_all(hash, &first);
+    LIBRDF_FREE(void*, first.data);
+  }
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_hashes_statement_contexts_open:
+ * @storage: the storage
+ *
+ * INTERNAL - Rebuild the statement to contexts index from the
+ * statements hash unless the meta hash records it as complete.
+ *
+ * The index is incomplete when the store was written without it,
+ * whether or not the index hash has anything in it.  A store that
+ * cannot be written to has the index turned off instead and
+ * contains_statement falls back to a search.  If building fails the
+ * index is emptied again and the open fails.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_statement_contexts_open(librdf_storage* storage)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int hash_index=context->statement_contexts_index;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_iterator* iterator;
+  librdf_statement statement; /* on stack */
+  unsigned char buffer[4];
+  size_t size=sizeof(buffer);
+  int status=0;
+
+  if(!librdf_storage_hashes_meta_get(context,
+                                     LIBRDF_STORAGE_HASHES_META_STATEMENT_CONTEXTS,
+                                     buffer, &size))
+    return 0;
+
+  if(!context->is_writable) {
+    context->statement_contexts_index= -1;
+    return 0;
+  }
+
+  /* anything already in the index may be stale */
+  if(librdf_storage_hashes_hash_clear(context->hashes[hash_index]))
+    return 1;
+
+  memset(&key, 0, sizeof(key));
+  memset(&value, 0, sizeof(value));
+  iterator=librdf_hash_get_all(context->hashes[context->all_statements_hash_index],
+                               &key, &value);
+  if(!iterator)
+    return 1;
+
+  librdf_statement_init(storage->world, &statement);
+  while(!status && !librdf_iterator_end(iterator)) {
+    librdf_hash_datum* k=(librdf_hash_datum*)librdf_iterator_get_key(iterator);
+    librdf_hash_datum* v=(librdf_hash_datum*)librdf_iterator_get_value(iterator);
+    librdf_node* context_node=NULL;
+    u64 ids[4];
+    size_t key_len, value_len;
+
+    if(!k || !v ||
+       !librdf_storage_hashes_decode(storage, &statement, NULL,
+                                     LIBRDF_STATEMENT_ALL,
+                                     (unsigned char*)k->data, k->size) ||
+       !librdf_storage_hashes_decode(storage, &statement, &context_node,
+                                     LIBRDF_STATEMENT_ALL,
+                                     (unsigned char*)v->data, v->size))
+      status=1;
+
+    if(!status && context->dictionary &&
+       librdf_storage_hashes_statement_ids(storage, &statement, context_node,
+                                           LIBRDF_STATEMENT_ALL, 0, ids))
+      status=1;
+
+    if(!status &&
+       !librdf_storage_hashes_encode_record(storage, &statement, context_node,
+                                            ids, hash_index,
+                                            &key_len, &value_len)) {
+      librdf_hash_datum hd_key, hd_value; /* on stack */
+
+      hd_key.data=context->key_buffer; hd_key.size=key_len;
+      hd_value.data=context->value_buffer; hd_value.size=value_len;
+      status=librdf_hash_put(context->hashes[hash_index], &hd_key, &hd_value);
+    } else
+      status=1;
+
+    if(context_node)
+      librdf_free_node(context_node);
+    librdf_statement_clear(&statement);
+    librdf_iterator_next(iterator);
+  }
+  librdf_free_iterator(iterator);
+
+  if(!status)
+    status=librdf_storage_hashes_meta_put(context,
+                                          LIBRDF_STORAGE_HASHES_META_STATEMENT_CONTEXTS,
+                                          (const unsigned char*)"yes", 3);
+
+  if(status) {
+    librdf_storage_hashes_hash_clear(context->hashes[hash_index]);
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Failed to build statement contexts index");
+  }
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_hashes_context_contains_statement:
+ * @storage: the storage
+ * @context_node: context node
+ * @statement: statement
+ *
+ * INTERNAL - Check if a statement is in a context using the statement to
+ * contexts index.
+ *
+ * Return value: >0 if present, 0 if not or there is no index, <0 on failure
+ */
+static int
+librdf_storage_hashes_context_contains_statement(librdf_storage* storage,
+                                                 librdf_node* context_node,
+                                                 librdf_statement* statement)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  librdf_statement empty; /* on stack */
+  unsigned char *key_buffer=NULL, *value_buffer=NULL;
+  size_t key_buffer_len=0, value_buffer_len=0;
+  size_t key_len, value_len;
+  int status;
+
+  if(context->statement_contexts_index < 0)
+    return 0;
+
+  librdf_statement_init(storage->world, &empty);
+
+  /* a term missing from the dictionary means it cannot be present */
+  status=librdf_storage_hashes_encode(storage, statement, NULL,
+                                      LIBRDF_STATEMENT_ALL, 0,
+                                      &key_buffer, &key_buffer_len, &key_len);
+  if(!status)
+    status=librdf_storage_hashes_encode(storage, &empty, context_node, 0, 0,
+                                        &value_buffer, &value_buffer_len,
+                                        &value_len);
+  if(!status) {
+    hd_key.data=key_buffer; hd_key.size=key_len;
+    hd_value.data=value_buffer; hd_value.size=value_len;
+    status=librdf_hash_exists(context->hashes[context->statement_contexts_index],
+                              &hd_key, &hd_value);
+  } else
+    status=(status < 0) ? 0 : -1;
+
+  if(key_buffer)
+    LIBRDF_FREE(data, key_buffer);
+  if(value_buffer)
+    LIBRDF_FREE(data, value_buffer);
+
+  return status;
+}
+
+
+/**
+ * librdf_storage_hashes_estimate_statements:
+ * @storage: the storage
+ * @statement: partial statement pattern or NULL
+ * @distinct: 0 or a #librdf_statement_part
+ *
+ * Estimate statements matching a pattern from the kept statistics.
+ *
+ * Return value: estimate or < 0 if statistics are not kept
+ **/
+static int
+librdf_storage_hashes_estimate_statements(librdf_storage* storage,
+                                          librdf_statement* statement,
+                                          int distinct)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+
+  if(!context->statistics)
+    return -1;
+
+  if(context->statistics->stale &&
+     librdf_storage_hashes_statistics_rebuild(storage))
+    return -1;
+
+  return librdf_storage_statistics_estimate(context->statistics, statement,
+                                            distinct);
+}
+
+
+static int
+librdf_storage_hashes_add_remove_statement(librdf_storage* storage, 
+                                           librdf_statement* statement,
+                                           librdf_node* context_node,
+                                           int is_addition)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int i;
+  int status=0;
+  u64 ids[4];
+  /* set for indexes whose key is first added / finally removed */
+  int key_changed[LIBRDF_STORAGE_HASHES_STATISTICS_KEYS]={0, 0, 0, 0};
+  int delta=is_addition ? 1 : -1;
+  int modified=0;
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+  if(is_addition)
+    LIBRDF_DEBUG1("Adding statement: ");
+  else
+    LIBRDF_DEBUG1("Removing statement: ");
+  librdf_statement_print(statement, stderr);
+  fputc('\n', stderr);
+#endif  
+
+  /* look up (or add) the terms once for all the hashes; a term
+   * missing from the dictionary means there is nothing to remove */
+  if(context->dictionary &&
+     librdf_storage_hashes_statement_ids(storage, statement, context_node,
+                                         LIBRDF_STATEMENT_ALL,
+                                         is_addition, ids))
+    return 1;
+
+  for(i=0; i<context->hash_count; i++) {
+    librdf_hash_datum hd_key, hd_value; /* on stack */
+    size_t key_len, value_len;
+
+    if(!librdf_storage_hashes_is_statement_index(context, i))
+      continue;
+
+    if(librdf_storage_hashes_encode_record(storage, statement, context_node,
+                                           ids, i, &key_len, &value_len)) {
+      status=1;
+      break;
+    }
+
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+    LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[i]->name, key_len, value_len);
+#endif
+
+    /* Finally, store / remove the sucker */
+    hd_key.data=context->key_buffer; hd_key.size=key_len;
+    hd_value.data=context->value_buffer; hd_value.size=value_len;
+    
+    if(is_addition) {
+      if(context->statistics)
+        librdf_storage_hashes_statistics_key(storage, i, &hd_key,
+                                             key_changed);
+      status=librdf_hash_put(context->hashes[i], &hd_key, &hd_value);
+    } else {
+      status=librdf_hash_delete(context->hashes[i], &hd_key, &hd_value);
+      if(!status && context->statistics)
+        librdf_storage_hashes_statistics_key(storage, i, &hd_key,
+                                             key_changed);
+    }
+    
+    if(status)
+      break;
+    modified++;
+  }
+
+  if(!status && is_addition)
+    context->may_have_statements=1;
+
+  if(context->statistics) {
+    /* a partly applied change leaves the counts unknown */
+    if(status) {
+      if(modified)
+        context->statistics->stale=1;
+    } else
+      librdf_storage_hashes_statistics_update(storage, statement, delta,
+                                              key_changed);
+  }
+
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_add_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  /* Do not add duplicate statements */
+  if(librdf_storage_hashes_contains_statement(storage, statement))
+    return 0;
+
+  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 1);
+}
+
+
+static int
+librdf_storage_hashes_add_statements(librdf_storage* storage,
+                                     librdf_stream* statement_stream)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  int status=0;
+
+  if(context->bulk_load)
+    return librdf_storage_hashes_bulk_add_statements(storage, statement_stream);
+
+  while(!librdf_stream_end(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+
+    if(statement) {
+      status=librdf_storage_hashes_add_statement(storage, statement);
+    } else
+      status=1;
+
+    if(status)
+      break;
+
+    librdf_stream_next(statement_stream);
+  }
+
+  return status;
+}
+
+
+/* memory used for buffering records of all indexes before sorting
+ * them to a spill file */
+#define LIBRDF_STORAGE_HASHES_BULK_BUFFER_SIZE (64 * 1024 * 1024)
+
+/* 
+ * A bulk load record is the key length and value length (size_t each)
+ * followed by the key and value bytes, in memory and in spill files.
+ */
+#define LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE (2 * sizeof(size_t))
+
+
+typedef struct {
+  /* records packed in one buffer */
+  unsigned char *buffer;
+  size_t buffer_used;
+  size_t buffer_size;
+  /* pointers to the records in buffer, for sorting */
+  unsigned char **records;
+  size_t records_count;
+  size_t records_size;
+  /* sorted runs spilled to temporary files */
+  FILE **runs;
+  int runs_count;
+  int runs_size;
+} librdf_storage_hashes_bulk_sorter;
+
+
+typedef struct {
+  FILE *fh;
+  unsigned char *record;
+  size_t record_size;
+} librdf_storage_hashes_bulk_run;
+
+
+static size_t
+librdf_storage_hashes_bulk_record_key_len(const unsigned char *record)
+{
+  size_t len;
+
+  memcpy(&len, record, sizeof(len));
+  return len;
+}
+
+
+static size_t
+librdf_storage_hashes_bulk_record_value_len(const unsigned char *record)
+{
+  size_t len;
+
+  memcpy(&len, record + sizeof(len), sizeof(len));
+  return len;
+}
+
+
+/* compare records by key then value, as bytes in the order of a BDB btree */
+static int
+librdf_storage_hashes_bulk_record_compare(const unsigned char *a,
+                                          const unsigned char *b)
+{
+  size_t a_key_len, b_key_len;
+  size_t a_value_len, b_value_len;
+  int cmp;
+
+  a_key_len=librdf_storage_hashes_bulk_record_key_len(a);
+  b_key_len=librdf_storage_hashes_bulk_record_key_len(b);
+
+  cmp=memcmp(a + LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE,
+             b + LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE,
+             (a_key_len < b_key_len) ? a_key_len : b_key_len);
+  if(cmp)
+    return cmp;
+  if(a_key_len != b_key_len)
+    return (a_key_len < b_key_len) ? -1 : 1;
+
+  a_value_len=librdf_storage_hashes_bulk_record_value_len(a);
+  b_value_len=librdf_storage_hashes_bulk_record_value_len(b);
+
+  cmp=memcmp(a + LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE + a_key_len,
+             b + LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE + b_key_len,
+             (a_value_len < b_value_len) ? a_value_len : b_value_len);
+  if(cmp)
+    return cmp;
+
+  return (a_value_len < b_value_len) ? -1 : (a_value_len > b_value_len);
+}
+
+
+static int
+librdf_storage_hashes_bulk_record_qsort_compare(const void *a, const void *b)
+{
+  return librdf_storage_hashes_bulk_record_compare(*(unsigned char* const*)a,
+                                                   *(unsigned char* const*)b);
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_spill:
+ * @sorter: the sorter
+ *
+ * INTERNAL - Sort the buffered records and write them as a new run
+ * to a temporary file, then empty the buffer.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_bulk_spill(librdf_storage_hashes_bulk_sorter* sorter)
+{
+  FILE *fh;
+  size_t i;
+
+  if(!sorter->records_count)
+    return 0;
+
+  if(sorter->runs_count == sorter->runs_size) {
+    int new_size=sorter->runs_size ? sorter->runs_size << 1 : 8;
+    FILE **new_runs;
+
+    new_runs = LIBRDF_CALLOC(FILE**, LIBRDF_GOOD_CAST(size_t, new_size),
+                             sizeof(FILE*));
+    if(!new_runs)
+      return 1;
+    if(sorter->runs) {
+      memcpy(new_runs, sorter->runs, sizeof(FILE*) * LIBRDF_GOOD_CAST(size_t, sorter->runs_count));
+      LIBRDF_FREE(FILE**, sorter->runs);
+    }
+    sorter->runs=new_runs;
+    sorter->runs_size=new_size;
+  }
+
+  fh=tmpfile();
+  if(!fh)
+    return 1;
+  sorter->runs[sorter->runs_count++]=fh;
+
+  qsort(sorter->records, sorter->records_count, sizeof(unsigned char*),
+        librdf_storage_hashes_bulk_record_qsort_compare);
+
+  for(i=0; i < sorter->records_count; i++) {
+    unsigned char *record=sorter->records[i];
+    size_t len=LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE +
+               librdf_storage_hashes_bulk_record_key_len(record) +
+               librdf_storage_hashes_bulk_record_value_len(record);
+
+    if(fwrite(record, 1, len, fh) != len)
+      return 1;
+  }
+
+  if(fflush(fh) || fseek(fh, 0L, SEEK_SET))
+    return 1;
+
+  sorter->buffer_used=0;
+  sorter->records_count=0;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_add:
+ * @sorter: the sorter
+ * @buffer_size: most bytes to buffer before spilling a run
+ * @key: key bytes
+ * @key_len: key length
+ * @value: value bytes
+ * @value_len: value length
+ *
+ * INTERNAL - Add a key/value record to a sorter.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_bulk_add(librdf_storage_hashes_bulk_sorter* sorter,
+                               size_t buffer_size,
+                               const unsigned char *key, size_t key_len,
+                               const unsigned char *value, size_t value_len)
+{
+  size_t len=LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE + key_len + value_len;
+  unsigned char *record;
+
+  /* keep records aligned for the header */
+  len=(len + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1);
+
+  if(sorter->buffer_used + len > sorter->buffer_size) {
+    if(librdf_storage_hashes_bulk_spill(sorter))
+      return 1;
+
+    if(len > sorter->buffer_size) {
+      if(sorter->buffer)
+        LIBRDF_FREE(data, sorter->buffer);
+      sorter->buffer_size=(len > buffer_size) ? len : buffer_size;
+      sorter->buffer = LIBRDF_MALLOC(unsigned char*, sorter->buffer_size);
+      if(!sorter->buffer) {
+        sorter->buffer_size=0;
+        return 1;
+      }
+    }
+  }
+
+  if(sorter->records_count == sorter->records_size) {
+    size_t new_size=sorter->records_size ? sorter->records_size << 1 : 1024;
+    unsigned char **new_records;
+
+    new_records = LIBRDF_MALLOC(unsigned char**, new_size * sizeof(unsigned char*));
+    if(!new_records)
+      return 1;
+    if(sorter->records) {
+      memcpy(new_records, sorter->records,
+             sorter->records_count * sizeof(unsigned char*));
+      LIBRDF_FREE(unsigned char**, sorter->records);
+    }
+    sorter->records=new_records;
+    sorter->records_size=new_size;
+  }
+
+  record=sorter->buffer + sorter->buffer_used;
+  memcpy(record, &key_len, sizeof(key_len));
+  memcpy(record + sizeof(key_len), &value_len, sizeof(value_len));
+  memcpy(record + LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE, key, key_len);
+  memcpy(record + LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE + key_len,
+         value, value_len);
+
+  sorter->records[sorter->records_count++]=record;
+  sorter->buffer_used += len;
+
+  return 0;
+}
+
+
+/* read the next record of a run into run->record; returns <0 at end,
+ * >0 on failure */
+static int
+librdf_storage_hashes_bulk_run_read(librdf_storage_hashes_bulk_run* run)
+{
+  unsigned char header[LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE];
+  size_t len;
+  size_t got;
+
+  got=fread(header, 1, sizeof(header), run->fh);
+  if(!got)
+    return -1;
+  if(got != sizeof(header))
+    return 1;
+
+  len=LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE +
+      librdf_storage_hashes_bulk_record_key_len(header) +
+      librdf_storage_hashes_bulk_record_value_len(header);
+  if(len > run->record_size) {
+    if(run->record)
+      LIBRDF_FREE(data, run->record);
+    run->record = LIBRDF_MALLOC(unsigned char*, len);
+    if(!run->record) {
+      run->record_size=0;
+      return 1;
+    }
+    run->record_size=len;
+  }
+
+  memcpy(run->record, header, sizeof(header));
+  len -= sizeof(header);
+  if(len && fread(run->record + sizeof(header), 1, len, run->fh) != len)
+    return 1;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_write:
+ * @hash: the hash
+ * @record: record to write
+ * @check_existing: non 0 if the hash may already hold the record
+ *
+ * INTERNAL - Write one sorted, de-duplicated record to its hash.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_bulk_write(librdf_hash* hash, unsigned char *record,
+                                 int check_existing)
+{
+  librdf_hash_datum key, value; /* on stack */
+
+  key.data=record + LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE;
+  key.size=librdf_storage_hashes_bulk_record_key_len(record);
+  value.data=(unsigned char*)key.data + key.size;
+  value.size=librdf_storage_hashes_bulk_record_value_len(record);
+
+  if(check_existing && librdf_hash_exists(hash, &key, &value) > 0)
+    return 0;
+
+  return librdf_hash_put(hash, &key, &value);
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_finish:
+ * @sorter: the sorter
+ * @hash: hash to write the records to
+ * @check_existing: non 0 if the hash may already hold some records
+ *
+ * INTERNAL - Merge all the runs of a sorter and write the records to
+ * the hash in sorted order, skipping duplicates.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_bulk_finish(librdf_storage_hashes_bulk_sorter* sorter,
+                                  librdf_hash* hash, int check_existing)
+{
+  librdf_storage_hashes_bulk_run* runs;
+  unsigned char *last=NULL;
+  int status=0;
+  int i;
+
+  if(!sorter->runs_count) {
+    size_t j;
+
+    /* everything fitted in memory */
+    qsort(sorter->records, sorter->records_count, sizeof(unsigned char*),
+          librdf_storage_hashes_bulk_record_qsort_compare);
+    for(j=0; j < sorter->records_count && !status; j++) {
+      if(last && !librdf_storage_hashes_bulk_record_compare(last, sorter->records[j]))
+        continue;
+      last=sorter->records[j];
+      status=librdf_storage_hashes_bulk_write(hash, last, check_existing);
+    }
+    return status;
+  }
+
+  if(librdf_storage_hashes_bulk_spill(sorter))
+    return 1;
+
+  runs = LIBRDF_CALLOC(librdf_storage_hashes_bulk_run*,
+                       LIBRDF_GOOD_CAST(size_t, sorter->runs_count),
+                       sizeof(*runs));
+  if(!runs)
+    return 1;
+
+  for(i=0; i < sorter->runs_count; i++) {
+    runs[i].fh=sorter->runs[i];
+    status=librdf_storage_hashes_bulk_run_read(&runs[i]);
+    if(status > 0)
+      goto tidy;
+    if(status < 0)
+      runs[i].fh=NULL;
+    status=0;
+  }
+
+  /* k-way merge; the last record written is kept in sorter->buffer */
+  while(1) {
+    int min= -1;
+    size_t len;
+
+    for(i=0; i < sorter->runs_count; i++) {
+      if(runs[i].fh &&
+         (min < 0 ||
+          librdf_storage_hashes_bulk_record_compare(runs[i].record,
+                                                    runs[min].record) < 0))
+        min=i;
+    }
+    if(min < 0)
+      break;
+
+    if(!last ||
+       librdf_storage_hashes_bulk_record_compare(last, runs[min].record)) {
+      status=librdf_storage_hashes_bulk_write(hash, runs[min].record,
+                                              check_existing);
+      if(status)
+        break;
+
+      len=LIBRDF_STORAGE_HASHES_BULK_HEADER_SIZE +
+          librdf_storage_hashes_bulk_record_key_len(runs[min].record) +
+          librdf_storage_hashes_bulk_record_value_len(runs[min].record);
+      if(len > sorter->buffer_size) {
+        if(sorter->buffer)
+          LIBRDF_FREE(data, sorter->buffer);
+        sorter->buffer = LIBRDF_MALLOC(unsigned char*, len);
+        if(!sorter->buffer) {
+          sorter->buffer_size=0;
+          status=1;
+          break;
+        }
+        sorter->buffer_size=len;
+      }
+      memcpy(sorter->buffer, runs[min].record, len);
+      last=sorter->buffer;
+    }
+
+    status=librdf_storage_hashes_bulk_run_read(&runs[min]);
+    if(status > 0)
+      break;
+    if(status < 0)
+      runs[min].fh=NULL;
+    status=0;
+  }
+
+  tidy:
+  for(i=0; i < sorter->runs_count; i++) {
+    if(runs[i].record)
+      LIBRDF_FREE(data, runs[i].record);
+  }
+  LIBRDF_FREE(librdf_storage_hashes_bulk_run, runs);
+
+  return status;
+}
+
+
+static void
+librdf_storage_hashes_bulk_free(librdf_storage_hashes_bulk_sorter* sorter)
+{
+  int i;
+
+  for(i=0; i < sorter->runs_count; i++)
+    fclose(sorter->runs[i]);
+  if(sorter->runs)
+    LIBRDF_FREE(FILE**, sorter->runs);
+  if(sorter->records)
+    LIBRDF_FREE(unsigned char**, sorter->records);
+  if(sorter->buffer)
+    LIBRDF_FREE(data, sorter->buffer);
+}
+
+
+/*
+ * librdf_storage_hashes_bulk_add_statements:
+ * @storage: the storage
+ * @statement_stream: stream of statements to add
+ *
+ * INTERNAL - Add a stream of statements by sorting the encoded records
+ * of each index hash and writing every hash in key order.
+ *
+ * Records are buffered in memory up to LIBRDF_STORAGE_HASHES_BULK_BUFFER_SIZE
+ * in total, with sorted runs spilled to temporary files beyond that and
+ * merged at the end.  Duplicates are dropped during the merge, so there
+ * is no contains check per statement; records already in the store are
+ * only looked for when the store may have had statements before.
+ *
+ * The hashes have no transactions, so a failure while writing them can
+ * leave some indexes with the new statements and others without.  The
+ * meta hash records that the writes are in progress and a store left
+ * like that fails to open until it is loaded again with new='yes'.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_bulk_add_statements(librdf_storage* storage,
+                                          librdf_stream* statement_stream)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_bulk_sorter* sorters;
+  size_t buffer_size;
+  int indexes=0;
+  int check_existing;
+  int written=0;
+  int status=0;
+  int i;
+
+  for(i=0; i<context->hash_count; i++) {
+    if(librdf_storage_hashes_is_statement_index(context, i))
+      indexes++;
+  }
+  if(!indexes)
+    return 1;
+  buffer_size=LIBRDF_STORAGE_HASHES_BULK_BUFFER_SIZE / LIBRDF_GOOD_CAST(size_t, indexes);
+
+  /* the merge does not tell which keys are new; recount later */
+  if(context->statistics)
+    context->statistics->stale=1;
+
+  sorters = LIBRDF_CALLOC(librdf_storage_hashes_bulk_sorter*,
+                          LIBRDF_GOOD_CAST(size_t, context->hash_count),
+                          sizeof(*sorters));
+  if(!sorters)
+    return 1;
+
+  check_existing=(context->may_have_statements &&
+                  librdf_storage_hashes_size(storage) != 0);
+
+  while(!status && !librdf_stream_end(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+    u64 ids[4];
+
+    if(!statement ||
+       (context->dictionary &&
+        librdf_storage_hashes_statement_ids(storage, statement, NULL,
+                                            LIBRDF_STATEMENT_ALL, 1, ids))) {
+      status=1;
+      break;
+    }
+
+    for(i=0; i<context->hash_count; i++) {
+      size_t key_len, value_len;
+
+      if(!librdf_storage_hashes_is_statement_index(context, i))
+        continue;
+
+      if(librdf_storage_hashes_encode_record(storage, statement, NULL, ids, i,
+                                             &key_len, &value_len) ||
+         librdf_storage_hashes_bulk_add(&sorters[i], buffer_size,
+                                        context->key_buffer, key_len,
+                                        context->value_buffer, value_len)) {
+        status=1;
+        break;
+      }
+    }
+
+    librdf_stream_next(statement_stream);
+  }
+
+  if(!status)
+    status=librdf_storage_hashes_meta_put(context,
+                                          LIBRDF_STORAGE_HASHES_META_BULK_LOAD,
+                                          (const unsigned char*)"yes", 3);
+  if(!status)
+    written=1;
+
+  for(i=0; i<context->hash_count; i++) {
+    if(!status && sorters[i].records_count + LIBRDF_GOOD_CAST(size_t, sorters[i].runs_count))
+      status=librdf_storage_hashes_bulk_finish(&sorters[i], context->hashes[i],
+                                               check_existing);
+    librdf_storage_hashes_bulk_free(&sorters[i]);
+  }
+  LIBRDF_FREE(librdf_storage_hashes_bulk_sorter, sorters);
+
+  if(written) {
+    if(!status)
+      status=librdf_storage_hashes_meta_put(context,
+                                            LIBRDF_STORAGE_HASHES_META_BULK_LOAD,
+                                            NULL, 0);
+    if(status)
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Bulk load failed with the indexes partly written");
+    context->may_have_statements=1;
+  }
+
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_remove_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  return librdf_storage_hashes_add_remove_statement(storage, statement, NULL, 0);
+}
+
+
+static int
+librdf_storage_hashes_contains_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_hash_datum hd_key, hd_value; /* on stack */
+  unsigned char *key_buffer, *value_buffer;
+  size_t key_buffer_len, value_buffer_len;
+  size_t key_len, value_len;
+  int hash_index=context->all_statements_hash_index;
+  int value_fields;
+  int status;
+  
+  if(context->index_contexts) {
+    if(context->statement_contexts_index < 0) {
+      /* Without the statement to contexts index, have to use
+       * find_statements for contains since a statement is encoded in
+       * KEY/VALUE and the VALUE may contain some context node.
+       */
+      librdf_stream *stream=librdf_storage_hashes_find_statements(storage, statement);
+    
+      if(!stream)
+        return 0;
+      /* librdf_stream_end returns 0 if have more, non-0 at end */
+      status=!librdf_stream_end(stream);
+      /* convert to 0 if at end (not found) and non-zero otherwise (found) */
+      librdf_free_stream(stream);
+      return status;
+    }
+
+    /* the statement is present if it has a key, whatever the contexts */
+    hash_index=context->statement_contexts_index;
+  }
+  value_fields=context->hash_descriptions[hash_index]->value_fields;
+
+  /* ENCODE KEY and VALUE; a term missing from the dictionary means
+   * the statement cannot be present */
+  key_buffer=NULL; key_buffer_len=0;
+  value_buffer=NULL; value_buffer_len=0;
+
+  status=librdf_storage_hashes_encode(storage, statement, NULL,
+                                      context->hash_descriptions[hash_index]->key_fields,
+                                      0, &key_buffer, &key_buffer_len,
+                                      &key_len);
+  value_len=0;
+  if(!status && value_fields)
+    status=librdf_storage_hashes_encode(storage, statement, NULL,
+                                        value_fields,
+                                        0, &value_buffer, &value_buffer_len,
+                                        &value_len);
+
+  if(!status) {
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 1
+    LIBRDF_DEBUG4("Using %s hash key %d bytes -> value %d bytes\n", context->hash_descriptions[hash_index]->name, key_len, value_len);
+#endif
+
+    hd_key.data=key_buffer; hd_key.size=key_len;
+    hd_value.data=value_buffer; hd_value.size=value_len;
+    status=librdf_hash_exists(context->hashes[hash_index], &hd_key,
+                              value_fields ? &hd_value : NULL);
+  } else if(status < 0)
+    status=0;
+  
+  if(key_buffer)
+    LIBRDF_FREE(data, key_buffer);
+  if(value_buffer)
+    LIBRDF_FREE(data, value_buffer);
+
+  /* DO NOT free statement, ownership was not passed in */
+  return status;
+}
+
+
+
+typedef struct {
+  librdf_storage *storage;
+  librdf_storage_hashes_instance* hash_context;
   int index;
   librdf_iterator* iterator;
   librdf_hash_datum *key;
@@ -859,6 +3226,9 @@ typedef struct {
   int index_contexts; /* true if this storage indexes contexts */
   librdf_node *context_node;
   int current_is_ok; /* true when current statement and context_node fresh */
+  librdf_statement *batch; /* statements decoded by the batch method */
+  librdf_node **batch_contexts;
+  int batch_size;
 } librdf_storage_hashes_serialise_stream_context;
 
 
@@ -924,6 +3294,9 @@ librdf_storage_hashes_serialise_common(librdf_storage* storage, int hash_index,
     librdf_storage_hashes_serialise_finished((void*)scontext);
     return NULL;
   }
+  if(!search_node)
+    librdf_stream_set_batch_method(stream,
+                                   &librdf_storage_hashes_serialise_batch);
   
   return stream;  
 
@@ -965,9 +3338,6 @@ librdf_storage_hashes_serialise_get_statement(void* context, int flags)
   librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
   librdf_hash_datum* hd;
   librdf_node** cnp=NULL;
-  librdf_world* world;
-  
-  world = scontext->storage->world;
   
   if(scontext->search_node) {
     switch(flags) {
@@ -1007,16 +3377,18 @@ librdf_storage_hashes_serialise_get_statement(void* context, int flags)
       hd=(librdf_hash_datum*)librdf_iterator_get_key(scontext->iterator);
       
       /* decode key content */
-      if(!librdf_statement_decode2(world, &scontext->current, NULL,
-                                   (unsigned char*)hd->data, hd->size)) {
+      if(!librdf_storage_hashes_decode(scontext->storage, &scontext->current,
+                                       NULL, LIBRDF_STATEMENT_ALL,
+                                       (unsigned char*)hd->data, hd->size)) {
         return NULL;
       }
       
       hd=(librdf_hash_datum*)librdf_iterator_get_value(scontext->iterator);
       
       /* decode value content and optional context */
-      if(!librdf_statement_decode2(world, &scontext->current, cnp,
-                                   (unsigned char*)hd->data, hd->size)) {
+      if(!librdf_storage_hashes_decode(scontext->storage, &scontext->current,
+                                       cnp, LIBRDF_STATEMENT_ALL,
+                                       (unsigned char*)hd->data, hd->size)) {
         return NULL;
       }
 
@@ -1036,6 +3408,111 @@ librdf_storage_hashes_serialise_get_statement(void* context, int flags)
 }
 
 
+/* Free the statements and contexts decoded by the batch method */
+static void
+librdf_storage_hashes_serialise_free_batch(librdf_storage_hashes_serialise_stream_context* scontext)
+{
+  int i;
+
+  for(i = 0; i < scontext->batch_size; i++) {
+    librdf_statement_clear(&scontext->batch[i]);
+    if(scontext->batch_contexts[i])
+      librdf_free_node(scontext->batch_contexts[i]);
+  }
+  if(scontext->batch)
+    LIBRDF_FREE(librdf_statement*, scontext->batch);
+  if(scontext->batch_contexts)
+    LIBRDF_FREE(librdf_node**, scontext->batch_contexts);
+  scontext->batch=NULL;
+  scontext->batch_contexts=NULL;
+  scontext->batch_size=0;
+}
+
+
+/*
+ * librdf_storage_hashes_serialise_batch:
+ * @context: serialise stream context
+ * @statements: array for up to @size statements
+ * @contexts: array for the context nodes or NULL
+ * @size: size of the arrays
+ *
+ * INTERNAL - Decode up to @size statements straight from the hash
+ * iterator into statements owned by the stream context, valid until
+ * the next call.
+ *
+ * Return value: number of statements, 0 at the end or <0 on failure
+ */
+static int
+librdf_storage_hashes_serialise_batch(void* context,
+                                      librdf_statement** statements,
+                                      librdf_node** contexts, int size)
+{
+  librdf_storage_hashes_serialise_stream_context* scontext=(librdf_storage_hashes_serialise_stream_context*)context;
+  int count;
+  int i;
+
+  if(size > scontext->batch_size) {
+    librdf_statement* new_batch;
+    librdf_node** new_contexts;
+
+    new_batch=LIBRDF_MALLOC(librdf_statement*, size * sizeof(librdf_statement));
+    new_contexts=LIBRDF_CALLOC(librdf_node**, size, sizeof(librdf_node*));
+    if(!new_batch || !new_contexts) {
+      if(new_batch)
+        LIBRDF_FREE(librdf_statement*, new_batch);
+      if(new_contexts)
+        LIBRDF_FREE(librdf_node**, new_contexts);
+      return -1;
+    }
+    for(i = 0; i < size; i++)
+      librdf_statement_init(scontext->storage->world, &new_batch[i]);
+
+    librdf_storage_hashes_serialise_free_batch(scontext);
+    scontext->batch=new_batch;
+    scontext->batch_contexts=new_contexts;
+    scontext->batch_size=size;
+  }
+
+  /* the single statement cache is moved past too */
+  scontext->current_is_ok=0;
+
+  for(count = 0; count < size && !librdf_iterator_end(scontext->iterator);
+      count++) {
+    librdf_statement* statement=&scontext->batch[count];
+    librdf_node** cnp=NULL;
+    librdf_hash_datum* hd;
+
+    librdf_statement_clear(statement);
+    if(scontext->batch_contexts[count]) {
+      librdf_free_node(scontext->batch_contexts[count]);
+      scontext->batch_contexts[count]=NULL;
+    }
+    if(scontext->index_contexts)
+      cnp=&scontext->batch_contexts[count];
+
+    hd=(librdf_hash_datum*)librdf_iterator_get_key(scontext->iterator);
+    if(!librdf_storage_hashes_decode(scontext->storage, statement,
+                                     NULL, LIBRDF_STATEMENT_ALL,
+                                     (unsigned char*)hd->data, hd->size))
+      return -1;
+
+    hd=(librdf_hash_datum*)librdf_iterator_get_value(scontext->iterator);
+    if(!librdf_storage_hashes_decode(scontext->storage, statement,
+                                     cnp, LIBRDF_STATEMENT_ALL,
+                                     (unsigned char*)hd->data, hd->size))
+      return -1;
+
+    statements[count]=statement;
+    if(contexts)
+      contexts[count]=scontext->batch_contexts[count];
+
+    librdf_iterator_next(scontext->iterator);
+  }
+
+  return count;
+}
+
+
 static void
 librdf_storage_hashes_serialise_finished(void* context)
 {
@@ -1044,6 +3521,8 @@ librdf_storage_hashes_serialise_finished(void* context)
   if(scontext->iterator)
     librdf_free_iterator(scontext->iterator);
 
+  librdf_storage_hashes_serialise_free_batch(scontext);
+
   if(scontext->context_node)
     librdf_free_node(scontext->context_node);
       
@@ -1065,6 +3544,140 @@ librdf_storage_hashes_serialise_finished(void* context)
 }
 
 
+typedef struct {
+  librdf_statement *statement; /* owned copy of the one matching statement */
+  int is_end;
+} librdf_storage_hashes_exact_stream_context;
+
+
+static int
+librdf_storage_hashes_exact_end_of_stream(void* context)
+{
+  librdf_storage_hashes_exact_stream_context* scontext=(librdf_storage_hashes_exact_stream_context*)context;
+
+  return scontext->is_end;
+}
+
+
+static int
+librdf_storage_hashes_exact_next_statement(void* context)
+{
+  librdf_storage_hashes_exact_stream_context* scontext=(librdf_storage_hashes_exact_stream_context*)context;
+
+  scontext->is_end=1;
+  return 1;
+}
+
+
+static void*
+librdf_storage_hashes_exact_get_statement(void* context, int flags)
+{
+  librdf_storage_hashes_exact_stream_context* scontext=(librdf_storage_hashes_exact_stream_context*)context;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return scontext->is_end ? NULL : scontext->statement;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+    default:
+      /* only used when the storage does not index contexts */
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_hashes_exact_finished(void* context)
+{
+  librdf_storage_hashes_exact_stream_context* scontext=(librdf_storage_hashes_exact_stream_context*)context;
+
+  if(scontext->statement)
+    librdf_free_statement(scontext->statement);
+
+  LIBRDF_FREE(librdf_storage_hashes_exact_stream_context, scontext);
+}
+
+
+/*
+ * librdf_storage_hashes_find_exact_statement - Find a fully bound statement
+ * @storage: the storage
+ * @statement: the complete statement to look for
+ *
+ * INTERNAL - Answer a (s, p, o) pattern with a single exists probe on
+ * the all statements hash and return a stream of zero or one statement.
+ * Only valid when contexts are not indexed, since otherwise the hash
+ * value also carries the context node.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ */
+static librdf_stream*
+librdf_storage_hashes_find_exact_statement(librdf_storage* storage,
+                                           librdf_statement* statement)
+{
+  librdf_storage_hashes_exact_stream_context* scontext;
+  librdf_stream* stream;
+
+  if(!librdf_storage_hashes_contains_statement(storage, statement))
+    return librdf_new_empty_stream(storage->world);
+
+  scontext = LIBRDF_CALLOC(librdf_storage_hashes_exact_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+
+  scontext->statement=librdf_new_statement_from_statement(statement);
+  if(!scontext->statement) {
+    librdf_storage_hashes_exact_finished((void*)scontext);
+    return NULL;
+  }
+
+  stream=librdf_new_stream(storage->world,
+                           (void*)scontext,
+                           &librdf_storage_hashes_exact_end_of_stream,
+                           &librdf_storage_hashes_exact_next_statement,
+                           &librdf_storage_hashes_exact_get_statement,
+                           &librdf_storage_hashes_exact_finished);
+  if(!stream) {
+    librdf_storage_hashes_exact_finished((void*)scontext);
+    return NULL;
+  }
+
+  return stream;
+}
+
+
+/*
+ * librdf_storage_hashes_find_two_bound - Find statements with two parts bound
+ * @storage: the storage
+ * @statement: the statement to match
+ * @node1: the first node to encode in the key
+ * @node2: the second node to encode in the key
+ * @hash_index: the index of the hash keyed on (node1, node2)
+ * @want: the single statement part missing from @statement
+ *
+ * INTERNAL - Turn a get sources, arcs or targets node iterator back
+ * into a stream of statements.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ */
+static librdf_stream*
+librdf_storage_hashes_find_two_bound(librdf_storage* storage,
+                                     librdf_statement* statement,
+                                     librdf_node* node1, librdf_node* node2,
+                                     int hash_index,
+                                     librdf_statement_part want)
+{
+  librdf_iterator* iterator;
+
+  iterator=librdf_storage_hashes_node_iterator_create(storage, node1, node2,
+                                                      hash_index, want);
+  if(!iterator)
+    return NULL;
+
+  return librdf_new_stream_from_node_iterator(iterator, statement, want);
+}
+
+
 /**
  * librdf_storage_hashes_find_statements:
  * @storage: the storage
@@ -1075,7 +3688,14 @@ librdf_storage_hashes_serialise_finished(void* context)
  * Return a stream of statements matching the given statement (or
  * all statements if NULL).  Parts (subject, predicate, object) of the
  * statement can be empty in which case any statement part will match that.
- * Uses #librdf_statement_match to do the matching.
+ *
+ * Each combination of bound parts is answered from the hash keyed on
+ * exactly those parts when it is present: sp2o, po2s and so2p always
+ * exist, p2so, s2po and o2sp when enabled with the index-predicates,
+ * index-subjects and index-objects options.  A fully bound pattern is
+ * a single exists probe (or, with contexts, a sp2o key lookup).  Only
+ * patterns without a matching hash fall back to serialising the whole
+ * storage and using #librdf_statement_match to do the matching.
  * 
  * Return value: a #librdf_stream or NULL on failure
  **/
@@ -1083,28 +3703,126 @@ static librdf_stream*
 librdf_storage_hashes_find_statements(librdf_storage* storage, librdf_statement* statement)
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
-  librdf_stream* stream;
+  librdf_stream* stream=NULL;
+  librdf_node *subject, *predicate, *object;
+  librdf_statement* partial;
+  int fields=0;
+
+  subject=librdf_statement_get_subject(statement);
+  predicate=librdf_statement_get_predicate(statement);
+  object=librdf_statement_get_object(statement);
+
+  if(subject)
+    fields |= LIBRDF_STATEMENT_SUBJECT;
+  if(predicate)
+    fields |= LIBRDF_STATEMENT_PREDICATE;
+  if(object)
+    fields |= LIBRDF_STATEMENT_OBJECT;
+
+  switch(fields) {
+    case LIBRDF_STATEMENT_ALL:
+      if(!context->index_contexts)
+        return librdf_storage_hashes_find_exact_statement(storage, statement);
+
+      /* (s p o) with contexts: look up (s p ?) and filter on o */
+      if(context->targets_index < 0)
+        break;
+
+      partial=librdf_new_statement_from_statement(statement);
+      if(!partial)
+        return NULL;
+      librdf_free_node(librdf_statement_get_object(partial));
+      librdf_statement_set_object(partial, NULL);
+      stream=librdf_storage_hashes_find_two_bound(storage, partial,
+                                                  subject, predicate,
+                                                  context->targets_index,
+                                                  LIBRDF_STATEMENT_OBJECT);
+      librdf_free_statement(partial);
+      if(!stream)
+        return NULL;
 
-  if(!librdf_statement_get_subject(statement) &&
-     librdf_statement_get_predicate(statement) &&
-     !librdf_statement_get_object(statement) &&
-     context->p2so_index >= 0) {
-    /* (? p ?) -> (s p o) wanted */
-    stream=librdf_storage_hashes_serialise_common(storage,
-                                                  context->p2so_index,
-                                                  librdf_statement_get_predicate(statement),
-                                                  LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT);
-  } else {
-    statement=librdf_new_statement_from_statement(statement);
-    if(!statement)
-      return NULL;
+      partial=librdf_new_statement_from_statement(statement);
+      if(!partial) {
+        librdf_free_stream(stream);
+        return NULL;
+      }
+      librdf_stream_add_map(stream, 
+                            &librdf_stream_statement_find_map,
+                            (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)partial);
+      return stream;
+
+    case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE):
+      /* (s p ?) */
+      if(context->targets_index >= 0)
+        return librdf_storage_hashes_find_two_bound(storage, statement,
+                                                    subject, predicate,
+                                                    context->targets_index,
+                                                    LIBRDF_STATEMENT_OBJECT);
+      break;
+
+    case (LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT):
+      /* (? p o) */
+      if(context->sources_index >= 0)
+        return librdf_storage_hashes_find_two_bound(storage, statement,
+                                                    predicate, object,
+                                                    context->sources_index,
+                                                    LIBRDF_STATEMENT_SUBJECT);
+      break;
+
+    case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT):
+      /* (s ? o) */
+      if(context->arcs_index >= 0)
+        return librdf_storage_hashes_find_two_bound(storage, statement,
+                                                    subject, object,
+                                                    context->arcs_index,
+                                                    LIBRDF_STATEMENT_PREDICATE);
+      break;
+
+    case LIBRDF_STATEMENT_SUBJECT:
+      /* (s ? ?) -> (s p o) wanted */
+      if(context->s2po_index >= 0)
+        return librdf_storage_hashes_serialise_common(storage,
+                                                      context->s2po_index,
+                                                      subject,
+                                                      LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT);
+      break;
+
+    case LIBRDF_STATEMENT_PREDICATE:
+      /* (? p ?) -> (s p o) wanted */
+      if(context->p2so_index >= 0)
+        return librdf_storage_hashes_serialise_common(storage,
+                                                      context->p2so_index,
+                                                      predicate,
+                                                      LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT);
+      break;
+
+    case LIBRDF_STATEMENT_OBJECT:
+      /* (? ? o) -> (s p o) wanted */
+      if(context->o2sp_index >= 0)
+        return librdf_storage_hashes_serialise_common(storage,
+                                                      context->o2sp_index,
+                                                      object,
+                                                      LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE);
+      break;
+
+    case 0:
+      /* (? ? ?) - everything */
+      return librdf_storage_hashes_serialise(storage);
 
-    stream=librdf_storage_hashes_serialise(storage);
-    if(stream)
-      librdf_stream_add_map(stream, 
-                            &librdf_stream_statement_find_map,
-                            (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)statement);
+    default:
+      break;
   }
+
+  /* No index for this pattern - scan everything */
+  statement=librdf_new_statement_from_statement(statement);
+  if(!statement)
+    return NULL;
+
+  stream=librdf_storage_hashes_serialise(storage);
+  if(stream)
+    librdf_stream_add_map(stream, 
+                          &librdf_stream_statement_find_map,
+                          (librdf_stream_map_free_context_handler)&librdf_free_statement, (void*)statement);
   
   return stream;
 }
@@ -1160,6 +3878,9 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
     return NULL;
 
   if(flags == LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT) {
+    librdf_statement value_statement; /* on stack */
+    size_t decoded;
+
     /* current stuff is out of date - get new cached answers */
     if(!context->index_contexts)
       return NULL;
@@ -1170,12 +3891,18 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
       librdf_free_node(context->context_node);
     context->context_node=NULL;
       
-    /* decode value content and optional context */
-    if(!librdf_statement_decode2(world, &context->statement,
-                                 &context->context_node,
-                                 (unsigned char*)value->data, value->size))
+    /* decode value content and optional context into a scratch
+     * statement so that the nodes in context->statement (shared with
+     * statement2 for the two-field wants) are left alone
+     */
+    librdf_statement_init(world, &value_statement);
+    decoded=librdf_storage_hashes_decode(context->storage, &value_statement,
+                                         &context->context_node, 0,
+                                         (unsigned char*)value->data,
+                                         value->size);
+    librdf_statement_clear(&value_statement);
+    if(!decoded)
       return NULL;
-    librdf_statement_clear(&context->statement);
     
     return context->context_node;
   }
@@ -1213,6 +3940,20 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
          librdf_free_node(node);
       break;
       
+    case (LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT): /* s2po */
+      if((node=librdf_statement_get_predicate(&context->statement)))
+         librdf_free_node(node);
+      if((node=librdf_statement_get_object(&context->statement)))
+         librdf_free_node(node);
+      break;
+      
+    case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE): /* o2sp */
+      if((node=librdf_statement_get_subject(&context->statement)))
+         librdf_free_node(node);
+      if((node=librdf_statement_get_predicate(&context->statement)))
+         librdf_free_node(node);
+      break;
+      
     default: /* error */
       librdf_log(context->iterator->world,
                  0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
@@ -1225,9 +3966,10 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
   if(!value)
     return NULL;
 
-  if(!librdf_statement_decode2(world, &context->statement, NULL,
-                               (unsigned char*)value->data,
-                               value->size))
+  if(!librdf_storage_hashes_decode(context->storage, &context->statement,
+                                   NULL, context->want,
+                                   (unsigned char*)value->data,
+                                   value->size))
     return NULL;
 
   switch(context->want) {
@@ -1244,13 +3986,24 @@ librdf_storage_hashes_node_iterator_get_method(void* iterator, int flags)
       break;
       
     case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_OBJECT): /* p2so */
-      librdf_statement_set_subject(&context->statement2, librdf_statement_get_subject(&context->statement));
-      /* fill in the only blank from the node stored in our context */
-      node=librdf_new_node_from_node(context->search_node);
-      if(!node)
-        return NULL;
-      librdf_statement_set_predicate(&context->statement2, node);
-      librdf_statement_set_object(&context->statement2, librdf_statement_get_object(&context->statement));
+    case (LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT): /* s2po */
+    case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE): /* o2sp */
+      /* statement2 only ever holds shared nodes: the two decoded
+       * parts from statement and the only blank filled in from the
+       * node stored in our context
+       */
+      librdf_statement_set_subject(&context->statement2,
+                                   (context->want & LIBRDF_STATEMENT_SUBJECT) ?
+                                   librdf_statement_get_subject(&context->statement) :
+                                   context->search_node);
+      librdf_statement_set_predicate(&context->statement2,
+                                     (context->want & LIBRDF_STATEMENT_PREDICATE) ?
+                                     librdf_statement_get_predicate(&context->statement) :
+                                     context->search_node);
+      librdf_statement_set_object(&context->statement2,
+                                  (context->want & LIBRDF_STATEMENT_OBJECT) ?
+                                  librdf_statement_get_object(&context->statement) :
+                                  context->search_node);
       return (void*)&context->statement2;
       break;
       
@@ -1269,7 +4022,6 @@ static void
 librdf_storage_hashes_node_iterator_finished(void* iterator) 
 {
   librdf_storage_hashes_node_iterator_context* icontext=(librdf_storage_hashes_node_iterator_context*)iterator;
-  librdf_node* node;
   
   if(icontext->search_node)
     librdf_free_node(icontext->search_node);
@@ -1281,8 +4033,7 @@ librdf_storage_hashes_node_iterator_finished(void* iterator)
     librdf_free_iterator(icontext->iterator);
 
   librdf_statement_clear(&icontext->statement);
-  if((node=librdf_statement_get_predicate(&icontext->statement2)))
-     librdf_free_node(node);
+  /* statement2 nodes are all shared, do not free them */
 
   if(icontext->storage)
     librdf_storage_remove_reference(icontext->storage);
@@ -1311,10 +4062,10 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
   librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
   librdf_storage_hashes_node_iterator_context* icontext;
   librdf_hash *hash;
-  librdf_statement_part fields;
   unsigned char *key_buffer;
+  size_t key_buffer_len;
+  int status;
   librdf_iterator* iterator;
-  librdf_world* world = storage->world;
   
   icontext = LIBRDF_CALLOC(librdf_storage_hashes_node_iterator_context*, 1,
                            sizeof(*icontext));
@@ -1336,7 +4087,7 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
   if(node2) {
     node2=librdf_new_node_from_node(node2);
     if(!node2) {
-      librdf_free_node(node2);
+      librdf_free_node(node1);
       LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
       return NULL;
     }
@@ -1369,6 +4120,16 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
       librdf_statement_set_predicate(&icontext->statement, node1);
       break;
       
+    case (LIBRDF_STATEMENT_PREDICATE|LIBRDF_STATEMENT_OBJECT): /* s2po */
+      icontext->search_node=librdf_new_node_from_node(node1);
+      librdf_statement_set_subject(&icontext->statement, node1);
+      break;
+      
+    case (LIBRDF_STATEMENT_SUBJECT|LIBRDF_STATEMENT_PREDICATE): /* o2sp */
+      icontext->search_node=librdf_new_node_from_node(node1);
+      librdf_statement_set_object(&icontext->statement, node1);
+      break;
+      
     default: /* error */
       LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
       librdf_log(storage->world,
@@ -1378,33 +4139,25 @@ librdf_storage_hashes_node_iterator_create(librdf_storage* storage,
   }
 
 
-  /* ENCODE KEY */
-  fields=(librdf_statement_part)scontext->hash_descriptions[hash_index]->key_fields;
-  icontext->key.size=librdf_statement_encode_parts2(world, &icontext->statement, NULL,
-                                                    NULL, 0, fields);
-  if(!icontext->key.size) {
-    LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
-    return NULL;
-  }
-  key_buffer = LIBRDF_MALLOC(unsigned char*, icontext->key.size);
-  if(!key_buffer) {
-    LIBRDF_FREE(librdf_storage_hashes_node_iterator_context, icontext);
-    return NULL;
-  }
-       
   /* after this point the finished method is called on errors
    * so must bump the reference count
    */
   librdf_storage_add_reference(icontext->storage);
 
-  if(!librdf_statement_encode_parts2(world, &icontext->statement, NULL,
-                                     key_buffer, icontext->key.size, fields)) {
-    LIBRDF_FREE(data, key_buffer);
+  /* ENCODE KEY */
+  key_buffer=NULL; key_buffer_len=0;
+  status=librdf_storage_hashes_encode(storage, &icontext->statement, NULL,
+                                      scontext->hash_descriptions[hash_index]->key_fields,
+                                      0, &key_buffer, &key_buffer_len,
+                                      &icontext->key.size);
+  if(status) {
+    if(key_buffer)
+      LIBRDF_FREE(data, key_buffer);
     librdf_storage_hashes_node_iterator_finished(icontext);
-    return NULL;
+    /* a term missing from the dictionary matches nothing */
+    return (status < 0) ? librdf_new_empty_iterator(storage->world) : NULL;
   }
 
-    
   icontext->key.data=key_buffer;
 
   icontext->iterator=librdf_hash_get_all(hash, &icontext->key, &icontext->value);
@@ -1459,6 +4212,390 @@ librdf_storage_hashes_find_targets(librdf_storage* storage,
                                                     LIBRDF_STATEMENT_OBJECT);
 }
 
+
+/*
+ * librdf_storage_hashes_has_arc:
+ * @storage: the storage
+ * @node1: first node of the key
+ * @node2: second node of the key
+ * @hash_index: the index of the hash with (@node1, @node2) keys
+ * @want: the field the hash values hold
+ *
+ * INTERNAL - Check for a key in a sp2o or po2s hash, which exists
+ * when there is at least one statement with those two parts.
+ *
+ * Return value: non 0 if present
+ */
+static int
+librdf_storage_hashes_has_arc(librdf_storage* storage,
+                              librdf_node* node1, librdf_node* node2,
+                              int hash_index, int want)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_statement statement; /* on stack */
+  librdf_hash_datum hd_key; /* on stack */
+  unsigned char *key_buffer=NULL;
+  size_t key_buffer_len=0;
+  size_t key_len;
+  int status;
+
+  librdf_statement_init(storage->world, &statement);
+  /* nodes are shared, the statement is not cleared */
+  if(want == LIBRDF_STATEMENT_OBJECT) {
+    librdf_statement_set_subject(&statement, node1);
+    librdf_statement_set_predicate(&statement, node2);
+  } else {
+    librdf_statement_set_predicate(&statement, node1);
+    librdf_statement_set_object(&statement, node2);
+  }
+
+  status=librdf_storage_hashes_encode(storage, &statement, NULL,
+                                      scontext->hash_descriptions[hash_index]->key_fields,
+                                      0, &key_buffer, &key_buffer_len,
+                                      &key_len);
+  if(!status) {
+    hd_key.data=key_buffer; hd_key.size=key_len;
+    status=librdf_hash_exists(scontext->hashes[hash_index], &hd_key, NULL);
+  } else if(status < 0)
+    /* a term missing from the dictionary matches nothing */
+    status=0;
+
+  if(key_buffer)
+    LIBRDF_FREE(data, key_buffer);
+
+  return status;
+}
+
+
+static int
+librdf_storage_hashes_has_arc_in(librdf_storage* storage,
+                                 librdf_node* node, librdf_node* property)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  return librdf_storage_hashes_has_arc(storage, property, node,
+                                       scontext->sources_index,
+                                       LIBRDF_STATEMENT_SUBJECT);
+}
+
+
+static int
+librdf_storage_hashes_has_arc_out(librdf_storage* storage,
+                                  librdf_node* node, librdf_node* property)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  return librdf_storage_hashes_has_arc(storage, node, property,
+                                       scontext->targets_index,
+                                       LIBRDF_STATEMENT_OBJECT);
+}
+
+
+/*
+ * librdf_storage_hashes_find_part:
+ * @storage: the storage
+ * @buffer: encoded hash key or value
+ * @length: length of @buffer
+ * @type: part type byte wanted ('s', 'p', 'o' or 'c')
+ * @part_length_p: pointer to store the length of the part
+ *
+ * INTERNAL - Find the encoded term of one statement part in a hash key
+ * or value without decoding it.
+ *
+ * Return value: pointer into @buffer or NULL if the part is absent
+ */
+static unsigned char*
+librdf_storage_hashes_find_part(librdf_storage* storage,
+                                unsigned char *buffer, size_t length,
+                                unsigned char type, size_t *part_length_p)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  size_t offset=1; /* skip 'x' or 'X' */
+
+  while(offset < length) {
+    unsigned char part_type=buffer[offset++];
+    size_t part_length;
+
+    if(scontext->dictionary)
+      part_length=LIBRDF_STORAGE_HASHES_TERM_ID_SIZE;
+    else
+      part_length=librdf_node_encoded_length(buffer + offset, length - offset);
+    if(!part_length || offset + part_length > length)
+      return NULL;
+
+    if(part_type == type) {
+      *part_length_p=part_length;
+      return buffer + offset;
+    }
+    offset += part_length;
+  }
+
+  return NULL;
+}
+
+
+typedef struct {
+  librdf_storage *storage;
+  librdf_iterator *iterator;
+  librdf_hash_datum key;
+  librdf_hash_datum value;
+  int values; /* non 0 if iterating the values of one s2po or o2sp key */
+  unsigned char type; /* key part to match when scanning all keys */
+  unsigned char *match_buffer;
+  size_t match_length;
+  librdf_hash *seen; /* predicates returned so far */
+  librdf_node *current;
+} librdf_storage_hashes_arcs_iterator_context;
+
+
+/*
+ * librdf_storage_hashes_arcs_advance:
+ * @icontext: arcs iterator context
+ *
+ * INTERNAL - Move to the next predicate not yet returned.  Only the
+ * predicate part is decoded and only once per distinct predicate.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_hashes_arcs_advance(librdf_storage_hashes_arcs_iterator_context* icontext)
+{
+  librdf_storage* storage=icontext->storage;
+
+  if(icontext->current) {
+    librdf_free_node(icontext->current);
+    icontext->current=NULL;
+  }
+
+  while(!librdf_iterator_end(icontext->iterator)) {
+    librdf_hash_datum *hd;
+    librdf_hash_datum hd_part; /* on stack */
+    unsigned char *part;
+    size_t part_length;
+
+    if(icontext->values)
+      hd=(librdf_hash_datum*)librdf_iterator_get_value(icontext->iterator);
+    else
+      hd=(librdf_hash_datum*)librdf_iterator_get_key(icontext->iterator);
+
+    part=NULL;
+    if(hd && !icontext->values) {
+      /* scanning sp2o or po2s keys: compare the node bytes */
+      part=librdf_storage_hashes_find_part(storage,
+                                           (unsigned char*)hd->data, hd->size,
+                                           icontext->type, &part_length);
+      if(part && (part_length != icontext->match_length - 2 ||
+                  memcmp(part, icontext->match_buffer + 2, part_length)))
+        part=NULL;
+      if(!part)
+        hd=NULL;
+    }
+    if(hd)
+      part=librdf_storage_hashes_find_part(storage,
+                                           (unsigned char*)hd->data, hd->size,
+                                           'p', &part_length);
+
+    if(part) {
+      hd_part.data=part; hd_part.size=part_length;
+      if(librdf_hash_exists(icontext->seen, &hd_part, NULL))
+        part=NULL;
+      else if(librdf_hash_put(icontext->seen, &hd_part, &hd_part))
+        return 1;
+    }
+
+    if(part) {
+      icontext->current=librdf_storage_hashes_term_node(storage, part,
+                                                        part_length);
+      librdf_iterator_next(icontext->iterator);
+      return (icontext->current == NULL);
+    }
+
+    librdf_iterator_next(icontext->iterator);
+  }
+
+  return 0;
+}
+
+
+static int
+librdf_storage_hashes_arcs_is_end(void* iterator)
+{
+  librdf_storage_hashes_arcs_iterator_context* icontext=(librdf_storage_hashes_arcs_iterator_context*)iterator;
+
+  return (icontext->current == NULL);
+}
+
+
+static int
+librdf_storage_hashes_arcs_next_method(void* iterator)
+{
+  librdf_storage_hashes_arcs_iterator_context* icontext=(librdf_storage_hashes_arcs_iterator_context*)iterator;
+
+  if(!icontext->current)
+    return 1;
+
+  librdf_storage_hashes_arcs_advance(icontext);
+  return (icontext->current == NULL);
+}
+
+
+static void*
+librdf_storage_hashes_arcs_get_method(void* iterator, int flags)
+{
+  librdf_storage_hashes_arcs_iterator_context* icontext=(librdf_storage_hashes_arcs_iterator_context*)iterator;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return icontext->current;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_KEY:
+    case LIBRDF_ITERATOR_GET_METHOD_GET_VALUE:
+      return NULL;
+
+    default:
+      librdf_log(icontext->storage->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_hashes_arcs_finished(void* iterator)
+{
+  librdf_storage_hashes_arcs_iterator_context* icontext=(librdf_storage_hashes_arcs_iterator_context*)iterator;
+
+  if(icontext->iterator)
+    librdf_free_iterator(icontext->iterator);
+
+  if(icontext->match_buffer)
+    LIBRDF_FREE(data, icontext->match_buffer);
+
+  if(icontext->seen)
+    librdf_free_hash(icontext->seen);
+
+  if(icontext->current)
+    librdf_free_node(icontext->current);
+
+  if(icontext->storage)
+    librdf_storage_remove_reference(icontext->storage);
+
+  LIBRDF_FREE(librdf_storage_hashes_arcs_iterator_context, icontext);
+}
+
+
+/*
+ * librdf_storage_hashes_get_arcs:
+ * @storage: the storage
+ * @node: the subject or object node
+ * @part: LIBRDF_STATEMENT_SUBJECT for arcs out, LIBRDF_STATEMENT_OBJECT
+ * for arcs in
+ *
+ * INTERNAL - Get the distinct predicates of statements with a subject
+ * or object.  The values of the node's key in the s2po or o2sp hash are
+ * used when that index exists, otherwise the keys of the sp2o or po2s
+ * hash are scanned, comparing the encoded node without decoding.
+ *
+ * Return value: a new #librdf_iterator or NULL on failure
+ */
+static librdf_iterator*
+librdf_storage_hashes_get_arcs(librdf_storage* storage, librdf_node* node,
+                               int part)
+{
+  librdf_storage_hashes_instance* scontext=(librdf_storage_hashes_instance*)storage->instance;
+  librdf_storage_hashes_arcs_iterator_context* icontext;
+  librdf_statement statement; /* on stack */
+  librdf_hash *hash;
+  size_t buffer_len=0;
+  int hash_index;
+  int status;
+  librdf_iterator* iterator;
+
+  icontext = LIBRDF_CALLOC(librdf_storage_hashes_arcs_iterator_context*, 1,
+                           sizeof(*icontext));
+  if(!icontext)
+    return NULL;
+
+  icontext->storage=storage;
+  librdf_storage_add_reference(icontext->storage);
+
+  librdf_statement_init(storage->world, &statement);
+  /* node is shared, the statement is not cleared */
+  if(part == LIBRDF_STATEMENT_SUBJECT) {
+    librdf_statement_set_subject(&statement, node);
+    icontext->type='s';
+    hash_index=scontext->s2po_index;
+    if(hash_index < 0)
+      hash_index=scontext->targets_index;
+  } else {
+    librdf_statement_set_object(&statement, node);
+    icontext->type='o';
+    hash_index=scontext->o2sp_index;
+    if(hash_index < 0)
+      hash_index=scontext->sources_index;
+  }
+  icontext->values=(hash_index == scontext->s2po_index ||
+                    hash_index == scontext->o2sp_index);
+  hash=scontext->hashes[hash_index];
+
+  /* ENCODE the node as a one part key */
+  status=librdf_storage_hashes_encode(storage, &statement, NULL, part, 0,
+                                      &icontext->match_buffer, &buffer_len,
+                                      &icontext->match_length);
+  if(status) {
+    librdf_storage_hashes_arcs_finished(icontext);
+    /* a term missing from the dictionary matches nothing */
+    return (status < 0) ? librdf_new_empty_iterator(storage->world) : NULL;
+  }
+
+  icontext->seen=librdf_new_hash(storage->world, NULL);
+  if(!icontext->seen ||
+     librdf_hash_open(icontext->seen, NULL, 0, 1, 1, NULL)) {
+    librdf_storage_hashes_arcs_finished(icontext);
+    return NULL;
+  }
+
+  if(icontext->values) {
+    icontext->key.data=icontext->match_buffer;
+    icontext->key.size=icontext->match_length;
+    icontext->iterator=librdf_hash_get_all(hash, &icontext->key,
+                                           &icontext->value);
+  } else
+    icontext->iterator=librdf_hash_keys(hash, &icontext->key);
+
+  if(!icontext->iterator ||
+     librdf_storage_hashes_arcs_advance(icontext)) {
+    librdf_storage_hashes_arcs_finished(icontext);
+    return NULL;
+  }
+
+  iterator=librdf_new_iterator(storage->world,
+                               (void*)icontext,
+                               librdf_storage_hashes_arcs_is_end,
+                               librdf_storage_hashes_arcs_next_method,
+                               librdf_storage_hashes_arcs_get_method,
+                               librdf_storage_hashes_arcs_finished);
+  if(!iterator)
+    librdf_storage_hashes_arcs_finished(icontext);
+  return iterator;
+}
+
+
+static librdf_iterator*
+librdf_storage_hashes_get_arcs_in(librdf_storage* storage, librdf_node* node)
+{
+  return librdf_storage_hashes_get_arcs(storage, node,
+                                        LIBRDF_STATEMENT_OBJECT);
+}
+
+
+static librdf_iterator*
+librdf_storage_hashes_get_arcs_out(librdf_storage* storage, librdf_node* node)
+{
+  return librdf_storage_hashes_get_arcs(storage, node,
+                                        LIBRDF_STATEMENT_SUBJECT);
+}
+
+
 /**
  * librdf_storage_hashes_context_add_statement:
  * @storage: #librdf_storage object
@@ -1476,35 +4613,50 @@ librdf_storage_hashes_context_add_statement(librdf_storage* storage,
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_hash_datum key, value; /* on stack - not allocated */
-  size_t size;
+  unsigned char *key_buffer, *value_buffer;
+  size_t key_buffer_len, value_buffer_len;
   int status;
-  librdf_world* world = storage->world;
   
   if(context->contexts_index <0) {
     librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
                "Storage was created without context support");
     return 1;
   }
+
+  /* Do not add duplicate statements to a context */
+  status=librdf_storage_hashes_context_contains_statement(storage,
+                                                          context_node,
+                                                          statement);
+  if(status)
+    return (status < 0);
   
   if(librdf_storage_hashes_add_remove_statement(storage, 
                                                 statement, context_node, 1))
     return 1;
 
-  size = librdf_node_encode(context_node, NULL, 0);
-  key.data = LIBRDF_MALLOC(char*, size);
-  key.size=librdf_node_encode(context_node, 
-                               (unsigned char*)key.data, size);
-
-  size = librdf_statement_encode2(world, statement, NULL, 0);
-
-  value.data = LIBRDF_MALLOC(char*, size);
-  value.size=librdf_statement_encode2(world, statement, (unsigned char*)value.data, size);
+  key_buffer=NULL; key_buffer_len=0;
+  value_buffer=NULL; value_buffer_len=0;
+
+  status=librdf_storage_hashes_encode_context(storage, context_node, 1,
+                                              &key_buffer, &key_buffer_len,
+                                              &key.size);
+  if(!status)
+    status=librdf_storage_hashes_encode(storage, statement, NULL,
+                                        LIBRDF_STATEMENT_ALL, 1,
+                                        &value_buffer, &value_buffer_len,
+                                        &value.size);
+  if(!status) {
+    key.data=key_buffer;
+    value.data=value_buffer;
+    status=librdf_hash_put(context->hashes[context->contexts_index], &key, &value);
+  }
 
-  status=librdf_hash_put(context->hashes[context->contexts_index], &key, &value);
-  LIBRDF_FREE(data, key.data);
-  LIBRDF_FREE(data, value.data);
+  if(key_buffer)
+    LIBRDF_FREE(data, key_buffer);
+  if(value_buffer)
+    LIBRDF_FREE(data, value_buffer);
 
-  return status;
+  return (status != 0);
 }
 
 
@@ -1525,34 +4677,48 @@ librdf_storage_hashes_context_remove_statement(librdf_storage* storage,
 {
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   librdf_hash_datum key, value; /* on stack - not allocated */
-  size_t size;
+  unsigned char *key_buffer, *value_buffer;
+  size_t key_buffer_len, value_buffer_len;
   int status;
-  librdf_world* world = storage->world;
   
   if(context_node && context->contexts_index <0) {
     librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
                "Storage was created without context support");
   }
   
+  /* nothing to remove from each index if it is not in the context */
+  if(context_node && context->statement_contexts_index >= 0 &&
+     librdf_storage_hashes_context_contains_statement(storage, context_node,
+                                                      statement) <= 0)
+    return 1;
+
   if(librdf_storage_hashes_add_remove_statement(storage, 
                                                 statement, context_node, 0))
     return 1;
   
-  size = librdf_node_encode(context_node, NULL, 0);
-  key.data = LIBRDF_MALLOC(char*, size);
-  key.size=librdf_node_encode(context_node,
-                               (unsigned char*)key.data, size);
-
-  size = librdf_statement_encode2(world, statement, NULL, 0);
-
-  value.data = LIBRDF_MALLOC(char*, size);
-  value.size=librdf_statement_encode2(world, statement, (unsigned char*)value.data, size);
+  key_buffer=NULL; key_buffer_len=0;
+  value_buffer=NULL; value_buffer_len=0;
+
+  status=librdf_storage_hashes_encode_context(storage, context_node, 0,
+                                              &key_buffer, &key_buffer_len,
+                                              &key.size);
+  if(!status)
+    status=librdf_storage_hashes_encode(storage, statement, NULL,
+                                        LIBRDF_STATEMENT_ALL, 0,
+                                        &value_buffer, &value_buffer_len,
+                                        &value.size);
+  if(!status) {
+    key.data=key_buffer;
+    value.data=value_buffer;
+    status=librdf_hash_delete(context->hashes[context->contexts_index], &key, &value);
+  }
 
-  status=librdf_hash_delete(context->hashes[context->contexts_index], &key, &value);
-  LIBRDF_FREE(data, key.data);
-  LIBRDF_FREE(data, value.data);
+  if(key_buffer)
+    LIBRDF_FREE(data, key_buffer);
+  if(value_buffer)
+    LIBRDF_FREE(data, value_buffer);
   
-  return status;
+  return (status != 0);
 }
 
 
@@ -1564,7 +4730,7 @@ typedef struct {
   librdf_statement current; /* static, shared statement */
   int index_contexts; /* true if this storage indexes contexts */
   librdf_node *context_node;
-  char *context_node_data;
+  unsigned char *context_node_data;
   int current_is_ok; /* true when current statement and context_node fresh */
 } librdf_storage_hashes_context_serialise_stream_context;
 
@@ -1586,6 +4752,7 @@ librdf_storage_hashes_context_serialise(librdf_storage* storage,
   librdf_storage_hashes_context_serialise_stream_context* scontext;
   librdf_stream* stream;
   size_t size;
+  int status;
 
   if(context->contexts_index <0) {
     librdf_log(storage->world, 0, LIBRDF_LOG_WARN, LIBRDF_FROM_STORAGE, NULL,
@@ -1614,11 +4781,16 @@ librdf_storage_hashes_context_serialise(librdf_storage* storage,
   scontext->index_contexts=context->index_contexts;
   scontext->context_node=librdf_new_node_from_node(context_node);
 
-  size=librdf_node_encode(context_node, NULL, 0);
-  scontext->key->data = scontext->context_node_data=LIBRDF_MALLOC(char*, size);
-  scontext->key->size=librdf_node_encode(context_node,
-                                         (unsigned char*)scontext->key->data,
-                                         size);
+  size=0;
+  status=librdf_storage_hashes_encode_context(storage, context_node, 0,
+                                              &scontext->context_node_data,
+                                              &size, &scontext->key->size);
+  if(status) {
+    librdf_storage_hashes_context_serialise_finished((void*)scontext);
+    /* a context missing from the dictionary has no statements */
+    return (status < 0) ? librdf_new_empty_stream(storage->world) : NULL;
+  }
+  scontext->key->data=scontext->context_node_data;
 
   scontext->iterator=librdf_hash_get_all(context->hashes[context->contexts_index], 
                                          scontext->key, scontext->value);
@@ -1668,10 +4840,8 @@ librdf_storage_hashes_context_serialise_get_statement(void* context, int flags)
 {
   librdf_storage_hashes_context_serialise_stream_context* scontext;
   librdf_hash_datum* v;
-  librdf_world* world;
 
   scontext = (librdf_storage_hashes_context_serialise_stream_context*)context;
-  world = scontext->storage->world;
 
   switch(flags) {
     case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
@@ -1689,8 +4859,9 @@ librdf_storage_hashes_context_serialise_get_statement(void* context, int flags)
       v = (librdf_hash_datum*)librdf_iterator_get_value(scontext->iterator);
       
       /* decode value content and optional context */
-      if(!librdf_statement_decode2(world, &scontext->current, NULL,
-                                   (unsigned char*)v->data, v->size)) {
+      if(!librdf_storage_hashes_decode(scontext->storage, &scontext->current,
+                                       NULL, LIBRDF_STATEMENT_ALL,
+                                       (unsigned char*)v->data, v->size)) {
         return NULL;
       }
       
@@ -1723,6 +4894,8 @@ librdf_storage_hashes_context_serialise_finished(void* context)
     librdf_free_iterator(scontext->iterator);
 
   if(scontext->key) {
+    /* key data is context_node_data, freed below */
+    scontext->key->data=NULL;
     librdf_free_hash_datum(scontext->key);
   }
   if(scontext->value) {
@@ -1748,6 +4921,9 @@ librdf_storage_hashes_sync(librdf_storage *storage)
   librdf_storage_hashes_instance* context=(librdf_storage_hashes_instance*)storage->instance;
   int i;
   
+  if(context->dictionary)
+    librdf_storage_hashes_dictionary_save(storage);
+
   for(i=0; i<context->hash_count; i++)
     librdf_hash_sync(context->hashes[i]);
   return 0;
@@ -1797,8 +4973,9 @@ librdf_storage_hashes_get_contexts_get_method(void* iterator, int flags)
         librdf_free_node(icontext->current);
 
       /* decode value content */
-      icontext->current=librdf_node_decode(icontext->storage->world, NULL,
-                                           (unsigned char*)k->data, k->size);
+      icontext->current=librdf_storage_hashes_decode_context(icontext->storage,
+                                                             (unsigned char*)k->data,
+                                                             k->size);
       result=icontext->current;
       break;
 
@@ -1926,6 +5103,26 @@ librdf_storage_hashes_get_feature(librdf_storage* storage, librdf_uri* feature)
                                               value, NULL, NULL);
   }
 
+  if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_NODE_CACHE_HITS) ||
+     !strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_NODE_CACHE_MISSES)) {
+    librdf_storage_hashes_node_cache* cache=scontext->node_cache;
+    unsigned long count=0;
+    unsigned char value[24];
+
+    if(cache) {
+      NODE_CACHE_LOCK(cache);
+      if(!strcmp((const char*)uri_string, LIBRDF_STORAGE_FEATURE_NODE_CACHE_HITS))
+        count=cache->hits;
+      else
+        count=cache->misses;
+      NODE_CACHE_UNLOCK(cache);
+    }
+
+    sprintf((char*)value, "%lu", count);
+    return librdf_new_node_from_typed_literal(storage->world, 
+                                              value, NULL, NULL);
+  }
+
   return NULL;
 }
 
@@ -1953,6 +5150,10 @@ librdf_storage_hashes_register_factory(librdf_storage_factory *factory)
   factory->find_sources       = librdf_storage_hashes_find_sources;
   factory->find_arcs          = librdf_storage_hashes_find_arcs;
   factory->find_targets       = librdf_storage_hashes_find_targets;
+  factory->has_arc_in         = librdf_storage_hashes_has_arc_in;
+  factory->has_arc_out        = librdf_storage_hashes_has_arc_out;
+  factory->get_arcs_in        = librdf_storage_hashes_get_arcs_in;
+  factory->get_arcs_out       = librdf_storage_hashes_get_arcs_out;
 
   factory->context_add_statement    = librdf_storage_hashes_context_add_statement;
   factory->context_remove_statement = librdf_storage_hashes_context_remove_statement;
@@ -1960,6 +5161,7 @@ librdf_storage_hashes_register_factory(librdf_storage_factory *factory)
   factory->sync                     = librdf_storage_hashes_sync;
   factory->get_contexts             = librdf_storage_hashes_get_contexts;
   factory->get_feature              = librdf_storage_hashes_get_feature;
+  factory->estimate_statements      = librdf_storage_hashes_estimate_statements;
 }
 
 
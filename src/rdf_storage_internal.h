@@ -56,6 +56,13 @@ void librdf_init_storage_hashes(librdf_world *world);
 
 void librdf_init_storage_trees(librdf_world *world);
 
+void librdf_init_storage_sorted(librdf_world *world);
+
+#ifdef STORAGE_SNAPSHOT
+void librdf_init_storage_snapshot(librdf_world *world);
+librdf_storage* librdf_new_storage_memory_snapshot(librdf_storage* storage);
+#endif
+
 void librdf_init_storage_file(librdf_world *world);
 
 #ifdef STORAGE_MYSQL
@@ -89,6 +96,44 @@ void librdf_finish_storage(librdf_world *world);
 librdf_storage_factory* librdf_get_storage_factory(librdf_world* world, const char *name);
 
 
+/* rdf_storage.c - statement count statistics kept by storage modules */
+
+/* counts for statements with one predicate */
+typedef struct {
+  librdf_node* predicate;
+  int statements;
+  /* distinct subjects / objects used with the predicate */
+  int subjects;
+  int objects;
+} librdf_storage_statistics_predicate;
+
+typedef struct {
+  librdf_world* world;
+  int statements;
+  /* distinct subjects / objects in the store */
+  int subjects;
+  int objects;
+  /* sums of the per predicate subjects / objects */
+  int predicate_subjects;
+  int predicate_objects;
+  /* OR of LIBRDF_STATEMENT_SUBJECT / OBJECT for the distinct counts
+   * that are maintained; others are estimated */
+  int predicate_parts;
+  int global_parts;
+  /* non 0 if the counts must be rebuilt before use */
+  int stale;
+  /* tree of librdf_storage_statistics_predicate */
+  raptor_avltree* predicates;
+} librdf_storage_statistics;
+
+librdf_storage_statistics* librdf_new_storage_statistics(librdf_world* world, int predicate_parts, int global_parts);
+void librdf_free_storage_statistics(librdf_storage_statistics* stats);
+void librdf_storage_statistics_clear(librdf_storage_statistics* stats);
+int librdf_storage_statistics_update(librdf_storage_statistics* stats, librdf_node* predicate, int statements, int predicate_subjects, int predicate_objects);
+int librdf_storage_statistics_estimate(librdf_storage_statistics* stats, librdf_statement* statement, int distinct);
+int librdf_storage_statistics_estimate_counts(librdf_statement* statement, int distinct, int statements, int subjects, int objects, int predicates);
+
+
 /* rdf_storage_sql.c */
 typedef struct  
 {
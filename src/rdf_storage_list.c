@@ -77,6 +77,7 @@ static int librdf_storage_list_serialise_end_of_stream(void* context);
 static int librdf_storage_list_serialise_next_statement(void* context);
 static void* librdf_storage_list_serialise_get_statement(void* context, int flags);
 static void librdf_storage_list_serialise_finished(void* context);
+static int librdf_storage_list_serialise_batch(void* context, librdf_statement** statements, librdf_node** contexts, int size);
 
 /* context functions */
 static int librdf_storage_list_context_add_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
@@ -366,6 +367,8 @@ librdf_storage_list_serialise(librdf_storage* storage)
     librdf_storage_list_serialise_finished((void*)scontext);
     return NULL;
   }
+  librdf_stream_set_batch_method(stream,
+                                 &librdf_storage_list_serialise_batch);
   
   return stream;  
 }
@@ -412,6 +415,29 @@ librdf_storage_list_serialise_get_statement(void* context, int flags)
 }
 
 
+/* Store up to size statements held in the list; they belong to the list */
+static int
+librdf_storage_list_serialise_batch(void* context,
+                                    librdf_statement** statements,
+                                    librdf_node** contexts, int size)
+{
+  librdf_storage_list_serialise_stream_context* scontext=(librdf_storage_list_serialise_stream_context*)context;
+  int count;
+
+  for(count = 0; count < size && !librdf_iterator_end(scontext->iterator);
+      count++) {
+    librdf_storage_list_node* sln=(librdf_storage_list_node*)librdf_iterator_get_object(scontext->iterator);
+
+    statements[count]=sln->statement;
+    if(contexts)
+      contexts[count]=scontext->index_contexts ? sln->context : NULL;
+    librdf_iterator_next(scontext->iterator);
+  }
+
+  return count;
+}
+
+
 static void
 librdf_storage_list_serialise_finished(void* context)
 {
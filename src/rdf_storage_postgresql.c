@@ -58,6 +58,25 @@ typedef struct {
   PGconn *handle;
 } librdf_storage_postgresql_connection;
 
+/* Staging tables filled by COPY during a bulk load, in this order */
+typedef enum {
+  LIBRDF_STORAGE_POSTGRESQL_BULK_RESOURCES = 0,
+  LIBRDF_STORAGE_POSTGRESQL_BULK_LITERALS = 1,
+  LIBRDF_STORAGE_POSTGRESQL_BULK_BNODES = 2,
+  LIBRDF_STORAGE_POSTGRESQL_BULK_STATEMENTS = 3,
+  LIBRDF_STORAGE_POSTGRESQL_BULK_TABLES_COUNT = 4
+} librdf_storage_postgresql_bulk_table;
+
+/* Rows staged before they are sent to the server with COPY */
+#define LIBRDF_STORAGE_POSTGRESQL_BULK_BATCH_ROWS 10000
+
+typedef struct {
+  /* COPY text format rows waiting to be sent to one staging table */
+  char *data;
+  size_t length;
+  size_t size;
+} librdf_storage_postgresql_copy_buffer;
+
 typedef struct {
   /* postgresql connection parameters */
   char *host;
@@ -84,6 +103,19 @@ typedef struct {
 
   PGconn* transaction_handle;
 
+  /* connection holding the staging tables while a bulk load is active */
+  PGconn* bulk_handle;
+  /* if the bulk load began the transaction on bulk_handle itself */
+  int bulk_transaction;
+  librdf_storage_postgresql_copy_buffer bulk_buffers[LIBRDF_STORAGE_POSTGRESQL_BULK_TABLES_COUNT];
+  int bulk_rows;
+
+  /* open addressed set of node hashes already staged in this bulk load;
+   * 0 marks an empty slot as it is never a valid node hash */
+  u64* bulk_seen;
+  size_t bulk_seen_size;
+  size_t bulk_seen_count;
+
 } librdf_storage_postgresql_instance;
 
 /* prototypes for local functions */
@@ -170,6 +202,13 @@ static u64 librdf_storage_postgresql_node_hash(librdf_storage* storage,
                                                librdf_node* node, int add);
 static int librdf_storage_postgresql_start_bulk(librdf_storage* storage);
 static int librdf_storage_postgresql_stop_bulk(librdf_storage* storage);
+static int librdf_storage_postgresql_bulk_end(librdf_storage* storage, int status);
+static int librdf_storage_postgresql_bulk_flush(librdf_storage* storage);
+static u64 librdf_storage_postgresql_bulk_node_hash(librdf_storage* storage,
+                                                    librdf_node* node);
+static int librdf_storage_postgresql_bulk_add_statement(librdf_storage* storage,
+                                                        u64 ctxt,
+                                                        librdf_statement* statement);
 static int librdf_storage_postgresql_context_add_statement_helper(librdf_storage* storage,
                                                                   u64 ctxt,
                                                                   librdf_statement* statement);
@@ -433,9 +472,12 @@ librdf_storage_postgresql_release_handle(librdf_storage* storage, PGconn *handle
  *
  * INTERNAL - Create connection to database.  Defaults to port 5432 if not given.
  *
- * The boolean bulk option can be set to true if optimized inserts (table
- * locks and temporary key disabling) is wanted. Note that this will block
- * all other access, and requires table locking and alter table privileges.
+ * The boolean bulk option can be set to true if optimized inserts are
+ * wanted when adding streams of statements. Nodes and statements are
+ * then sent with COPY to temporary tables in large batches and merged
+ * into the model in one transaction at the end of each stream, without
+ * checking for duplicate statements.  This requires the temporary
+ * tables privilege and PostgreSQL 9.5 or later.
  *
  * The boolean merge option can be set to true if a merged "view" of all
  * models should be maintained. This "view" will be a table with TYPE=MERGE.
@@ -805,6 +847,8 @@ librdf_storage_postgresql_terminate(librdf_storage* storage)
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN(storage, librdf_storage);
 
+  librdf_storage_postgresql_stop_bulk(storage);
+
   librdf_storage_postgresql_finish_connections(storage);
 
   if(context->password)
@@ -1239,19 +1283,481 @@ librdf_storage_postgresql_node_hash(librdf_storage* storage,
 }
 
 
+/* Removes the staging tables if they are on the connection */
+#define LIBRDF_STORAGE_POSTGRESQL_BULK_DROP "DROP TABLE IF EXISTS BulkResources, BulkLiterals, BulkBnodes, BulkStatements"
+
+/* Names of the staging tables, indexed by librdf_storage_postgresql_bulk_table */
+static const char* const librdf_storage_postgresql_bulk_tables[LIBRDF_STORAGE_POSTGRESQL_BULK_TABLES_COUNT]={
+  "BulkResources",
+  "BulkLiterals",
+  "BulkBnodes",
+  "BulkStatements"
+};
+
+
+/*
+ * librdf_storage_postgresql_bulk_exec:
+ * @storage: the storage
+ * @handle: the postgresql handle
+ * @query: the command to run
+ *
+ * INTERNAL - Run a command that returns no rows during a bulk load
+ *
+ * Return value: Non-zero on failure.
+ */
+static int
+librdf_storage_postgresql_bulk_exec(librdf_storage* storage, PGconn *handle,
+                                    const char *query)
+{
+  PGresult *res;
+  int status=1;
+
+  if((res=PQexec(handle, query))) {
+    if(PQresultStatus(res) == PGRES_COMMAND_OK) {
+      status=0;
+    } else {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "postgresql bulk load query %s failed: %s",
+                 query, PQresultErrorMessage(res));
+    }
+    PQclear(res);
+  } else {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "postgresql bulk load query %s failed: %s",
+               query, PQerrorMessage(handle));
+  }
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_postgresql_bulk_append:
+ * @buffer: the COPY buffer
+ * @data: the data to append
+ * @length: length of @data
+ * @escape: non-0 to escape @data as a COPY text format column value
+ *
+ * INTERNAL - Append to a COPY buffer, growing it as needed
+ *
+ * Return value: Non-zero on failure.
+ */
+static int
+librdf_storage_postgresql_bulk_append(librdf_storage_postgresql_copy_buffer* buffer,
+                                      const char *data, size_t length,
+                                      int escape)
+{
+  size_t needed=buffer->length + (escape ? length * 2 : length);
+  size_t i;
+
+  if(needed > buffer->size) {
+    size_t new_size=buffer->size ? buffer->size : 4096;
+    char *new_data;
+
+    while(new_size < needed)
+      new_size*=2;
+    new_data=LIBRDF_MALLOC(char*, new_size);
+    if(!new_data)
+      return 1;
+    if(buffer->data) {
+      memcpy(new_data, buffer->data, buffer->length);
+      LIBRDF_FREE(char*, buffer->data);
+    }
+    buffer->data=new_data;
+    buffer->size=new_size;
+  }
+
+  if(!escape) {
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length+=length;
+    return 0;
+  }
+
+  /* Backslash and the row and column separators must be escaped */
+  for(i=0; i < length; i++) {
+    char c=data[i];
+
+    switch(c) {
+      case '\\':
+        buffer->data[buffer->length++]='\\';
+        break;
+      case '\t':
+        buffer->data[buffer->length++]='\\';
+        c='t';
+        break;
+      case '\n':
+        buffer->data[buffer->length++]='\\';
+        c='n';
+        break;
+      case '\r':
+        buffer->data[buffer->length++]='\\';
+        c='r';
+        break;
+      default:
+        break;
+    }
+    buffer->data[buffer->length++]=c;
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_postgresql_bulk_append_hash:
+ * @buffer: the COPY buffer
+ * @hash: the hash column value
+ * @separator: column or row separator to append after it
+ *
+ * INTERNAL - Append a hash column to a COPY buffer
+ *
+ * Return value: Non-zero on failure.
+ */
+static int
+librdf_storage_postgresql_bulk_append_hash(librdf_storage_postgresql_copy_buffer* buffer,
+                                           u64 hash, char separator)
+{
+  char column[22];
+  int length;
+
+  length=sprintf(column, UINT64_T_FMT "%c", hash, separator);
+
+  return librdf_storage_postgresql_bulk_append(buffer, column,
+                                               LIBRDF_GOOD_CAST(size_t, length),
+                                               0);
+}
+
+
+/*
+ * librdf_storage_postgresql_bulk_seen:
+ * @context: the storage instance
+ * @hash: the node hash
+ *
+ * INTERNAL - Check if a node was already staged, remembering it if not
+ *
+ * Return value: 1 if already staged, 0 if not, <0 on failure.
+ */
+static int
+librdf_storage_postgresql_bulk_seen(librdf_storage_postgresql_instance* context,
+                                    u64 hash)
+{
+  size_t i;
+
+  /* Keep the set at most half full */
+  if((context->bulk_seen_count + 1) * 2 > context->bulk_seen_size) {
+    size_t new_size=context->bulk_seen_size ? context->bulk_seen_size * 2 : 1024;
+    u64* new_seen;
+
+    new_seen=LIBRDF_CALLOC(u64*, new_size, sizeof(u64));
+    if(!new_seen)
+      return -1;
+    for(i=0; i < context->bulk_seen_size; i++) {
+      u64 old=context->bulk_seen[i];
+      size_t j;
+
+      if(!old)
+        continue;
+      for(j=(size_t)old & (new_size - 1); new_seen[j]; j=(j + 1) & (new_size - 1))
+        ;
+      new_seen[j]=old;
+    }
+    if(context->bulk_seen)
+      LIBRDF_FREE(u64*, context->bulk_seen);
+    context->bulk_seen=new_seen;
+    context->bulk_seen_size=new_size;
+  }
+
+  for(i=(size_t)hash & (context->bulk_seen_size - 1);
+      context->bulk_seen[i];
+      i=(i + 1) & (context->bulk_seen_size - 1)) {
+    if(context->bulk_seen[i] == hash)
+      return 1;
+  }
+  context->bulk_seen[i]=hash;
+  context->bulk_seen_count++;
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_postgresql_bulk_node_hash:
+ * @storage: the storage
+ * @node: a node to get hash for
+ *
+ * INTERNAL - Get the hash of a node, staging the node row the first
+ * time it is seen in this bulk load
+ *
+ * Return value: Non-zero on succes.
+ */
+static u64
+librdf_storage_postgresql_bulk_node_hash(librdf_storage* storage,
+                                         librdf_node* node)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  librdf_storage_postgresql_copy_buffer* buffer;
+  u64 hash;
+  int seen;
+  int status;
+
+  hash=librdf_storage_postgresql_node_hash(storage, node, 0);
+  if(!hash)
+    return 0;
+
+  seen=librdf_storage_postgresql_bulk_seen(context, hash);
+  if(seen)
+    return (seen > 0) ? hash : 0;
+
+  switch(librdf_node_get_type(node)) {
+    case LIBRDF_NODE_TYPE_RESOURCE:
+      {
+        size_t urilen;
+        unsigned char *uri=librdf_uri_as_counted_string(librdf_node_get_uri(node),
+                                                        &urilen);
+
+        buffer=&context->bulk_buffers[LIBRDF_STORAGE_POSTGRESQL_BULK_RESOURCES];
+        status=librdf_storage_postgresql_bulk_append_hash(buffer, hash, '\t') ||
+               librdf_storage_postgresql_bulk_append(buffer, (const char*)uri,
+                                                     urilen, 1);
+      }
+      break;
+
+    case LIBRDF_NODE_TYPE_LITERAL:
+      {
+        size_t valuelen;
+        unsigned char *value;
+        char *lang;
+        librdf_uri *dt;
+        unsigned char *datatype=NULL;
+
+        value=librdf_node_get_literal_value_as_counted_string(node, &valuelen);
+        lang=librdf_node_get_literal_value_language(node);
+        dt=librdf_node_get_literal_value_datatype_uri(node);
+        if(dt)
+          datatype=librdf_uri_as_string(dt);
+
+        /* Missing language and datatype are stored as empty strings */
+        buffer=&context->bulk_buffers[LIBRDF_STORAGE_POSTGRESQL_BULK_LITERALS];
+        status=librdf_storage_postgresql_bulk_append_hash(buffer, hash, '\t') ||
+               librdf_storage_postgresql_bulk_append(buffer, (const char*)value,
+                                                     valuelen, 1) ||
+               librdf_storage_postgresql_bulk_append(buffer, "\t", 1, 0) ||
+               (lang &&
+                librdf_storage_postgresql_bulk_append(buffer, lang,
+                                                      strlen(lang), 1)) ||
+               librdf_storage_postgresql_bulk_append(buffer, "\t", 1, 0) ||
+               (datatype &&
+                librdf_storage_postgresql_bulk_append(buffer, (const char*)datatype,
+                                                      strlen((const char*)datatype), 1));
+      }
+      break;
+
+    case LIBRDF_NODE_TYPE_BLANK:
+      {
+        unsigned char *name=librdf_node_get_blank_identifier(node);
+
+        buffer=&context->bulk_buffers[LIBRDF_STORAGE_POSTGRESQL_BULK_BNODES];
+        status=librdf_storage_postgresql_bulk_append_hash(buffer, hash, '\t') ||
+               librdf_storage_postgresql_bulk_append(buffer, (const char*)name,
+                                                     strlen((const char*)name), 1);
+      }
+      break;
+
+    case LIBRDF_NODE_TYPE_UNKNOWN:
+    default:
+      return 0;
+  }
+
+  if(status || librdf_storage_postgresql_bulk_append(buffer, "\n", 1, 0))
+    return 0;
+  context->bulk_rows++;
+
+  return hash;
+}
+
+
+/*
+ * librdf_storage_postgresql_bulk_flush:
+ * @storage: the storage
+ *
+ * INTERNAL - Send the staged rows to the staging tables with COPY
+ *
+ * Return value: Non-zero on failure.
+ */
+static int
+librdf_storage_postgresql_bulk_flush(librdf_storage* storage)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  const char copy_table[]="COPY %s FROM STDIN";
+  PGconn *handle=context->bulk_handle;
+  char query[64];
+  PGresult *res;
+  int i;
+  int status=0;
+
+  for(i=0; !status && i < LIBRDF_STORAGE_POSTGRESQL_BULK_TABLES_COUNT; i++) {
+    librdf_storage_postgresql_copy_buffer* buffer=&context->bulk_buffers[i];
+
+    if(!buffer->length)
+      continue;
+
+    sprintf(query, copy_table, librdf_storage_postgresql_bulk_tables[i]);
+    res=PQexec(handle, query);
+    if(!res || PQresultStatus(res) != PGRES_COPY_IN) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "postgresql %s failed: %s", query,
+                 res ? PQresultErrorMessage(res) : PQerrorMessage(handle));
+      if(res)
+        PQclear(res);
+      status=1;
+      break;
+    }
+    PQclear(res);
+
+    if(PQputCopyData(handle, buffer->data,
+                     LIBRDF_BAD_CAST(int, buffer->length)) != 1) {
+      PQputCopyEnd(handle, "librdf bulk load failed");
+      status=1;
+    } else if(PQputCopyEnd(handle, NULL) != 1)
+      status=1;
+    if(status)
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "postgresql %s failed: %s", query, PQerrorMessage(handle));
+
+    /* Collect the results of the COPY, which also ends it on errors */
+    while((res=PQgetResult(handle))) {
+      if(PQresultStatus(res) != PGRES_COMMAND_OK) {
+        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                   "postgresql %s failed: %s", query,
+                   PQresultErrorMessage(res));
+        status=1;
+      }
+      PQclear(res);
+    }
+
+    buffer->length=0;
+  }
+
+  context->bulk_rows=0;
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_postgresql_bulk_add_statement:
+ * @storage: the storage
+ * @ctxt: u64 context hash
+ * @statement: #librdf_statement statement to add
+ *
+ * INTERNAL - Stage a statement and any of its nodes not yet staged,
+ * sending the staged rows to the server once a batch is full
+ *
+ * Return value: Non-zero on failure.
+ */
+static int
+librdf_storage_postgresql_bulk_add_statement(librdf_storage* storage,
+                                             u64 ctxt,
+                                             librdf_statement* statement)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  librdf_storage_postgresql_copy_buffer* buffer=&context->bulk_buffers[LIBRDF_STORAGE_POSTGRESQL_BULK_STATEMENTS];
+  u64 subject, predicate, object;
+
+  subject=librdf_storage_postgresql_bulk_node_hash(storage,
+                                                   librdf_statement_get_subject(statement));
+  predicate=librdf_storage_postgresql_bulk_node_hash(storage,
+                                                     librdf_statement_get_predicate(statement));
+  object=librdf_storage_postgresql_bulk_node_hash(storage,
+                                                  librdf_statement_get_object(statement));
+  if(!subject || !predicate || !object)
+    return 1;
+
+  if(librdf_storage_postgresql_bulk_append_hash(buffer, subject, '\t') ||
+     librdf_storage_postgresql_bulk_append_hash(buffer, predicate, '\t') ||
+     librdf_storage_postgresql_bulk_append_hash(buffer, object, '\t') ||
+     librdf_storage_postgresql_bulk_append_hash(buffer, ctxt, '\n'))
+    return 1;
+  context->bulk_rows++;
+
+  if(context->bulk_rows >= LIBRDF_STORAGE_POSTGRESQL_BULK_BATCH_ROWS)
+    return librdf_storage_postgresql_bulk_flush(storage);
+
+  return 0;
+}
+
+
 /*
  * librdf_storage_postgresql_start_bulk:
  * @storage: the storage
  *
  * INTERNAL - Prepare for bulk insert operation
  *
+ * Creates temporary staging tables, inside a transaction unless one
+ * is already active, that are filled with COPY until the bulk load
+ * is stopped.  Staging tables left on the connection by an earlier
+ * load in the same transaction are dropped first.
+ *
  * Return value: Non-zero on failure.
  */
 static int
 librdf_storage_postgresql_start_bulk(librdf_storage* storage)
 {
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  const char start_transaction[]="START TRANSACTION";
+  const char *create_staging_tables[]={
+    LIBRDF_STORAGE_POSTGRESQL_BULK_DROP,
+    "CREATE TEMPORARY TABLE BulkResources (LIKE Resources) ON COMMIT DROP",
+    "CREATE TEMPORARY TABLE BulkLiterals (LIKE Literals) ON COMMIT DROP",
+    "CREATE TEMPORARY TABLE BulkBnodes (LIKE Bnodes) ON COMMIT DROP",
+    NULL
+  };
+  const char create_staging_statements[]="CREATE TEMPORARY TABLE BulkStatements (LIKE Statements" UINT64_T_FMT ") ON COMMIT DROP";
+  char *query;
+  PGconn *handle;
+  int i;
+  int status=0;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
+
+  /* Already loading */
+  if(context->bulk_handle)
+    return 0;
+
+  /* Get postgresql connection handle */
+  handle=librdf_storage_postgresql_get_handle(storage);
+  if(!handle)
+    return 1;
+
+  /* Join a transaction that is already active */
+  context->bulk_transaction=!context->transaction_handle;
+  if(context->bulk_transaction)
+    status=librdf_storage_postgresql_bulk_exec(storage, handle,
+                                               start_transaction);
+
+  for(i=0; !status && create_staging_tables[i]; i++)
+    status=librdf_storage_postgresql_bulk_exec(storage, handle,
+                                               create_staging_tables[i]);
 
-  return 1;
+  if(!status) {
+    query=LIBRDF_MALLOC(char*, strlen(create_staging_statements) + 21);
+    if(query) {
+      sprintf(query, create_staging_statements, context->model);
+      status=librdf_storage_postgresql_bulk_exec(storage, handle, query);
+      LIBRDF_FREE(char*, query);
+    } else
+      status=1;
+  }
+
+  context->bulk_handle=handle;
+  context->bulk_rows=0;
+
+  if(status) {
+    librdf_storage_postgresql_bulk_end(storage, 1);
+    return 1;
+  }
+
+  return 0;
 }
 
 
@@ -1261,12 +1767,104 @@ librdf_storage_postgresql_start_bulk(librdf_storage* storage)
  *
  * INTERNAL - End bulk insert operation
  *
+ * Sends any rows still staged and merges the staging tables into the
+ * node and statement tables, skipping nodes already stored.
+ *
  * Return value: Non-zero on failure.
  */
 static int
 librdf_storage_postgresql_stop_bulk(librdf_storage* storage)
 {
-  return 1;
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  const char *merge_staging_tables[]={
+    "INSERT INTO Resources (ID,URI) SELECT ID,URI FROM BulkResources ON CONFLICT DO NOTHING",
+    "INSERT INTO Literals (ID,Value,Language,Datatype) SELECT ID,Value,Language,Datatype FROM BulkLiterals ON CONFLICT DO NOTHING",
+    "INSERT INTO Bnodes (ID,Name) SELECT ID,Name FROM BulkBnodes ON CONFLICT DO NOTHING",
+    NULL
+  };
+  const char merge_staging_statements[]="INSERT INTO Statements" UINT64_T_FMT " (Subject,Predicate,Object,Context) SELECT Subject,Predicate,Object,Context FROM BulkStatements";
+  PGconn *handle=context->bulk_handle;
+  char *query;
+  int i;
+  int status;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
+
+  /* Not loading */
+  if(!handle)
+    return 0;
+
+  status=librdf_storage_postgresql_bulk_flush(storage);
+
+  for(i=0; !status && merge_staging_tables[i]; i++)
+    status=librdf_storage_postgresql_bulk_exec(storage, handle,
+                                               merge_staging_tables[i]);
+
+  if(!status) {
+    query=LIBRDF_MALLOC(char*, strlen(merge_staging_statements) + 21);
+    if(query) {
+      sprintf(query, merge_staging_statements, context->model);
+      status=librdf_storage_postgresql_bulk_exec(storage, handle, query);
+      LIBRDF_FREE(char*, query);
+    } else
+      status=1;
+  }
+
+  return librdf_storage_postgresql_bulk_end(storage, status);
+}
+
+
+/*
+ * librdf_storage_postgresql_bulk_end:
+ * @storage: the storage
+ * @status: non-zero if the bulk load failed
+ *
+ * INTERNAL - Remove the staging tables and end the transaction the
+ * bulk load began, committing it only if the load succeeded
+ *
+ * Return value: Non-zero on failure.
+ */
+static int
+librdf_storage_postgresql_bulk_end(librdf_storage* storage, int status)
+{
+  librdf_storage_postgresql_instance* context=(librdf_storage_postgresql_instance*)storage->instance;
+  const char commit_transaction[]="COMMIT TRANSACTION";
+  const char rollback_transaction[]="ROLLBACK TRANSACTION";
+  PGconn *handle=context->bulk_handle;
+  int i;
+
+  /* The staging tables go with the commit and a rollback undoes
+   * creating them; inside the caller's transaction they are dropped
+   * here so a later bulk load can create them again */
+  if(context->bulk_transaction) {
+    if(librdf_storage_postgresql_bulk_exec(storage, handle,
+                                           status ? rollback_transaction :
+                                                    commit_transaction))
+      status=1;
+  } else if(librdf_storage_postgresql_bulk_exec(storage, handle,
+                                                LIBRDF_STORAGE_POSTGRESQL_BULK_DROP))
+    status=1;
+
+  librdf_storage_postgresql_release_handle(storage, handle);
+  context->bulk_handle=NULL;
+
+  for(i=0; i < LIBRDF_STORAGE_POSTGRESQL_BULK_TABLES_COUNT; i++) {
+    if(context->bulk_buffers[i].data)
+      LIBRDF_FREE(char*, context->bulk_buffers[i].data);
+    context->bulk_buffers[i].data=NULL;
+    context->bulk_buffers[i].length=0;
+    context->bulk_buffers[i].size=0;
+  }
+  context->bulk_rows=0;
+
+  if(context->bulk_seen) {
+    LIBRDF_FREE(u64*, context->bulk_seen);
+    context->bulk_seen=NULL;
+  }
+  context->bulk_seen_size=0;
+  context->bulk_seen_count=0;
+
+  return status;
 }
 
 
@@ -1300,9 +1898,12 @@ librdf_storage_postgresql_context_add_statements(librdf_storage* storage,
 
   /* Find hash for context, creating if necessary */
   if(context_node) {
-    ctxt=librdf_storage_postgresql_node_hash(storage,context_node,1);
+    if(context->bulk_handle)
+      ctxt=librdf_storage_postgresql_bulk_node_hash(storage, context_node);
+    else
+      ctxt=librdf_storage_postgresql_node_hash(storage,context_node,1);
     if(!ctxt)
-      return 1;
+      helper=1;
   }
 
   while(!helper && !librdf_stream_end(statement_stream)) {
@@ -1322,6 +1923,15 @@ librdf_storage_postgresql_context_add_statements(librdf_storage* storage,
     librdf_stream_next(statement_stream);
   }
 
+  /* Merge the staged rows into the model only if all were staged,
+   * otherwise throw them away so a failed load adds nothing */
+  if(context->bulk_handle) {
+    if(helper)
+      librdf_storage_postgresql_bulk_end(storage, 1);
+    else if(librdf_storage_postgresql_stop_bulk(storage))
+      helper=1;
+  }
+
   return helper;
 }
 
@@ -1381,6 +1991,11 @@ librdf_storage_postgresql_context_add_statement_helper(librdf_storage* storage,
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statement, librdf_statement, 1);
 
+  /* Stage the statement while bulk loading */
+  if(context->bulk_handle)
+    return librdf_storage_postgresql_bulk_add_statement(storage, ctxt,
+                                                        statement);
+
   /* Get postgresql connection handle */
   if ((handle=librdf_storage_postgresql_get_handle(storage))) {
 
@@ -0,0 +1,1878 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_storage_snapshot.c - RDF Storage in a read-only memory-mapped file
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+/*
+ * A snapshot is a read-only file written from any storage by
+ * librdf_storage_write_snapshot() and opened by the "snapshot" storage
+ * with mmap() so that opening it does no parsing and its pages are
+ * shared between processes.
+ *
+ * All positions in the file are byte offsets from its start, so it
+ * can be mapped at any address.  Integers are in the byte order of the
+ * host that wrote it; the header records that order and files from a
+ * host with another order are refused.  The file holds in order,
+ * each section aligned to LIBRDF_STORAGE_SNAPSHOT_ALIGN bytes:
+ *
+ *   header         librdf_storage_snapshot_header
+ *   term offsets   u64 [terms_count + 1] offsets of each term in the
+ *                  term data; term i has id i + 1
+ *   term data      terms in librdf_node_encode() form, sorted by bytes
+ *   indexes        quads_count librdf_storage_snapshot_quad in each of
+ *                  the (s, p, o, c), (p, o, s, c), (o, s, p, c) and
+ *                  (c, s, p, o) orders
+ *   context table  librdf_storage_snapshot_context [contexts_count]
+ *                  ranges of the (c, s, p, o) index by context id
+ *
+ * Statements without a context have context id 0.  Without mmap() the
+ * file is read into memory instead.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(HAVE_SYS_MMAN_H) && defined(HAVE_MMAP)
+#include <sys/mman.h>
+#define LIBRDF_STORAGE_SNAPSHOT_USE_MMAP 1
+#endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+#define LIBRDF_STORAGE_SNAPSHOT_MAGIC "RDFSNAP\n"
+#define LIBRDF_STORAGE_SNAPSHOT_MAGIC_LEN 8
+
+#define LIBRDF_STORAGE_SNAPSHOT_VERSION 1
+
+/* written as a u32 to detect files from hosts of another byte order */
+#define LIBRDF_STORAGE_SNAPSHOT_BYTE_ORDER 0x01020304
+
+/* alignment of each file section - a cache line */
+#define LIBRDF_STORAGE_SNAPSHOT_ALIGN 64
+
+/* size of a term id in the writer dictionary hash */
+#define LIBRDF_STORAGE_SNAPSHOT_TERM_ID_SIZE sizeof(u32)
+
+
+/* sort orders of the quad indexes */
+typedef enum {
+  LIBRDF_STORAGE_SNAPSHOT_SPOC,
+  LIBRDF_STORAGE_SNAPSHOT_POSC,
+  LIBRDF_STORAGE_SNAPSHOT_OSPC,
+  LIBRDF_STORAGE_SNAPSHOT_CSPO,
+  LIBRDF_STORAGE_SNAPSHOT_ORDERS
+} librdf_storage_snapshot_order;
+
+/* quad part (0 subject, 1 predicate, 2 object, 3 context) held in
+ * each position of a quad of each order */
+static const int librdf_storage_snapshot_parts[LIBRDF_STORAGE_SNAPSHOT_ORDERS][4] = {
+  { 0, 1, 2, 3 },
+  { 1, 2, 0, 3 },
+  { 2, 0, 1, 3 },
+  { 3, 0, 1, 2 }
+};
+
+
+/* file header; all offsets are from the start of the file */
+typedef struct
+{
+  unsigned char magic[LIBRDF_STORAGE_SNAPSHOT_MAGIC_LEN];
+  u32 version;
+  u32 byte_order;
+  u32 terms_count;
+  u32 contexts_count;
+  u64 quads_count;
+  u64 file_size;
+  u64 term_offsets_offset;
+  u64 term_data_offset;
+  u64 indexes_offset[LIBRDF_STORAGE_SNAPSHOT_ORDERS];
+  u64 contexts_offset;
+} librdf_storage_snapshot_header;
+
+/* a statement as term ids in the positions of one order; 0 is no term */
+typedef struct
+{
+  u32 ids[4];
+} librdf_storage_snapshot_quad;
+
+/* range of the (c, s, p, o) index holding one context */
+typedef struct
+{
+  u64 start;
+  u64 end;
+  u32 id;
+  u32 reserved;
+} librdf_storage_snapshot_context;
+
+
+#ifdef STORAGE_SNAPSHOT
+typedef struct
+{
+  char *name;
+
+  /* the whole file, mapped or read */
+  unsigned char* file;
+  size_t file_size;
+  int mapped;
+
+  /* snapshot built in memory by librdf_new_storage_memory_snapshot()
+   * instead of a file, or NULL */
+  unsigned char* memory;
+  size_t memory_size;
+
+  /* sections of the file */
+  const librdf_storage_snapshot_header* header;
+  const u64* term_offsets;
+  const unsigned char* term_data;
+  u64 term_data_size;
+  const librdf_storage_snapshot_quad* indexes[LIBRDF_STORAGE_SNAPSHOT_ORDERS];
+  const librdf_storage_snapshot_context* contexts;
+
+  /* terms decoded on first use, by id - 1; all decoded when opened
+   * for snapshots in memory so that concurrent readers only read */
+  librdf_node** nodes;
+#ifdef WITH_THREADS
+  /* guards decoding terms of a file snapshot on first use, which
+   * concurrent readers may do at the same time */
+  pthread_mutex_t nodes_mutex;
+#endif
+} librdf_storage_snapshot_instance;
+
+#ifdef WITH_THREADS
+#define SNAPSHOT_NODES_LOCK(context) pthread_mutex_lock(&(context)->nodes_mutex)
+#define SNAPSHOT_NODES_UNLOCK(context) pthread_mutex_unlock(&(context)->nodes_mutex)
+#else
+#define SNAPSHOT_NODES_LOCK(context)
+#define SNAPSHOT_NODES_UNLOCK(context)
+#endif
+
+
+/* prototypes for local functions */
+static int librdf_storage_snapshot_init(librdf_storage* storage, const char *name, librdf_hash* options);
+static void librdf_storage_snapshot_terminate(librdf_storage* storage);
+static int librdf_storage_snapshot_open(librdf_storage* storage, librdf_model* model);
+static int librdf_storage_snapshot_close(librdf_storage* storage);
+static int librdf_storage_snapshot_size(librdf_storage* storage);
+static int librdf_storage_snapshot_contains_statement(librdf_storage* storage, librdf_statement* statement);
+static librdf_stream* librdf_storage_snapshot_serialise(librdf_storage* storage);
+static librdf_stream* librdf_storage_snapshot_find_statements(librdf_storage* storage, librdf_statement* statement);
+static librdf_stream* librdf_storage_snapshot_context_serialise(librdf_storage* storage, librdf_node* context_node);
+static librdf_stream* librdf_storage_snapshot_find_statements_in_context(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node);
+static librdf_iterator* librdf_storage_snapshot_get_contexts(librdf_storage* storage);
+static int librdf_storage_snapshot_estimate_statements(librdf_storage* storage, librdf_statement* statement, int distinct);
+
+/* serialising implementing functions */
+static int librdf_storage_snapshot_serialise_end_of_stream(void* context);
+static int librdf_storage_snapshot_serialise_next_statement(void* context);
+static void* librdf_storage_snapshot_serialise_get_statement(void* context, int flags);
+static void librdf_storage_snapshot_serialise_finished(void* context);
+
+/* get_contexts iterator functions */
+static int librdf_storage_snapshot_get_contexts_is_end(void* iterator);
+static int librdf_storage_snapshot_get_contexts_next_method(void* iterator);
+static void* librdf_storage_snapshot_get_contexts_get_method(void* iterator, int flags);
+static void librdf_storage_snapshot_get_contexts_finished(void* iterator);
+
+static void librdf_storage_snapshot_register_factory(librdf_storage_factory *factory);
+#endif
+
+
+/* quad functions */
+
+static int
+librdf_storage_snapshot_quad_compare_prefix(const librdf_storage_snapshot_quad* a,
+                                            const librdf_storage_snapshot_quad* b,
+                                            int length)
+{
+  int i;
+
+  for(i = 0; i < length; i++) {
+    if(a->ids[i] != b->ids[i])
+      return (a->ids[i] < b->ids[i]) ? -1 : 1;
+  }
+  return 0;
+}
+
+
+/* qsort comparison of whole quads */
+static int
+librdf_storage_snapshot_quad_compare(const void* a, const void* b)
+{
+  return librdf_storage_snapshot_quad_compare_prefix((const librdf_storage_snapshot_quad*)a,
+                                                     (const librdf_storage_snapshot_quad*)b,
+                                                     4);
+}
+
+
+/* Reorder a quad from (s, p, o, c) order to another order */
+static void
+librdf_storage_snapshot_quad_to_order(const librdf_storage_snapshot_quad* spoc,
+                                      librdf_storage_snapshot_order order,
+                                      librdf_storage_snapshot_quad* quad)
+{
+  int i;
+
+  for(i = 0; i < 4; i++)
+    quad->ids[i] = spoc->ids[librdf_storage_snapshot_parts[order][i]];
+}
+
+
+#ifdef STORAGE_SNAPSHOT
+/* Reorder a quad from another order to (s, p, o, c) order */
+static void
+librdf_storage_snapshot_quad_from_order(const librdf_storage_snapshot_quad* quad,
+                                        librdf_storage_snapshot_order order,
+                                        librdf_storage_snapshot_quad* spoc)
+{
+  int i;
+
+  for(i = 0; i < 4; i++)
+    spoc->ids[librdf_storage_snapshot_parts[order][i]] = quad->ids[i];
+}
+
+
+/* Check a (s, p, o, c) quad against a pattern with 0 for wildcards */
+static int
+librdf_storage_snapshot_quad_match(const librdf_storage_snapshot_quad* spoc,
+                                   const librdf_storage_snapshot_quad* pattern)
+{
+  int i;
+
+  for(i = 0; i < 4; i++) {
+    if(pattern->ids[i] && pattern->ids[i] != spoc->ids[i])
+      return 0;
+  }
+  return 1;
+}
+
+
+/*
+ * librdf_storage_snapshot_bound:
+ * @quads: sorted quads
+ * @count: number of quads
+ * @key: key quad
+ * @length: number of leading positions of @key to compare
+ * @upper: non 0 for the upper bound
+ *
+ * INTERNAL - Binary search for the first quad whose first @length
+ * positions compare greater or equal (greater if @upper) to @key.
+ *
+ * Return value: index of the quad or @count
+ */
+static size_t
+librdf_storage_snapshot_bound(const librdf_storage_snapshot_quad* quads,
+                              size_t count,
+                              const librdf_storage_snapshot_quad* key,
+                              int length, int upper)
+{
+  size_t low = 0;
+  size_t high = count;
+
+  while(low < high) {
+    size_t middle = low + (high - low) / 2;
+    int cmp = librdf_storage_snapshot_quad_compare_prefix(&quads[middle],
+                                                          key, length);
+
+    if(cmp < 0 || (upper && !cmp))
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+#endif
+
+
+/* Compare two encoded terms by bytes then length - the dictionary order */
+static int
+librdf_storage_snapshot_term_compare(const unsigned char* a, size_t a_len,
+                                     const unsigned char* b, size_t b_len)
+{
+  int cmp = memcmp(a, b, (a_len < b_len) ? a_len : b_len);
+
+  if(cmp)
+    return cmp;
+  return (a_len < b_len) ? -1 : ((a_len > b_len) ? 1 : 0);
+}
+
+
+/*
+ * librdf_storage_snapshot_encode_node:
+ * @buffer_p: pointer to a buffer, grown as needed
+ * @buffer_len_p: pointer to the size of the buffer
+ * @node: node to encode
+ *
+ * INTERNAL - Encode a node into a reusable buffer.
+ *
+ * Return value: length of the encoding or 0 on failure
+ */
+static size_t
+librdf_storage_snapshot_encode_node(unsigned char** buffer_p,
+                                    size_t* buffer_len_p, librdf_node* node)
+{
+  size_t len;
+
+  len=librdf_node_encode(node, NULL, 0);
+  if(!len)
+    return 0;
+  if(len > *buffer_len_p) {
+    unsigned char* buffer=LIBRDF_MALLOC(unsigned char*, len);
+    if(!buffer)
+      return 0;
+    if(*buffer_p)
+      LIBRDF_FREE(char*, *buffer_p);
+    *buffer_p=buffer;
+    *buffer_len_p=len;
+  }
+  return librdf_node_encode(node, *buffer_p, len);
+}
+
+
+/* writer */
+
+typedef struct
+{
+  librdf_world* world;
+
+  /* dictionary of encoded terms to writer ids, in order of appearance */
+  librdf_hash* term2id;
+  unsigned char* term_data;
+  size_t term_data_len;
+  size_t term_data_size;
+  u64* term_offsets; /* [terms_count + 1] */
+  size_t terms_size;
+  u32 terms_count;
+
+  /* statements as writer ids in (s, p, o, c) order */
+  librdf_storage_snapshot_quad* quads;
+  size_t quads_count;
+  size_t quads_size;
+
+  unsigned char* buffer;
+  size_t buffer_len;
+} librdf_storage_snapshot_writer;
+
+
+/* where the writer saves a snapshot: a file or a growing buffer */
+typedef struct
+{
+  FILE* fh;
+  unsigned char* data;
+  size_t size;
+  u64 position;
+} librdf_storage_snapshot_sink;
+
+
+/* term of the writer dictionary, for sorting */
+typedef struct
+{
+  const unsigned char* data;
+  size_t len;
+  u32 id;
+} librdf_storage_snapshot_writer_term;
+
+
+static int
+librdf_storage_snapshot_writer_term_compare(const void* a, const void* b)
+{
+  const librdf_storage_snapshot_writer_term* ta=(const librdf_storage_snapshot_writer_term*)a;
+  const librdf_storage_snapshot_writer_term* tb=(const librdf_storage_snapshot_writer_term*)b;
+
+  return librdf_storage_snapshot_term_compare(ta->data, ta->len,
+                                              tb->data, tb->len);
+}
+
+
+/* Map a term to its writer id, adding it to the dictionary if new */
+static int
+librdf_storage_snapshot_writer_term_to_id(librdf_storage_snapshot_writer* writer,
+                                          librdf_node* node, u32* id_p)
+{
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_cursor* cursor;
+  size_t len;
+  int status;
+  u32 id;
+
+  len=librdf_storage_snapshot_encode_node(&writer->buffer,
+                                          &writer->buffer_len, node);
+  if(!len)
+    return 1;
+
+  key.data=writer->buffer; key.size=len;
+  value.data=NULL; value.size=0;
+
+  cursor=librdf_new_hash_cursor(writer->term2id);
+  if(!cursor)
+    return 1;
+  status=librdf_hash_cursor_set(cursor, &key, &value);
+  if(!status) {
+    if(value.size == LIBRDF_STORAGE_SNAPSHOT_TERM_ID_SIZE)
+      memcpy(id_p, value.data, LIBRDF_STORAGE_SNAPSHOT_TERM_ID_SIZE);
+    else
+      status=-1;
+  }
+  librdf_free_hash_cursor(cursor);
+
+  if(!status)
+    return 0;
+  if(status < 0)
+    return 1;
+
+  /* new term */
+  if(writer->terms_count + 1 >= writer->terms_size) {
+    size_t new_size=writer->terms_size ? writer->terms_size * 2 : 1024;
+    u64* new_offsets=LIBRDF_MALLOC(u64*, new_size * sizeof(u64));
+    if(!new_offsets)
+      return 1;
+    if(writer->term_offsets) {
+      memcpy(new_offsets, writer->term_offsets,
+             (writer->terms_count + 1) * sizeof(u64));
+      LIBRDF_FREE(u64*, writer->term_offsets);
+    } else
+      new_offsets[0]=0;
+    writer->term_offsets=new_offsets;
+    writer->terms_size=new_size;
+  }
+
+  if(writer->term_data_len + len > writer->term_data_size) {
+    size_t new_size=writer->term_data_size ? writer->term_data_size * 2 : 65536;
+    unsigned char* new_data;
+
+    while(new_size < writer->term_data_len + len)
+      new_size *= 2;
+    new_data=LIBRDF_MALLOC(unsigned char*, new_size);
+    if(!new_data)
+      return 1;
+    if(writer->term_data) {
+      memcpy(new_data, writer->term_data, writer->term_data_len);
+      LIBRDF_FREE(char*, writer->term_data);
+    }
+    writer->term_data=new_data;
+    writer->term_data_size=new_size;
+  }
+
+  id=writer->terms_count + 1;
+  value.data=&id; value.size=LIBRDF_STORAGE_SNAPSHOT_TERM_ID_SIZE;
+  if(librdf_hash_put(writer->term2id, &key, &value))
+    return 1;
+
+  memcpy(writer->term_data + writer->term_data_len, writer->buffer, len);
+  writer->term_data_len += len;
+  writer->terms_count++;
+  writer->term_offsets[writer->terms_count]=writer->term_data_len;
+
+  *id_p=id;
+  return 0;
+}
+
+
+/* Add a statement in a context (or NULL) to the writer */
+static int
+librdf_storage_snapshot_writer_add(librdf_storage_snapshot_writer* writer,
+                                   librdf_statement* statement,
+                                   librdf_node* context_node)
+{
+  librdf_storage_snapshot_quad* quad;
+
+  if(writer->quads_count == writer->quads_size) {
+    size_t new_size=writer->quads_size ? writer->quads_size * 2 : 4096;
+    librdf_storage_snapshot_quad* new_quads;
+
+    new_quads=LIBRDF_MALLOC(librdf_storage_snapshot_quad*,
+                            new_size * sizeof(*new_quads));
+    if(!new_quads)
+      return 1;
+    if(writer->quads) {
+      memcpy(new_quads, writer->quads, writer->quads_count * sizeof(*new_quads));
+      LIBRDF_FREE(librdf_storage_snapshot_quad*, writer->quads);
+    }
+    writer->quads=new_quads;
+    writer->quads_size=new_size;
+  }
+
+  quad=&writer->quads[writer->quads_count];
+  quad->ids[3]=0;
+  if(librdf_storage_snapshot_writer_term_to_id(writer, statement->subject,
+                                               &quad->ids[0]) ||
+     librdf_storage_snapshot_writer_term_to_id(writer, statement->predicate,
+                                               &quad->ids[1]) ||
+     librdf_storage_snapshot_writer_term_to_id(writer, statement->object,
+                                               &quad->ids[2]) ||
+     (context_node &&
+      librdf_storage_snapshot_writer_term_to_id(writer, context_node,
+                                                &quad->ids[3])))
+    return 1;
+
+  writer->quads_count++;
+  return 0;
+}
+
+
+/* Write bytes, tracking the file position */
+static int
+librdf_storage_snapshot_writer_output(librdf_storage_snapshot_sink* sink,
+                                      const void* data, size_t size)
+{
+  if(!size)
+    return 0;
+
+  if(sink->fh) {
+    if(fwrite(data, 1, size, sink->fh) != size)
+      return 1;
+  } else {
+    if(sink->position + size > sink->size) {
+      size_t new_size=sink->size ? sink->size * 2 : 65536;
+      unsigned char* new_data;
+
+      while(new_size < sink->position + size)
+        new_size *= 2;
+      new_data=LIBRDF_MALLOC(unsigned char*, new_size);
+      if(!new_data)
+        return 1;
+      if(sink->data) {
+        memcpy(new_data, sink->data, (size_t)sink->position);
+        LIBRDF_FREE(char*, sink->data);
+      }
+      sink->data=new_data;
+      sink->size=new_size;
+    }
+    memcpy(sink->data + sink->position, data, size);
+  }
+
+  sink->position += size;
+  return 0;
+}
+
+
+/* Pad the file to the next section boundary */
+static int
+librdf_storage_snapshot_writer_align(librdf_storage_snapshot_sink* sink)
+{
+  static const unsigned char zeros[LIBRDF_STORAGE_SNAPSHOT_ALIGN]={ 0 };
+  size_t pad=(size_t)((LIBRDF_STORAGE_SNAPSHOT_ALIGN -
+                       (sink->position % LIBRDF_STORAGE_SNAPSHOT_ALIGN)) %
+                      LIBRDF_STORAGE_SNAPSHOT_ALIGN);
+
+  return librdf_storage_snapshot_writer_output(sink, zeros, pad);
+}
+
+
+/*
+ * librdf_storage_snapshot_writer_save:
+ * @writer: writer holding all the statements
+ * @sink: file positioned at its start or empty memory buffer
+ *
+ * INTERNAL - Renumber the terms in sorted order and write the file.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_snapshot_writer_save(librdf_storage_snapshot_writer* writer,
+                                    librdf_storage_snapshot_sink* sink)
+{
+  librdf_storage_snapshot_header header;
+  librdf_storage_snapshot_writer_term* terms=NULL;
+  librdf_storage_snapshot_quad* ordered=NULL;
+  u32* new_ids=NULL;
+  u64* offsets=NULL;
+  librdf_storage_snapshot_context* contexts=NULL;
+  size_t count=writer->quads_count;
+  size_t contexts_count=0;
+  u64 data_len=0;
+  size_t i, n;
+  int order;
+  int status=1;
+
+  memset(&header, 0, sizeof(header));
+
+  if(writer->terms_count) {
+    terms=LIBRDF_MALLOC(librdf_storage_snapshot_writer_term*,
+                        writer->terms_count * sizeof(*terms));
+    new_ids=LIBRDF_MALLOC(u32*, (writer->terms_count + 1) * sizeof(u32));
+    offsets=LIBRDF_MALLOC(u64*, (writer->terms_count + 1) * sizeof(u64));
+    if(!terms || !new_ids || !offsets)
+      goto tidy;
+  }
+  if(count) {
+    ordered=LIBRDF_MALLOC(librdf_storage_snapshot_quad*,
+                          count * sizeof(*ordered));
+    if(!ordered)
+      goto tidy;
+  }
+
+  /* renumber the terms in dictionary order */
+  for(i = 0; i < writer->terms_count; i++) {
+    terms[i].data=writer->term_data + writer->term_offsets[i];
+    terms[i].len=(size_t)(writer->term_offsets[i + 1] - writer->term_offsets[i]);
+    terms[i].id=(u32)(i + 1);
+  }
+  if(writer->terms_count) {
+    qsort(terms, writer->terms_count, sizeof(*terms),
+          librdf_storage_snapshot_writer_term_compare);
+    new_ids[0]=0;
+    offsets[0]=0;
+    for(i = 0; i < writer->terms_count; i++) {
+      new_ids[terms[i].id]=(u32)(i + 1);
+      data_len += terms[i].len;
+      offsets[i + 1]=data_len;
+    }
+  }
+
+  for(i = 0; i < count; i++) {
+    librdf_storage_snapshot_quad* quad=&writer->quads[i];
+    int j;
+
+    for(j = 0; j < 4; j++)
+      quad->ids[j]=quad->ids[j] ? new_ids[quad->ids[j]] : 0;
+  }
+
+  /* sort and drop duplicates */
+  if(count) {
+    qsort(writer->quads, count, sizeof(*writer->quads),
+          librdf_storage_snapshot_quad_compare);
+    for(i = 1, n = 1; i < count; i++) {
+      if(librdf_storage_snapshot_quad_compare(&writer->quads[i],
+                                              &writer->quads[n - 1]))
+        writer->quads[n++]=writer->quads[i];
+    }
+    count=n;
+  }
+
+  memcpy(header.magic, LIBRDF_STORAGE_SNAPSHOT_MAGIC,
+         LIBRDF_STORAGE_SNAPSHOT_MAGIC_LEN);
+  header.version=LIBRDF_STORAGE_SNAPSHOT_VERSION;
+  header.byte_order=LIBRDF_STORAGE_SNAPSHOT_BYTE_ORDER;
+  header.terms_count=writer->terms_count;
+  header.quads_count=count;
+
+  /* header now, rewritten at the end with the section offsets */
+  if(librdf_storage_snapshot_writer_output(sink, &header, sizeof(header)) ||
+     librdf_storage_snapshot_writer_align(sink))
+    goto tidy;
+
+  header.term_offsets_offset=sink->position;
+  if(writer->terms_count) {
+    if(librdf_storage_snapshot_writer_output(sink, offsets,
+                                             (writer->terms_count + 1) * sizeof(u64)))
+      goto tidy;
+  } else {
+    u64 zero=0;
+    if(librdf_storage_snapshot_writer_output(sink, &zero, sizeof(zero)))
+      goto tidy;
+  }
+  if(librdf_storage_snapshot_writer_align(sink))
+    goto tidy;
+
+  header.term_data_offset=sink->position;
+  for(i = 0; i < writer->terms_count; i++) {
+    if(librdf_storage_snapshot_writer_output(sink, terms[i].data,
+                                             terms[i].len))
+      goto tidy;
+  }
+  if(librdf_storage_snapshot_writer_align(sink))
+    goto tidy;
+
+  for(order = 0; order < LIBRDF_STORAGE_SNAPSHOT_ORDERS; order++) {
+    for(i = 0; i < count; i++)
+      librdf_storage_snapshot_quad_to_order(&writer->quads[i],
+                                            (librdf_storage_snapshot_order)order,
+                                            &ordered[i]);
+    if(count && order != LIBRDF_STORAGE_SNAPSHOT_SPOC)
+      qsort(ordered, count, sizeof(*ordered),
+            librdf_storage_snapshot_quad_compare);
+
+    header.indexes_offset[order]=sink->position;
+    if(librdf_storage_snapshot_writer_output(sink, ordered,
+                                             count * sizeof(*ordered)) ||
+       librdf_storage_snapshot_writer_align(sink))
+      goto tidy;
+  }
+
+  /* context table from the last, (c, s, p, o), index */
+  for(i = 0; i < count; i++) {
+    if(ordered[i].ids[0] && (!i || ordered[i].ids[0] != ordered[i - 1].ids[0]))
+      contexts_count++;
+  }
+  if(contexts_count) {
+    contexts=LIBRDF_CALLOC(librdf_storage_snapshot_context*, contexts_count,
+                           sizeof(*contexts));
+    if(!contexts)
+      goto tidy;
+    for(i = 0, n = 0; i < count; i++) {
+      if(!ordered[i].ids[0])
+        continue;
+      if(!n || contexts[n - 1].id != ordered[i].ids[0]) {
+        contexts[n].id=ordered[i].ids[0];
+        contexts[n].start=i;
+        n++;
+      }
+      contexts[n - 1].end=i + 1;
+    }
+  }
+
+  header.contexts_offset=sink->position;
+  header.contexts_count=(u32)contexts_count;
+  if(librdf_storage_snapshot_writer_output(sink, contexts,
+                                           contexts_count * sizeof(*contexts)) ||
+     librdf_storage_snapshot_writer_align(sink))
+    goto tidy;
+
+  header.file_size=sink->position;
+  if(sink->fh) {
+    if(fseek(sink->fh, 0, SEEK_SET) ||
+       fwrite(&header, 1, sizeof(header), sink->fh) != sizeof(header))
+      goto tidy;
+  } else
+    memcpy(sink->data, &header, sizeof(header));
+
+  status=0;
+
+  tidy:
+  if(contexts)
+    LIBRDF_FREE(librdf_storage_snapshot_context*, contexts);
+  if(ordered)
+    LIBRDF_FREE(librdf_storage_snapshot_quad*, ordered);
+  if(offsets)
+    LIBRDF_FREE(u64*, offsets);
+  if(new_ids)
+    LIBRDF_FREE(u32*, new_ids);
+  if(terms)
+    LIBRDF_FREE(librdf_storage_snapshot_writer_term*, terms);
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_snapshot_writer_read:
+ * @writer: writer to set up
+ * @storage: storage to read
+ *
+ * INTERNAL - Set up a writer and add all the statements of a storage.
+ * The writer must be cleared with librdf_storage_snapshot_writer_clear()
+ * even on failure.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_snapshot_writer_read(librdf_storage_snapshot_writer* writer,
+                                    librdf_storage* storage)
+{
+  librdf_stream* stream;
+  int status=0;
+
+  memset(writer, 0, sizeof(*writer));
+  writer->world=storage->world;
+
+  writer->term2id=librdf_new_hash(storage->world, "memory-flat");
+  if(!writer->term2id)
+    return 1;
+  if(librdf_hash_open(writer->term2id, NULL, 0, 1, 1, NULL)) {
+    librdf_free_hash(writer->term2id);
+    writer->term2id=NULL;
+    return 1;
+  }
+
+  stream=librdf_storage_serialise(storage);
+  if(!stream)
+    return 1;
+
+  for(; !librdf_stream_end(stream); librdf_stream_next(stream)) {
+    librdf_statement* statement=librdf_stream_get_object(stream);
+    librdf_node* context_node=librdf_stream_get_context2(stream);
+
+    if(!statement ||
+       librdf_storage_snapshot_writer_add(writer, statement, context_node)) {
+      status=1;
+      break;
+    }
+  }
+  librdf_free_stream(stream);
+
+  return status;
+}
+
+
+/* Free the resources of a writer */
+static void
+librdf_storage_snapshot_writer_clear(librdf_storage_snapshot_writer* writer)
+{
+  if(writer->buffer)
+    LIBRDF_FREE(char*, writer->buffer);
+  if(writer->quads)
+    LIBRDF_FREE(librdf_storage_snapshot_quad*, writer->quads);
+  if(writer->term_offsets)
+    LIBRDF_FREE(u64*, writer->term_offsets);
+  if(writer->term_data)
+    LIBRDF_FREE(char*, writer->term_data);
+  if(writer->term2id) {
+    librdf_hash_close(writer->term2id);
+    librdf_free_hash(writer->term2id);
+  }
+}
+
+
+/**
+ * librdf_storage_write_snapshot:
+ * @storage: #librdf_storage object
+ * @filename: snapshot file to write
+ *
+ * Write all the statements of a storage, with their contexts, to a
+ * snapshot file that the "snapshot" storage can open.
+ *
+ * The file is written under a temporary name next to @filename and
+ * renamed over it when complete, so readers never see a partial file.
+ *
+ * Return value: non 0 on failure
+ **/
+int
+librdf_storage_write_snapshot(librdf_storage* storage, const char *filename)
+{
+  librdf_storage_snapshot_writer writer;
+  librdf_storage_snapshot_sink sink;
+  char* temp_filename;
+  int status;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, 1);
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(filename, string, 1);
+
+  status=librdf_storage_snapshot_writer_read(&writer, storage);
+
+  temp_filename=LIBRDF_MALLOC(char*, strlen(filename) + 5);
+  if(!temp_filename)
+    status=1;
+
+  if(!status) {
+    memset(&sink, 0, sizeof(sink));
+    sprintf(temp_filename, "%s.tmp", filename);
+    sink.fh=fopen(temp_filename, "wb");
+    if(!sink.fh) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Failed to create snapshot file '%s'", temp_filename);
+      status=1;
+    } else {
+      status=librdf_storage_snapshot_writer_save(&writer, &sink);
+      if(fclose(sink.fh))
+        status=1;
+
+#ifdef WIN32
+      if(!status)
+        remove(filename);
+#endif
+      if(!status && rename(temp_filename, filename)) {
+        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                   "Failed to rename '%s' to snapshot file '%s'",
+                   temp_filename, filename);
+        status=1;
+      }
+      if(status) {
+        librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                   "Failed to write snapshot file '%s'", filename);
+        remove(temp_filename);
+      }
+    }
+  }
+
+  if(temp_filename)
+    LIBRDF_FREE(char*, temp_filename);
+  librdf_storage_snapshot_writer_clear(&writer);
+
+  return status;
+}
+
+
+#ifdef STORAGE_SNAPSHOT
+
+/* term dictionary functions */
+
+/*
+ * librdf_storage_snapshot_term_to_id:
+ * @storage: the storage
+ * @node: term to look up
+ * @id_p: pointer to store the term id
+ *
+ * INTERNAL - Binary search the sorted term dictionary for a term.
+ *
+ * Return value: 0 on success, <0 if the term is not in the dictionary,
+ * >0 on failure
+ */
+static int
+librdf_storage_snapshot_term_to_id(librdf_storage* storage, librdf_node* node,
+                                   u32* id_p)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+  /* not shared in the instance, readers may be concurrent */
+  unsigned char* buffer=NULL;
+  size_t buffer_len=0;
+  size_t len;
+  u32 low=0;
+  u32 high=context->header->terms_count;
+  int status=-1;
+
+  len=librdf_storage_snapshot_encode_node(&buffer, &buffer_len, node);
+  if(!len) {
+    if(buffer)
+      LIBRDF_FREE(char*, buffer);
+    return 1;
+  }
+
+  while(low < high) {
+    u32 middle=low + (high - low) / 2;
+    u64 start=context->term_offsets[middle];
+    u64 end=context->term_offsets[middle + 1];
+    int cmp;
+
+    if(start > end || end > context->term_data_size) {
+      status=1; /* corrupt dictionary */
+      break;
+    }
+
+    cmp=librdf_storage_snapshot_term_compare(context->term_data + start,
+                                             (size_t)(end - start),
+                                             buffer, len);
+    if(!cmp) {
+      *id_p=middle + 1;
+      status=0;
+      break;
+    }
+    if(cmp < 0)
+      low=middle + 1;
+    else
+      high=middle;
+  }
+
+  LIBRDF_FREE(char*, buffer);
+  return status;
+}
+
+
+/* Get the node for a term id, decoding it on first use */
+static librdf_node*
+librdf_storage_snapshot_id_to_node(librdf_storage* storage, u32 id)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+  librdf_node* node;
+  u64 start, end;
+
+  if(!id || id > context->header->terms_count)
+    return NULL;
+
+  /* snapshots in memory have every term decoded when opened */
+  if(context->memory && context->nodes[id - 1])
+    return context->nodes[id - 1];
+
+  SNAPSHOT_NODES_LOCK(context);
+  node=context->nodes[id - 1];
+  if(!node) {
+    start=context->term_offsets[id - 1];
+    end=context->term_offsets[id];
+    if(start <= end && end <= context->term_data_size) {
+      node=librdf_node_decode(storage->world, NULL,
+                              (unsigned char*)context->term_data + start,
+                              (size_t)(end - start));
+      context->nodes[id - 1]=node;
+    }
+  }
+  SNAPSHOT_NODES_UNLOCK(context);
+
+  return node;
+}
+
+
+/*
+ * librdf_storage_snapshot_statement_to_quad:
+ * @storage: the storage
+ * @statement: statement or partial statement or NULL
+ * @context_node: context node or NULL
+ * @spoc: quad to fill in (s, p, o, c) order; 0 for missing parts
+ *
+ * INTERNAL - Map the terms of a statement and context to ids
+ *
+ * Return value: 0 on success, <0 if a term is not in the dictionary,
+ * >0 on failure
+ */
+static int
+librdf_storage_snapshot_statement_to_quad(librdf_storage* storage,
+                                          librdf_statement* statement,
+                                          librdf_node* context_node,
+                                          librdf_storage_snapshot_quad* spoc)
+{
+  librdf_node* nodes[4];
+  int i;
+
+  nodes[0]=statement ? statement->subject : NULL;
+  nodes[1]=statement ? statement->predicate : NULL;
+  nodes[2]=statement ? statement->object : NULL;
+  nodes[3]=context_node;
+
+  for(i = 0; i < 4; i++) {
+    spoc->ids[i]=0;
+    if(nodes[i]) {
+      int status=librdf_storage_snapshot_term_to_id(storage, nodes[i],
+                                                    &spoc->ids[i]);
+      if(status)
+        return status;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_snapshot_pattern_range:
+ * @context: storage instance
+ * @pattern: (s, p, o, c) quad with 0 for wildcards
+ * @order_p: pointer to store the order searched
+ * @start_p: pointer to store the first index of the range
+ * @end_p: pointer to store the index after the range
+ *
+ * INTERNAL - Find the range of an index holding the statements matching
+ * the leading bound terms of a pattern in the best order.  With a
+ * context the (c, s, p, o) index is used and the range may still need
+ * filtering.
+ *
+ * Return value: non 0 if the range may hold statements not matching
+ */
+static int
+librdf_storage_snapshot_pattern_range(librdf_storage_snapshot_instance* context,
+                                      const librdf_storage_snapshot_quad* pattern,
+                                      librdf_storage_snapshot_order* order_p,
+                                      size_t* start_p, size_t* end_p)
+{
+  const u32 s=pattern->ids[0], p=pattern->ids[1], o=pattern->ids[2];
+  const u32 c=pattern->ids[3];
+  librdf_storage_snapshot_order order=LIBRDF_STORAGE_SNAPSHOT_SPOC;
+  librdf_storage_snapshot_quad key;
+  const librdf_storage_snapshot_quad* quads;
+  size_t count=(size_t)context->header->quads_count;
+  int length;
+  int filter=0;
+
+  if(c) {
+    order=LIBRDF_STORAGE_SNAPSHOT_CSPO;
+    length=1 + (!s ? 0 : (!p ? 1 : (!o ? 2 : 3)));
+    filter=(length < 4 && (p || o));
+  } else if(!s && p) {
+    order=LIBRDF_STORAGE_SNAPSHOT_POSC;
+    length=o ? 2 : 1;
+  } else if(!p && o) {
+    order=LIBRDF_STORAGE_SNAPSHOT_OSPC;
+    length=s ? 2 : 1;
+  } else
+    length=!s ? 0 : (!p ? 1 : (!o ? 2 : 3));
+
+  quads=context->indexes[order];
+  librdf_storage_snapshot_quad_to_order(pattern, order, &key);
+
+  *order_p=order;
+  *start_p=librdf_storage_snapshot_bound(quads, count, &key, length, 0);
+  *end_p=librdf_storage_snapshot_bound(quads, count, &key, length, 1);
+
+  return filter;
+}
+
+
+/* functions implementing storage api */
+
+static int
+librdf_storage_snapshot_init(librdf_storage* storage, const char *name,
+                             librdf_hash* options)
+{
+  librdf_storage_snapshot_instance* context;
+  int status=1;
+
+  context = LIBRDF_CALLOC(librdf_storage_snapshot_instance*, 1, sizeof(*context));
+  if(!context)
+    goto done;
+
+  librdf_storage_set_instance(storage, context);
+#ifdef WITH_THREADS
+  pthread_mutex_init(&context->nodes_mutex, NULL);
+#endif
+
+  if(!name) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "No snapshot file name given");
+    goto done;
+  }
+
+  context->name=LIBRDF_MALLOC(char*, strlen(name) + 1);
+  if(!context->name)
+    goto done;
+  strcpy(context->name, name);
+
+  status=0;
+
+  done:
+  /* no options, might as well free them now */
+  if(options)
+    librdf_free_hash(options);
+
+  return status;
+}
+
+
+static void
+librdf_storage_snapshot_terminate(librdf_storage* storage)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+
+  if(context == NULL)
+    return;
+
+  if(context->name)
+    LIBRDF_FREE(char*, context->name);
+  if(context->memory)
+    LIBRDF_FREE(char*, context->memory);
+#ifdef WITH_THREADS
+  pthread_mutex_destroy(&context->nodes_mutex);
+#endif
+
+  LIBRDF_FREE(librdf_storage_snapshot_instance, context);
+}
+
+
+/*
+ * librdf_storage_snapshot_load:
+ * @storage: the storage
+ *
+ * INTERNAL - Map the snapshot file, or read it without mmap(), or use
+ * the snapshot in memory
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_snapshot_load(librdf_storage* storage)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+#ifdef LIBRDF_STORAGE_SNAPSHOT_USE_MMAP
+  struct stat sb;
+  void* file;
+  int fd;
+#else
+  FILE* fh;
+  long size;
+#endif
+
+  if(context->memory) {
+    context->file=context->memory;
+    context->file_size=context->memory_size;
+    return 0;
+  }
+
+#ifdef LIBRDF_STORAGE_SNAPSHOT_USE_MMAP
+  fd=open(context->name, O_RDONLY);
+  if(fd < 0)
+    return 1;
+  if(fstat(fd, &sb) || !sb.st_size) {
+    close(fd);
+    return 1;
+  }
+
+  file=mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(file == MAP_FAILED)
+    return 1;
+
+  context->file=(unsigned char*)file;
+  context->file_size=(size_t)sb.st_size;
+  context->mapped=1;
+#else
+  fh=fopen(context->name, "rb");
+  if(!fh)
+    return 1;
+  if(fseek(fh, 0, SEEK_END) || (size=ftell(fh)) <= 0 ||
+     fseek(fh, 0, SEEK_SET)) {
+    fclose(fh);
+    return 1;
+  }
+
+  context->file=LIBRDF_MALLOC(unsigned char*, (size_t)size);
+  if(!context->file) {
+    fclose(fh);
+    return 1;
+  }
+  context->file_size=(size_t)size;
+  if(fread(context->file, 1, context->file_size, fh) != context->file_size) {
+    fclose(fh);
+    LIBRDF_FREE(char*, context->file);
+    context->file=NULL;
+    context->file_size=0;
+    return 1;
+  }
+  fclose(fh);
+#endif
+
+  return 0;
+}
+
+
+/* Check a section of @size bytes at @offset lies in the file */
+static int
+librdf_storage_snapshot_check_section(librdf_storage_snapshot_instance* context,
+                                      u64 offset, u64 size)
+{
+  return (offset % LIBRDF_STORAGE_SNAPSHOT_ALIGN ||
+          offset > context->file_size ||
+          size > context->file_size - offset);
+}
+
+
+static int
+librdf_storage_snapshot_open(librdf_storage* storage, librdf_model* model)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+  const librdf_storage_snapshot_header* header;
+  u64 quads_size;
+  int order;
+
+  if(librdf_storage_snapshot_load(storage)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Failed to open snapshot file '%s'", context->name);
+    librdf_storage_snapshot_close(storage);
+    return 1;
+  }
+
+  header=(const librdf_storage_snapshot_header*)context->file;
+  if(context->file_size < sizeof(*header) ||
+     memcmp(header->magic, LIBRDF_STORAGE_SNAPSHOT_MAGIC,
+            LIBRDF_STORAGE_SNAPSHOT_MAGIC_LEN)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "File '%s' is not a snapshot", context->name);
+    librdf_storage_snapshot_close(storage);
+    return 1;
+  }
+  if(header->byte_order != LIBRDF_STORAGE_SNAPSHOT_BYTE_ORDER ||
+     header->version != LIBRDF_STORAGE_SNAPSHOT_VERSION) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Snapshot file '%s' has an unsupported version or byte order",
+               context->name);
+    librdf_storage_snapshot_close(storage);
+    return 1;
+  }
+
+  quads_size=header->quads_count * sizeof(librdf_storage_snapshot_quad);
+  if(header->file_size != context->file_size ||
+     header->quads_count > header->file_size / sizeof(librdf_storage_snapshot_quad) ||
+     librdf_storage_snapshot_check_section(context, header->term_offsets_offset,
+                                           ((u64)header->terms_count + 1) * sizeof(u64)) ||
+     librdf_storage_snapshot_check_section(context, header->term_data_offset, 0) ||
+     librdf_storage_snapshot_check_section(context, header->contexts_offset,
+                                           (u64)header->contexts_count * sizeof(librdf_storage_snapshot_context))) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Snapshot file '%s' is corrupt", context->name);
+    librdf_storage_snapshot_close(storage);
+    return 1;
+  }
+  for(order = 0; order < LIBRDF_STORAGE_SNAPSHOT_ORDERS; order++) {
+    if(librdf_storage_snapshot_check_section(context,
+                                             header->indexes_offset[order],
+                                             quads_size)) {
+      librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Snapshot file '%s' is corrupt", context->name);
+      librdf_storage_snapshot_close(storage);
+      return 1;
+    }
+    context->indexes[order]=(const librdf_storage_snapshot_quad*)(context->file + header->indexes_offset[order]);
+  }
+
+  context->header=header;
+  context->term_offsets=(const u64*)(context->file + header->term_offsets_offset);
+  context->term_data=context->file + header->term_data_offset;
+  context->term_data_size=context->file_size - header->term_data_offset;
+  context->contexts=(const librdf_storage_snapshot_context*)(context->file + header->contexts_offset);
+
+  /* zeroed pages are only touched as terms are decoded */
+  context->nodes=LIBRDF_CALLOC(librdf_node**,
+                               header->terms_count ? header->terms_count : 1,
+                               sizeof(librdf_node*));
+  if(!context->nodes) {
+    librdf_storage_snapshot_close(storage);
+    return 1;
+  }
+
+  if(context->memory) {
+    u32 id;
+
+    for(id = 1; id <= header->terms_count; id++) {
+      if(!librdf_storage_snapshot_id_to_node(storage, id)) {
+        librdf_storage_snapshot_close(storage);
+        return 1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_storage_snapshot_close:
+ * @storage: the storage
+ *
+ * Close the storage, unmapping the file and freeing decoded terms.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_snapshot_close(librdf_storage* storage)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+  u32 i;
+
+  if(context->nodes) {
+    for(i = 0; i < context->header->terms_count; i++) {
+      if(context->nodes[i])
+        librdf_free_node(context->nodes[i]);
+    }
+    LIBRDF_FREE(librdf_node**, context->nodes);
+    context->nodes=NULL;
+  }
+
+  /* a snapshot in memory is kept until the storage is freed */
+  if(context->file && context->file != context->memory) {
+#ifdef LIBRDF_STORAGE_SNAPSHOT_USE_MMAP
+    munmap(context->file, context->file_size);
+#else
+    LIBRDF_FREE(char*, context->file);
+#endif
+  }
+  context->file=NULL;
+  context->file_size=0;
+  context->header=NULL;
+
+  return 0;
+}
+
+
+static int
+librdf_storage_snapshot_size(librdf_storage* storage)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+
+  return (int)context->header->quads_count;
+}
+
+
+static int
+librdf_storage_snapshot_contains_statement(librdf_storage* storage,
+                                           librdf_statement* statement)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+  librdf_storage_snapshot_quad pattern;
+  librdf_storage_snapshot_order order;
+  size_t start, end;
+
+  if(librdf_storage_snapshot_statement_to_quad(storage, statement, NULL,
+                                               &pattern))
+    return 0;
+
+  librdf_storage_snapshot_pattern_range(context, &pattern, &order,
+                                        &start, &end);
+  return (start < end);
+}
+
+
+typedef struct {
+  librdf_storage *storage;
+  librdf_storage_snapshot_quad pattern;
+  librdf_storage_snapshot_order order;
+  int filter;
+  size_t position; /* in the index range */
+  size_t end;
+  librdf_statement current; /* static, shared terms */
+  librdf_node* context_node;
+} librdf_storage_snapshot_serialise_stream_context;
+
+
+/*
+ * librdf_storage_snapshot_serialise_settle:
+ * @scontext: stream context
+ *
+ * INTERNAL - Move to the next matching statement at or after the
+ * current position and decode its terms.
+ *
+ * Return value: non 0 at the end of the stream
+ */
+static int
+librdf_storage_snapshot_serialise_settle(librdf_storage_snapshot_serialise_stream_context* scontext)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)scontext->storage->instance;
+  const librdf_storage_snapshot_quad* quads=context->indexes[scontext->order];
+  librdf_storage_snapshot_quad spoc;
+
+  for(; scontext->position < scontext->end; scontext->position++) {
+    librdf_storage_snapshot_quad_from_order(&quads[scontext->position],
+                                            scontext->order, &spoc);
+    if(!scontext->filter ||
+       librdf_storage_snapshot_quad_match(&spoc, &scontext->pattern))
+      break;
+  }
+  if(scontext->position >= scontext->end)
+    return 1;
+
+  scontext->current.subject=librdf_storage_snapshot_id_to_node(scontext->storage,
+                                                               spoc.ids[0]);
+  scontext->current.predicate=librdf_storage_snapshot_id_to_node(scontext->storage,
+                                                                 spoc.ids[1]);
+  scontext->current.object=librdf_storage_snapshot_id_to_node(scontext->storage,
+                                                              spoc.ids[2]);
+  scontext->context_node=spoc.ids[3] ?
+    librdf_storage_snapshot_id_to_node(scontext->storage, spoc.ids[3]) : NULL;
+
+  if(!scontext->current.subject || !scontext->current.predicate ||
+     !scontext->current.object || (spoc.ids[3] && !scontext->context_node)) {
+    /* corrupt term */
+    scontext->position=scontext->end;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static librdf_stream*
+librdf_storage_snapshot_serialise_range(librdf_storage* storage,
+                                        librdf_statement* statement,
+                                        librdf_node* context_node)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+  librdf_storage_snapshot_serialise_stream_context* scontext;
+  librdf_stream* stream;
+  int status;
+
+  scontext = LIBRDF_CALLOC(librdf_storage_snapshot_serialise_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+
+  status=librdf_storage_snapshot_statement_to_quad(storage, statement,
+                                                   context_node,
+                                                   &scontext->pattern);
+  if(status) {
+    LIBRDF_FREE(librdf_storage_snapshot_serialise_stream_context, scontext);
+    /* a term that is not in the file matches nothing */
+    return (status < 0) ? librdf_new_empty_stream(storage->world) : NULL;
+  }
+
+  scontext->filter=librdf_storage_snapshot_pattern_range(context,
+                                                         &scontext->pattern,
+                                                         &scontext->order,
+                                                         &scontext->position,
+                                                         &scontext->end);
+
+  librdf_statement_init(storage->world, &scontext->current);
+
+  scontext->storage=storage;
+  librdf_storage_add_reference(scontext->storage);
+
+  librdf_storage_snapshot_serialise_settle(scontext);
+
+  stream=librdf_new_stream(storage->world,
+                           (void*)scontext,
+                           &librdf_storage_snapshot_serialise_end_of_stream,
+                           &librdf_storage_snapshot_serialise_next_statement,
+                           &librdf_storage_snapshot_serialise_get_statement,
+                           &librdf_storage_snapshot_serialise_finished);
+  if(!stream) {
+    librdf_storage_snapshot_serialise_finished((void*)scontext);
+    return NULL;
+  }
+
+  return stream;
+}
+
+
+static librdf_stream*
+librdf_storage_snapshot_serialise(librdf_storage* storage)
+{
+  return librdf_storage_snapshot_serialise_range(storage, NULL, NULL);
+}
+
+
+static int
+librdf_storage_snapshot_serialise_end_of_stream(void* context)
+{
+  librdf_storage_snapshot_serialise_stream_context* scontext=(librdf_storage_snapshot_serialise_stream_context*)context;
+
+  return (scontext->position >= scontext->end);
+}
+
+
+static int
+librdf_storage_snapshot_serialise_next_statement(void* context)
+{
+  librdf_storage_snapshot_serialise_stream_context* scontext=(librdf_storage_snapshot_serialise_stream_context*)context;
+
+  if(scontext->position >= scontext->end)
+    return 1;
+
+  scontext->position++;
+  return librdf_storage_snapshot_serialise_settle(scontext);
+}
+
+
+static void*
+librdf_storage_snapshot_serialise_get_statement(void* context, int flags)
+{
+  librdf_storage_snapshot_serialise_stream_context* scontext=(librdf_storage_snapshot_serialise_stream_context*)context;
+
+  if(scontext->position >= scontext->end)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return &scontext->current;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return scontext->context_node;
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_snapshot_serialise_finished(void* context)
+{
+  librdf_storage_snapshot_serialise_stream_context* scontext=(librdf_storage_snapshot_serialise_stream_context*)context;
+
+  /* the terms belong to the storage */
+  if(scontext->storage)
+    librdf_storage_remove_reference(scontext->storage);
+
+  LIBRDF_FREE(librdf_storage_snapshot_serialise_stream_context, scontext);
+}
+
+
+/**
+ * librdf_storage_snapshot_find_statements:
+ * @storage: the storage
+ * @statement: the statement to match
+ *
+ * Return a stream of statements matching the given statement (or
+ * all statements if NULL) in any context.  Parts (subject, predicate,
+ * object) of the statement can be empty in which case any statement
+ * part will match that.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_snapshot_find_statements(librdf_storage* storage,
+                                        librdf_statement* statement)
+{
+  return librdf_storage_snapshot_serialise_range(storage, statement, NULL);
+}
+
+
+static librdf_stream*
+librdf_storage_snapshot_context_serialise(librdf_storage* storage,
+                                          librdf_node* context_node)
+{
+  return librdf_storage_snapshot_serialise_range(storage, NULL, context_node);
+}
+
+
+/**
+ * librdf_storage_snapshot_find_statements_in_context:
+ * @storage: the storage
+ * @statement: the statement to match
+ * @context_node: context node or NULL for any
+ *
+ * Find statements matching a pattern in one context, searching the
+ * (context, subject, predicate, object) index.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_snapshot_find_statements_in_context(librdf_storage* storage,
+                                                   librdf_statement* statement,
+                                                   librdf_node* context_node)
+{
+  return librdf_storage_snapshot_serialise_range(storage, statement,
+                                                 context_node);
+}
+
+
+typedef struct {
+  librdf_storage *storage;
+  u32 index; /* in the context table */
+} librdf_storage_snapshot_get_contexts_iterator_context;
+
+
+static int
+librdf_storage_snapshot_get_contexts_is_end(void* iterator)
+{
+  librdf_storage_snapshot_get_contexts_iterator_context* icontext=(librdf_storage_snapshot_get_contexts_iterator_context*)iterator;
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)icontext->storage->instance;
+
+  return (icontext->index >= context->header->contexts_count);
+}
+
+
+static int
+librdf_storage_snapshot_get_contexts_next_method(void* iterator)
+{
+  librdf_storage_snapshot_get_contexts_iterator_context* icontext=(librdf_storage_snapshot_get_contexts_iterator_context*)iterator;
+
+  if(librdf_storage_snapshot_get_contexts_is_end(iterator))
+    return 1;
+
+  icontext->index++;
+  return librdf_storage_snapshot_get_contexts_is_end(iterator);
+}
+
+
+static void*
+librdf_storage_snapshot_get_contexts_get_method(void* iterator, int flags)
+{
+  librdf_storage_snapshot_get_contexts_iterator_context* icontext=(librdf_storage_snapshot_get_contexts_iterator_context*)iterator;
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)icontext->storage->instance;
+
+  if(librdf_storage_snapshot_get_contexts_is_end(iterator))
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return librdf_storage_snapshot_id_to_node(icontext->storage,
+                                                context->contexts[icontext->index].id);
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return NULL;
+
+    default:
+      librdf_log(icontext->storage->world,
+                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+                 "Unknown iterator method flag %d", flags);
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_snapshot_get_contexts_finished(void* iterator)
+{
+  librdf_storage_snapshot_get_contexts_iterator_context* icontext=(librdf_storage_snapshot_get_contexts_iterator_context*)iterator;
+
+  librdf_storage_remove_reference(icontext->storage);
+
+  LIBRDF_FREE(librdf_storage_snapshot_get_contexts_iterator_context, icontext);
+}
+
+
+/**
+ * librdf_storage_snapshot_get_contexts:
+ * @storage: input storage
+ *
+ * Return an iterator over the context nodes in the context table.
+ *
+ * Return value: #librdf_iterator of context nodes or NULL on failure
+ **/
+static librdf_iterator*
+librdf_storage_snapshot_get_contexts(librdf_storage* storage)
+{
+  librdf_storage_snapshot_get_contexts_iterator_context* icontext;
+  librdf_iterator* iterator;
+
+  icontext = LIBRDF_CALLOC(librdf_storage_snapshot_get_contexts_iterator_context*, 1,
+                           sizeof(*icontext));
+  if(!icontext)
+    return NULL;
+
+  icontext->storage=storage;
+  librdf_storage_add_reference(icontext->storage);
+
+  iterator=librdf_new_iterator(storage->world,
+                               (void*)icontext,
+                               &librdf_storage_snapshot_get_contexts_is_end,
+                               &librdf_storage_snapshot_get_contexts_next_method,
+                               &librdf_storage_snapshot_get_contexts_get_method,
+                               &librdf_storage_snapshot_get_contexts_finished);
+  if(!iterator)
+    librdf_storage_snapshot_get_contexts_finished(icontext);
+
+  return iterator;
+}
+
+
+/**
+ * librdf_storage_snapshot_estimate_statements:
+ * @storage: #librdf_storage object
+ * @statement: partial statement pattern or NULL
+ * @distinct: 0 or a #librdf_statement_part
+ *
+ * Count the statements matching a pattern from the index range.
+ * Distinct counts are not kept.
+ *
+ * Return value: count or < 0 if @distinct is not 0
+ **/
+static int
+librdf_storage_snapshot_estimate_statements(librdf_storage* storage,
+                                            librdf_statement* statement,
+                                            int distinct)
+{
+  librdf_storage_snapshot_instance* context=(librdf_storage_snapshot_instance*)storage->instance;
+  librdf_storage_snapshot_quad pattern;
+  librdf_storage_snapshot_order order;
+  size_t start, end;
+  int status;
+
+  if(distinct)
+    return -1;
+
+  status=librdf_storage_snapshot_statement_to_quad(storage, statement, NULL,
+                                                   &pattern);
+  if(status)
+    return (status < 0) ? 0 : -1;
+
+  librdf_storage_snapshot_pattern_range(context, &pattern, &order,
+                                        &start, &end);
+  return (int)(end - start);
+}
+
+
+/** Local entry point for dynamically loaded storage module */
+static void
+librdf_storage_snapshot_register_factory(librdf_storage_factory *factory)
+{
+  LIBRDF_ASSERT_CONDITION(!strncmp(factory->name, "snapshot", 8));
+
+  factory->version                  = LIBRDF_STORAGE_INTERFACE_VERSION;
+  factory->init                     = librdf_storage_snapshot_init;
+  factory->clone                    = NULL;
+  factory->terminate                = librdf_storage_snapshot_terminate;
+  factory->open                     = librdf_storage_snapshot_open;
+  factory->close                    = librdf_storage_snapshot_close;
+  factory->size                     = librdf_storage_snapshot_size;
+  factory->add_statement            = NULL;
+  factory->add_statements           = NULL;
+  factory->remove_statement         = NULL;
+  factory->contains_statement       = librdf_storage_snapshot_contains_statement;
+  factory->serialise                = librdf_storage_snapshot_serialise;
+  factory->find_statements          = librdf_storage_snapshot_find_statements;
+  factory->find_sources             = NULL;
+  factory->find_arcs                = NULL;
+  factory->find_targets             = NULL;
+  factory->context_add_statement    = NULL;
+  factory->context_remove_statement = NULL;
+  factory->context_serialise        = librdf_storage_snapshot_context_serialise;
+  factory->find_statements_in_context = librdf_storage_snapshot_find_statements_in_context;
+  factory->get_contexts             = librdf_storage_snapshot_get_contexts;
+  factory->sync                     = NULL;
+  factory->get_feature              = NULL;
+  factory->estimate_statements      = librdf_storage_snapshot_estimate_statements;
+}
+
+
+/*
+ * librdf_init_storage_snapshot:
+ * @world: world object
+ *
+ * INTERNAL - Initialise the built-in storage_snapshot module.
+ */
+void
+librdf_init_storage_snapshot(librdf_world *world)
+{
+  librdf_storage_register_factory(world, "snapshot",
+                                  "Read-only memory-mapped snapshot file",
+                                  &librdf_storage_snapshot_register_factory);
+}
+
+
+/**
+ * librdf_new_storage_memory_snapshot:
+ * @storage: #librdf_storage object to copy
+ *
+ * INTERNAL - Constructor - Create a "snapshot" storage holding a copy of
+ * all the statements of a storage in memory.
+ *
+ * The copy is read-only and never changes, so any number of threads
+ * may read it without locking once it is opened.  The caller must
+ * stop other threads changing @storage while it is read.
+ *
+ * Return value: new #librdf_storage object or NULL on failure
+ **/
+librdf_storage*
+librdf_new_storage_memory_snapshot(librdf_storage* storage)
+{
+  librdf_storage_snapshot_writer writer;
+  librdf_storage_snapshot_sink sink;
+  librdf_storage_snapshot_instance* context;
+  librdf_storage* snapshot;
+  int status;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(storage, librdf_storage, NULL);
+
+  memset(&sink, 0, sizeof(sink));
+
+  status=librdf_storage_snapshot_writer_read(&writer, storage);
+  if(!status)
+    status=librdf_storage_snapshot_writer_save(&writer, &sink);
+  librdf_storage_snapshot_writer_clear(&writer);
+
+  if(status) {
+    if(sink.data)
+      LIBRDF_FREE(char*, sink.data);
+    return NULL;
+  }
+
+  snapshot=librdf_new_storage(storage->world, "snapshot", "memory", NULL);
+  if(!snapshot) {
+    LIBRDF_FREE(char*, sink.data);
+    return NULL;
+  }
+
+  context=(librdf_storage_snapshot_instance*)snapshot->instance;
+  context->memory=sink.data;
+  context->memory_size=(size_t)sink.position;
+
+  return snapshot;
+}
+
+#endif /* STORAGE_SNAPSHOT */
@@ -0,0 +1,1238 @@
+/* -*- Mode: c; c-basic-offset: 2 -*-
+ *
+ * rdf_storage_sorted.c - RDF Storage in memory using sorted arrays of term ids
+ *
+ * This package is Free Software and part of Redland http://librdf.org/
+ *
+ * It is licensed under the following three licenses as alternatives:
+ *   1. GNU Lesser General Public License (LGPL) V2.1 or any newer version
+ *   2. GNU General Public License (GPL) V2 or any newer version
+ *   3. Apache License, V2.0 or any newer version
+ *
+ * You may not use this file except in compliance with at least one of
+ * the above three licenses.
+ *
+ * See LICENSE.html or LICENSE.txt at the top of this package for the
+ * complete terms and further detail along with the license texts for
+ * the licenses in COPYING.LIB, COPYING and LICENSE-2.0.txt respectively.
+ *
+ *
+ */
+
+/*
+ * The "sorted" storage is an in-memory store for read-mostly models.
+ * Every term is given a 32 bit id from a dictionary and each statement
+ * is kept as three ids in three packed arrays, sorted in (s, p, o),
+ * (p, o, s) and (o, s, p) order, so that any pattern is a binary
+ * searched range of one of them.
+ *
+ * Changes go into two small sorted delta arrays of added and removed
+ * statements that searches also consult; once either holds delta-size
+ * statements they are merged into the sorted arrays in one pass.
+ * Adding a stream of statements sorts them all and merges them at once.
+ *
+ * Terms are never removed from the dictionary.  Contexts are not
+ * supported.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <rdf_config.h>
+#endif
+
+#ifdef WIN32
+#include <win32_rdf_config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+#ifdef HAVE_STDLIB_H
+#include <stdlib.h>
+#endif
+#include <sys/types.h>
+
+#include <redland.h>
+#include <rdf_types.h>
+
+
+/* statements held in each delta array before merging */
+#define LIBRDF_STORAGE_SORTED_DELTA_SIZE 1024
+
+/* alignment of the sorted arrays - a cache line */
+#define LIBRDF_STORAGE_SORTED_ALIGN 64
+
+/* size of a term id in the dictionary hash */
+#define LIBRDF_STORAGE_SORTED_TERM_ID_SIZE sizeof(u32)
+
+
+/* sort orders of the statement arrays */
+typedef enum {
+  LIBRDF_STORAGE_SORTED_SPO,
+  LIBRDF_STORAGE_SORTED_POS,
+  LIBRDF_STORAGE_SORTED_OSP,
+  LIBRDF_STORAGE_SORTED_ORDERS
+} librdf_storage_sorted_order;
+
+/* statement part (0 subject, 1 predicate, 2 object) held in each
+ * position of a triple of each order */
+static const int librdf_storage_sorted_parts[LIBRDF_STORAGE_SORTED_ORDERS][3] = {
+  { 0, 1, 2 },
+  { 1, 2, 0 },
+  { 2, 0, 1 }
+};
+
+
+/* a statement as term ids in the positions of one order; 0 is no term */
+typedef struct
+{
+  u32 ids[3];
+} librdf_storage_sorted_triple;
+
+/* triples sorted in one order */
+typedef struct
+{
+  librdf_storage_sorted_triple* triples; /* aligned inside block */
+  void* block;
+  size_t size;
+} librdf_storage_sorted_array;
+
+typedef struct
+{
+  /* term dictionary: encoded term to id and id - 1 to term */
+  librdf_hash* term2id;
+  librdf_node** terms;
+  u32 terms_count;
+  size_t terms_size;
+  unsigned char* term_buffer;
+  size_t term_buffer_len;
+
+  /* merged statements, the same set in every order */
+  librdf_storage_sorted_array arrays[LIBRDF_STORAGE_SORTED_ORDERS];
+
+  /* pending changes in (s, p, o) order; added statements are not in
+   * the arrays and removed ones are */
+  librdf_storage_sorted_triple* added;
+  size_t added_count;
+  librdf_storage_sorted_triple* removed;
+  size_t removed_count;
+  size_t delta_size;
+} librdf_storage_sorted_instance;
+
+
+/* prototypes for local functions */
+static int librdf_storage_sorted_init(librdf_storage* storage, const char *name, librdf_hash* options);
+static void librdf_storage_sorted_terminate(librdf_storage* storage);
+static int librdf_storage_sorted_open(librdf_storage* storage, librdf_model* model);
+static int librdf_storage_sorted_close(librdf_storage* storage);
+static int librdf_storage_sorted_size(librdf_storage* storage);
+static int librdf_storage_sorted_add_statement(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_sorted_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
+static int librdf_storage_sorted_remove_statement(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_sorted_contains_statement(librdf_storage* storage, librdf_statement* statement);
+static librdf_stream* librdf_storage_sorted_serialise(librdf_storage* storage);
+static librdf_stream* librdf_storage_sorted_find_statements(librdf_storage* storage, librdf_statement* statement);
+static int librdf_storage_sorted_estimate_statements(librdf_storage* storage, librdf_statement* statement, int distinct);
+
+/* serialising implementing functions */
+static int librdf_storage_sorted_serialise_end_of_stream(void* context);
+static int librdf_storage_sorted_serialise_next_statement(void* context);
+static void* librdf_storage_sorted_serialise_get_statement(void* context, int flags);
+static void librdf_storage_sorted_serialise_finished(void* context);
+
+static void librdf_storage_sorted_register_factory(librdf_storage_factory *factory);
+
+
+/* triple functions */
+
+static int
+librdf_storage_sorted_triple_compare_prefix(const librdf_storage_sorted_triple* a,
+                                            const librdf_storage_sorted_triple* b,
+                                            int length)
+{
+  int i;
+
+  for(i = 0; i < length; i++) {
+    if(a->ids[i] != b->ids[i])
+      return (a->ids[i] < b->ids[i]) ? -1 : 1;
+  }
+  return 0;
+}
+
+
+/* qsort comparison of whole triples */
+static int
+librdf_storage_sorted_triple_compare(const void* a, const void* b)
+{
+  return librdf_storage_sorted_triple_compare_prefix((const librdf_storage_sorted_triple*)a,
+                                                     (const librdf_storage_sorted_triple*)b,
+                                                     3);
+}
+
+
+/* Reorder a triple from (s, p, o) order to another order */
+static void
+librdf_storage_sorted_triple_to_order(const librdf_storage_sorted_triple* spo,
+                                      librdf_storage_sorted_order order,
+                                      librdf_storage_sorted_triple* triple)
+{
+  int i;
+
+  for(i = 0; i < 3; i++)
+    triple->ids[i] = spo->ids[librdf_storage_sorted_parts[order][i]];
+}
+
+
+/* Reorder a triple from another order to (s, p, o) order */
+static void
+librdf_storage_sorted_triple_from_order(const librdf_storage_sorted_triple* triple,
+                                        librdf_storage_sorted_order order,
+                                        librdf_storage_sorted_triple* spo)
+{
+  int i;
+
+  for(i = 0; i < 3; i++)
+    spo->ids[librdf_storage_sorted_parts[order][i]] = triple->ids[i];
+}
+
+
+/*
+ * librdf_storage_sorted_bound:
+ * @triples: sorted triples
+ * @count: number of triples
+ * @key: key triple
+ * @length: number of leading positions of @key to compare
+ * @upper: non 0 for the upper bound
+ *
+ * INTERNAL - Binary search for the first triple whose first @length
+ * positions compare greater or equal (greater if @upper) to @key.
+ *
+ * Return value: index of the triple or @count
+ */
+static size_t
+librdf_storage_sorted_bound(const librdf_storage_sorted_triple* triples,
+                            size_t count,
+                            const librdf_storage_sorted_triple* key,
+                            int length, int upper)
+{
+  size_t low = 0;
+  size_t high = count;
+
+  while(low < high) {
+    size_t middle = low + (high - low) / 2;
+    int cmp = librdf_storage_sorted_triple_compare_prefix(&triples[middle],
+                                                          key, length);
+
+    if(cmp < 0 || (upper && !cmp))
+      low = middle + 1;
+    else
+      high = middle;
+  }
+
+  return low;
+}
+
+
+/* Check for a whole triple in sorted triples */
+static int
+librdf_storage_sorted_triples_contain(const librdf_storage_sorted_triple* triples,
+                                      size_t count,
+                                      const librdf_storage_sorted_triple* key)
+{
+  size_t i = librdf_storage_sorted_bound(triples, count, key, 3, 0);
+
+  return (i < count &&
+          !librdf_storage_sorted_triple_compare_prefix(&triples[i], key, 3));
+}
+
+
+/*
+ * librdf_storage_sorted_delta_update:
+ * @triples: sorted delta triples with room for one more
+ * @count: pointer to number of triples
+ * @spo: triple to insert or delete
+ * @add: non 0 to insert, 0 to delete
+ *
+ * INTERNAL - Insert a triple into a delta array or delete it, keeping
+ * the array sorted.
+ *
+ * Return value: non 0 if the triple was already present on insert or
+ * missing on delete
+ */
+static int
+librdf_storage_sorted_delta_update(librdf_storage_sorted_triple* triples,
+                                   size_t* count,
+                                   const librdf_storage_sorted_triple* spo,
+                                   int add)
+{
+  size_t i = librdf_storage_sorted_bound(triples, *count, spo, 3, 0);
+  int found = (i < *count &&
+               !librdf_storage_sorted_triple_compare_prefix(&triples[i], spo, 3));
+
+  if(add) {
+    if(found)
+      return 1;
+    memmove(&triples[i + 1], &triples[i], (*count - i) * sizeof(*triples));
+    triples[i] = *spo;
+    (*count)++;
+  } else {
+    if(!found)
+      return 1;
+    memmove(&triples[i], &triples[i + 1], (*count - i - 1) * sizeof(*triples));
+    (*count)--;
+  }
+
+  return 0;
+}
+
+
+/* Allocate room for triples aligned to a cache line */
+static librdf_storage_sorted_triple*
+librdf_storage_sorted_alloc_triples(size_t count, void** block_p)
+{
+  char* block;
+  size_t offset;
+
+  block = LIBRDF_MALLOC(char*, (count ? count : 1) * sizeof(librdf_storage_sorted_triple) +
+                        LIBRDF_STORAGE_SORTED_ALIGN - 1);
+  if(!block)
+    return NULL;
+
+  offset = (LIBRDF_STORAGE_SORTED_ALIGN -
+            ((size_t)block % LIBRDF_STORAGE_SORTED_ALIGN)) % LIBRDF_STORAGE_SORTED_ALIGN;
+  *block_p = block;
+  return (librdf_storage_sorted_triple*)(block + offset);
+}
+
+
+/* term dictionary functions */
+
+/*
+ * librdf_storage_sorted_term_to_id:
+ * @storage: the storage
+ * @node: term to look up
+ * @add: non 0 to give the term a new id if it has none
+ * @id_p: pointer to store the term id
+ *
+ * INTERNAL - Map a term to its id in the term dictionary.
+ *
+ * Return value: 0 on success, <0 if the term has no id and @add is 0,
+ * >0 on failure
+ */
+static int
+librdf_storage_sorted_term_to_id(librdf_storage* storage, librdf_node* node,
+                                 int add, u32* id_p)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+  librdf_hash_datum key, value; /* on stack */
+  librdf_hash_cursor* cursor;
+  size_t len;
+  int status;
+  u32 id;
+
+  len=librdf_node_encode(node, NULL, 0);
+  if(!len)
+    return 1;
+  if(len > context->term_buffer_len) {
+    unsigned char* buffer=LIBRDF_MALLOC(unsigned char*, len);
+    if(!buffer)
+      return 1;
+    if(context->term_buffer)
+      LIBRDF_FREE(char*, context->term_buffer);
+    context->term_buffer=buffer;
+    context->term_buffer_len=len;
+  }
+  if(!librdf_node_encode(node, context->term_buffer, len))
+    return 1;
+
+  key.data=context->term_buffer; key.size=len;
+  value.data=NULL; value.size=0;
+
+  cursor=librdf_new_hash_cursor(context->term2id);
+  if(!cursor)
+    return 1;
+  status=librdf_hash_cursor_set(cursor, &key, &value);
+  if(!status) {
+    if(value.size == LIBRDF_STORAGE_SORTED_TERM_ID_SIZE)
+      memcpy(id_p, value.data, LIBRDF_STORAGE_SORTED_TERM_ID_SIZE);
+    else
+      status=-1;
+  }
+  librdf_free_hash_cursor(cursor);
+
+  if(!status)
+    return 0;
+  if(status < 0)
+    return 1; /* corrupt dictionary */
+  if(!add)
+    return -1;
+
+  /* new term */
+  if(context->terms_count == context->terms_size) {
+    size_t new_size=context->terms_size ? context->terms_size * 2 : 1024;
+    librdf_node** new_terms=LIBRDF_MALLOC(librdf_node**,
+                                          new_size * sizeof(librdf_node*));
+    if(!new_terms)
+      return 1;
+    if(context->terms) {
+      memcpy(new_terms, context->terms,
+             context->terms_count * sizeof(librdf_node*));
+      LIBRDF_FREE(librdf_node**, context->terms);
+    }
+    context->terms=new_terms;
+    context->terms_size=new_size;
+  }
+
+  id=context->terms_count + 1;
+  value.data=&id; value.size=LIBRDF_STORAGE_SORTED_TERM_ID_SIZE;
+  if(librdf_hash_put(context->term2id, &key, &value))
+    return 1;
+
+  context->terms[context->terms_count]=librdf_new_node_from_node(node);
+  if(!context->terms[context->terms_count])
+    return 1;
+  context->terms_count++;
+
+  *id_p=id;
+  return 0;
+}
+
+
+/*
+ * librdf_storage_sorted_statement_to_triple:
+ * @storage: the storage
+ * @statement: statement or partial statement
+ * @add: non 0 to add terms to the dictionary
+ * @spo: triple to fill in (s, p, o) order; 0 for missing parts
+ *
+ * INTERNAL - Map the terms of a statement to ids
+ *
+ * Return value: 0 on success, <0 if a term is not in the dictionary
+ * and @add is 0, >0 on failure
+ */
+static int
+librdf_storage_sorted_statement_to_triple(librdf_storage* storage,
+                                          librdf_statement* statement,
+                                          int add,
+                                          librdf_storage_sorted_triple* spo)
+{
+  librdf_node* nodes[3];
+  int i;
+
+  nodes[0]=statement ? statement->subject : NULL;
+  nodes[1]=statement ? statement->predicate : NULL;
+  nodes[2]=statement ? statement->object : NULL;
+
+  for(i = 0; i < 3; i++) {
+    spo->ids[i]=0;
+    if(nodes[i]) {
+      int status=librdf_storage_sorted_term_to_id(storage, nodes[i], add,
+                                                  &spo->ids[i]);
+      if(status)
+        return status;
+    }
+  }
+
+  return 0;
+}
+
+
+/*
+ * librdf_storage_sorted_merge:
+ * @storage: the storage
+ * @adds: sorted (s, p, o) triples to add, or NULL
+ * @adds_count: number of triples to add
+ * @removes: sorted (s, p, o) triples to remove, or NULL
+ * @removes_count: number of triples to remove
+ *
+ * INTERNAL - Rebuild every sorted array in one pass over it, leaving
+ * out removed triples and merging in added ones that are not present.
+ *
+ * Return value: non 0 on failure, when the arrays are unchanged
+ */
+static int
+librdf_storage_sorted_merge(librdf_storage* storage,
+                            const librdf_storage_sorted_triple* adds,
+                            size_t adds_count,
+                            const librdf_storage_sorted_triple* removes,
+                            size_t removes_count)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+  librdf_storage_sorted_triple* new_triples[LIBRDF_STORAGE_SORTED_ORDERS];
+  void* new_blocks[LIBRDF_STORAGE_SORTED_ORDERS];
+  librdf_storage_sorted_triple* ordered_adds=NULL;
+  size_t capacity=context->arrays[0].size + adds_count;
+  int order;
+  int status=0;
+
+  for(order = 0; order < LIBRDF_STORAGE_SORTED_ORDERS; order++)
+    new_blocks[order]=NULL;
+
+  /* allocate everything first so that failure changes nothing */
+  for(order = 0; order < LIBRDF_STORAGE_SORTED_ORDERS; order++) {
+    new_triples[order]=librdf_storage_sorted_alloc_triples(capacity,
+                                                           &new_blocks[order]);
+    if(!new_triples[order])
+      status=1;
+  }
+  if(!status && adds_count) {
+    ordered_adds=LIBRDF_MALLOC(librdf_storage_sorted_triple*,
+                               adds_count * sizeof(*ordered_adds));
+    if(!ordered_adds)
+      status=1;
+  }
+  if(status) {
+    for(order = 0; order < LIBRDF_STORAGE_SORTED_ORDERS; order++) {
+      if(new_blocks[order])
+        LIBRDF_FREE(char*, new_blocks[order]);
+    }
+    return 1;
+  }
+
+  for(order = 0; order < LIBRDF_STORAGE_SORTED_ORDERS; order++) {
+    librdf_storage_sorted_array* array=&context->arrays[order];
+    librdf_storage_sorted_triple* out=new_triples[order];
+    size_t i=0, j=0, n=0;
+
+    if(adds_count) {
+      for(j = 0; j < adds_count; j++)
+        librdf_storage_sorted_triple_to_order(&adds[j],
+                                              (librdf_storage_sorted_order)order,
+                                              &ordered_adds[j]);
+      if(order != LIBRDF_STORAGE_SORTED_SPO)
+        qsort(ordered_adds, adds_count, sizeof(*ordered_adds),
+              librdf_storage_sorted_triple_compare);
+      j=0;
+    }
+
+    while(i < array->size || j < adds_count) {
+      int cmp;
+
+      if(i < array->size && removes_count) {
+        librdf_storage_sorted_triple spo;
+
+        librdf_storage_sorted_triple_from_order(&array->triples[i],
+                                                (librdf_storage_sorted_order)order,
+                                                &spo);
+        if(librdf_storage_sorted_triples_contain(removes, removes_count, &spo)) {
+          i++;
+          continue;
+        }
+      }
+
+      if(i == array->size)
+        cmp=1;
+      else if(j == adds_count)
+        cmp=-1;
+      else
+        cmp=librdf_storage_sorted_triple_compare(&array->triples[i],
+                                                 &ordered_adds[j]);
+
+      if(cmp <= 0) {
+        out[n++]=array->triples[i++];
+        if(!cmp)
+          j++; /* already present */
+      } else
+        out[n++]=ordered_adds[j++];
+    }
+
+    if(array->block)
+      LIBRDF_FREE(char*, array->block);
+    array->block=new_blocks[order];
+    array->triples=out;
+    array->size=n;
+  }
+
+  if(ordered_adds)
+    LIBRDF_FREE(librdf_storage_sorted_triple*, ordered_adds);
+
+  return 0;
+}
+
+
+/* Merge the delta arrays into the sorted arrays */
+static int
+librdf_storage_sorted_flush(librdf_storage* storage)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+
+  if(!context->added_count && !context->removed_count)
+    return 0;
+
+  if(librdf_storage_sorted_merge(storage,
+                                 context->added, context->added_count,
+                                 context->removed, context->removed_count))
+    return 1;
+
+  context->added_count=0;
+  context->removed_count=0;
+  return 0;
+}
+
+
+/* functions implementing storage api */
+
+/*
+ * Options:
+ *   delta-size: statements added or removed before they are merged
+ *     into the sorted arrays (default 1024)
+ */
+static int
+librdf_storage_sorted_init(librdf_storage* storage, const char *name,
+                           librdf_hash* options)
+{
+  librdf_storage_sorted_instance* context;
+  long delta_size;
+
+  context = LIBRDF_CALLOC(librdf_storage_sorted_instance*, 1, sizeof(*context));
+  if(!context) {
+    if(options)
+      librdf_free_hash(options);
+    return 1;
+  }
+
+  librdf_storage_set_instance(storage, context);
+
+  delta_size=librdf_hash_get_as_long(options, "delta-size");
+  context->delta_size=(delta_size > 0) ? (size_t)delta_size :
+    LIBRDF_STORAGE_SORTED_DELTA_SIZE;
+
+  /* no more options, might as well free them now */
+  if(options)
+    librdf_free_hash(options);
+
+  return 0;
+}
+
+
+static void
+librdf_storage_sorted_terminate(librdf_storage* storage)
+{
+  if(storage->instance != NULL)
+    LIBRDF_FREE(librdf_storage_sorted_instance, storage->instance);
+}
+
+
+static int
+librdf_storage_sorted_open(librdf_storage* storage, librdf_model* model)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+  int order;
+
+  context->term2id=librdf_new_hash(storage->world, "memory-flat");
+  if(!context->term2id)
+    return 1;
+  if(librdf_hash_open(context->term2id, NULL, 0, 1, 1, NULL)) {
+    librdf_free_hash(context->term2id);
+    context->term2id=NULL;
+    return 1;
+  }
+
+  context->added=LIBRDF_MALLOC(librdf_storage_sorted_triple*,
+                               context->delta_size * sizeof(librdf_storage_sorted_triple));
+  context->removed=LIBRDF_MALLOC(librdf_storage_sorted_triple*,
+                                 context->delta_size * sizeof(librdf_storage_sorted_triple));
+  for(order = 0; order < LIBRDF_STORAGE_SORTED_ORDERS; order++) {
+    librdf_storage_sorted_array* array=&context->arrays[order];
+
+    array->triples=librdf_storage_sorted_alloc_triples(0, &array->block);
+    array->size=0;
+    if(!array->triples) {
+      librdf_storage_sorted_close(storage);
+      return 1;
+    }
+  }
+  if(!context->added || !context->removed) {
+    librdf_storage_sorted_close(storage);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+/**
+ * librdf_storage_sorted_close:
+ * @storage: the storage
+ *
+ * Close the storage, and free all content since there is no persistance.
+ *
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_sorted_close(librdf_storage* storage)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+  int order;
+  u32 i;
+
+  for(order = 0; order < LIBRDF_STORAGE_SORTED_ORDERS; order++) {
+    librdf_storage_sorted_array* array=&context->arrays[order];
+
+    if(array->block)
+      LIBRDF_FREE(char*, array->block);
+    array->block=NULL;
+    array->triples=NULL;
+    array->size=0;
+  }
+
+  if(context->added) {
+    LIBRDF_FREE(librdf_storage_sorted_triple*, context->added);
+    context->added=NULL;
+  }
+  if(context->removed) {
+    LIBRDF_FREE(librdf_storage_sorted_triple*, context->removed);
+    context->removed=NULL;
+  }
+  context->added_count=0;
+  context->removed_count=0;
+
+  if(context->terms) {
+    for(i = 0; i < context->terms_count; i++)
+      librdf_free_node(context->terms[i]);
+    LIBRDF_FREE(librdf_node**, context->terms);
+    context->terms=NULL;
+  }
+  context->terms_count=0;
+  context->terms_size=0;
+
+  if(context->term2id) {
+    librdf_hash_close(context->term2id);
+    librdf_free_hash(context->term2id);
+    context->term2id=NULL;
+  }
+
+  if(context->term_buffer) {
+    LIBRDF_FREE(char*, context->term_buffer);
+    context->term_buffer=NULL;
+  }
+  context->term_buffer_len=0;
+
+  return 0;
+}
+
+
+static int
+librdf_storage_sorted_size(librdf_storage* storage)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+
+  return (int)(context->arrays[0].size - context->removed_count +
+               context->added_count);
+}
+
+
+static int
+librdf_storage_sorted_add_statement(librdf_storage* storage,
+                                    librdf_statement* statement)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+  librdf_storage_sorted_triple spo;
+  librdf_storage_sorted_array* array=&context->arrays[LIBRDF_STORAGE_SORTED_SPO];
+
+  if(!statement->subject || !statement->predicate || !statement->object)
+    return 1;
+
+  if(librdf_storage_sorted_statement_to_triple(storage, statement, 1, &spo))
+    return 1;
+
+  if(librdf_storage_sorted_triples_contain(array->triples, array->size, &spo)) {
+    /* present unless removed since the last merge */
+    librdf_storage_sorted_delta_update(context->removed,
+                                       &context->removed_count, &spo, 0);
+    return 0;
+  }
+
+  /* merge a full delta before inserting */
+  if(context->added_count == context->delta_size &&
+     librdf_storage_sorted_flush(storage))
+    return 1;
+
+  librdf_storage_sorted_delta_update(context->added, &context->added_count,
+                                     &spo, 1);
+  return 0;
+}
+
+
+/*
+ * librdf_storage_sorted_add_statements:
+ * @storage: the storage
+ * @statement_stream: stream of statements
+ *
+ * Add a stream of statements by collecting, sorting and merging them
+ * all at once.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_sorted_add_statements(librdf_storage* storage,
+                                     librdf_stream* statement_stream)
+{
+  librdf_storage_sorted_triple* triples=NULL;
+  size_t count=0;
+  size_t size=0;
+  size_t i, n;
+  int status=0;
+
+  for(; !librdf_stream_end(statement_stream); librdf_stream_next(statement_stream)) {
+    librdf_statement* statement=librdf_stream_get_object(statement_stream);
+
+    if(!statement || !statement->subject || !statement->predicate ||
+       !statement->object) {
+      status=1;
+      break;
+    }
+
+    if(count == size) {
+      size_t new_size=size ? size * 2 : 4096;
+      librdf_storage_sorted_triple* new_triples;
+
+      new_triples=LIBRDF_MALLOC(librdf_storage_sorted_triple*,
+                                new_size * sizeof(*new_triples));
+      if(!new_triples) {
+        status=1;
+        break;
+      }
+      if(triples) {
+        memcpy(new_triples, triples, count * sizeof(*triples));
+        LIBRDF_FREE(librdf_storage_sorted_triple*, triples);
+      }
+      triples=new_triples;
+      size=new_size;
+    }
+
+    if(librdf_storage_sorted_statement_to_triple(storage, statement, 1,
+                                                 &triples[count])) {
+      status=1;
+      break;
+    }
+    count++;
+  }
+
+  if(!status && count) {
+    qsort(triples, count, sizeof(*triples),
+          librdf_storage_sorted_triple_compare);
+    /* drop duplicates */
+    for(i = 1, n = 1; i < count; i++) {
+      if(librdf_storage_sorted_triple_compare(&triples[i], &triples[n - 1]))
+        triples[n++]=triples[i];
+    }
+
+    status=librdf_storage_sorted_flush(storage);
+    if(!status)
+      status=librdf_storage_sorted_merge(storage, triples, n, NULL, 0);
+  }
+
+  if(triples)
+    LIBRDF_FREE(librdf_storage_sorted_triple*, triples);
+
+  return status;
+}
+
+
+static int
+librdf_storage_sorted_remove_statement(librdf_storage* storage,
+                                       librdf_statement* statement)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+  librdf_storage_sorted_triple spo;
+  librdf_storage_sorted_array* array=&context->arrays[LIBRDF_STORAGE_SORTED_SPO];
+  int status;
+
+  status=librdf_storage_sorted_statement_to_triple(storage, statement, 0, &spo);
+  if(status)
+    return (status < 0) ? 0 : 1;
+
+  if(!librdf_storage_sorted_delta_update(context->added,
+                                         &context->added_count, &spo, 0))
+    return 0;
+
+  if(!librdf_storage_sorted_triples_contain(array->triples, array->size, &spo))
+    return 0;
+
+  if(librdf_storage_sorted_triples_contain(context->removed,
+                                           context->removed_count, &spo))
+    return 0;
+
+  /* merge a full delta before inserting */
+  if(context->removed_count == context->delta_size &&
+     librdf_storage_sorted_flush(storage))
+    return 1;
+
+  librdf_storage_sorted_delta_update(context->removed, &context->removed_count,
+                                     &spo, 1);
+  return 0;
+}
+
+
+static int
+librdf_storage_sorted_contains_statement(librdf_storage* storage,
+                                         librdf_statement* statement)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+  librdf_storage_sorted_triple spo;
+  librdf_storage_sorted_array* array=&context->arrays[LIBRDF_STORAGE_SORTED_SPO];
+
+  if(librdf_storage_sorted_statement_to_triple(storage, statement, 0, &spo))
+    return 0;
+
+  if(librdf_storage_sorted_triples_contain(context->added,
+                                           context->added_count, &spo))
+    return 1;
+
+  return (librdf_storage_sorted_triples_contain(array->triples, array->size, &spo) &&
+          !librdf_storage_sorted_triples_contain(context->removed,
+                                                 context->removed_count, &spo));
+}
+
+
+/*
+ * librdf_storage_sorted_pattern_range:
+ * @context: storage instance
+ * @pattern: (s, p, o) triple with 0 for wildcards
+ * @order_p: pointer to store the order searched
+ * @start_p: pointer to store the first index of the range
+ * @end_p: pointer to store the index after the range
+ *
+ * INTERNAL - Find the range of a sorted array holding exactly the
+ * merged statements matching a pattern, using the order in which the
+ * bound terms come first.
+ */
+static void
+librdf_storage_sorted_pattern_range(librdf_storage_sorted_instance* context,
+                                    const librdf_storage_sorted_triple* pattern,
+                                    librdf_storage_sorted_order* order_p,
+                                    size_t* start_p, size_t* end_p)
+{
+  const u32 s=pattern->ids[0], p=pattern->ids[1], o=pattern->ids[2];
+  librdf_storage_sorted_order order=LIBRDF_STORAGE_SORTED_SPO;
+  librdf_storage_sorted_triple key;
+  librdf_storage_sorted_array* array;
+  int length;
+
+  if(!s && p) {
+    order=LIBRDF_STORAGE_SORTED_POS;
+    length=o ? 2 : 1;
+  } else if(!p && o) {
+    order=LIBRDF_STORAGE_SORTED_OSP;
+    length=s ? 2 : 1;
+  } else
+    length=!s ? 0 : (!p ? 1 : (!o ? 2 : 3));
+
+  array=&context->arrays[order];
+  librdf_storage_sorted_triple_to_order(pattern, order, &key);
+
+  *order_p=order;
+  *start_p=librdf_storage_sorted_bound(array->triples, array->size, &key,
+                                       length, 0);
+  *end_p=librdf_storage_sorted_bound(array->triples, array->size, &key,
+                                     length, 1);
+}
+
+
+/* Check a (s, p, o) triple against a pattern with 0 for wildcards */
+static int
+librdf_storage_sorted_triple_match(const librdf_storage_sorted_triple* spo,
+                                   const librdf_storage_sorted_triple* pattern)
+{
+  int i;
+
+  for(i = 0; i < 3; i++) {
+    if(pattern->ids[i] && pattern->ids[i] != spo->ids[i])
+      return 0;
+  }
+  return 1;
+}
+
+
+typedef struct {
+  librdf_storage *storage;
+  librdf_storage_sorted_triple pattern;
+  librdf_storage_sorted_order order;
+  size_t position; /* in the sorted array range */
+  size_t end;
+  size_t added_position; /* in the added delta after the range */
+  int at_end;
+  librdf_statement current; /* static, shared terms */
+} librdf_storage_sorted_serialise_stream_context;
+
+
+/*
+ * librdf_storage_sorted_serialise_settle:
+ * @scontext: stream context
+ *
+ * INTERNAL - Move to the next matching statement at or after the
+ * current position: first in the sorted array range, skipping removed
+ * statements, then in the added delta.
+ *
+ * Return value: non 0 at the end of the stream
+ */
+static int
+librdf_storage_sorted_serialise_settle(librdf_storage_sorted_serialise_stream_context* scontext)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)scontext->storage->instance;
+  librdf_storage_sorted_array* array=&context->arrays[scontext->order];
+  librdf_storage_sorted_triple spo;
+  int found=0;
+
+  while(!found && scontext->position < scontext->end &&
+        scontext->position < array->size) {
+    librdf_storage_sorted_triple_from_order(&array->triples[scontext->position],
+                                            scontext->order, &spo);
+    if(context->removed_count &&
+       librdf_storage_sorted_triples_contain(context->removed,
+                                             context->removed_count, &spo))
+      scontext->position++;
+    else
+      found=1;
+  }
+
+  if(!found) {
+    scontext->position=scontext->end;
+    while(scontext->added_position < context->added_count) {
+      spo=context->added[scontext->added_position];
+      if(librdf_storage_sorted_triple_match(&spo, &scontext->pattern)) {
+        found=1;
+        break;
+      }
+      scontext->added_position++;
+    }
+  }
+
+  if(!found) {
+    scontext->at_end=1;
+    return 1;
+  }
+
+  scontext->current.subject=context->terms[spo.ids[0] - 1];
+  scontext->current.predicate=context->terms[spo.ids[1] - 1];
+  scontext->current.object=context->terms[spo.ids[2] - 1];
+  return 0;
+}
+
+
+static librdf_stream*
+librdf_storage_sorted_serialise_range(librdf_storage* storage,
+                                      librdf_statement* statement)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+  librdf_storage_sorted_serialise_stream_context* scontext;
+  librdf_stream* stream;
+  int status;
+
+  scontext = LIBRDF_CALLOC(librdf_storage_sorted_serialise_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext)
+    return NULL;
+
+  status=librdf_storage_sorted_statement_to_triple(storage, statement, 0,
+                                                   &scontext->pattern);
+  if(status) {
+    LIBRDF_FREE(librdf_storage_sorted_serialise_stream_context, scontext);
+    /* a term that was never added matches nothing */
+    return (status < 0) ? librdf_new_empty_stream(storage->world) : NULL;
+  }
+
+  librdf_storage_sorted_pattern_range(context, &scontext->pattern,
+                                      &scontext->order,
+                                      &scontext->position, &scontext->end);
+
+  librdf_statement_init(storage->world, &scontext->current);
+
+  scontext->storage=storage;
+  librdf_storage_add_reference(scontext->storage);
+
+  librdf_storage_sorted_serialise_settle(scontext);
+
+  stream=librdf_new_stream(storage->world,
+                           (void*)scontext,
+                           &librdf_storage_sorted_serialise_end_of_stream,
+                           &librdf_storage_sorted_serialise_next_statement,
+                           &librdf_storage_sorted_serialise_get_statement,
+                           &librdf_storage_sorted_serialise_finished);
+  if(!stream) {
+    librdf_storage_sorted_serialise_finished((void*)scontext);
+    return NULL;
+  }
+
+  return stream;
+}
+
+
+static librdf_stream*
+librdf_storage_sorted_serialise(librdf_storage* storage)
+{
+  return librdf_storage_sorted_serialise_range(storage, NULL);
+}
+
+
+static int
+librdf_storage_sorted_serialise_end_of_stream(void* context)
+{
+  librdf_storage_sorted_serialise_stream_context* scontext=(librdf_storage_sorted_serialise_stream_context*)context;
+
+  return scontext->at_end;
+}
+
+
+static int
+librdf_storage_sorted_serialise_next_statement(void* context)
+{
+  librdf_storage_sorted_serialise_stream_context* scontext=(librdf_storage_sorted_serialise_stream_context*)context;
+
+  if(scontext->at_end)
+    return 1;
+
+  if(scontext->position < scontext->end)
+    scontext->position++;
+  else
+    scontext->added_position++;
+
+  return librdf_storage_sorted_serialise_settle(scontext);
+}
+
+
+static void*
+librdf_storage_sorted_serialise_get_statement(void* context, int flags)
+{
+  librdf_storage_sorted_serialise_stream_context* scontext=(librdf_storage_sorted_serialise_stream_context*)context;
+
+  if(scontext->at_end)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return &scontext->current;
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return NULL;
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_sorted_serialise_finished(void* context)
+{
+  librdf_storage_sorted_serialise_stream_context* scontext=(librdf_storage_sorted_serialise_stream_context*)context;
+
+  /* the terms belong to the dictionary */
+  if(scontext->storage)
+    librdf_storage_remove_reference(scontext->storage);
+
+  LIBRDF_FREE(librdf_storage_sorted_serialise_stream_context, scontext);
+}
+
+
+/**
+ * librdf_storage_sorted_find_statements:
+ * @storage: the storage
+ * @statement: the statement to match
+ *
+ * Return a stream of statements matching the given statement (or
+ * all statements if NULL).  Parts (subject, predicate, object) of the
+ * statement can be empty in which case any statement part will match that.
+ *
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_sorted_find_statements(librdf_storage* storage,
+                                      librdf_statement* statement)
+{
+  return librdf_storage_sorted_serialise_range(storage, statement);
+}
+
+
+/**
+ * librdf_storage_sorted_estimate_statements:
+ * @storage: #librdf_storage object
+ * @statement: partial statement pattern or NULL
+ * @distinct: 0 or a #librdf_statement_part
+ *
+ * Count the statements matching a pattern from the sorted range and
+ * the delta arrays.  Distinct counts are not kept.
+ *
+ * Return value: count or < 0 if @distinct is not 0
+ **/
+static int
+librdf_storage_sorted_estimate_statements(librdf_storage* storage,
+                                          librdf_statement* statement,
+                                          int distinct)
+{
+  librdf_storage_sorted_instance* context=(librdf_storage_sorted_instance*)storage->instance;
+  librdf_storage_sorted_triple pattern;
+  librdf_storage_sorted_order order;
+  size_t start, end;
+  size_t count;
+  size_t i;
+  int status;
+
+  if(distinct)
+    return -1;
+
+  status=librdf_storage_sorted_statement_to_triple(storage, statement, 0,
+                                                   &pattern);
+  if(status)
+    return (status < 0) ? 0 : -1;
+
+  librdf_storage_sorted_pattern_range(context, &pattern, &order, &start, &end);
+  count=end - start;
+
+  for(i = 0; i < context->added_count; i++) {
+    if(librdf_storage_sorted_triple_match(&context->added[i], &pattern))
+      count++;
+  }
+  for(i = 0; i < context->removed_count; i++) {
+    if(librdf_storage_sorted_triple_match(&context->removed[i], &pattern))
+      count--;
+  }
+
+  return (int)count;
+}
+
+
+/** Local entry point for dynamically loaded storage module */
+static void
+librdf_storage_sorted_register_factory(librdf_storage_factory *factory)
+{
+  LIBRDF_ASSERT_CONDITION(!strncmp(factory->name, "sorted", 6));
+
+  factory->version                  = LIBRDF_STORAGE_INTERFACE_VERSION;
+  factory->init                     = librdf_storage_sorted_init;
+  factory->clone                    = NULL;
+  factory->terminate                = librdf_storage_sorted_terminate;
+  factory->open                     = librdf_storage_sorted_open;
+  factory->close                    = librdf_storage_sorted_close;
+  factory->size                     = librdf_storage_sorted_size;
+  factory->add_statement            = librdf_storage_sorted_add_statement;
+  factory->add_statements           = librdf_storage_sorted_add_statements;
+  factory->remove_statement         = librdf_storage_sorted_remove_statement;
+  factory->contains_statement       = librdf_storage_sorted_contains_statement;
+  factory->serialise                = librdf_storage_sorted_serialise;
+  factory->find_statements          = librdf_storage_sorted_find_statements;
+  factory->find_sources             = NULL;
+  factory->find_arcs                = NULL;
+  factory->find_targets             = NULL;
+  factory->context_add_statement    = NULL;
+  factory->context_remove_statement = NULL;
+  factory->context_serialise        = NULL;
+  factory->get_contexts             = NULL;
+  factory->sync                     = NULL;
+  factory->get_feature              = NULL;
+  factory->estimate_statements      = librdf_storage_sorted_estimate_statements;
+}
+
+
+/*
+ * librdf_init_storage_sorted:
+ * @world: world object
+ *
+ * INTERNAL - Initialise the built-in storage_sorted module.
+ */
+void
+librdf_init_storage_sorted(librdf_world *world)
+{
+  librdf_storage_register_factory(world, "sorted", "Sorted arrays of term ids",
+                                  &librdf_storage_sorted_register_factory);
+}
@@ -40,6 +40,9 @@
 #include <unistd.h>
 #endif
 #include <sys/types.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include <redland.h>
 #include <rdf_storage.h>
@@ -82,6 +85,17 @@ static const char* const sqlite_synchronous_flags[4] = {
   "off", "normal", "full", NULL
 };
 
+#if REDLAND_SQLITE_API == 3
+static const char* const sqlite_journal_mode_flags[7] = {
+  "delete", "truncate", "persist", "memory", "wal", "off", NULL
+};
+
+#define SQLITE_JOURNAL_MODE_WAL 4
+
+/* Schema version recorded in PRAGMA user_version; 0 is the original */
+#define SQLITE_SCHEMA_VERSION 1
+#endif
+
 typedef struct librdf_storage_sqlite_query librdf_storage_sqlite_query;
 
 struct librdf_storage_sqlite_query
@@ -90,6 +104,46 @@ struct librdf_storage_sqlite_query
   librdf_storage_sqlite_query *next;
 };
 
+#if REDLAND_SQLITE_API == 3
+/* Milliseconds to wait for another connection's lock before a
+ * statement fails with SQLITE_BUSY */
+#define SQLITE_STORAGE_BUSY_TIMEOUT 10000
+
+/* Number of prepared statements kept for reuse per storage */
+#define SQLITE_STATEMENT_CACHE_SIZE 32
+
+typedef struct
+{
+  /* prepared statement, keyed by its SQL text, or NULL if slot is free */
+  sqlite3_stmt *vm;
+  size_t sql_len;
+  unsigned long last_used;
+} librdf_storage_sqlite_cached_statement;
+#endif
+
+/* Maximum number of values in one request */
+#define SQLITE_REQUEST_MAX_VALUES 8
+
+typedef struct
+{
+  /* value text or NULL for an integer value */
+  const unsigned char *text;
+  size_t text_len;
+  int integer;
+} librdf_storage_sqlite_value;
+
+/*
+ * A SQL request being built. With SQLite 3 the values are written as
+ * ? parameters and bound to a cached prepared statement; with SQLite 2
+ * they are quoted into the SQL text.
+ */
+typedef struct
+{
+  raptor_stringbuffer *sb;
+  int values_count;
+  librdf_storage_sqlite_value values[SQLITE_REQUEST_MAX_VALUES];
+} librdf_storage_sqlite_request;
+
 typedef struct
 {
   librdf_storage *storage;
@@ -107,8 +161,39 @@ typedef struct
   librdf_storage_sqlite_query *in_stream_queries;
 
   int in_transaction;
+
+  /* non-0 if predicate_stats table is maintained for estimates */
+  int statistics;
+
+  /* -1 (not set), 0+ index into sqlite_journal_mode_flags */
+  int journal_mode;
+
+  /* WAL pages between automatic checkpoints, -1 (not set) or 0 to
+   * checkpoint only when the storage is closed */
+  long checkpoint;
+
+  /* schema version of the open database */
+  int schema_version;
+
+#if REDLAND_SQLITE_API == 3
+  librdf_storage_sqlite_cached_statement statement_cache[SQLITE_STATEMENT_CACHE_SIZE];
+  unsigned long statement_cache_clock;
+#endif
+
+#ifdef WITH_THREADS
+  /* guards the statement cache and in_stream for concurrent readers */
+  pthread_mutex_t mutex;
+#endif
 } librdf_storage_sqlite_instance;
 
+#ifdef WITH_THREADS
+#define SQLITE_LOCK(context) pthread_mutex_lock(&(context)->mutex)
+#define SQLITE_UNLOCK(context) pthread_mutex_unlock(&(context)->mutex)
+#else
+#define SQLITE_LOCK(context)
+#define SQLITE_UNLOCK(context)
+#endif
+
 
 
 /* prototypes for local functions */
@@ -128,6 +213,7 @@ static int librdf_storage_sqlite_serialise_end_of_stream(void* context);
 static int librdf_storage_sqlite_serialise_next_statement(void* context);
 static void* librdf_storage_sqlite_serialise_get_statement(void* context, int flags);
 static void librdf_storage_sqlite_serialise_finished(void* context);
+static int librdf_storage_sqlite_serialise_batch(void* context, librdf_statement** statements, librdf_node** contexts, int size);
 
 /* find_statements implementing functions */
 static int librdf_storage_sqlite_find_statements_end_of_stream(void* context);
@@ -163,6 +249,16 @@ static int librdf_storage_sqlite_transaction_commit(librdf_storage *storage);
 static int librdf_storage_sqlite_transaction_rollback(librdf_storage *storage);
 
 static void librdf_storage_sqlite_query_flush(librdf_storage *storage);
+static void librdf_storage_sqlite_stream_started(librdf_storage_sqlite_instance* context);
+static void librdf_storage_sqlite_stream_ended(librdf_storage* storage, librdf_storage_sqlite_instance* context);
+
+static int librdf_storage_sqlite_estimate_statements(librdf_storage* storage, librdf_statement* statement, int distinct);
+
+/* arcs */
+static int librdf_storage_sqlite_has_arc_in(librdf_storage* storage, librdf_node* node, librdf_node* property);
+static int librdf_storage_sqlite_has_arc_out(librdf_storage* storage, librdf_node* node, librdf_node* property);
+static librdf_iterator* librdf_storage_sqlite_get_arcs_in(librdf_storage* storage, librdf_node* node);
+static librdf_iterator* librdf_storage_sqlite_get_arcs_out(librdf_storage* storage, librdf_node* node);
 
 static void librdf_storage_sqlite_register_factory(librdf_storage_factory *factory);
 #ifdef MODULAR_LIBRDF
@@ -177,6 +273,9 @@ librdf_storage_sqlite_init(librdf_storage* storage, const char *name,
 {
   char *name_copy;
   char* synchronous;
+#if REDLAND_SQLITE_API == 3
+  char* journal_mode;
+#endif
   librdf_storage_sqlite_instance* context;
   
   if(!name) {
@@ -195,6 +294,9 @@ librdf_storage_sqlite_init(librdf_storage* storage, const char *name,
   librdf_storage_set_instance(storage, context);
   
   context->storage = storage;
+#ifdef WITH_THREADS
+  pthread_mutex_init(&context->mutex, NULL);
+#endif
 
   context->name_len = strlen(name);
   name_copy = LIBRDF_MALLOC(char*, context->name_len + 1);
@@ -213,6 +315,30 @@ librdf_storage_sqlite_init(librdf_storage* storage, const char *name,
   /* Redland default is "PRAGMA synchronous normal" */
   context->synchronous = 1;
 
+  context->journal_mode = -1;
+  context->checkpoint = -1;
+
+#if REDLAND_SQLITE_API == 3
+  if(librdf_hash_get_as_boolean(options, "statistics")>0)
+    context->statistics = 1; /* default is NO statistics */
+
+  if((journal_mode = librdf_hash_get(options, "journal-mode"))) {
+    int i;
+    
+    for(i = 0; sqlite_journal_mode_flags[i]; i++) {
+      if(!strcmp(journal_mode, sqlite_journal_mode_flags[i])) {
+        context->journal_mode = i;
+        break;
+      }
+    }
+    
+    LIBRDF_FREE(char*, journal_mode);
+  }
+
+  /* -1 if not given */
+  context->checkpoint = librdf_hash_get_as_long(options, "checkpoint");
+#endif
+
   if((synchronous = librdf_hash_get(options, "synchronous"))) {
     int i;
     
@@ -249,6 +375,10 @@ librdf_storage_sqlite_terminate(librdf_storage* storage)
   if(context->name)
     LIBRDF_FREE(char*, context->name);
   
+#ifdef WITH_THREADS
+  pthread_mutex_destroy(&context->mutex);
+#endif
+
   LIBRDF_FREE(librdf_storage_sqlite_terminate, storage->instance);
 }
 
@@ -327,6 +457,7 @@ librdf_storage_sqlite_get_1int_callback(void *arg,
 }
 
 
+#if REDLAND_SQLITE_API == 2
 static unsigned char *
 sqlite_string_escape(const unsigned char *raw, size_t raw_len, size_t *len_p) 
 {
@@ -362,6 +493,7 @@ sqlite_string_escape(const unsigned char *raw, size_t raw_len, size_t *len_p)
   
   return escaped;
 }
+#endif
 
 
 static int
@@ -436,315 +568,691 @@ librdf_storage_sqlite_exec(librdf_storage* storage,
 }
 
 
-static int
-librdf_storage_sqlite_set_helper(librdf_storage *storage,
-                                 int table, 
-                                 const unsigned char *values,
-                                 size_t values_len) 
+#if REDLAND_SQLITE_API == 3
+/*
+ * Take a prepared statement for the given SQL from the cache or
+ * prepare a new one.  The statement is owned by the caller until it
+ * is handed back with librdf_storage_sqlite_release_statement, so a
+ * statement held open by a stream is never shared.
+ */
+static sqlite3_stmt*
+librdf_storage_sqlite_get_statement(librdf_storage* storage,
+                                    const unsigned char *sql,
+                                    size_t sql_len)
 {
   librdf_storage_sqlite_instance* context;
-  int rc;
-  raptor_stringbuffer *sb;
-  unsigned char *request;
+  librdf_storage_sqlite_cached_statement* entry;
+  sqlite3_stmt *vm = NULL;
+  int status;
+  int i;
 
   context = (librdf_storage_sqlite_instance*)storage->instance;
 
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    return -1;
-
-  raptor_stringbuffer_append_string(sb, 
-                                    (const unsigned char*)"INSERT INTO ", 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)sqlite_tables[table].name, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                    (const unsigned char*)" (id, ", 6, 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)sqlite_tables[table].columns, 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (const unsigned char*) ") VALUES(NULL, ", 15, 1);
-  raptor_stringbuffer_append_counted_string(sb, values, values_len, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)");", 2, 1);
-  request=raptor_stringbuffer_as_string(sb);
-
-  rc=librdf_storage_sqlite_exec(storage,
-                                request,
-                                NULL, /* no callback */
-                                NULL, /* arg */
-                                0);
+  SQLITE_LOCK(context);
+  for(i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; i++) {
+    entry = &context->statement_cache[i];
+    if(entry->vm && entry->sql_len == sql_len &&
+       !strcmp(sqlite3_sql(entry->vm), (const char*)sql)) {
+      vm = entry->vm;
+      entry->vm = NULL;
+      break;
+    }
+  }
+  SQLITE_UNLOCK(context);
+  if(vm)
+    return vm;
 
-  raptor_free_stringbuffer(sb);
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 2
+  LIBRDF_DEBUG2("SQLite prepare '%s'\n", sql);
+#endif
 
-  if(rc)
-    return -1;
+  status = sqlite3_prepare_v2(context->db,
+                              (const char*)sql,
+                              LIBRDF_GOOD_CAST(int, sql_len),
+                              &vm,
+                              NULL);
+  if(status != SQLITE_OK) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "SQLite database %s SQL compile '%s' failed - %s (%d)", 
+               context->name, sql, sqlite3_errmsg(context->db), status);
+    if(vm)
+      sqlite3_finalize(vm);
+    return NULL;
+  }
 
-  return LIBRDF_BAD_CAST(int, sqlite_last_insert_rowid(context->db));
+  return vm;
 }
 
 
-static int
-librdf_storage_sqlite_get_helper(librdf_storage *storage,
-                                 int table, 
-                                 const unsigned char *expression) 
+/*
+ * Reset a prepared statement and return it to the cache, replacing
+ * the least recently used entry if the cache is full.
+ */
+static void
+librdf_storage_sqlite_release_statement(librdf_storage* storage,
+                                        sqlite3_stmt *vm)
 {
-  int id = -1;
-  int rc;
-  raptor_stringbuffer *sb;
-  unsigned char *request;
-
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    return -1;
+  librdf_storage_sqlite_instance* context;
+  librdf_storage_sqlite_cached_statement* entry;
+  librdf_storage_sqlite_cached_statement* victim;
+  sqlite3_stmt *old_vm;
+  int i;
 
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)"SELECT id FROM ", 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)sqlite_tables[table].name, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)" WHERE ", 7, 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)expression, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)";", 1, 1);
-  request=raptor_stringbuffer_as_string(sb);
+  context = (librdf_storage_sqlite_instance*)storage->instance;
 
-  rc = librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  librdf_storage_sqlite_get_1int_callback,
-                                  &id,
-                                  0);
+  sqlite3_reset(vm);
+  sqlite3_clear_bindings(vm);
 
-  raptor_free_stringbuffer(sb);
+  SQLITE_LOCK(context);
+  victim = &context->statement_cache[0];
+  for(i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; i++) {
+    entry = &context->statement_cache[i];
+    if(!entry->vm) {
+      victim = entry;
+      break;
+    }
+    if(entry->last_used < victim->last_used)
+      victim = entry;
+  }
 
-  if(rc)
-    return -1;
+  old_vm = victim->vm;
+  victim->vm = vm;
+  victim->sql_len = strlen(sqlite3_sql(vm));
+  victim->last_used = ++context->statement_cache_clock;
+  SQLITE_UNLOCK(context);
 
-  return id;
+  if(old_vm)
+    sqlite3_finalize(old_vm);
 }
 
 
-static int
-librdf_storage_sqlite_uri_helper(librdf_storage* storage,
-                                 librdf_uri* uri,
-                                 int add_new) 
+static void
+librdf_storage_sqlite_statement_cache_clear(librdf_storage* storage)
 {
-  const unsigned char *uri_string;
-  size_t uri_len;
-  unsigned char *expression = NULL;
-  unsigned char *uri_e;
-  size_t uri_e_len;
-  int id = -1;
-  static const char * const field="uri";
-
-  uri_string = librdf_uri_as_counted_string(uri, &uri_len);
-  uri_e = sqlite_string_escape(uri_string, uri_len, &uri_e_len);
-  if(!uri_e)
-    goto tidy;
-  
-  expression = LIBRDF_MALLOC(unsigned char*, strlen(field) + 3 + uri_e_len + 1);
-  if(!expression)
-    goto tidy;
-
-  sprintf((char*)expression, "%s = %s", field, uri_e);
-  id = librdf_storage_sqlite_get_helper(storage, TABLE_URIS, expression);
-  if(id >= 0)
-    goto tidy;
-
-  if(add_new)  
-    id = librdf_storage_sqlite_set_helper(storage, TABLE_URIS, uri_e,
-                                          uri_e_len);
+  librdf_storage_sqlite_instance* context;
+  int i;
 
-  tidy:
-  if(expression)
-    LIBRDF_FREE(char*, expression);
-  if(uri_e)
-    LIBRDF_FREE(char*, uri_e);
+  context = (librdf_storage_sqlite_instance*)storage->instance;
 
-  return id;
+  for(i = 0; i < SQLITE_STATEMENT_CACHE_SIZE; i++) {
+    if(context->statement_cache[i].vm) {
+      sqlite3_finalize(context->statement_cache[i].vm);
+      context->statement_cache[i].vm = NULL;
+    }
+  }
 }
+#endif
 
 
 static int
-librdf_storage_sqlite_blank_helper(librdf_storage* storage,
-                                   const unsigned char *blank,
-                                   int add_new)
+librdf_storage_sqlite_request_init(librdf_storage_sqlite_request* request)
 {
-  size_t blank_len;
-  unsigned char *expression = NULL;
-  unsigned char *blank_e;
-  size_t blank_e_len;
-  int id = -1;
-  static const char * const field="blank";
+  request->values_count = 0;
+  request->sb = raptor_new_stringbuffer();
 
-  blank_len = strlen((const char*)blank);
-  blank_e = sqlite_string_escape(blank, blank_len, &blank_e_len);
-  if(!blank_e)
-    goto tidy;
-  
-  expression = LIBRDF_MALLOC(unsigned char*,
-                             strlen(field) + 3 + blank_e_len + 1);
-  if(!expression)
-    goto tidy;
+  return (request->sb == NULL);
+}
 
-  sprintf((char*)expression, "%s = %s", field, blank_e);
-  id = librdf_storage_sqlite_get_helper(storage, TABLE_BLANKS, expression);
-  if(id >= 0)
-    goto tidy;
 
-  if(add_new)
-    id = librdf_storage_sqlite_set_helper(storage, TABLE_BLANKS, blank_e, 
-                                          blank_e_len);
+static void
+librdf_storage_sqlite_request_clear(librdf_storage_sqlite_request* request)
+{
+  if(request->sb) {
+    raptor_free_stringbuffer(request->sb);
+    request->sb = NULL;
+  }
+}
 
-  tidy:
-  if(expression)
-    LIBRDF_FREE(char*, expression);
-  if(blank_e)
-    LIBRDF_FREE(char*, blank_e);
 
-  return id;
+static int
+librdf_storage_sqlite_request_append(librdf_storage_sqlite_request* request,
+                                     const char *string)
+{
+  return raptor_stringbuffer_append_string(request->sb,
+                                           (const unsigned char*)string, 1);
 }
 
 
+/* Add a text value to the request; @text must live until it is run */
 static int
-librdf_storage_sqlite_literal_helper(librdf_storage* storage,
-                                     const unsigned char *value,
-                                     size_t value_len,
-                                     const char *language,
-                                     librdf_uri *datatype,
-                                     int add_new) 
+librdf_storage_sqlite_request_add_text(librdf_storage_sqlite_request* request,
+                                       const unsigned char *text,
+                                       size_t text_len)
 {
-  int id = -1;
-  size_t len;
-  unsigned char *value_e;
-  size_t value_e_len;
-  unsigned char *language_e = NULL;
-  size_t language_e_len = 0;
-  int datatype_id = -1;
-  raptor_stringbuffer *sb = NULL;
-  unsigned char *expression;
+#if REDLAND_SQLITE_API == 3
+  librdf_storage_sqlite_value* value;
 
-  value_e = sqlite_string_escape(value, value_len, &value_e_len);
-  if(!value_e)
-    goto tidy;
+  if(request->values_count == SQLITE_REQUEST_MAX_VALUES)
+    return 1;
 
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    goto tidy;
+  value = &request->values[request->values_count++];
+  value->text = text;
+  value->text_len = text_len;
+  value->integer = 0;
 
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)"text = ",
-                                            7, 1);
-  raptor_stringbuffer_append_counted_string(sb, value_e, value_e_len, 1);
-  raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)" ", 1, 1);
+  return raptor_stringbuffer_append_counted_string(request->sb,
+                                                   (const unsigned char*)"?",
+                                                   1, 1);
+#endif
+#if REDLAND_SQLITE_API == 2
+  unsigned char *escaped;
+  size_t escaped_len;
+  int rc;
 
-  if(language) {
-    len = strlen(language);
-    language_e = sqlite_string_escape((unsigned const char*)language, len,
-                                      &language_e_len);
-    if(!language_e)
-      goto tidy;
-
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)"AND language = ", 1);
-    raptor_stringbuffer_append_counted_string(sb, language_e, language_e_len, 1);
-  } else
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)"AND language IS NULL ", 1);
+  escaped = sqlite_string_escape(text, text_len, &escaped_len);
+  if(!escaped)
+    return 1;
 
-  if(datatype) {
-    datatype_id = librdf_storage_sqlite_uri_helper(storage, datatype, add_new);
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)"AND datatype = ", 1);
-    raptor_stringbuffer_append_decimal(sb, datatype_id);
-  } else
-    raptor_stringbuffer_append_string(sb, (const unsigned char*)"AND datatype IS NULL ", 1);
-  
-  expression = raptor_stringbuffer_as_string(sb);
-  id = librdf_storage_sqlite_get_helper(storage, TABLE_LITERALS, expression);
-  
-  if(id >= 0 || !add_new)
-    goto tidy;
-  
-  raptor_free_stringbuffer(sb);
-  sb = raptor_new_stringbuffer();
-  if(!sb) {
-    id = -1;
-    goto tidy;
-  }
+  rc = raptor_stringbuffer_append_counted_string(request->sb, escaped,
+                                                 escaped_len, 1);
+  LIBRDF_FREE(char*, escaped);
 
-  raptor_stringbuffer_append_counted_string(sb, value_e, value_e_len, 1);
+  return rc;
+#endif
+}
 
-  raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)", ", 2, 1);
-  if(language_e)
-    raptor_stringbuffer_append_counted_string(sb,language_e, language_e_len, 1);
-  else
-    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)"NULL", 4, 1);
 
-  raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)", ", 2, 1);
-  if(datatype)
-    raptor_stringbuffer_append_decimal(sb, datatype_id);
-  else
-    raptor_stringbuffer_append_counted_string(sb, (const unsigned char*)"NULL", 4, 1);
+static int
+librdf_storage_sqlite_request_add_int(librdf_storage_sqlite_request* request,
+                                      int integer)
+{
+#if REDLAND_SQLITE_API == 3
+  librdf_storage_sqlite_value* value;
 
-  expression = raptor_stringbuffer_as_string(sb);
-  id = librdf_storage_sqlite_set_helper(storage, TABLE_LITERALS, expression,
-                                      raptor_stringbuffer_length(sb));
+  if(request->values_count == SQLITE_REQUEST_MAX_VALUES)
+    return 1;
 
-  tidy:
-  if(sb)
-    raptor_free_stringbuffer(sb);
-  if(value_e)
-    LIBRDF_FREE(char*, value_e);
-  if(language_e)
-    LIBRDF_FREE(char*, language_e);
-  
-  return id;
+  value = &request->values[request->values_count++];
+  value->text = NULL;
+  value->text_len = 0;
+  value->integer = integer;
+
+  return raptor_stringbuffer_append_counted_string(request->sb,
+                                                   (const unsigned char*)"?",
+                                                   1, 1);
+#endif
+#if REDLAND_SQLITE_API == 2
+  return raptor_stringbuffer_append_decimal(request->sb, integer);
+#endif
 }
 
 
+/* Append the SQL text and values of request @src to @request */
 static int
-librdf_storage_sqlite_node_helper(librdf_storage* storage,
-                                  librdf_node* node,
-                                  int* id_p,
-                                  triple_node_type *node_type_p,
-                                  int add_new) 
+librdf_storage_sqlite_request_append_request(librdf_storage_sqlite_request* request,
+                                             librdf_storage_sqlite_request* src)
 {
-  int id;
-  triple_node_type node_type;
-  unsigned char *value;
-  size_t value_len;
+  int i;
 
-  if(!node)
+  if(request->values_count + src->values_count > SQLITE_REQUEST_MAX_VALUES)
     return 1;
-  
-  switch(librdf_node_get_type(node)) {
-    case LIBRDF_NODE_TYPE_RESOURCE:
-      id = librdf_storage_sqlite_uri_helper(storage,
-                                            librdf_node_get_uri(node),
-                                            add_new);
-      if(id < 0 && add_new)
-        return 1;
 
-      node_type = TRIPLE_URI;
-      break;
+  for(i = 0; i < src->values_count; i++)
+    request->values[request->values_count++] = src->values[i];
 
-    case LIBRDF_NODE_TYPE_LITERAL:
-      value = librdf_node_get_literal_value_as_counted_string(node, &value_len);
-      id = librdf_storage_sqlite_literal_helper(storage,
-                                                value, value_len,
-                                                librdf_node_get_literal_value_language(node),
-                                                librdf_node_get_literal_value_datatype_uri(node),
-                                                add_new);
-      if(id < 0 && add_new)
-        return 1;
+  return raptor_stringbuffer_append_counted_string(request->sb,
+                                                   raptor_stringbuffer_as_string(src->sb),
+                                                   raptor_stringbuffer_length(src->sb),
+                                                   1);
+}
 
-      node_type = TRIPLE_LITERAL;
-      break;
 
-    case LIBRDF_NODE_TYPE_BLANK:
-      id = librdf_storage_sqlite_blank_helper(storage,
-                                              librdf_node_get_blank_identifier(node),
-                                              add_new);
-      if(id < 0 && add_new)
-        return 1;
+/*
+ * Compile a request into a statement with its values bound, for
+ * stepping through result rows.  The statement must be given to
+ * librdf_storage_sqlite_finish_statement when done.
+ */
+static sqlite_STATEMENT*
+librdf_storage_sqlite_request_prepare(librdf_storage* storage,
+                                      librdf_storage_sqlite_request* request)
+{
+  librdf_storage_sqlite_instance* context;
+  unsigned char *sql;
+  sqlite_STATEMENT *vm = NULL;
+#if REDLAND_SQLITE_API == 3
+  librdf_storage_sqlite_value* value;
+  int status = SQLITE_OK;
+  int i;
+#endif
+#if REDLAND_SQLITE_API == 2
+  const char *zTail;
+  char *errmsg = NULL;
+  int status;
+#endif
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  sql = raptor_stringbuffer_as_string(request->sb);
+  if(!sql)
+    return NULL;
+
+#if REDLAND_SQLITE_API == 3
+  vm = librdf_storage_sqlite_get_statement(storage, sql,
+                                           raptor_stringbuffer_length(request->sb));
+  if(!vm)
+    return NULL;
+
+  for(i = 0; i < request->values_count && status == SQLITE_OK; i++) {
+    value = &request->values[i];
+    if(value->text)
+      status = sqlite3_bind_text(vm, i + 1, (const char*)value->text,
+                                 LIBRDF_GOOD_CAST(int, value->text_len),
+                                 SQLITE_STATIC);
+    else
+      status = sqlite3_bind_int(vm, i + 1, value->integer);
+  }
+
+  if(status != SQLITE_OK) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "SQLite database %s SQL bind '%s' failed - %s (%d)", 
+               context->name, sql, sqlite3_errmsg(context->db), status);
+    librdf_storage_sqlite_release_statement(storage, vm);
+    return NULL;
+  }
+#endif
+#if REDLAND_SQLITE_API == 2
+#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 2
+  LIBRDF_DEBUG2("SQLite prepare '%s'\n", sql);
+#endif
+
+  status = sqlite_compile(context->db, (const char*)sql, &zTail, &vm,
+                          &errmsg);
+  if(status != SQLITE_OK) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "SQLite database %s SQL compile '%s' failed - %s (%d)", 
+               context->name, sql, errmsg, status);
+    sqlite_FREE(errmsg);
+    return NULL;
+  }
+#endif
+
+  return vm;
+}
+
+
+/* Give back a statement from librdf_storage_sqlite_request_prepare */
+static void
+librdf_storage_sqlite_finish_statement(librdf_storage* storage,
+                                       sqlite_STATEMENT *vm)
+{
+#if REDLAND_SQLITE_API == 3
+  librdf_storage_sqlite_release_statement(storage, vm);
+#endif
+#if REDLAND_SQLITE_API == 2
+  librdf_storage_sqlite_instance* context;
+  char *errmsg = NULL;
+  int status;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  status = sqlite_finalize(vm, &errmsg);
+  if(status != SQLITE_OK) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "SQLite database %s finalize failed - %s (%d)", 
+               context->name, errmsg, status);
+    sqlite_FREE(errmsg);
+  }
+#endif
+}
+
+
+/*
+ * Run a request, calling @callback with the text of up to 4 columns
+ * of each result row as sqlite_exec does.
+ */
+static int
+librdf_storage_sqlite_request_exec(librdf_storage* storage,
+                                   librdf_storage_sqlite_request* request,
+                                   sqlite_callback callback, void *arg)
+{
+#if REDLAND_SQLITE_API == 3
+  librdf_storage_sqlite_instance* context;
+  sqlite3_stmt *vm;
+  char *values[4];
+  int count;
+  int status;
+  int i;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  vm = librdf_storage_sqlite_request_prepare(storage, request);
+  if(!vm)
+    return 1;
+
+  /* SQLite 3 allows writes while a stream is reading on the same
+   * connection so unlike librdf_storage_sqlite_exec nothing is queued */
+  do {
+    /* SQLITE_BUSY is returned only after the busy timeout so fails */
+    status = sqlite3_step(vm);
+    if(status != SQLITE_ROW)
+      break;
+
+    if(callback) {
+      count = sqlite3_column_count(vm);
+      if(count > 4)
+        count = 4;
+      for(i = 0; i < count; i++)
+        values[i] = (char*)sqlite3_column_text(vm, i);
+      if(callback(arg, count, values, NULL)) {
+        status = SQLITE_ABORT;
+        break;
+      }
+    }
+  } while(1);
+
+  if(status != SQLITE_DONE)
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "SQLite database %s SQL exec '%s' failed - %s (%d)",
+               context->name, sqlite3_sql(vm), sqlite3_errmsg(context->db),
+               status);
+
+  librdf_storage_sqlite_release_statement(storage, vm);
+
+  return (status != SQLITE_DONE);
+#endif
+#if REDLAND_SQLITE_API == 2
+  return librdf_storage_sqlite_exec(storage,
+                                    raptor_stringbuffer_as_string(request->sb),
+                                    callback, arg, 0);
+#endif
+}
+
+
+/* Insert a row of @values for @columns, or the table columns if NULL */
+static int
+librdf_storage_sqlite_set_helper(librdf_storage *storage,
+                                 int table, 
+                                 const char *columns,
+                                 librdf_storage_sqlite_request* values)
+{
+  librdf_storage_sqlite_instance* context;
+  librdf_storage_sqlite_request request;
+  int rc;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(librdf_storage_sqlite_request_init(&request))
+    return -1;
+
+  librdf_storage_sqlite_request_append(&request, "INSERT INTO ");
+  librdf_storage_sqlite_request_append(&request, sqlite_tables[table].name);
+  librdf_storage_sqlite_request_append(&request, " (id, ");
+  librdf_storage_sqlite_request_append(&request,
+                                       columns ? columns : sqlite_tables[table].columns);
+  librdf_storage_sqlite_request_append(&request, ") VALUES(NULL, ");
+  rc = librdf_storage_sqlite_request_append_request(&request, values);
+  librdf_storage_sqlite_request_append(&request, ");");
+
+  if(!rc)
+    rc = librdf_storage_sqlite_request_exec(storage, &request,
+                                            NULL, /* no callback */
+                                            NULL /* arg */);
+
+  librdf_storage_sqlite_request_clear(&request);
+
+  if(rc)
+    return -1;
+
+  return LIBRDF_BAD_CAST(int, sqlite_last_insert_rowid(context->db));
+}
+
+
+static int
+librdf_storage_sqlite_get_helper(librdf_storage *storage,
+                                 int table, 
+                                 librdf_storage_sqlite_request* expression)
+{
+  librdf_storage_sqlite_request request;
+  int id = -1;
+  int rc;
+
+  if(librdf_storage_sqlite_request_init(&request))
+    return -1;
+
+  librdf_storage_sqlite_request_append(&request, "SELECT id FROM ");
+  librdf_storage_sqlite_request_append(&request, sqlite_tables[table].name);
+  librdf_storage_sqlite_request_append(&request, " WHERE ");
+  rc = librdf_storage_sqlite_request_append_request(&request, expression);
+  librdf_storage_sqlite_request_append(&request, ";");
+
+  if(!rc)
+    rc = librdf_storage_sqlite_request_exec(storage, &request,
+                                            librdf_storage_sqlite_get_1int_callback,
+                                            &id);
+
+  librdf_storage_sqlite_request_clear(&request);
+
+  if(rc)
+    return -1;
+
+  return id;
+}
+
+
+/* FNV-1a hash of literal text, stored in the literals hash column */
+static int
+librdf_storage_sqlite_literal_hash(const unsigned char *value,
+                                   size_t value_len)
+{
+  unsigned int hash = 2166136261U;
+
+  while(value_len--) {
+    hash ^= *value++;
+    hash *= 16777619U;
+  }
+
+  return LIBRDF_BAD_CAST(int, hash);
+}
+
+
+/* Find or add a row of the single text column table uris or blanks */
+static int
+librdf_storage_sqlite_string_helper(librdf_storage* storage,
+                                    int table,
+                                    const unsigned char *string,
+                                    size_t string_len,
+                                    int add_new) 
+{
+  librdf_storage_sqlite_request request;
+  int id = -1;
+
+  if(librdf_storage_sqlite_request_init(&request))
+    return -1;
+
+  librdf_storage_sqlite_request_append(&request, sqlite_tables[table].columns);
+  librdf_storage_sqlite_request_append(&request, " = ");
+  if(librdf_storage_sqlite_request_add_text(&request, string, string_len))
+    goto tidy;
+
+  id = librdf_storage_sqlite_get_helper(storage, table, &request);
+  if(id >= 0 || !add_new)
+    goto tidy;
+
+  librdf_storage_sqlite_request_clear(&request);
+  if(librdf_storage_sqlite_request_init(&request))
+    goto tidy;
+
+  if(!librdf_storage_sqlite_request_add_text(&request, string, string_len))
+    id = librdf_storage_sqlite_set_helper(storage, table, NULL, &request);
+
+  tidy:
+  librdf_storage_sqlite_request_clear(&request);
+
+  return id;
+}
+
+
+static int
+librdf_storage_sqlite_uri_helper(librdf_storage* storage,
+                                 librdf_uri* uri,
+                                 int add_new) 
+{
+  const unsigned char *uri_string;
+  size_t uri_len;
+
+  uri_string = librdf_uri_as_counted_string(uri, &uri_len);
+
+  return librdf_storage_sqlite_string_helper(storage, TABLE_URIS,
+                                             uri_string, uri_len, add_new);
+}
+
+
+static int
+librdf_storage_sqlite_blank_helper(librdf_storage* storage,
+                                   const unsigned char *blank,
+                                   int add_new)
+{
+  return librdf_storage_sqlite_string_helper(storage, TABLE_BLANKS,
+                                             blank,
+                                             strlen((const char*)blank),
+                                             add_new);
+}
+
+
+static int
+librdf_storage_sqlite_literal_helper(librdf_storage* storage,
+                                     const unsigned char *value,
+                                     size_t value_len,
+                                     const char *language,
+                                     librdf_uri *datatype,
+                                     int add_new) 
+{
+  librdf_storage_sqlite_instance* context;
+  int id = -1;
+  size_t language_len = 0;
+  int datatype_id = -1;
+  int hash = 0;
+  librdf_storage_sqlite_request request;
+  int rc;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(librdf_storage_sqlite_request_init(&request))
+    return -1;
+
+  if(language)
+    language_len = strlen(language);
+
+  if(datatype)
+    datatype_id = librdf_storage_sqlite_uri_helper(storage, datatype, add_new);
+
+  /* schema 1 indexes literals by a hash of the text */
+  if(context->schema_version >= 1) {
+    hash = librdf_storage_sqlite_literal_hash(value, value_len);
+    librdf_storage_sqlite_request_append(&request, "hash = ");
+    librdf_storage_sqlite_request_add_int(&request, hash);
+    librdf_storage_sqlite_request_append(&request, " AND ");
+  }
+
+  librdf_storage_sqlite_request_append(&request, "text = ");
+  rc = librdf_storage_sqlite_request_add_text(&request, value, value_len);
+
+  if(language) {
+    librdf_storage_sqlite_request_append(&request, " AND language = ");
+    rc |= librdf_storage_sqlite_request_add_text(&request,
+                                                 (const unsigned char*)language,
+                                                 language_len);
+  } else
+    librdf_storage_sqlite_request_append(&request, " AND language IS NULL");
+
+  if(datatype) {
+    librdf_storage_sqlite_request_append(&request, " AND datatype = ");
+    rc |= librdf_storage_sqlite_request_add_int(&request, datatype_id);
+  } else
+    librdf_storage_sqlite_request_append(&request, " AND datatype IS NULL");
+
+  if(rc)
+    goto tidy;
+
+  id = librdf_storage_sqlite_get_helper(storage, TABLE_LITERALS, &request);
+  
+  if(id >= 0 || !add_new)
+    goto tidy;
+  
+  librdf_storage_sqlite_request_clear(&request);
+  if(librdf_storage_sqlite_request_init(&request)) {
+    id = -1;
+    goto tidy;
+  }
+
+  rc = librdf_storage_sqlite_request_add_text(&request, value, value_len);
+
+  librdf_storage_sqlite_request_append(&request, ", ");
+  if(language)
+    rc |= librdf_storage_sqlite_request_add_text(&request,
+                                                 (const unsigned char*)language,
+                                                 language_len);
+  else
+    librdf_storage_sqlite_request_append(&request, "NULL");
+
+  librdf_storage_sqlite_request_append(&request, ", ");
+  if(datatype)
+    rc |= librdf_storage_sqlite_request_add_int(&request, datatype_id);
+  else
+    librdf_storage_sqlite_request_append(&request, "NULL");
+
+  if(context->schema_version >= 1) {
+    librdf_storage_sqlite_request_append(&request, ", ");
+    rc |= librdf_storage_sqlite_request_add_int(&request, hash);
+  }
+
+  if(!rc)
+    id = librdf_storage_sqlite_set_helper(storage, TABLE_LITERALS,
+                                          context->schema_version >= 1 ? "text, language, datatype, hash" : NULL,
+                                          &request);
+
+  tidy:
+  librdf_storage_sqlite_request_clear(&request);
+  
+  return id;
+}
+
+
+static int
+librdf_storage_sqlite_node_helper(librdf_storage* storage,
+                                  librdf_node* node,
+                                  int* id_p,
+                                  triple_node_type *node_type_p,
+                                  int add_new) 
+{
+  int id;
+  triple_node_type node_type;
+  unsigned char *value;
+  size_t value_len;
+
+  if(!node)
+    return 1;
+  
+  switch(librdf_node_get_type(node)) {
+    case LIBRDF_NODE_TYPE_RESOURCE:
+      id = librdf_storage_sqlite_uri_helper(storage,
+                                            librdf_node_get_uri(node),
+                                            add_new);
+      if(id < 0 && add_new)
+        return 1;
+
+      node_type = TRIPLE_URI;
+      break;
+
+    case LIBRDF_NODE_TYPE_LITERAL:
+      value = librdf_node_get_literal_value_as_counted_string(node, &value_len);
+      id = librdf_storage_sqlite_literal_helper(storage,
+                                                value, value_len,
+                                                librdf_node_get_literal_value_language(node),
+                                                librdf_node_get_literal_value_datatype_uri(node),
+                                                add_new);
+      if(id < 0 && add_new)
+        return 1;
+
+      node_type = TRIPLE_LITERAL;
+      break;
+
+    case LIBRDF_NODE_TYPE_BLANK:
+      id = librdf_storage_sqlite_blank_helper(storage,
+                                              librdf_node_get_blank_identifier(node),
+                                              add_new);
+      if(id < 0 && add_new)
+        return 1;
 
       node_type = TRIPLE_BLANK;
       break;
@@ -806,6 +1314,198 @@ librdf_storage_sqlite_statement_helper(librdf_storage* storage,
 }
 
 
+#if REDLAND_SQLITE_API == 3
+/*
+ * Upgrade from schema 0 to 1.  Each triples index covers every column
+ * so lookups in subject, predicate-object, object and context order
+ * never visit the table rows.  Queries bind the URI and blank columns
+ * before a blank or literal node as IS NULL so every index column up
+ * to the node is used.  Literals gain a hash of their text to index
+ * instead of the text itself.
+ *
+ * WITHOUT ROWID tables are not used: the node tables need their
+ * INTEGER PRIMARY KEY rowid aliases to allocate ids and the triples
+ * table has no non-NULL key.
+ */
+static const char* const sqlite_schema_upgrade_1[] = {
+  "ALTER TABLE literals ADD COLUMN hash INTEGER;",
+  "UPDATE literals SET hash = librdf_literal_hash(text);",
+  "DROP INDEX IF EXISTS spindex;",
+  "DROP INDEX IF EXISTS poindex;",
+  "CREATE INDEX IF NOT EXISTS spocindex ON triples (subjectUri, subjectBlank, predicateUri, objectUri, objectBlank, objectLiteral, contextUri);",
+  "CREATE INDEX IF NOT EXISTS poscindex ON triples (predicateUri, objectUri, objectBlank, objectLiteral, subjectUri, subjectBlank, contextUri);",
+  "CREATE INDEX IF NOT EXISTS ospcindex ON triples (objectUri, objectBlank, objectLiteral, subjectUri, subjectBlank, predicateUri, contextUri);",
+  "CREATE INDEX IF NOT EXISTS cspoindex ON triples (contextUri, subjectUri, subjectBlank, predicateUri, objectUri, objectBlank, objectLiteral);",
+  "CREATE INDEX IF NOT EXISTS uriindex ON uris (uri);",
+  "CREATE INDEX IF NOT EXISTS blankindex ON blanks (blank);",
+  "CREATE INDEX IF NOT EXISTS literalindex ON literals (hash);",
+  "PRAGMA user_version = 1;",
+  NULL
+};
+
+
+static void
+librdf_storage_sqlite_literal_hash_function(sqlite3_context *ctx,
+                                            int argc, sqlite3_value **argv)
+{
+  const unsigned char *value = sqlite3_value_text(argv[0]);
+
+  if(!value) {
+    sqlite3_result_null(ctx);
+    return;
+  }
+
+  sqlite3_result_int(ctx,
+                     librdf_storage_sqlite_literal_hash(value,
+                                                        (size_t)sqlite3_value_bytes(argv[0])));
+}
+
+
+/*
+ * librdf_storage_sqlite_schema_upgrade:
+ * @storage: the storage
+ *
+ * Upgrade the database schema in place to SQLITE_SCHEMA_VERSION.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_sqlite_schema_upgrade(librdf_storage* storage)
+{
+  librdf_storage_sqlite_instance* context;
+  int begin;
+  int i;
+  int rc = 0;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(librdf_storage_sqlite_exec(storage,
+                                (unsigned char*)"PRAGMA user_version;",
+                                librdf_storage_sqlite_get_1int_callback,
+                                &context->schema_version,
+                                0))
+    return 1;
+
+  if(context->schema_version >= SQLITE_SCHEMA_VERSION)
+    return 0;
+
+  if(sqlite3_create_function(context->db, "librdf_literal_hash", 1,
+                             SQLITE_UTF8, NULL,
+                             librdf_storage_sqlite_literal_hash_function,
+                             NULL, NULL) != SQLITE_OK)
+    return 1;
+
+  begin = librdf_storage_sqlite_transaction_start(storage);
+
+  for(i = 0; sqlite_schema_upgrade_1[i]; i++) {
+    rc = librdf_storage_sqlite_exec(storage,
+                                    (unsigned char*)sqlite_schema_upgrade_1[i],
+                                    NULL, NULL, 0);
+    if(rc)
+      break;
+  }
+
+  if(!begin) {
+    if(rc)
+      librdf_storage_sqlite_transaction_rollback(storage);
+    else
+      librdf_storage_sqlite_transaction_commit(storage);
+  }
+
+  if(!rc)
+    context->schema_version = SQLITE_SCHEMA_VERSION;
+
+  return rc;
+}
+
+
+/*
+ * Per predicate statement counts, maintained by triggers on the
+ * triples table.  A (subject, predicate) or (predicate, object) pair
+ * is counted when its first row is inserted and uncounted when its
+ * last row is deleted; spocindex and poscindex keep the lookups cheap.
+ */
+static const char* const sqlite_statistics_schema[] = {
+  "CREATE TABLE IF NOT EXISTS predicate_stats (predicateUri INTEGER PRIMARY KEY, statements INTEGER, subjects INTEGER, objects INTEGER);",
+  "CREATE TRIGGER IF NOT EXISTS predicate_stats_insert AFTER INSERT ON triples BEGIN "
+    "INSERT OR IGNORE INTO predicate_stats VALUES (new.predicateUri, 0, 0, 0); "
+    "UPDATE predicate_stats SET statements = statements + 1, "
+      "subjects = subjects + NOT EXISTS (SELECT 1 FROM triples WHERE subjectUri IS new.subjectUri AND subjectBlank IS new.subjectBlank AND predicateUri = new.predicateUri AND rowid <> new.rowid), "
+      "objects = objects + NOT EXISTS (SELECT 1 FROM triples WHERE predicateUri = new.predicateUri AND objectUri IS new.objectUri AND objectBlank IS new.objectBlank AND objectLiteral IS new.objectLiteral AND rowid <> new.rowid) "
+    "WHERE predicateUri = new.predicateUri; "
+  "END;",
+  "CREATE TRIGGER IF NOT EXISTS predicate_stats_delete AFTER DELETE ON triples BEGIN "
+    "UPDATE predicate_stats SET statements = statements - 1, "
+      "subjects = subjects - NOT EXISTS (SELECT 1 FROM triples WHERE subjectUri IS old.subjectUri AND subjectBlank IS old.subjectBlank AND predicateUri = old.predicateUri), "
+      "objects = objects - NOT EXISTS (SELECT 1 FROM triples WHERE predicateUri = old.predicateUri AND objectUri IS old.objectUri AND objectBlank IS old.objectBlank AND objectLiteral IS old.objectLiteral) "
+    "WHERE predicateUri = old.predicateUri; "
+    "DELETE FROM predicate_stats WHERE predicateUri = old.predicateUri AND statements <= 0; "
+  "END;",
+  NULL
+};
+
+
+/* Count existing triples into a newly created predicate_stats table */
+static const char sqlite_statistics_populate[] =
+  "INSERT INTO predicate_stats (predicateUri, statements, subjects, objects) "
+  "SELECT c.p, c.n, s.n, o.n FROM "
+    "(SELECT predicateUri AS p, COUNT(*) AS n FROM triples GROUP BY predicateUri) c, "
+    "(SELECT p, COUNT(*) AS n FROM (SELECT predicateUri AS p FROM triples GROUP BY predicateUri, subjectUri, subjectBlank) GROUP BY p) s, "
+    "(SELECT p, COUNT(*) AS n FROM (SELECT predicateUri AS p FROM triples GROUP BY predicateUri, objectUri, objectBlank, objectLiteral) GROUP BY p) o "
+  "WHERE s.p = c.p AND o.p = c.p;";
+
+
+/*
+ * librdf_storage_sqlite_statistics_open:
+ * @storage: the storage
+ *
+ * INTERNAL - Create the statistics table and triggers if missing,
+ * counting any triples already in the database.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_sqlite_statistics_open(librdf_storage* storage)
+{
+  int exists = 0;
+  int begin;
+  int i;
+  int rc = 0;
+
+  if(librdf_storage_sqlite_exec(storage,
+                                (unsigned char*)"SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name = 'predicate_stats';",
+                                librdf_storage_sqlite_get_1int_callback,
+                                &exists,
+                                0))
+    return 1;
+
+  begin = librdf_storage_sqlite_transaction_start(storage);
+
+  for(i = 0; sqlite_statistics_schema[i]; i++) {
+    rc = librdf_storage_sqlite_exec(storage,
+                                    (unsigned char*)sqlite_statistics_schema[i],
+                                    NULL, NULL, 0);
+    if(rc)
+      break;
+  }
+
+  if(!rc && !exists)
+    rc = librdf_storage_sqlite_exec(storage,
+                                    (unsigned char*)sqlite_statistics_populate,
+                                    NULL, NULL, 0);
+
+  if(!begin) {
+    if(rc)
+      librdf_storage_sqlite_transaction_rollback(storage);
+    else
+      librdf_storage_sqlite_transaction_commit(storage);
+  }
+
+  return rc;
+}
+#endif
+
+
 static int
 librdf_storage_sqlite_open(librdf_storage* storage, librdf_model* model)
 {
@@ -828,6 +1528,9 @@ librdf_storage_sqlite_open(librdf_storage* storage, librdf_model* model)
 #if REDLAND_SQLITE_API == 3
   context->db = NULL;
   rc = sqlite3_open(context->name, &context->db);
+  if(rc == SQLITE_OK)
+    /* wait for other connections' locks rather than fail at once */
+    rc = sqlite3_busy_timeout(context->db, SQLITE_STORAGE_BUSY_TIMEOUT);
   if(rc != SQLITE_OK)
     errmsg = (char*)sqlite3_errmsg(context->db);
 #endif
@@ -876,6 +1579,32 @@ librdf_storage_sqlite_open(librdf_storage* storage, librdf_model* model)
     }
   }
 
+#if REDLAND_SQLITE_API == 3
+  if(context->journal_mode >= 0) {
+    char request[40];
+
+    /* WAL lets readers carry on while a writer commits */
+    sprintf(request, "PRAGMA journal_mode=%s;",
+            sqlite_journal_mode_flags[context->journal_mode]);
+    if(librdf_storage_sqlite_exec(storage, (unsigned char*)request,
+                                  NULL, NULL, 0)) {
+      librdf_storage_sqlite_close(storage);
+      return 1;
+    }
+  }
+
+  if(context->checkpoint >= 0) {
+    char request[50];
+
+    sprintf(request, "PRAGMA wal_autocheckpoint=%ld;", context->checkpoint);
+    if(librdf_storage_sqlite_exec(storage, (unsigned char*)request,
+                                  NULL, NULL, 0)) {
+      librdf_storage_sqlite_close(storage);
+      return 1;
+    }
+  }
+#endif
+
   
   if(context->is_new) {
     int i;
@@ -911,6 +1640,8 @@ librdf_storage_sqlite_open(librdf_storage* storage, librdf_model* model)
 
     } /* end drop/create table loop */
 
+#if REDLAND_SQLITE_API == 2
+    /* SQLite 3 creates its indexes in the schema upgrade below */
     strcpy((char*)request, 
            "CREATE INDEX spindex ON triples (subjectUri, subjectBlank, predicateUri);");
     if(librdf_storage_sqlite_exec(storage,
@@ -936,11 +1667,27 @@ librdf_storage_sqlite_open(librdf_storage* storage, librdf_model* model)
       librdf_storage_sqlite_close(storage);
       return 1;
     }
+#endif
     
     if(!begin)
       librdf_storage_sqlite_transaction_commit(storage);    
   } /* end if is new */
 
+#if REDLAND_SQLITE_API == 3
+  if(librdf_storage_sqlite_schema_upgrade(storage)) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "SQLite database %s schema upgrade to version %d failed", 
+               context->name, SQLITE_SCHEMA_VERSION);
+    librdf_storage_sqlite_close(storage);
+    return 1;
+  }
+
+  if(context->statistics && librdf_storage_sqlite_statistics_open(storage)) {
+    librdf_storage_sqlite_close(storage);
+    return 1;
+  }
+#endif
+
   return 0;
 }
 
@@ -962,6 +1709,16 @@ librdf_storage_sqlite_close(librdf_storage* storage)
   context = (librdf_storage_sqlite_instance*)storage->instance;
 
   if(context->db) {
+#if REDLAND_SQLITE_API == 3
+    librdf_storage_sqlite_statement_cache_clear(storage);
+
+    /* without automatic checkpoints the WAL is written back on close */
+    if(context->journal_mode == SQLITE_JOURNAL_MODE_WAL &&
+       !context->checkpoint)
+      librdf_storage_sqlite_exec(storage,
+                                 (unsigned char*)"PRAGMA wal_checkpoint(TRUNCATE);",
+                                 NULL, NULL, 0);
+#endif
     sqlite_CLOSE(context->db);
     context->db = NULL;
   }
@@ -986,6 +1743,162 @@ librdf_storage_sqlite_size(librdf_storage* storage)
 }
 
 
+static int
+librdf_storage_sqlite_get_4int_callback(void *arg,
+                                        int argc, char **argv,
+                                        char **columnNames)
+{
+  int* counts = (int*)arg;
+  int i;
+  
+  for(i = 0; i < argc && i < 4; i++)
+    counts[i] = argv[i] ? atoi(argv[i]) : 0;
+
+  return 0;
+}
+
+
+/**
+ * librdf_storage_sqlite_estimate_statements:
+ * @storage: the storage
+ * @statement: partial statement pattern or NULL
+ * @distinct: 0 or a #librdf_statement_part
+ *
+ * Estimate statements matching a pattern from the predicate_stats table.
+ *
+ * Return value: estimate or < 0 if statistics are not kept
+ **/
+static int
+librdf_storage_sqlite_estimate_statements(librdf_storage* storage,
+                                          librdf_statement* statement,
+                                          int distinct)
+{
+  librdf_storage_sqlite_instance* context;
+  librdf_node* predicate = NULL;
+  /* statements, subjects, objects, predicates */
+  int counts[4] = {0, 0, 0, 0};
+  librdf_storage_sqlite_request request;
+  int rc;
+  
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(!context->statistics)
+    return -1;
+
+  if(statement)
+    predicate = librdf_statement_get_predicate(statement);
+
+  if(predicate) {
+    int id;
+
+    if(!librdf_node_is_resource(predicate))
+      return 0;
+    id = librdf_storage_sqlite_uri_helper(storage,
+                                          librdf_node_get_uri(predicate), 0);
+    if(id < 0)
+      return 0;
+
+    if(librdf_storage_sqlite_request_init(&request))
+      return -1;
+    librdf_storage_sqlite_request_append(&request, "SELECT statements, subjects, objects, 1 FROM predicate_stats WHERE predicateUri = ");
+    rc = librdf_storage_sqlite_request_add_int(&request, id);
+    librdf_storage_sqlite_request_append(&request, ";");
+    if(!rc)
+      rc = librdf_storage_sqlite_request_exec(storage, &request,
+                                              librdf_storage_sqlite_get_4int_callback,
+                                              counts);
+    librdf_storage_sqlite_request_clear(&request);
+  } else
+    rc = librdf_storage_sqlite_exec(storage,
+                                    (unsigned char*)"SELECT SUM(statements), SUM(subjects), SUM(objects), COUNT(*) FROM predicate_stats;",
+                                    librdf_storage_sqlite_get_4int_callback,
+                                    counts, 0);
+
+  if(rc)
+    return -1;
+
+  if(predicate && !counts[0])
+    return 0;
+
+  return librdf_storage_statistics_estimate_counts(statement, distinct,
+                                                   counts[0], counts[1],
+                                                   counts[2], counts[3]);
+}
+
+
+/*
+ * Append the condition matching node @id of @node_type in triple
+ * @part.  The columns before it for the same part are constrained to
+ * NULL so that the leading columns of the triples indexes are all
+ * bound, for example subjectUri IS NULL AND subjectBlank=id
+ */
+static int
+librdf_storage_sqlite_request_add_part(librdf_storage_sqlite_request* request,
+                                       const char *prefix,
+                                       int part,
+                                       triple_node_type node_type,
+                                       int id)
+{
+  int i;
+
+  for(i = 0; i < (int)node_type; i++) {
+    librdf_storage_sqlite_request_append(request, prefix);
+    librdf_storage_sqlite_request_append(request, triples_fields[part][i]);
+    librdf_storage_sqlite_request_append(request, " IS NULL AND ");
+  }
+
+  librdf_storage_sqlite_request_append(request, prefix);
+  librdf_storage_sqlite_request_append(request,
+                                       triples_fields[part][node_type]);
+  librdf_storage_sqlite_request_append(request, "=");
+
+  return librdf_storage_sqlite_request_add_int(request, id);
+}
+
+
+/* Insert a row into the triples table for @max nodes */
+static int
+librdf_storage_sqlite_triple_insert_helper(librdf_storage* storage,
+                                           const unsigned char* fields[4],
+                                           int node_ids[4],
+                                           int max)
+{
+  librdf_storage_sqlite_request request;
+  int i;
+  int rc = 0;
+
+  if(librdf_storage_sqlite_request_init(&request))
+    return -1;
+
+  librdf_storage_sqlite_request_append(&request, "INSERT INTO ");
+  librdf_storage_sqlite_request_append(&request,
+                                       sqlite_tables[TABLE_TRIPLES].name);
+  librdf_storage_sqlite_request_append(&request, " ( ");
+  for(i = 0; i < max; i++) {
+    librdf_storage_sqlite_request_append(&request, (const char*)fields[i]);
+    if(i < (max-1))
+      librdf_storage_sqlite_request_append(&request, ", ");
+  }
+  
+  librdf_storage_sqlite_request_append(&request, ") VALUES(");
+  for(i = 0; i < max; i++) {
+    rc |= librdf_storage_sqlite_request_add_int(&request, node_ids[i]);
+    if(i < (max-1))
+      librdf_storage_sqlite_request_append(&request, ", ");
+  }
+  librdf_storage_sqlite_request_append(&request, ");");
+
+  if(!rc)
+    rc = librdf_storage_sqlite_request_exec(storage, &request,
+                                            NULL, /* no callback */
+                                            NULL /* arg */);
+
+  librdf_storage_sqlite_request_clear(&request);
+
+  return rc;
+}
+
+
 static int
 librdf_storage_sqlite_add_statement(librdf_storage* storage, 
                                     librdf_statement* statement)
@@ -1014,9 +1927,6 @@ librdf_storage_sqlite_add_statements(librdf_storage* storage,
     triple_node_type node_types[4];
     int node_ids[4];
     const unsigned char* fields[4];
-    raptor_stringbuffer *sb;
-    int i;
-    unsigned char* request;
     int rc;
     int max = 3;
     
@@ -1045,48 +1955,8 @@ librdf_storage_sqlite_add_statements(librdf_storage* storage,
     if(context_node)
       max++;
     
-    /* FIXME no context field used */
-    sb = raptor_new_stringbuffer();
-    if(!sb) {
-      if(!begin)
-        librdf_storage_sqlite_transaction_rollback(storage);
-      return -1;
-    }
-
-    raptor_stringbuffer_append_string(sb,
-                                      (unsigned char*)"INSERT INTO ", 1);
-    raptor_stringbuffer_append_string(sb, 
-                                      (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)" ( ", 3, 1);
-    for(i = 0; i < max; i++) {
-      raptor_stringbuffer_append_string(sb, fields[i], 1);
-      if(i < (max-1))
-        raptor_stringbuffer_append_counted_string(sb, 
-                                                  (unsigned char*)", ", 2, 1);
-    }
-    
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)") VALUES(", 9, 1);
-    for(i = 0; i < max; i++) {
-      raptor_stringbuffer_append_decimal(sb, node_ids[i]);
-      if(i < (max-1))
-        raptor_stringbuffer_append_counted_string(sb, 
-                                                  (unsigned char*)", ", 2, 1);
-    }
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)");", 2, 1);
-    
-    request = raptor_stringbuffer_as_string(sb);
-
-    rc = librdf_storage_sqlite_exec(storage,
-                                    request,
-                                    NULL, /* no callback */
-                                    NULL, /* arg */
-                                    0);
-
-    raptor_free_stringbuffer(sb);
-
+    rc = librdf_storage_sqlite_triple_insert_helper(storage, fields, node_ids,
+                                                    max);
     if(rc) {
       if(!begin)
         librdf_storage_sqlite_transaction_rollback(storage);
@@ -1115,7 +1985,7 @@ static int
 librdf_storage_sqlite_statement_operator_helper(librdf_storage* storage, 
                                                 librdf_statement* statement,
                                                 librdf_node* context_node,
-                                                raptor_stringbuffer* sb,
+                                                librdf_storage_sqlite_request* request,
                                                 int add_new)
 {
   /* librdf_storage_sqlite_instance* context; */
@@ -1138,21 +2008,17 @@ librdf_storage_sqlite_statement_operator_helper(librdf_storage* storage,
                                             add_new))
     return 1;
   
-  raptor_stringbuffer_append_counted_string(sb,
-                                            (const unsigned char*)" FROM ", 6, 1);
-  raptor_stringbuffer_append_string(sb,  
-                                    (const unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
-  raptor_stringbuffer_append_counted_string(sb,  
-                                            (const unsigned char*)" WHERE ", 7, 1);
+  librdf_storage_sqlite_request_append(request, " FROM ");
+  librdf_storage_sqlite_request_append(request,
+                                       sqlite_tables[TABLE_TRIPLES].name);
+  librdf_storage_sqlite_request_append(request, " WHERE ");
   
   for(i = 0; i < max; i++) {
     if(need_and)
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)" AND ", 5, 1);
-    raptor_stringbuffer_append_string(sb, fields[i], 1);
-    raptor_stringbuffer_append_counted_string(sb,  
-                                              (const unsigned char*)"=", 1, 1);
-    raptor_stringbuffer_append_decimal(sb, node_ids[i]);
+      librdf_storage_sqlite_request_append(request, " AND ");
+    if(librdf_storage_sqlite_request_add_part(request, "", i, node_types[i],
+                                              node_ids[i]))
+      return 1;
     
     need_and = 1;
   }
@@ -1174,40 +2040,34 @@ librdf_storage_sqlite_context_contains_statement(librdf_storage* storage,
                                                  librdf_node* context_node,
                                                  librdf_statement* statement)
 {
-  raptor_stringbuffer *sb;
-  unsigned char *request;
+  librdf_storage_sqlite_request request;
   int count = 0;
   int rc, begin;
 
-  sb = raptor_new_stringbuffer();
-  if(!sb)
+  if(librdf_storage_sqlite_request_init(&request))
     return -1;
 
   /* returns non-0 if a transaction is already active */
   begin = librdf_storage_sqlite_transaction_start(storage);
 
-  raptor_stringbuffer_append_string(sb, 
-                                    (const unsigned char*)"SELECT 1",
-                                    1);
-
+  librdf_storage_sqlite_request_append(&request, "SELECT 1");
+
   if(librdf_storage_sqlite_statement_operator_helper(storage, statement, 
-                                                     context_node, sb, 0)) {
+                                                     context_node, &request,
+                                                     0)) {
     if(!begin)
       librdf_storage_sqlite_transaction_rollback(storage);
-    raptor_free_stringbuffer(sb);
+    librdf_storage_sqlite_request_clear(&request);
     return -1;
   }
 
-  raptor_stringbuffer_append_string(sb, (const unsigned char*)" LIMIT 1;", 1);
-  request = raptor_stringbuffer_as_string(sb);
+  librdf_storage_sqlite_request_append(&request, " LIMIT 1;");
   
-  rc = librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  librdf_storage_sqlite_get_1int_callback,
-                                  &count,
-                                  0);
+  rc = librdf_storage_sqlite_request_exec(storage, &request,
+                                          librdf_storage_sqlite_get_1int_callback,
+                                          &count);
   
-  raptor_free_stringbuffer(sb);
+  librdf_storage_sqlite_request_clear(&request);
 
   if(!begin)
     librdf_storage_transaction_commit(storage);
@@ -1270,6 +2130,11 @@ typedef struct {
   librdf_statement *statement;
   librdf_node* context;
 
+  /* rows handed out by the batch method */
+  librdf_statement **batch;
+  librdf_node **batch_contexts;
+  int batch_size;
+
   /* OUT from sqlite3_prepare (V3) or sqlite_compile (V2) */
   sqlite_STATEMENT *vm;
   const char *zTail;
@@ -1298,7 +2163,7 @@ librdf_storage_sqlite_serialise(librdf_storage* storage)
   librdf_storage_add_reference(scontext->storage);
 
   scontext->sqlite_context = context;
-  context->in_stream++;
+  librdf_storage_sqlite_stream_started(context);
 
   sb = raptor_new_stringbuffer();
   if(!sb) {
@@ -1359,6 +2224,8 @@ librdf_storage_sqlite_serialise(librdf_storage* storage)
     librdf_storage_sqlite_serialise_finished((void*)scontext);
     return NULL;
   }
+  librdf_stream_set_batch_method(stream,
+                                 &librdf_storage_sqlite_serialise_batch);
   
   return stream;  
 }
@@ -1627,13 +2494,102 @@ librdf_storage_sqlite_serialise_get_statement(void* context, int flags)
 }
 
 
+/*
+ * librdf_storage_sqlite_serialise_batch:
+ * @context: serialise stream context
+ * @statements: array for up to @size statements
+ * @contexts: array for the context nodes or NULL
+ * @size: size of the arrays
+ *
+ * INTERNAL - Step through up to @size rows, taking over the statement
+ * and context built for each row so that no copies are made.  They
+ * stay owned by the stream context until the next call.
+ *
+ * Return value: number of statements, 0 at the end or <0 on failure
+ */
+static int
+librdf_storage_sqlite_serialise_batch(void* context,
+                                      librdf_statement** statements,
+                                      librdf_node** contexts, int size)
+{
+  librdf_storage_sqlite_serialise_stream_context* scontext;
+  int count;
+  int i;
+
+  scontext = (librdf_storage_sqlite_serialise_stream_context*)context;
+
+  if(size > scontext->batch_size) {
+    librdf_statement** new_batch;
+    librdf_node** new_contexts;
+
+    new_batch = LIBRDF_CALLOC(librdf_statement**, size, sizeof(librdf_statement*));
+    new_contexts = LIBRDF_CALLOC(librdf_node**, size, sizeof(librdf_node*));
+    if(!new_batch || !new_contexts) {
+      if(new_batch)
+        LIBRDF_FREE(librdf_statement**, new_batch);
+      if(new_contexts)
+        LIBRDF_FREE(librdf_node**, new_contexts);
+      return -1;
+    }
+    for(i = 0; i < scontext->batch_size; i++) {
+      new_batch[i] = scontext->batch[i];
+      new_contexts[i] = scontext->batch_contexts[i];
+    }
+    if(scontext->batch)
+      LIBRDF_FREE(librdf_statement**, scontext->batch);
+    if(scontext->batch_contexts)
+      LIBRDF_FREE(librdf_node**, scontext->batch_contexts);
+    scontext->batch = new_batch;
+    scontext->batch_contexts = new_contexts;
+    scontext->batch_size = size;
+  }
+
+  /* fetches the current row if not yet done */
+  if(librdf_storage_sqlite_serialise_end_of_stream(context))
+    return 0;
+
+  for(count = 0; count < size && !scontext->finished; count++) {
+    librdf_statement* statement = scontext->batch[count];
+
+    /* take the current row; its old slot is reused for the next row */
+    scontext->batch[count] = scontext->statement;
+    scontext->statement = statement;
+
+    if(scontext->batch_contexts[count])
+      librdf_free_node(scontext->batch_contexts[count]);
+    scontext->batch_contexts[count] = scontext->context;
+    scontext->context = NULL;
+
+    statements[count] = scontext->batch[count];
+    if(contexts)
+      contexts[count] = scontext->batch_contexts[count];
+
+    librdf_storage_sqlite_serialise_next_statement(context);
+  }
+
+  return count;
+}
+
+
 static void
 librdf_storage_sqlite_serialise_finished(void* context)
 {
   librdf_storage_sqlite_serialise_stream_context* scontext;
+  int i;
 
   scontext = (librdf_storage_sqlite_serialise_stream_context*)context;
 
+  for(i = 0; i < scontext->batch_size; i++) {
+    if(scontext->batch[i])
+      librdf_free_statement(scontext->batch[i]);
+    if(scontext->batch_contexts[i])
+      librdf_free_node(scontext->batch_contexts[i]);
+  }
+  if(scontext->batch)
+    LIBRDF_FREE(librdf_statement**, scontext->batch);
+  if(scontext->batch_contexts)
+    LIBRDF_FREE(librdf_node**, scontext->batch_contexts);
+
   if(scontext->vm) {
     char *errmsg = NULL;
     int status;
@@ -1666,9 +2622,7 @@ librdf_storage_sqlite_serialise_finished(void* context)
   if(scontext->context)
     librdf_free_node(scontext->context);
 
-  scontext->sqlite_context->in_stream--;
-  if(!scontext->sqlite_context->in_stream)
-    librdf_storage_sqlite_query_flush(scontext->storage);
+  librdf_storage_sqlite_stream_ended(scontext->storage, scontext->sqlite_context);
 
   LIBRDF_FREE(librdf_storage_sqlite_serialise_stream_context, scontext);
 }
@@ -1712,13 +2666,10 @@ librdf_storage_sqlite_find_statements(librdf_storage* storage,
   librdf_storage_sqlite_instance* context;
   librdf_storage_sqlite_find_statements_stream_context* scontext;
   librdf_stream* stream;
-  unsigned char* request;
-  int status;
   triple_node_type node_types[4];
   int node_ids[4];
   const unsigned char* fields[4];
-  char *errmsg = NULL;
-  raptor_stringbuffer *sb;
+  librdf_storage_sqlite_request request;
   int need_where = 1;
   int need_and = 0;
   int i;
@@ -1734,7 +2685,7 @@ librdf_storage_sqlite_find_statements(librdf_storage* storage,
   librdf_storage_add_reference(scontext->storage);
 
   scontext->sqlite_context = context;
-  context->in_stream++;
+  librdf_storage_sqlite_stream_started(context);
 
   scontext->query_statement = librdf_new_statement_from_statement(statement);
   if(!scontext->query_statement) {
@@ -1751,77 +2702,39 @@ librdf_storage_sqlite_find_statements(librdf_storage* storage,
     return NULL;
   }
 
-  sb = raptor_new_stringbuffer();
-  if(!sb) {
+  if(librdf_storage_sqlite_request_init(&request)) {
     librdf_storage_sqlite_find_statements_finished((void*)scontext);
     return NULL;
   }
 
-  sqlite_construct_select_helper(sb);
+  sqlite_construct_select_helper(request.sb);
 
   for(i = 0; i < 3; i++) {
     if(node_types[i] == TRIPLE_NONE)
       continue;
     
     if(need_where) {
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)" WHERE ", 7, 1);
+      librdf_storage_sqlite_request_append(&request, " WHERE ");
       need_where = 0;
       need_and = 1;
     } else if(need_and)
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)" AND ", 5, 1);
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)"T.", 2, 1);
-    raptor_stringbuffer_append_string(sb, fields[i], 1);
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)"=", 1, 1);
-    raptor_stringbuffer_append_decimal(sb, node_ids[i]);
-    raptor_stringbuffer_append_counted_string(sb, 
-                                              (unsigned char*)"\n", 1, 1);
-  }
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)";", 1, 1);
-  
-  request = raptor_stringbuffer_as_string(sb);
-  if(!request) {
-    raptor_free_stringbuffer(sb);
-    librdf_storage_sqlite_find_statements_finished((void*)scontext);
-    return NULL;
+      librdf_storage_sqlite_request_append(&request, " AND ");
+    librdf_storage_sqlite_request_add_part(&request, "T.", i, node_types[i],
+                                           node_ids[i]);
+    librdf_storage_sqlite_request_append(&request, "\n");
   }
+  librdf_storage_sqlite_request_append(&request, ";");
 
-#if defined(LIBRDF_DEBUG) && LIBRDF_DEBUG > 2
-  LIBRDF_DEBUG2("SQLite prepare '%s'\n", request);
-#endif
-
-#if REDLAND_SQLITE_API == 3
-  status = sqlite3_prepare(context->db,
-                           (const char*)request,
-                           LIBRDF_GOOD_CAST(int, raptor_stringbuffer_length(sb)),
-                           &scontext->vm,
-                           &scontext->zTail);
-  if(status != SQLITE_OK)
-    errmsg = (char*)sqlite3_errmsg(context->db);
-#endif
-#if REDLAND_SQLITE_API == 2  
-  status = sqlite_compile(context->db,
-                          (const char*)request,
-                          &scontext->zTail, 
-                          &scontext->vm,
-                          &errmsg);
-#endif
-
-  raptor_free_stringbuffer(sb);
+  scontext->vm = librdf_storage_sqlite_request_prepare(storage, &request);
 
-  if(status != SQLITE_OK) {
-    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-               "SQLite database %s SQL compile '%s' failed - %s (%d)", 
-               context->name, request, errmsg, status);
+  librdf_storage_sqlite_request_clear(&request);
 
+  if(!scontext->vm) {
     librdf_storage_sqlite_find_statements_finished((void*)scontext);
     return NULL;
   }
   
+
   stream = librdf_new_stream(storage->world,
                              (void*)scontext,
                              &librdf_storage_sqlite_find_statements_end_of_stream,
@@ -1922,28 +2835,8 @@ librdf_storage_sqlite_find_statements_finished(void* context)
 
   scontext  = (librdf_storage_sqlite_find_statements_stream_context*)context;
 
-  if(scontext->vm) {
-    char *errmsg = NULL;
-    int status;
-    
-#if REDLAND_SQLITE_API == 3
-    status = sqlite3_finalize(scontext->vm);
-    if(status != SQLITE_OK)
-      errmsg = (char*)sqlite3_errmsg(scontext->sqlite_context->db);
-#endif
-#if REDLAND_SQLITE_API == 2
-    status = sqlite_finalize(scontext->vm, &errmsg);
-#endif
-    if(status != SQLITE_OK) {
-      librdf_log(scontext->storage->world,
-                 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
-                 "SQLite database %s finalize failed - %s (%d)", 
-                 scontext->sqlite_context->name, errmsg, status);
-#if REDLAND_SQLITE_API == 2
-      sqlite_FREE(errmsg);
-#endif
-    }
-  }
+  if(scontext->vm)
+    librdf_storage_sqlite_finish_statement(scontext->storage, scontext->vm);
 
   if(scontext->storage)
     librdf_storage_remove_reference(scontext->storage);
@@ -1957,9 +2850,7 @@ librdf_storage_sqlite_find_statements_finished(void* context)
   if(scontext->context)
     librdf_free_node(scontext->context);
 
-  scontext->sqlite_context->in_stream--;
-  if(!scontext->sqlite_context->in_stream)
-    librdf_storage_sqlite_query_flush(scontext->storage);
+  librdf_storage_sqlite_stream_ended(scontext->storage, scontext->sqlite_context);
 
   LIBRDF_FREE(librdf_storage_sqlite_find_statements_stream_context, scontext);
 }
@@ -1984,9 +2875,6 @@ librdf_storage_sqlite_context_add_statement(librdf_storage* storage,
   triple_node_type node_types[4];
   int node_ids[4];
   const unsigned char* fields[4];
-  raptor_stringbuffer *sb;
-  unsigned char* request;
-  int i;
   int rc, begin;
   int max=3;
 
@@ -1996,10 +2884,6 @@ librdf_storage_sqlite_context_add_statement(librdf_storage* storage,
 
   /* context = (librdf_storage_sqlite_instance*)storage->instance; */
 
-  sb = raptor_new_stringbuffer();
-  if(!sb)
-    return -1;
-
   /* returns non-0 if transaction is already active */
   begin = librdf_storage_sqlite_transaction_start(storage);
 
@@ -2011,47 +2895,14 @@ librdf_storage_sqlite_context_add_statement(librdf_storage* storage,
 
     if(!begin)
       librdf_storage_sqlite_transaction_rollback(storage);
-    raptor_free_stringbuffer(sb);
     return -1;
   }
   
   if(context_node)
     max++;
 
-  raptor_stringbuffer_append_string(sb, 
-                                    (unsigned char*)"INSERT INTO ", 1);
-  raptor_stringbuffer_append_string(sb, 
-                                    (unsigned char*)sqlite_tables[TABLE_TRIPLES].name, 1);
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)" ( ", 3, 1);
-  for(i = 0; i < max; i++) {
-    raptor_stringbuffer_append_string(sb, fields[i], 1);
-    if(i < (max-1))
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)", ", 2, 1);
-  }
-  
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)") VALUES(", 9, 1);
-  for(i = 0; i < max; i++) {
-    raptor_stringbuffer_append_decimal(sb, node_ids[i]);
-    if(i < (max-1))
-      raptor_stringbuffer_append_counted_string(sb, 
-                                                (unsigned char*)", ", 2, 1);
-  }
-  raptor_stringbuffer_append_counted_string(sb, 
-                                            (unsigned char*)");", 2, 1);
-  
-  request = raptor_stringbuffer_as_string(sb);
-  
-  rc = librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  NULL, /* no callback */
-                                  NULL, /* arg */
-                                  0);
-  
-  raptor_free_stringbuffer(sb);
-  
+  rc = librdf_storage_sqlite_triple_insert_helper(storage, fields, node_ids,
+                                                  max);
   if(rc) {
     if(!begin)
       librdf_storage_transaction_rollback(storage);
@@ -2082,34 +2933,26 @@ librdf_storage_sqlite_context_remove_statement(librdf_storage* storage,
 {
   /* librdf_storage_sqlite_instance* context; */
   int rc;
-  raptor_stringbuffer *sb;
-  unsigned char *request;
+  librdf_storage_sqlite_request request;
 
   /* context = (librdf_storage_sqlite_instance*)storage->instance; */
 
-  sb = raptor_new_stringbuffer();
-  if(!sb)
+  if(librdf_storage_sqlite_request_init(&request))
     return -1;
 
-  raptor_stringbuffer_append_string(sb, (const unsigned char*)"DELETE", 1);
+  librdf_storage_sqlite_request_append(&request, "DELETE");
   if(librdf_storage_sqlite_statement_operator_helper(storage, statement,
-                                                     context_node, sb, 0)) {
-    raptor_free_stringbuffer(sb);
+                                                     context_node, &request,
+                                                     0)) {
+    librdf_storage_sqlite_request_clear(&request);
     return -1;
   }
 
-  raptor_stringbuffer_append_counted_string(sb,
-                                            (const unsigned char*)";", 1, 1);
- 
-  request = raptor_stringbuffer_as_string(sb);
+  librdf_storage_sqlite_request_append(&request, ";");
   
-  rc = librdf_storage_sqlite_exec(storage,
-                                  request,
-                                  NULL,
-                                  NULL,
-                                  0);
+  rc = librdf_storage_sqlite_request_exec(storage, &request, NULL, NULL);
   
-  raptor_free_stringbuffer(sb);
+  librdf_storage_sqlite_request_clear(&request);
 
   return rc;
 }
@@ -2223,7 +3066,7 @@ librdf_storage_sqlite_context_serialise(librdf_storage* storage,
   librdf_storage_add_reference(scontext->storage);
 
   scontext->sqlite_context = context;
-  context->in_stream++;
+  librdf_storage_sqlite_stream_started(context);
 
   scontext->context_node = librdf_new_node_from_node(context_node);
 
@@ -2431,9 +3274,7 @@ librdf_storage_sqlite_context_serialise_finished(void* context)
   if(scontext->context_node)
     librdf_free_node(scontext->context_node);
 
-  scontext->sqlite_context->in_stream--;
-  if(!scontext->sqlite_context->in_stream)
-    librdf_storage_sqlite_query_flush(scontext->storage);
+  librdf_storage_sqlite_stream_ended(scontext->storage, scontext->sqlite_context);
 
   LIBRDF_FREE(librdf_storage_sqlite_context_serialise_stream_context, scontext);
 }
@@ -2448,9 +3289,16 @@ typedef struct {
   
   librdf_node *current;
 
+  /* result column holding the URI of each node */
+  int column;
+
   /* OUT from sqlite3_prepare (V3) or sqlite_compile (V2) */
   sqlite_STATEMENT *vm;
   const char *zTail;
+
+  /* non 0 if vm is from librdf_storage_sqlite_request_prepare and the
+   * iterator counts as an open stream */
+  int prepared;
 } librdf_storage_sqlite_get_contexts_iterator_context;
 
 
@@ -2458,6 +3306,7 @@ typedef struct {
 static int
 librdf_storage_sqlite_get_next_context_common(librdf_storage_sqlite_instance* scontext,
                                               sqlite_STATEMENT *vm,
+                                              int column,
                                               librdf_node **context_node)
 {
   int status = SQLITE_BUSY;
@@ -2509,7 +3358,7 @@ librdf_storage_sqlite_get_next_context_common(librdf_storage_sqlite_instance* sc
     fputc('\n', stderr);
 #endif
 
-    uri_string = GET_COLUMN_VALUE_TEXT(vm, 0);
+    uri_string = GET_COLUMN_VALUE_TEXT(vm, column);
     if(uri_string) {
       librdf_node *node;
       node = librdf_new_node_from_uri_string(scontext->storage->world,
@@ -2570,6 +3419,7 @@ librdf_storage_sqlite_get_contexts_is_end(void* iterator)
     
     result = librdf_storage_sqlite_get_next_context_common(icontext->sqlite_context,
                                                          icontext->vm,
+                                                         icontext->column,
                                                          &icontext->current);
     if(result) {
       /* error or finished */
@@ -2597,6 +3447,7 @@ librdf_storage_sqlite_get_contexts_next_method(void* iterator)
 
   result = librdf_storage_sqlite_get_next_context_common(icontext->sqlite_context,
                                                          icontext->vm,
+                                                         icontext->column,
                                                          &icontext->current);
   if(result) {
     /* error or finished */
@@ -2646,7 +3497,12 @@ librdf_storage_sqlite_get_contexts_finished(void* iterator)
 
   icontext = (librdf_storage_sqlite_get_contexts_iterator_context*)iterator;
 
-  if(icontext->vm) {
+  if(icontext->prepared) {
+    if(icontext->vm)
+      librdf_storage_sqlite_finish_statement(icontext->storage, icontext->vm);
+    librdf_storage_sqlite_stream_ended(icontext->storage,
+                                       icontext->sqlite_context);
+  } else if(icontext->vm) {
     char *errmsg = NULL;
     int status;
     
@@ -2777,6 +3633,166 @@ librdf_storage_sqlite_get_contexts(librdf_storage* storage)
 
 
 
+/*
+ * Check for a triple with @node as triple @part (0 subject or 2
+ * object) and predicate @property, stopping at the first row found.
+ */
+static int
+librdf_storage_sqlite_has_arc(librdf_storage* storage,
+                              librdf_node* node, int part,
+                              librdf_node* property)
+{
+  librdf_storage_sqlite_request request;
+  triple_node_type node_type, property_type;
+  int node_id, property_id;
+  int count = 0;
+  int rc;
+
+  if(librdf_storage_sqlite_node_helper(storage, node, &node_id, &node_type,
+                                       0) ||
+     librdf_storage_sqlite_node_helper(storage, property, &property_id,
+                                       &property_type, 0))
+    return 0;
+
+  /* a node not in the database, a literal subject or a non-URI
+   * predicate matches nothing */
+  if(node_id < 0 || property_id < 0 || property_type != TRIPLE_URI ||
+     !triples_fields[part][node_type])
+    return 0;
+
+  if(librdf_storage_sqlite_request_init(&request))
+    return 0;
+
+  librdf_storage_sqlite_request_append(&request, "SELECT 1 FROM ");
+  librdf_storage_sqlite_request_append(&request,
+                                       sqlite_tables[TABLE_TRIPLES].name);
+  librdf_storage_sqlite_request_append(&request, " WHERE ");
+  rc = librdf_storage_sqlite_request_add_part(&request, "", part, node_type,
+                                              node_id);
+  librdf_storage_sqlite_request_append(&request, " AND ");
+  rc |= librdf_storage_sqlite_request_add_part(&request, "", 1, TRIPLE_URI,
+                                               property_id);
+  librdf_storage_sqlite_request_append(&request, " LIMIT 1;");
+
+  if(!rc)
+    rc = librdf_storage_sqlite_request_exec(storage, &request,
+                                            librdf_storage_sqlite_get_1int_callback,
+                                            &count);
+
+  librdf_storage_sqlite_request_clear(&request);
+
+  if(rc)
+    return 0;
+
+  return (count > 0);
+}
+
+
+static int
+librdf_storage_sqlite_has_arc_in(librdf_storage* storage,
+                                 librdf_node* node, librdf_node* property)
+{
+  return librdf_storage_sqlite_has_arc(storage, node, 2, property);
+}
+
+
+static int
+librdf_storage_sqlite_has_arc_out(librdf_storage* storage,
+                                  librdf_node* node, librdf_node* property)
+{
+  return librdf_storage_sqlite_has_arc(storage, node, 0, property);
+}
+
+
+/*
+ * Get the distinct predicates of triples with @node as triple @part
+ * (0 subject or 2 object).  The distinct predicate ids are found from
+ * the spocindex or ospcindex alone and only those URIs are looked up.
+ */
+static librdf_iterator*
+librdf_storage_sqlite_get_arcs(librdf_storage* storage, librdf_node* node,
+                               int part)
+{
+  librdf_storage_sqlite_instance* context;
+  librdf_storage_sqlite_get_contexts_iterator_context* icontext;
+  librdf_storage_sqlite_request request;
+  triple_node_type node_type;
+  int node_id;
+  int rc;
+  librdf_iterator* iterator;
+
+  context = (librdf_storage_sqlite_instance*)storage->instance;
+
+  if(librdf_storage_sqlite_node_helper(storage, node, &node_id, &node_type, 0))
+    return NULL;
+
+  /* a node not in the database or a literal subject has no arcs */
+  if(node_id < 0 || !triples_fields[part][node_type])
+    return librdf_new_empty_iterator(storage->world);
+
+  icontext = LIBRDF_CALLOC(librdf_storage_sqlite_get_contexts_iterator_context*,
+                           1, sizeof(*icontext));
+  if(!icontext)
+    return NULL;
+
+  icontext->storage = storage;
+  librdf_storage_add_reference(icontext->storage);
+
+  icontext->sqlite_context = context;
+  icontext->column = 0;
+  icontext->prepared = 1;
+  librdf_storage_sqlite_stream_started(context);
+
+  if(librdf_storage_sqlite_request_init(&request)) {
+    librdf_storage_sqlite_get_contexts_finished((void*)icontext);
+    return NULL;
+  }
+
+  librdf_storage_sqlite_request_append(&request, "SELECT uri FROM uris WHERE id IN (SELECT DISTINCT predicateUri FROM ");
+  librdf_storage_sqlite_request_append(&request,
+                                       sqlite_tables[TABLE_TRIPLES].name);
+  librdf_storage_sqlite_request_append(&request, " WHERE ");
+  rc = librdf_storage_sqlite_request_add_part(&request, "", part, node_type,
+                                              node_id);
+  librdf_storage_sqlite_request_append(&request, ");");
+
+  if(!rc)
+    icontext->vm = librdf_storage_sqlite_request_prepare(storage, &request);
+
+  librdf_storage_sqlite_request_clear(&request);
+
+  if(!icontext->vm) {
+    librdf_storage_sqlite_get_contexts_finished((void*)icontext);
+    return NULL;
+  }
+
+  iterator = librdf_new_iterator(storage->world,
+                                 (void*)icontext,
+                                 &librdf_storage_sqlite_get_contexts_is_end,
+                                 &librdf_storage_sqlite_get_contexts_next_method,
+                                 &librdf_storage_sqlite_get_contexts_get_method,
+                                 &librdf_storage_sqlite_get_contexts_finished);
+  if(!iterator)
+    librdf_storage_sqlite_get_contexts_finished(icontext);
+  return iterator;
+}
+
+
+static librdf_iterator*
+librdf_storage_sqlite_get_arcs_in(librdf_storage* storage, librdf_node* node)
+{
+  return librdf_storage_sqlite_get_arcs(storage, node, 2);
+}
+
+
+static librdf_iterator*
+librdf_storage_sqlite_get_arcs_out(librdf_storage* storage, librdf_node* node)
+{
+  return librdf_storage_sqlite_get_arcs(storage, node, 0);
+}
+
+
+
 /**
  * librdf_storage_sqlite_get_feature:
  * @storage: #librdf_storage object
@@ -2902,6 +3918,33 @@ librdf_storage_sqlite_transaction_rollback(librdf_storage *storage)
 }
 
 
+/* Count a stream of the database starting */
+static void
+librdf_storage_sqlite_stream_started(librdf_storage_sqlite_instance* context)
+{
+  SQLITE_LOCK(context);
+  context->in_stream++;
+  SQLITE_UNLOCK(context);
+}
+
+
+/* Count a stream of the database ending, running the queries queued
+ * while streams were open after the last one */
+static void
+librdf_storage_sqlite_stream_ended(librdf_storage* storage,
+                                   librdf_storage_sqlite_instance* context)
+{
+  int in_stream;
+
+  SQLITE_LOCK(context);
+  in_stream = --context->in_stream;
+  SQLITE_UNLOCK(context);
+
+  if(!in_stream)
+    librdf_storage_sqlite_query_flush(storage);
+}
+
+
 static void
 librdf_storage_sqlite_query_flush(librdf_storage *storage)
 {
@@ -2953,6 +3996,10 @@ librdf_storage_sqlite_register_factory(librdf_storage_factory *factory)
   factory->contains_statement = librdf_storage_sqlite_contains_statement;
   factory->serialise          = librdf_storage_sqlite_serialise;
   factory->find_statements    = librdf_storage_sqlite_find_statements;
+  factory->has_arc_in         = librdf_storage_sqlite_has_arc_in;
+  factory->has_arc_out        = librdf_storage_sqlite_has_arc_out;
+  factory->get_arcs_in        = librdf_storage_sqlite_get_arcs_in;
+  factory->get_arcs_out       = librdf_storage_sqlite_get_arcs_out;
   factory->context_add_statement    = librdf_storage_sqlite_context_add_statement;
   factory->context_remove_statement = librdf_storage_sqlite_context_remove_statement;
   factory->context_remove_statements = librdf_storage_sqlite_context_remove_statements;
@@ -2962,6 +4009,7 @@ librdf_storage_sqlite_register_factory(librdf_storage_factory *factory)
   factory->transaction_start        = librdf_storage_sqlite_transaction_start;
   factory->transaction_commit       = librdf_storage_sqlite_transaction_commit;
   factory->transaction_rollback     = librdf_storage_sqlite_transaction_rollback;
+  factory->estimate_statements      = librdf_storage_sqlite_estimate_statements;
 }
 
 #ifdef MODULAR_LIBRDF
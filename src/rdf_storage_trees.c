@@ -41,34 +41,71 @@
 #include <stddef.h>
 #endif
 #include <sys/types.h>
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
 
 #include <redland.h>
 
-/* Not yet fully implemented (namely iteration) */
-/*#define RDF_STORAGE_TREES_WITH_CONTEXTS 1*/
-
 typedef struct
 {
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_node* context;
-#endif
+  librdf_node* context; /* NULL for statements without a context */
   raptor_avltree* spo_tree; /* Always present */
   raptor_avltree* sop_tree; /* Optional */
   raptor_avltree* ops_tree; /* Optional */
   raptor_avltree* pso_tree; /* Optional */
 } librdf_storage_trees_graph;
 
+/* Optional index orders, in the order of the graph fields */
+typedef enum {
+  LIBRDF_STORAGE_TREES_INDEX_SOP,
+  LIBRDF_STORAGE_TREES_INDEX_OPS,
+  LIBRDF_STORAGE_TREES_INDEX_PSO,
+  LIBRDF_STORAGE_TREES_INDEX_COUNT
+} librdf_storage_trees_index;
+
+/* Full scans of a missing order before it is built when adaptive */
+#define LIBRDF_STORAGE_TREES_INDEX_BUILD_THRESHOLD 4
+
+/* Usage of an optional order built on demand */
+typedef struct
+{
+  int scans; /* full scans since the order was last present */
+  unsigned long last_used; /* value of finds when last searched */
+  int users; /* open streams iterating the order */
+} librdf_storage_trees_index_usage;
+
 typedef struct
 {
   librdf_storage_trees_graph* graph; /* Statements without a context */
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  raptor_avltree* contexts; /* Tree of librdf_storage_trees_graph */
-#endif
+  raptor_avltree* contexts; /* Tree of librdf_storage_trees_graph or NULL */
   int index_sop;
   int index_ops;
   int index_pso;
+  /* build missing orders on demand and drop them when idle */
+  int index_adaptive;
+  int index_build_threshold;
+  /* finds without use before dropping a built order or 0 to keep */
+  unsigned long index_drop_after;
+  unsigned long finds;
+  librdf_storage_trees_index_usage index_usage[LIBRDF_STORAGE_TREES_INDEX_COUNT];
+  /* statement counts of all graphs or NULL */
+  librdf_storage_statistics* statistics;
+#ifdef WITH_THREADS
+  /* guards the optional orders and their usage, which concurrent
+   * readers change when building and dropping orders on demand */
+  pthread_mutex_t index_mutex;
+#endif
 } librdf_storage_trees_instance;
 
+#ifdef WITH_THREADS
+#define TREES_INDEX_LOCK(context) pthread_mutex_lock(&(context)->index_mutex)
+#define TREES_INDEX_UNLOCK(context) pthread_mutex_unlock(&(context)->index_mutex)
+#else
+#define TREES_INDEX_LOCK(context)
+#define TREES_INDEX_UNLOCK(context)
+#endif
+
 /* prototypes for local functions */
 static int librdf_storage_trees_init(librdf_storage* storage, const char *name, librdf_hash* options);
 static int librdf_storage_trees_open(librdf_storage* storage, librdf_model* model);
@@ -77,36 +114,58 @@ static int librdf_storage_trees_size(librdf_storage* storage);
 static int librdf_storage_trees_add_statement(librdf_storage* storage, librdf_statement* statement);
 static int librdf_storage_trees_add_statements(librdf_storage* storage, librdf_stream* statement_stream);
 static int librdf_storage_trees_remove_statement(librdf_storage* storage, librdf_statement* statement);
-static int librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph, librdf_statement* statement);
+static int librdf_storage_trees_add_statement_internal(librdf_storage* storage, librdf_storage_trees_graph* graph, librdf_statement* statement);
+static int librdf_storage_trees_remove_statement_internal(librdf_storage* storage, librdf_storage_trees_graph* graph, librdf_statement* statement);
 static int librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement);
 static librdf_stream* librdf_storage_trees_serialise(librdf_storage* storage);
 static librdf_stream* librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement);
+static librdf_stream* librdf_storage_trees_find_statements_in_context(librdf_storage* storage, librdf_statement* statement, librdf_node* context_node);
+static int librdf_storage_trees_estimate_statements(librdf_storage* storage, librdf_statement* statement, int distinct);
+static int librdf_storage_trees_has_arc_in(librdf_storage* storage, librdf_node* node, librdf_node* property);
+static int librdf_storage_trees_has_arc_out(librdf_storage* storage, librdf_node* node, librdf_node* property);
+static librdf_iterator* librdf_storage_trees_get_arcs_in(librdf_storage* storage, librdf_node* node);
+static librdf_iterator* librdf_storage_trees_get_arcs_out(librdf_storage* storage, librdf_node* node);
 
 /* graph functions */
 static librdf_storage_trees_graph* librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context);
 static void librdf_storage_trees_graph_free(void* data);
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+static raptor_avltree** librdf_storage_trees_graph_index(librdf_storage_trees_graph* graph, librdf_storage_trees_index index);
+static int librdf_storage_trees_graph_build_index(librdf_storage_trees_graph* graph, librdf_storage_trees_index index);
 static int librdf_storage_trees_graph_compare(const void* data1, const void* data2);
-#endif
 
 /* serialising implementing functions */
 static int librdf_storage_trees_serialise_end_of_stream(void* context);
 static int librdf_storage_trees_serialise_next_statement(void* context);
 static void* librdf_storage_trees_serialise_get_statement(void* context, int flags);
 static void librdf_storage_trees_serialise_finished(void* context);
+static int librdf_storage_trees_serialise_batch(void* context, librdf_statement** statements, librdf_node** contexts, int size);
 
 /* context functions */
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
 static int librdf_storage_trees_context_add_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
 static int librdf_storage_trees_context_remove_statement(librdf_storage* storage, librdf_node* context_node, librdf_statement* statement);
+static int librdf_storage_trees_context_remove_statements(librdf_storage* storage, librdf_node* context_node);
 static librdf_stream* librdf_storage_trees_context_serialise(librdf_storage* storage, librdf_node* context_node);
-#endif
+static librdf_iterator* librdf_storage_trees_get_contexts(librdf_storage* storage);
+static librdf_storage_trees_graph* librdf_storage_trees_get_graph(librdf_storage* storage, librdf_node* context_node);
+
+/* get_contexts iterator functions */
+static int librdf_storage_trees_get_contexts_is_end(void* iterator);
+static int librdf_storage_trees_get_contexts_next_method(void* iterator);
+static void* librdf_storage_trees_get_contexts_get_method(void* iterator, int flags);
+static void librdf_storage_trees_get_contexts_finished(void* iterator);
+
+/* get_arcs iterator functions */
+static int librdf_storage_trees_arcs_is_end(void* iterator);
+static int librdf_storage_trees_arcs_next_method(void* iterator);
+static void* librdf_storage_trees_arcs_get_method(void* iterator, int flags);
+static void librdf_storage_trees_arcs_finished(void* iterator);
 
 /* statement tree functions */
 static int librdf_statement_compare_spo(const void* data1, const void* data2);
 static int librdf_statement_compare_sop(const void* data1, const void* data2);
 static int librdf_statement_compare_ops(const void* data1, const void* data2);
 static int librdf_statement_compare_pso(const void* data1, const void* data2);
+static int librdf_storage_trees_node_compare(librdf_node* n1, librdf_node* n2);
 static void librdf_storage_trees_avl_free(void* data);
 
 
@@ -114,6 +173,20 @@ static void librdf_storage_trees_register_factory(librdf_storage_factory *factor
 
 
 /* functions implementing storage api */
+
+/*
+ * Options:
+ *   index-spo, index-sop, index-ops, index-pso: orders always kept
+ *     (spo always is); all of them when none of these is given
+ *   index-adaptive: build a missing order once index-build-threshold
+ *     searches (default 4) needed it and were full scans, and drop
+ *     it again after index-drop-after finds (default never) without
+ *     a search using it.  Without explicit index options only spo is
+ *     kept up front.
+ *   contexts: keep a graph with its own indexes for each context
+ *   statistics: keep statement counts for estimates (default no);
+ *     distinct subjects and objects are counted once per graph
+ */
 static int
 librdf_storage_trees_init(librdf_storage* storage, const char *name,
                          librdf_hash* options)
@@ -122,6 +195,9 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
   const int index_sop_option = librdf_hash_get_as_boolean(options, "index-sop") > 0;
   const int index_ops_option = librdf_hash_get_as_boolean(options, "index-ops") > 0;
   const int index_pso_option = librdf_hash_get_as_boolean(options, "index-pso") > 0;
+  const int index_adaptive_option = librdf_hash_get_as_boolean(options, "index-adaptive") > 0;
+  long threshold;
+  long drop_after;
 
   librdf_storage_trees_instance* context;
 
@@ -133,19 +209,23 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
   }
 
   librdf_storage_set_instance(storage, context);
+#ifdef WITH_THREADS
+  pthread_mutex_init(&context->index_mutex, NULL);
+#endif
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   /* Support contexts if option given */
   if (librdf_hash_get_as_boolean(options, "contexts") > 0) {
-    context->contexts=librdf_new_avltree(librdf_storage_trees_graph_compare,
-      librdf_storage_trees_graph_free);
+    context->contexts=raptor_new_avltree(librdf_storage_trees_graph_compare,
+                                         librdf_storage_trees_graph_free,
+                                         /* flags */ 0);
   } else {
     context->contexts=NULL;
   }
-#endif
 
-  /* No indexing options given, index all by default */
-  if (!index_spo_option && !index_sop_option && !index_ops_option && !index_pso_option) {
+  /* No indexing options given, index all by default unless the
+   * missing orders are to be built on demand */
+  if (!index_spo_option && !index_sop_option && !index_ops_option &&
+      !index_pso_option && !index_adaptive_option) {
     context->index_sop=1;
     context->index_ops=1;
     context->index_pso=1;
@@ -156,8 +236,26 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
     context->index_ops=index_ops_option;
     context->index_pso=index_pso_option;
   }
+
+  context->index_adaptive = index_adaptive_option;
+  threshold = librdf_hash_get_as_long(options, "index-build-threshold");
+  context->index_build_threshold = (threshold > 0) ? (int)threshold :
+    LIBRDF_STORAGE_TREES_INDEX_BUILD_THRESHOLD;
+  drop_after = librdf_hash_get_as_long(options, "index-drop-after");
+  context->index_drop_after = (drop_after > 0) ? (unsigned long)drop_after : 0;
   
   context->graph = librdf_storage_trees_graph_new(storage, NULL);
+
+  /* Keep statistics if asked for; distinct object counts need the
+   * ops index */
+  if(librdf_hash_get_as_boolean(options, "statistics") > 0) {
+    int parts = LIBRDF_STATEMENT_SUBJECT;
+
+    if(context->index_ops)
+      parts |= LIBRDF_STATEMENT_OBJECT;
+    context->statistics = librdf_new_storage_statistics(storage->world,
+                                                        parts, parts);
+  }
   
   /* no more options, might as well free them now */
   if(options)
@@ -170,8 +268,16 @@ librdf_storage_trees_init(librdf_storage* storage, const char *name,
 static void
 librdf_storage_trees_terminate(librdf_storage* storage)
 {
-  if (storage->instance != NULL)
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  if (context != NULL) {
+    if (context->statistics)
+      librdf_free_storage_statistics(context->statistics);
+#ifdef WITH_THREADS
+    pthread_mutex_destroy(&context->index_mutex);
+#endif
     LIBRDF_FREE(librdf_storage_trees_instance, storage->instance);
+  }
 }
 
 
@@ -200,11 +306,14 @@ librdf_storage_trees_close(librdf_storage* storage)
   
   librdf_storage_trees_graph_free(context->graph);
   context->graph=NULL;
+
+  if(context->statistics)
+    librdf_storage_statistics_clear(context->statistics);
   
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_free_avltree(context->contexts);
-  context->contexts=NULL;
-#endif
+  if(context->contexts) {
+    raptor_free_avltree(context->contexts);
+    context->contexts=NULL;
+  }
   
   return 0;
 }
@@ -214,8 +323,87 @@ static int
 librdf_storage_trees_size(librdf_storage* storage)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  raptor_avltree_iterator* iterator;
+  int size;
+
+  size = raptor_avltree_size(context->graph->spo_tree);
+
+  if(context->contexts) {
+    iterator = raptor_new_avltree_iterator(context->contexts, NULL, NULL, 1);
+    if(iterator) {
+      for(; !raptor_avltree_iterator_is_end(iterator);
+          raptor_avltree_iterator_next(iterator)) {
+        librdf_storage_trees_graph* graph;
+
+        graph = (librdf_storage_trees_graph*)raptor_avltree_iterator_get(iterator);
+        size += raptor_avltree_size(graph->spo_tree);
+      }
+      raptor_free_avltree_iterator(iterator);
+    }
+  }
+
+  return size;
+}
+
+
+/* Check for any statement matching (s, p, o) with NULL wildcards
+ * trailing in the order of the tree */
+static int
+librdf_storage_trees_graph_has(raptor_avltree* tree, librdf_node* subject,
+                               librdf_node* predicate, librdf_node* object)
+{
+  librdf_statement key;
+
+  memset(&key, 0, sizeof(key));
+  key.subject = subject;
+  key.predicate = predicate;
+  key.object = object;
+
+  return (raptor_avltree_search(tree, &key) != NULL);
+}
+
+
+/*
+ * librdf_storage_trees_statistics_update:
+ * @storage: #librdf_storage object
+ * @graph: graph the statement is added to or removed from
+ * @statement: statement added or removed
+ * @delta: +1 before adding a new statement, -1 after removing one
+ *
+ * INTERNAL - Update the statistics for a change to one graph.
+ * Pairs are looked up in the graph's trees before an addition and
+ * after a removal, so a pair missing at that point is the one changing.
+ */
+static void
+librdf_storage_trees_statistics_update(librdf_storage* storage,
+                                       librdf_storage_trees_graph* graph,
+                                       librdf_statement* statement,
+                                       int delta)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_statistics* stats=context->statistics;
+  int sp_changed;
+  int po_changed = 0;
+
+  sp_changed = !librdf_storage_trees_graph_has(graph->spo_tree,
+                                               statement->subject,
+                                               statement->predicate, NULL);
+  if(!librdf_storage_trees_graph_has(graph->spo_tree, statement->subject,
+                                     NULL, NULL))
+    stats->subjects += delta;
+
+  if(context->index_ops) {
+    po_changed = !librdf_storage_trees_graph_has(graph->ops_tree, NULL,
+                                                 statement->predicate,
+                                                 statement->object);
+    if(!librdf_storage_trees_graph_has(graph->ops_tree, NULL, NULL,
+                                       statement->object))
+      stats->objects += delta;
+  }
 
-  return raptor_avltree_size(context->graph->spo_tree);
+  librdf_storage_statistics_update(stats, statement->predicate, delta,
+                                   sp_changed ? delta : 0,
+                                   po_changed ? delta : 0);
 }
 
 
@@ -226,6 +414,10 @@ librdf_storage_trees_add_statement_internal(librdf_storage* storage,
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
   int status = 0;
+
+  if(context->statistics &&
+     !raptor_avltree_search(graph->spo_tree, statement))
+    librdf_storage_trees_statistics_update(storage, graph, statement, +1);
   
   /* copy statement (store single copy in all trees) */
   statement = librdf_new_statement_from_statement(statement);
@@ -234,19 +426,22 @@ librdf_storage_trees_add_statement_internal(librdf_storage* storage,
   status = raptor_avltree_add(graph->spo_tree, statement);
   if (status > 0) /* item already exists; old item remains in tree */
     return 0;
-  else if (status < 0) /* failure */
+  else if (status < 0) { /* failure */
+    if(context->statistics)
+      context->statistics->stale = 1;
     return status;
+  }
     
   /* others have null deleters */
   /* (XXX: corrupt model if insertions fail) */
 
-  if (context->index_sop)
+  if (graph->sop_tree)
     raptor_avltree_add(graph->sop_tree, statement);
     
-  if (context->index_ops)
+  if (graph->ops_tree)
     raptor_avltree_add(graph->ops_tree, statement);
     
-  if (context->index_pso)
+  if (graph->pso_tree)
     raptor_avltree_add(graph->pso_tree, statement);
     
   return status;
@@ -269,6 +464,7 @@ librdf_storage_trees_add_statement(librdf_storage* storage,
                                    librdf_statement* statement) 
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
   return librdf_storage_trees_add_statement_internal(storage, context->graph, statement);
 }
 
@@ -296,9 +492,16 @@ librdf_storage_trees_add_statements(librdf_storage* storage,
 }
 
 static int
-librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph,
+librdf_storage_trees_remove_statement_internal(librdf_storage* storage,
+                                               librdf_storage_trees_graph* graph,
                                                librdf_statement* statement) 
 {
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  int exists = 0;
+
+  if(context->statistics)
+    exists = (raptor_avltree_search(graph->spo_tree, statement) != NULL);
+
   if (graph->sop_tree)
     raptor_avltree_delete(graph->sop_tree, statement);
 
@@ -309,6 +512,9 @@ librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph
     raptor_avltree_delete(graph->pso_tree, statement);
   
   raptor_avltree_delete(graph->spo_tree, statement);
+
+  if(exists)
+    librdf_storage_trees_statistics_update(storage, graph, statement, -1);
   
   return 0;
 }
@@ -325,322 +531,1246 @@ librdf_storage_trees_remove_statement_internal(librdf_storage_trees_graph* graph
  * Return value: non 0 on failure
  **/
 static int
-librdf_storage_trees_remove_statement(librdf_storage* storage, 
-                                      librdf_statement* statement) 
+librdf_storage_trees_remove_statement(librdf_storage* storage, 
+                                      librdf_statement* statement) 
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  return librdf_storage_trees_remove_statement_internal(storage, context->graph,
+                                                        statement);
+}
+
+
+/**
+ * librdf_storage_trees_contains_statement:
+ * @storage: #librdf_storage object
+ * @statement: #librdf_statement statement to find
+ *
+ * Check for a statement in the storage, without a context or in any
+ * context.
+ * 
+ * Return value: non 0 if the statement is present
+ **/
+static int
+librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  raptor_avltree_iterator* iterator;
+  int found;
+
+  found = (raptor_avltree_search(context->graph->spo_tree, statement) != NULL);
+
+  if(!found && context->contexts) {
+    iterator = raptor_new_avltree_iterator(context->contexts, NULL, NULL, 1);
+    if(iterator) {
+      for(; !found && !raptor_avltree_iterator_is_end(iterator);
+          raptor_avltree_iterator_next(iterator)) {
+        librdf_storage_trees_graph* graph;
+
+        graph = (librdf_storage_trees_graph*)raptor_avltree_iterator_get(iterator);
+        found = (raptor_avltree_search(graph->spo_tree, statement) != NULL);
+      }
+      raptor_free_avltree_iterator(iterator);
+    }
+  }
+
+  return found;
+}
+
+
+typedef struct {
+  librdf_storage *storage;
+  librdf_statement *range; /* pattern or NULL for all statements */
+  raptor_avltree_iterator *contexts_iterator; /* context graphs left or NULL */
+  librdf_storage_trees_graph *graph; /* graph being iterated, NULL at end */
+  raptor_avltree_iterator *avltree_iterator;
+  int index; /* optional order iterated or -1 */
+  int filter; /* statements must be matched against range */
+} librdf_storage_trees_serialise_stream_context;
+
+
+/* Free one optional order of a graph */
+static void
+librdf_storage_trees_graph_drop_index(librdf_storage_trees_graph* graph,
+                                      librdf_storage_trees_index index)
+{
+  raptor_avltree** tree = librdf_storage_trees_graph_index(graph, index);
+
+  if(*tree) {
+    raptor_free_avltree(*tree);
+    *tree = NULL;
+  }
+}
+
+
+/*
+ * librdf_storage_trees_drop_idle_indexes:
+ * @storage: #librdf_storage object
+ *
+ * INTERNAL - Free the optional orders built on demand that have not
+ * been searched in the last index-drop-after finds and that no open
+ * stream is iterating, in every graph.
+ */
+static void
+librdf_storage_trees_drop_idle_indexes(librdf_storage* storage)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  const int pinned[LIBRDF_STORAGE_TREES_INDEX_COUNT] = {
+    context->index_sop, context->index_ops, context->index_pso
+  };
+  int i;
+
+  for(i = 0; i < LIBRDF_STORAGE_TREES_INDEX_COUNT; i++) {
+    librdf_storage_trees_index_usage* usage = &context->index_usage[i];
+    raptor_avltree_iterator* iterator;
+
+    /* only orders that have been built can be dropped */
+    if(pinned[i] || usage->users ||
+       usage->scans < context->index_build_threshold ||
+       context->finds - usage->last_used <= context->index_drop_after)
+      continue;
+
+    librdf_storage_trees_graph_drop_index(context->graph,
+                                          (librdf_storage_trees_index)i);
+    if(context->contexts) {
+      iterator = raptor_new_avltree_iterator(context->contexts, NULL, NULL, 1);
+      if(iterator) {
+        for(; !raptor_avltree_iterator_is_end(iterator);
+            raptor_avltree_iterator_next(iterator))
+          librdf_storage_trees_graph_drop_index((librdf_storage_trees_graph*)raptor_avltree_iterator_get(iterator),
+                                                (librdf_storage_trees_index)i);
+        raptor_free_avltree_iterator(iterator);
+      }
+    }
+    usage->scans = 0;
+  }
+}
+
+
+/*
+ * librdf_storage_trees_get_index:
+ * @storage: #librdf_storage object
+ * @graph: graph to search
+ * @index: optional order wanted for a search
+ *
+ * INTERNAL - Get the tree of an optional order of a graph for a
+ * search, building it when adaptive and searches needing the order
+ * have been full scans once too often.
+ *
+ * Return value: tree or NULL if the search must scan and filter
+ */
+static raptor_avltree*
+librdf_storage_trees_get_index(librdf_storage* storage,
+                               librdf_storage_trees_graph* graph,
+                               librdf_storage_trees_index index)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_index_usage* usage = &context->index_usage[index];
+  raptor_avltree** tree;
+
+  tree = librdf_storage_trees_graph_index(graph, index);
+  if(!*tree) {
+    if(!context->index_adaptive)
+      return NULL;
+
+    if(usage->scans < context->index_build_threshold &&
+       ++usage->scans < context->index_build_threshold)
+      return NULL;
+
+    if(librdf_storage_trees_graph_build_index(graph, index))
+      return NULL;
+  }
+
+  usage->last_used = context->finds;
+  return *tree;
+}
+
+
+/*
+ * librdf_storage_trees_serialise_graph:
+ * @scontext: stream context
+ * @graph: graph to iterate next
+ *
+ * INTERNAL - Start iterating the statements of a graph matching the
+ * stream range, with the best order the graph has for it.
+ */
+static void
+librdf_storage_trees_serialise_graph(librdf_storage_trees_serialise_stream_context* scontext,
+                                     librdf_storage_trees_graph* graph)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)scontext->storage->instance;
+  librdf_statement* range = scontext->range;
+  raptor_avltree* tree = NULL;
+  int index = -1;
+
+  if(scontext->avltree_iterator) {
+    raptor_free_avltree_iterator(scontext->avltree_iterator);
+    scontext->avltree_iterator = NULL;
+  }
+
+  TREES_INDEX_LOCK(context);
+  if(scontext->index >= 0)
+    context->index_usage[scontext->index].users--;
+
+  scontext->graph = graph;
+  scontext->filter = 0;
+
+  /* ?s ?p ?o */
+  if (!range) {
+    tree = graph->spo_tree;
+  /* s ?p o */
+  } else if (range->subject && !range->predicate && range->object) {
+    index = LIBRDF_STORAGE_TREES_INDEX_SOP;
+  /* s _ _ */
+  } else if (range->subject) {
+    tree = graph->spo_tree;
+  /* ?s _ o */
+  } else if (range->object) {
+    index = LIBRDF_STORAGE_TREES_INDEX_OPS;
+  /* ?s p ?o */
+  } else { /* range->predicate != NULL */
+    index = LIBRDF_STORAGE_TREES_INDEX_PSO;
+  }
+
+  if (index >= 0) {
+    tree = librdf_storage_trees_get_index(scontext->storage, graph,
+                                          (librdf_storage_trees_index)index);
+    /* If there is no tree, we're missing the required index.
+     * Iterate over the entire graph and filter the statements.
+     * (With a fully indexed store, this will never happen) */
+    if (!tree) {
+      tree = graph->spo_tree;
+      index = -1;
+      scontext->filter = 1;
+    }
+  }
+
+  /* the tree iterator owns its copy of the range */
+  if (range)
+    range = librdf_new_statement_from_statement(range);
+
+  scontext->avltree_iterator = raptor_new_avltree_iterator(tree,
+                                                           range,
+                                                           range ? librdf_storage_trees_avl_free : NULL,
+                                                           1);
+  scontext->index = -1;
+  if (index >= 0 && scontext->avltree_iterator) {
+    scontext->index = index;
+    context->index_usage[index].users++;
+  }
+  TREES_INDEX_UNLOCK(context);
+}
+
+
+/*
+ * librdf_storage_trees_serialise_settle:
+ * @scontext: stream context
+ *
+ * INTERNAL - Move to the next statement of the stream at or after
+ * the current position, going on to the next graph when one is done.
+ *
+ * Return value: non 0 at the end of the stream
+ */
+static int
+librdf_storage_trees_serialise_settle(librdf_storage_trees_serialise_stream_context* scontext)
+{
+  while(scontext->graph) {
+    raptor_avltree_iterator* iterator = scontext->avltree_iterator;
+
+    if(iterator && !raptor_avltree_iterator_is_end(iterator)) {
+      librdf_statement* statement;
+
+      if(!scontext->filter)
+        return 0;
+
+      statement = (librdf_statement*)raptor_avltree_iterator_get(iterator);
+      if(librdf_statement_match(statement, scontext->range))
+        return 0;
+
+      raptor_avltree_iterator_next(iterator);
+      continue;
+    }
+
+    if(!scontext->contexts_iterator ||
+       raptor_avltree_iterator_is_end(scontext->contexts_iterator)) {
+      scontext->graph = NULL;
+      break;
+    }
+
+    librdf_storage_trees_serialise_graph(scontext,
+      (librdf_storage_trees_graph*)raptor_avltree_iterator_get(scontext->contexts_iterator));
+    raptor_avltree_iterator_next(scontext->contexts_iterator);
+  }
+
+  return 1;
+}
+
+
+/*
+ * librdf_storage_trees_serialise_range:
+ * @storage: #librdf_storage object
+ * @graph: graph to search or NULL for all graphs
+ * @range: statement pattern or NULL; owned by this function
+ *
+ * INTERNAL - Stream the statements matching a pattern in one graph or
+ * in all of them, the graph without a context first.
+ *
+ * Return value: #librdf_stream or NULL on failure
+ */
+static librdf_stream*
+librdf_storage_trees_serialise_range(librdf_storage* storage,
+                                     librdf_storage_trees_graph* graph,
+                                     librdf_statement* range)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_serialise_stream_context* scontext;
+  librdf_stream* stream;
+  
+  scontext = LIBRDF_CALLOC(librdf_storage_trees_serialise_stream_context*, 1,
+                           sizeof(*scontext));
+  if(!scontext) {
+    if(range)
+      librdf_free_statement(range);
+    return NULL;
+  }
+
+  TREES_INDEX_LOCK(context);
+  context->finds++;
+  if(context->index_adaptive && context->index_drop_after)
+    librdf_storage_trees_drop_idle_indexes(storage);
+  TREES_INDEX_UNLOCK(context);
+
+  if (range && !range->subject && !range->predicate && !range->object) {
+    librdf_free_statement(range);
+    range=NULL;
+  }
+
+  scontext->storage=storage;
+  librdf_storage_add_reference(scontext->storage);
+  scontext->range=range;
+  scontext->index=-1;
+
+  if(!graph) {
+    graph=context->graph;
+    if(context->contexts)
+      scontext->contexts_iterator=raptor_new_avltree_iterator(context->contexts,
+                                                              NULL, NULL, 1);
+  }
+
+  librdf_storage_trees_serialise_graph(scontext, graph);
+  librdf_storage_trees_serialise_settle(scontext);
+
+  stream=librdf_new_stream(storage->world,
+                           (void*)scontext,
+                           &librdf_storage_trees_serialise_end_of_stream,
+                           &librdf_storage_trees_serialise_next_statement,
+                           &librdf_storage_trees_serialise_get_statement,
+                           &librdf_storage_trees_serialise_finished);
+  
+  if(!stream) {
+    librdf_storage_trees_serialise_finished((void*)scontext);
+    return NULL;
+  }
+  librdf_stream_set_batch_method(stream,
+                                 &librdf_storage_trees_serialise_batch);
+
+  return stream;  
+}
+
+
+static librdf_stream*
+librdf_storage_trees_serialise(librdf_storage* storage)
+{
+  return librdf_storage_trees_serialise_range(storage, NULL, NULL);
+}
+
+
+static int
+librdf_storage_trees_serialise_end_of_stream(void* context)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+
+  return (scontext->graph == NULL);
+}
+
+static int
+librdf_storage_trees_serialise_next_statement(void* context)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+
+  if(!scontext->graph)
+    return 1;
+
+  raptor_avltree_iterator_next(scontext->avltree_iterator);
+  return librdf_storage_trees_serialise_settle(scontext);
+}
+
+
+static void*
+librdf_storage_trees_serialise_get_statement(void* context, int flags)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+
+  if(!scontext->graph)
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return (librdf_statement*)raptor_avltree_iterator_get(scontext->avltree_iterator);
+
+    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
+      return scontext->graph->context;
+
+    default:
+      return NULL;
+  }
+}
+
+
+/* Store up to size statements held in the trees; they belong to the trees */
+static int
+librdf_storage_trees_serialise_batch(void* context,
+                                     librdf_statement** statements,
+                                     librdf_node** contexts, int size)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  int count;
+
+  for(count = 0; count < size && scontext->graph; count++) {
+    statements[count]=(librdf_statement*)raptor_avltree_iterator_get(scontext->avltree_iterator);
+    if(contexts)
+      contexts[count]=scontext->graph->context;
+
+    raptor_avltree_iterator_next(scontext->avltree_iterator);
+    librdf_storage_trees_serialise_settle(scontext);
+  }
+
+  return count;
+}
+
+
+static void
+librdf_storage_trees_serialise_finished(void* context)
+{
+  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  librdf_storage_trees_instance* instance;
+
+  instance = (librdf_storage_trees_instance*)scontext->storage->instance;
+
+  if(scontext->avltree_iterator)
+    raptor_free_avltree_iterator(scontext->avltree_iterator);
+
+  if(scontext->index >= 0) {
+    TREES_INDEX_LOCK(instance);
+    instance->index_usage[scontext->index].users--;
+    TREES_INDEX_UNLOCK(instance);
+  }
+
+  if(scontext->contexts_iterator)
+    raptor_free_avltree_iterator(scontext->contexts_iterator);
+
+  if(scontext->range)
+    librdf_free_statement(scontext->range);
+
+  librdf_storage_remove_reference(scontext->storage);
+  
+  LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
+}
+
+
+/*
+ * librdf_storage_trees_get_graph:
+ * @storage: #librdf_storage object
+ * @context_node: context node or NULL
+ *
+ * INTERNAL - Find the graph of a context
+ *
+ * Return value: graph, the graph without a context if @context_node
+ * is NULL or NULL if there is no such context
+ */
+static librdf_storage_trees_graph*
+librdf_storage_trees_get_graph(librdf_storage* storage,
+                               librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph key;
+
+  if(!context_node)
+    return context->graph;
+
+  if(!context->contexts)
+    return NULL;
+
+  /* graphs are compared by context node only */
+  memset(&key, 0, sizeof(key));
+  key.context = context_node;
+
+  return (librdf_storage_trees_graph*)raptor_avltree_search(context->contexts,
+                                                            &key);
+}
+
+
+/**
+ * librdf_storage_trees_context_add_statement:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ * @statement: #librdf_statement statement to add
+ *
+ * Add a statement to a storage context.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_add_statement(librdf_storage* storage,
+                                           librdf_node* context_node,
+                                           librdf_statement* statement) 
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+
+  if(!context->contexts) {
+    librdf_log(storage->world, 0, LIBRDF_LOG_ERROR, LIBRDF_FROM_STORAGE, NULL,
+               "Storage was created without context support");
+    return 1;
+  }
+
+  graph=librdf_storage_trees_get_graph(storage, context_node);
+  if(!graph) {
+    graph=librdf_storage_trees_graph_new(storage, context_node);
+    if(!graph)
+      return 1;
+    if(raptor_avltree_add(context->contexts, graph))
+      return 1;
+  }
+    
+  return librdf_storage_trees_add_statement_internal(storage, graph, statement);
+}
+
+
+/**
+ * librdf_storage_trees_context_remove_statement:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ * @statement: #librdf_statement statement to remove
+ *
+ * Remove a statement from a storage context.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_remove_statement(librdf_storage* storage, 
+                                              librdf_node* context_node,
+                                              librdf_statement* statement) 
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  int status;
+
+  graph=librdf_storage_trees_get_graph(storage, context_node);
+  if(!graph)
+    return -1;
+
+  status=librdf_storage_trees_remove_statement_internal(storage, graph,
+                                                        statement);
+
+  /* contexts are listed while they have statements */
+  if(graph != context->graph && !raptor_avltree_size(graph->spo_tree))
+    raptor_avltree_delete(context->contexts, graph);
+
+  return status;
+}
+
+
+/*
+ * librdf_storage_trees_statistics_remove_graph:
+ * @storage: #librdf_storage object
+ * @graph: graph about to be freed
+ *
+ * INTERNAL - Take all the statements of a graph out of the
+ * statistics.  Walking the ops and spo orders, the first statement of
+ * each run of equal nodes is the one counting the node or pair.
+ */
+static void
+librdf_storage_trees_statistics_remove_graph(librdf_storage* storage,
+                                             librdf_storage_trees_graph* graph)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_statistics* stats=context->statistics;
+  raptor_avltree_iterator* iterator;
+  librdf_statement* previous;
+
+  /* object counts first, while the predicates are still counted */
+  if(context->index_ops) {
+    iterator = raptor_new_avltree_iterator(graph->ops_tree, NULL, NULL, 1);
+    if(iterator) {
+      previous = NULL;
+      for(; !raptor_avltree_iterator_is_end(iterator);
+          raptor_avltree_iterator_next(iterator)) {
+        librdf_statement* statement;
+        int new_object;
+
+        statement = (librdf_statement*)raptor_avltree_iterator_get(iterator);
+        new_object = !previous ||
+          librdf_storage_trees_node_compare(previous->object, statement->object);
+        if(new_object)
+          stats->objects--;
+        if(new_object ||
+           librdf_storage_trees_node_compare(previous->predicate, statement->predicate))
+          librdf_storage_statistics_update(stats, statement->predicate,
+                                           0, 0, -1);
+        previous = statement;
+      }
+      raptor_free_avltree_iterator(iterator);
+    }
+  }
+
+  iterator = raptor_new_avltree_iterator(graph->spo_tree, NULL, NULL, 1);
+  if(iterator) {
+    previous = NULL;
+    for(; !raptor_avltree_iterator_is_end(iterator);
+        raptor_avltree_iterator_next(iterator)) {
+      librdf_statement* statement;
+      int new_subject;
+      int new_pair;
+
+      statement = (librdf_statement*)raptor_avltree_iterator_get(iterator);
+      new_subject = !previous ||
+        librdf_storage_trees_node_compare(previous->subject, statement->subject);
+      if(new_subject)
+        stats->subjects--;
+      new_pair = new_subject ||
+        librdf_storage_trees_node_compare(previous->predicate, statement->predicate);
+      librdf_storage_statistics_update(stats, statement->predicate,
+                                       -1, new_pair ? -1 : 0, 0);
+      previous = statement;
+    }
+    raptor_free_avltree_iterator(iterator);
+  }
+}
+
+
+/**
+ * librdf_storage_trees_context_remove_statements:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object or NULL
+ *
+ * Remove all statements in a storage context, or without a context
+ * if @context_node is NULL, by freeing the graph holding them.
+ * 
+ * Return value: non 0 on failure
+ **/
+static int
+librdf_storage_trees_context_remove_statements(librdf_storage* storage, 
+                                               librdf_node* context_node)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_graph* graph;
+  librdf_storage_trees_graph* empty_graph = NULL;
+
+  graph=librdf_storage_trees_get_graph(storage, context_node);
+  if(!graph)
+    return 0;
+
+  if(!context_node) {
+    empty_graph=librdf_storage_trees_graph_new(storage, NULL);
+    if(!empty_graph)
+      return 1;
+  }
+
+  if(context->statistics)
+    librdf_storage_trees_statistics_remove_graph(storage, graph);
+
+  if(empty_graph) {
+    librdf_storage_trees_graph_free(graph);
+    context->graph=empty_graph;
+  } else
+    raptor_avltree_delete(context->contexts, graph);
+
+  return 0;
+}
+
+
+/**
+ * librdf_storage_trees_context_serialise:
+ * @storage: #librdf_storage object
+ * @context_node: #librdf_node object
+ *
+ * List all statements in a storage context.
+ * 
+ * Return value: #librdf_stream of statements or NULL on failure or context is empty
+ **/
+static librdf_stream*
+librdf_storage_trees_context_serialise(librdf_storage* storage,
+                                        librdf_node* context_node) 
+{
+  librdf_storage_trees_graph* graph;
+
+  graph=librdf_storage_trees_get_graph(storage, context_node);
+  if(!graph)
+    return librdf_new_empty_stream(storage->world);
+
+  return librdf_storage_trees_serialise_range(storage, graph, NULL);
+}
+
+
+typedef struct {
+  librdf_storage *storage;
+  raptor_avltree_iterator *avltree_iterator;
+} librdf_storage_trees_get_contexts_iterator_context;
+
+
+/**
+ * librdf_storage_trees_context_get_contexts:
+ * @storage: #librdf_storage object
+ *
+ * List all context nodes in a storage.
+ * 
+ * Return value: #librdf_iterator of context_nodes or NULL on failure or no contexts
+ **/
+static librdf_iterator*
+librdf_storage_trees_get_contexts(librdf_storage* storage) 
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_get_contexts_iterator_context* icontext;
+  librdf_iterator* iterator;
+
+  if(!context->contexts)
+    return NULL;
+
+  icontext = LIBRDF_CALLOC(librdf_storage_trees_get_contexts_iterator_context*,
+                           1, sizeof(*icontext));
+  if(!icontext)
+    return NULL;
+
+  icontext->avltree_iterator=raptor_new_avltree_iterator(context->contexts,
+                                                         NULL, NULL, 1);
+  icontext->storage=storage;
+  librdf_storage_add_reference(icontext->storage);
+
+  iterator=librdf_new_iterator(storage->world,
+                               (void*)icontext,
+                               &librdf_storage_trees_get_contexts_is_end,
+                               &librdf_storage_trees_get_contexts_next_method,
+                               &librdf_storage_trees_get_contexts_get_method,
+                               &librdf_storage_trees_get_contexts_finished);
+  if(!iterator)
+    librdf_storage_trees_get_contexts_finished(icontext);
+
+  return iterator;
+}
+
+
+static int
+librdf_storage_trees_get_contexts_is_end(void* iterator)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+
+  return (!icontext->avltree_iterator ||
+          raptor_avltree_iterator_is_end(icontext->avltree_iterator));
+}
+
+
+static int
+librdf_storage_trees_get_contexts_next_method(void* iterator)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+
+  if(librdf_storage_trees_get_contexts_is_end(iterator))
+    return 1;
+
+  return raptor_avltree_iterator_next(icontext->avltree_iterator);
+}
+
+
+static void*
+librdf_storage_trees_get_contexts_get_method(void* iterator, int flags)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+  librdf_storage_trees_graph* graph;
+
+  if(librdf_storage_trees_get_contexts_is_end(iterator))
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      graph=(librdf_storage_trees_graph*)raptor_avltree_iterator_get(icontext->avltree_iterator);
+      return graph->context;
+
+    default:
+      return NULL;
+  }
+}
+
+
+static void
+librdf_storage_trees_get_contexts_finished(void* iterator)
+{
+  librdf_storage_trees_get_contexts_iterator_context* icontext=(librdf_storage_trees_get_contexts_iterator_context*)iterator;
+
+  if(icontext->avltree_iterator)
+    raptor_free_avltree_iterator(icontext->avltree_iterator);
+
+  librdf_storage_remove_reference(icontext->storage);
+
+  LIBRDF_FREE(librdf_storage_trees_get_contexts_iterator_context, icontext);
+}
+
+
+/**
+ * librdf_storage_trees_find_statements:
+ * @storage: the storage
+ * @statement: the statement to match
+ *
+ * .
+ * 
+ * Return a stream of statements matching the given statement (or
+ * all statements if NULL).  Parts (subject, predicate, object) of the
+ * statement can be empty in which case any statement part will match that.
+ * Uses #librdf_statement_match to do the matching.
+ * 
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement)
+{
+  librdf_statement* range=librdf_new_statement_from_statement(statement);
+  if(!range)
+    return NULL;
+
+  return librdf_storage_trees_serialise_range(storage, NULL, range);
+}
+
+
+/**
+ * librdf_storage_trees_find_statements_in_context:
+ * @storage: the storage
+ * @statement: the statement to match
+ * @context_node: context node or NULL
+ *
+ * Return a stream of statements matching the given statement in one
+ * context, or without a context if @context_node is NULL, using the
+ * indexes of that context's graph.
+ * 
+ * Return value: a #librdf_stream or NULL on failure
+ **/
+static librdf_stream*
+librdf_storage_trees_find_statements_in_context(librdf_storage* storage,
+                                                librdf_statement* statement,
+                                                librdf_node* context_node)
+{
+  librdf_storage_trees_graph* graph;
+  librdf_statement* range;
+
+  graph=librdf_storage_trees_get_graph(storage, context_node);
+  if(!graph)
+    return librdf_new_empty_stream(storage->world);
+
+  range=librdf_new_statement_from_statement(statement);
+  if(!range)
+    return NULL;
+
+  return librdf_storage_trees_serialise_range(storage, graph, range);
+}
+
+
+/**
+ * librdf_storage_trees_estimate_statements:
+ * @storage: #librdf_storage object
+ * @statement: partial statement pattern or NULL
+ * @distinct: 0 or a #librdf_statement_part
+ *
+ * Estimate statements (without a context) matching a pattern.
+ * 
+ * Return value: estimate or < 0 if statistics are not kept
+ **/
+static int
+librdf_storage_trees_estimate_statements(librdf_storage* storage,
+                                         librdf_statement* statement,
+                                         int distinct)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+
+  if(!context->statistics)
+    return -1;
+
+  return librdf_storage_statistics_estimate(context->statistics, statement,
+                                            distinct);
+}
+
+/*
+ * librdf_storage_trees_graph_has_arc_in:
+ * @storage: #librdf_storage object
+ * @graph: graph to search
+ * @node: object node
+ * @property: predicate node
+ *
+ * INTERNAL - Check for a (?, property, node) statement in one graph,
+ * a search of the ops order when the graph has it.
+ *
+ * Return value: non 0 if present
+ */
+static int
+librdf_storage_trees_graph_has_arc_in(librdf_storage* storage,
+                                      librdf_storage_trees_graph* graph,
+                                      librdf_node* node, librdf_node* property)
+{
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  raptor_avltree* tree;
+  raptor_avltree_iterator* iterator;
+  librdf_statement key;
+  int found = 0;
+
+  TREES_INDEX_LOCK(context);
+  tree = librdf_storage_trees_get_index(storage, graph,
+                                        LIBRDF_STORAGE_TREES_INDEX_OPS);
+  if(tree)
+    found = librdf_storage_trees_graph_has(tree, NULL, property, node);
+  TREES_INDEX_UNLOCK(context);
+  if(tree)
+    return found;
+
+  /* no ops order: scan the graph */
+  memset(&key, 0, sizeof(key));
+  key.predicate = property;
+  key.object = node;
+
+  iterator = raptor_new_avltree_iterator(graph->spo_tree, NULL, NULL, 1);
+  if(!iterator)
+    return 0;
+  for(; !found && !raptor_avltree_iterator_is_end(iterator);
+      raptor_avltree_iterator_next(iterator))
+    found = librdf_statement_match((librdf_statement*)raptor_avltree_iterator_get(iterator), &key);
+  raptor_free_avltree_iterator(iterator);
+
+  return found;
+}
+
+
+/**
+ * librdf_storage_trees_has_arc_in:
+ * @storage: #librdf_storage object
+ * @node: object node
+ * @property: predicate node
+ *
+ * Check for a (?, property, node) statement in any graph, stopping at
+ * the first found.
+ *
+ * Return value: non 0 if present
+ **/
+static int
+librdf_storage_trees_has_arc_in(librdf_storage* storage, librdf_node* node,
+                                librdf_node* property)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  raptor_avltree_iterator* iterator;
+  int found;
+
+  found = librdf_storage_trees_graph_has_arc_in(storage, context->graph,
+                                                node, property);
+
+  if(!found && context->contexts) {
+    iterator = raptor_new_avltree_iterator(context->contexts, NULL, NULL, 1);
+    if(iterator) {
+      for(; !found && !raptor_avltree_iterator_is_end(iterator);
+          raptor_avltree_iterator_next(iterator))
+        found = librdf_storage_trees_graph_has_arc_in(storage,
+                  (librdf_storage_trees_graph*)raptor_avltree_iterator_get(iterator),
+                  node, property);
+      raptor_free_avltree_iterator(iterator);
+    }
+  }
 
-  return librdf_storage_trees_remove_statement_internal(context->graph, statement);
+  return found;
 }
 
+
+/**
+ * librdf_storage_trees_has_arc_out:
+ * @storage: #librdf_storage object
+ * @node: subject node
+ * @property: predicate node
+ *
+ * Check for a (node, property, ?) statement in any graph with a search
+ * of the spo order, stopping at the first found.
+ *
+ * Return value: non 0 if present
+ **/
 static int
-librdf_storage_trees_contains_statement(librdf_storage* storage, librdf_statement* statement)
+librdf_storage_trees_has_arc_out(librdf_storage* storage, librdf_node* node,
+                                 librdf_node* property)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  raptor_avltree_iterator* iterator;
+  int found;
+
+  found = librdf_storage_trees_graph_has(context->graph->spo_tree,
+                                         node, property, NULL);
+
+  if(!found && context->contexts) {
+    iterator = raptor_new_avltree_iterator(context->contexts, NULL, NULL, 1);
+    if(iterator) {
+      for(; !found && !raptor_avltree_iterator_is_end(iterator);
+          raptor_avltree_iterator_next(iterator)) {
+        librdf_storage_trees_graph* graph;
+
+        graph = (librdf_storage_trees_graph*)raptor_avltree_iterator_get(iterator);
+        found = librdf_storage_trees_graph_has(graph->spo_tree,
+                                               node, property, NULL);
+      }
+      raptor_free_avltree_iterator(iterator);
+    }
+  }
 
-  return (raptor_avltree_search(context->graph->spo_tree, statement) != NULL);
+  return found;
 }
 
 
 typedef struct {
   librdf_storage *storage;
+  raptor_avltree *arcs; /* distinct predicate nodes, owned */
   raptor_avltree_iterator *avltree_iterator;
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  librdf_node *context_node;
-#endif
-} librdf_storage_trees_serialise_stream_context;
+} librdf_storage_trees_arcs_iterator_context;
 
 
-static librdf_stream*
-librdf_storage_trees_serialise_range(librdf_storage* storage, librdf_statement* range)
+static int
+librdf_storage_trees_arcs_compare(const void* data1, const void* data2)
+{
+  return librdf_storage_trees_node_compare((librdf_node*)data1,
+                                           (librdf_node*)data2);
+}
+
+
+static void
+librdf_storage_trees_arcs_free(void* data)
+{
+  librdf_free_node((librdf_node*)data);
+}
+
+
+/*
+ * librdf_storage_trees_graph_arcs:
+ * @storage: #librdf_storage object
+ * @graph: graph to search
+ * @subject: subject node or NULL
+ * @object: object node if @subject is NULL
+ * @arcs: tree to add the distinct predicates to
+ *
+ * INTERNAL - Collect the predicates of the statements of one graph
+ * with the given subject or object.  The spo order (or ops order for
+ * an object) keeps the predicates of the node together, so only
+ * changes of predicate are added.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_graph_arcs(librdf_storage* storage,
+                                librdf_storage_trees_graph* graph,
+                                librdf_node* subject, librdf_node* object,
+                                raptor_avltree* arcs)
 {
   librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  librdf_storage_trees_serialise_stream_context* scontext;
-  librdf_stream* stream;
+  raptor_avltree* tree = graph->spo_tree;
+  raptor_avltree_iterator* iterator;
+  librdf_statement key;
+  librdf_node* last = NULL;
+  int index = -1;
   int filter = 0;
-  
-  scontext = LIBRDF_CALLOC(librdf_storage_trees_serialise_stream_context*, 1,
-                           sizeof(*scontext));
-  if(!scontext)
-    return NULL;
-    
-  scontext->avltree_iterator = NULL;
+  int status = 0;
 
-  /* ?s ?p ?o */
-  if (!range || (!range->subject && !range->predicate && !range->object)) {
-    scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->spo_tree,
-                                                             /* range */ NULL,
-                                                             /* range free */ NULL,
-                                                             1);
-    if (range) {
-      librdf_free_statement(range);
-      range=NULL;
+  memset(&key, 0, sizeof(key));
+  key.subject = subject;
+  key.object = object;
+
+  if(!subject) {
+    TREES_INDEX_LOCK(context);
+    tree = librdf_storage_trees_get_index(storage, graph,
+                                          LIBRDF_STORAGE_TREES_INDEX_OPS);
+    if(tree) {
+      index = LIBRDF_STORAGE_TREES_INDEX_OPS;
+      context->index_usage[index].users++;
     }
-  /* s ?p o */
-  } else if (range->subject && !range->predicate && range->object) {
-    if (context->index_sop)
-      scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->sop_tree,
-                                                               range, 
-                                                               librdf_storage_trees_avl_free,
-                                                               1);
-	else
-		filter=1;
-  /* s _ _ */
-  } else if (range->subject) {
-    scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->spo_tree,
-                                                             range,
-                                                             librdf_storage_trees_avl_free,
-                                                             1);
-  /* ?s _ o */
-  } else if (range->object) {
-    if (context->index_ops)
-      scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->ops_tree,
-                                                               range,
-                                                               librdf_storage_trees_avl_free,
-                                                               1);
-	else
-		filter=1;
-  /* ?s p ?o */
-  } else { /* range->predicate != NULL */
-    if (context->index_pso)
-      scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->pso_tree,
-                                                               range,
-                                                               librdf_storage_trees_avl_free,
-                                                               1);
-	else
-		filter=1;
-  }
-    
-  /* If filter is set, we're missing the required index.
-   * Iterate over the entire model and filter the stream.
-   * (With a fully indexed store, this will never happen) */
-  if (filter) {
-    scontext->avltree_iterator = raptor_new_avltree_iterator(context->graph->spo_tree,
-                                                     range,
-                                                     librdf_storage_trees_avl_free,
-                                                     1);
-  }
-
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-  scontext->context_node=NULL;
-#endif
+    TREES_INDEX_UNLOCK(context);
 
-  if(!scontext->avltree_iterator) {
-    LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
-    return librdf_new_empty_stream(storage->world);
+    if(!tree) {
+      tree = graph->spo_tree;
+      filter = 1;
+    }
   }
-  
-  scontext->storage=storage;
-  librdf_storage_add_reference(scontext->storage);
 
-  stream=librdf_new_stream(storage->world,
-                           (void*)scontext,
-                           &librdf_storage_trees_serialise_end_of_stream,
-                           &librdf_storage_trees_serialise_next_statement,
-                           &librdf_storage_trees_serialise_get_statement,
-                           &librdf_storage_trees_serialise_finished);
-  
-  if(!stream) {
-    librdf_storage_trees_serialise_finished((void*)scontext);
-    return NULL;
-  }
+  iterator = raptor_new_avltree_iterator(tree, filter ? NULL : &key, NULL, 1);
+  if(!iterator)
+    status = 1;
 
-  if(filter) {
-    if(librdf_stream_add_map(stream, &librdf_stream_statement_find_map, NULL, (void*)range)) {
-      /* error - stream_add_map failed */
-      librdf_free_stream(stream);
-      stream=NULL;
-    }
-  }
-  
-  return stream;  
-}
+  for(; !status && !raptor_avltree_iterator_is_end(iterator);
+      raptor_avltree_iterator_next(iterator)) {
+    librdf_statement* statement;
 
+    statement = (librdf_statement*)raptor_avltree_iterator_get(iterator);
+    if(filter && !librdf_statement_match(statement, &key))
+      continue;
 
-static librdf_stream*
-librdf_storage_trees_serialise(librdf_storage* storage)
-{
-  return librdf_storage_trees_serialise_range(storage, NULL);
-}
+    if(last && !librdf_storage_trees_node_compare(last, statement->predicate))
+      continue;
+    last = statement->predicate;
 
+    if(raptor_avltree_add(arcs, librdf_new_node_from_node(last)) < 0)
+      status = 1;
+  }
+  if(iterator)
+    raptor_free_avltree_iterator(iterator);
 
-static int
-librdf_storage_trees_serialise_end_of_stream(void* context)
-{
-  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  if(index >= 0) {
+    TREES_INDEX_LOCK(context);
+    context->index_usage[index].users--;
+    TREES_INDEX_UNLOCK(context);
+  }
 
-  return raptor_avltree_iterator_is_end(scontext->avltree_iterator);
+  return status;
 }
 
-static int
-librdf_storage_trees_serialise_next_statement(void* context)
+
+/*
+ * librdf_storage_trees_get_arcs:
+ * @storage: #librdf_storage object
+ * @subject: subject node or NULL
+ * @object: object node if @subject is NULL
+ *
+ * INTERNAL - Get the distinct predicates of statements with the given
+ * subject or object in all graphs.
+ *
+ * Return value: #librdf_iterator of #librdf_node or NULL on failure
+ */
+static librdf_iterator*
+librdf_storage_trees_get_arcs(librdf_storage* storage, librdf_node* subject,
+                              librdf_node* object)
 {
-  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
+  librdf_storage_trees_arcs_iterator_context* icontext;
+  raptor_avltree_iterator* graphs;
+  librdf_iterator* iterator;
+  int status;
+
+  icontext = LIBRDF_CALLOC(librdf_storage_trees_arcs_iterator_context*,
+                           1, sizeof(*icontext));
+  if(!icontext)
+    return NULL;
 
-  return raptor_avltree_iterator_next(scontext->avltree_iterator);
-}
+  icontext->storage=storage;
+  librdf_storage_add_reference(icontext->storage);
 
+  icontext->arcs = raptor_new_avltree(librdf_storage_trees_arcs_compare,
+                                      librdf_storage_trees_arcs_free, 0);
+  if(!icontext->arcs) {
+    librdf_storage_trees_arcs_finished(icontext);
+    return NULL;
+  }
 
-static void*
-librdf_storage_trees_serialise_get_statement(void* context, int flags)
-{
-  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  status = librdf_storage_trees_graph_arcs(storage, context->graph,
+                                           subject, object, icontext->arcs);
+  if(!status && context->contexts) {
+    graphs = raptor_new_avltree_iterator(context->contexts, NULL, NULL, 1);
+    if(graphs) {
+      for(; !status && !raptor_avltree_iterator_is_end(graphs);
+          raptor_avltree_iterator_next(graphs))
+        status = librdf_storage_trees_graph_arcs(storage,
+                   (librdf_storage_trees_graph*)raptor_avltree_iterator_get(graphs),
+                   subject, object, icontext->arcs);
+      raptor_free_avltree_iterator(graphs);
+    }
+  }
 
-  if(!scontext->avltree_iterator)
+  if(status) {
+    librdf_storage_trees_arcs_finished(icontext);
     return NULL;
+  }
 
-  switch(flags) {
-    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
-      return (librdf_statement*)raptor_avltree_iterator_get(scontext->avltree_iterator);
+  icontext->avltree_iterator = raptor_new_avltree_iterator(icontext->arcs,
+                                                           NULL, NULL, 1);
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-    case LIBRDF_ITERATOR_GET_METHOD_GET_CONTEXT:
-      return scontext->context_node;
-#endif
+  iterator=librdf_new_iterator(storage->world,
+                               (void*)icontext,
+                               &librdf_storage_trees_arcs_is_end,
+                               &librdf_storage_trees_arcs_next_method,
+                               &librdf_storage_trees_arcs_get_method,
+                               &librdf_storage_trees_arcs_finished);
+  if(!iterator)
+    librdf_storage_trees_arcs_finished(icontext);
 
-    default:
-      return NULL;
-  }
+  return iterator;
 }
 
 
-static void
-librdf_storage_trees_serialise_finished(void* context)
+static librdf_iterator*
+librdf_storage_trees_get_arcs_in(librdf_storage* storage, librdf_node* node)
 {
-  librdf_storage_trees_serialise_stream_context* scontext=(librdf_storage_trees_serialise_stream_context*)context;
+  return librdf_storage_trees_get_arcs(storage, NULL, node);
+}
 
-  if(scontext->avltree_iterator)
-    raptor_free_avltree_iterator(scontext->avltree_iterator);
 
-  if(scontext->storage)
-    librdf_storage_remove_reference(scontext->storage);
-  
-  LIBRDF_FREE(librdf_storage_trees_serialise_stream_context, scontext);
+static librdf_iterator*
+librdf_storage_trees_get_arcs_out(librdf_storage* storage, librdf_node* node)
+{
+  return librdf_storage_trees_get_arcs(storage, node, NULL);
 }
 
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
-/**
- * librdf_storage_trees_context_add_statement:
- * @storage: #librdf_storage object
- * @context_node: #librdf_node object
- * @statement: #librdf_statement statement to add
- *
- * Add a statement to a storage context.
- * 
- * Return value: non 0 on failure
- **/
 static int
-librdf_storage_trees_context_add_statement(librdf_storage* storage,
-                                           librdf_node* context_node,
-                                           librdf_statement* statement) 
+librdf_storage_trees_arcs_is_end(void* iterator)
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  
-  librdf_storage_trees_graph* key=librdf_storage_trees_graph_new(storage, context_node);
-  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)
-    raptor_avltree_search(context->contexts, key);
-  
-  if(graph) {
-    librdf_storage_trees_graph_free(key);
-  } else {
-    raptor_avltree_add(context->contexts, key);
-    graph=key;
-  }
-    
-  return librdf_storage_trees_add_statement_internal(storage, graph, statement);
+  librdf_storage_trees_arcs_iterator_context* icontext=(librdf_storage_trees_arcs_iterator_context*)iterator;
+
+  return (!icontext->avltree_iterator ||
+          raptor_avltree_iterator_is_end(icontext->avltree_iterator));
 }
 
 
-/**
- * librdf_storage_trees_context_remove_statement:
- * @storage: #librdf_storage object
- * @context_node: #librdf_node object
- * @statement: #librdf_statement statement to remove
- *
- * Remove a statement from a storage context.
- * 
- * Return value: non 0 on failure
- **/
 static int
-librdf_storage_trees_context_remove_statement(librdf_storage* storage, 
-                                              librdf_node* context_node,
-                                              librdf_statement* statement) 
+librdf_storage_trees_arcs_next_method(void* iterator)
 {
-  librdf_storage_trees_instance* context=(librdf_storage_trees_instance*)storage->instance;
-  librdf_storage_trees_graph* key=librdf_storage_trees_graph_new(storage, context_node);
-  librdf_storage_trees_graph* graph=(librdf_storage_trees_graph*)
-    raptor_avltree_search(context->contexts, &key);
-  librdf_storage_trees_graph_free(key);
-  if (graph) {
-    return librdf_storage_trees_remove_statement_internal(graph, statement);
-  } else {
-    return -1;
-  }
-}
+  librdf_storage_trees_arcs_iterator_context* icontext=(librdf_storage_trees_arcs_iterator_context*)iterator;
 
+  if(librdf_storage_trees_arcs_is_end(iterator))
+    return 1;
 
-/**
- * librdf_storage_trees_context_serialise:
- * @storage: #librdf_storage object
- * @context_node: #librdf_node object
- *
- * List all statements in a storage context.
- * 
- * Return value: #librdf_stream of statements or NULL on failure or context is empty
- **/
-static librdf_stream*
-librdf_storage_trees_context_serialise(librdf_storage* storage,
-                                        librdf_node* context_node) 
-{
-  return NULL;
+  return raptor_avltree_iterator_next(icontext->avltree_iterator);
 }
 
 
-/**
- * librdf_storage_trees_context_get_contexts:
- * @storage: #librdf_storage object
- *
- * List all context nodes in a storage.
- * 
- * Return value: #librdf_iterator of context_nodes or NULL on failure or no contexts
- **/
-static librdf_iterator*
-librdf_storage_trees_get_contexts(librdf_storage* storage) 
+static void*
+librdf_storage_trees_arcs_get_method(void* iterator, int flags)
 {
-  return NULL;
+  librdf_storage_trees_arcs_iterator_context* icontext=(librdf_storage_trees_arcs_iterator_context*)iterator;
+
+  if(librdf_storage_trees_arcs_is_end(iterator))
+    return NULL;
+
+  switch(flags) {
+    case LIBRDF_ITERATOR_GET_METHOD_GET_OBJECT:
+      return raptor_avltree_iterator_get(icontext->avltree_iterator);
+
+    default:
+      return NULL;
+  }
 }
-#endif
 
 
-/**
- * librdf_storage_trees_find_statements:
- * @storage: the storage
- * @statement: the statement to match
- *
- * .
- * 
- * Return a stream of statements matching the given statement (or
- * all statements if NULL).  Parts (subject, predicate, object) of the
- * statement can be empty in which case any statement part will match that.
- * Uses #librdf_statement_match to do the matching.
- * 
- * Return value: a #librdf_stream or NULL on failure
- **/
-static librdf_stream*
-librdf_storage_trees_find_statements(librdf_storage* storage, librdf_statement* statement)
+static void
+librdf_storage_trees_arcs_finished(void* iterator)
 {
-  librdf_stream* stream;
+  librdf_storage_trees_arcs_iterator_context* icontext=(librdf_storage_trees_arcs_iterator_context*)iterator;
 
-  librdf_statement* range=librdf_new_statement_from_statement(statement);
-  if(!range)
-    return NULL;
+  if(icontext->avltree_iterator)
+    raptor_free_avltree_iterator(icontext->avltree_iterator);
 
-  stream=librdf_storage_trees_serialise_range(storage, range);
+  if(icontext->arcs)
+    raptor_free_avltree(icontext->arcs);
 
-  return stream;
+  librdf_storage_remove_reference(icontext->storage);
+
+  LIBRDF_FREE(librdf_storage_trees_arcs_iterator_context, icontext);
 }
 
+
 /* statement tree functions */
 
 static int
@@ -866,9 +1996,7 @@ librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context_nod
 
   graph = LIBRDF_MALLOC(librdf_storage_trees_graph*, sizeof(*graph));
   
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   graph->context=(context_node ? librdf_new_node_from_node(context_node) : NULL);
-#endif
 
   /* Always create SPO index */
   graph->spo_tree = raptor_new_avltree(librdf_statement_compare_spo,
@@ -901,7 +2029,72 @@ librdf_storage_trees_graph_new(librdf_storage* storage, librdf_node* context_nod
 }
 
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
+/* Get the field of a graph holding an optional order */
+static raptor_avltree**
+librdf_storage_trees_graph_index(librdf_storage_trees_graph* graph,
+                                 librdf_storage_trees_index index)
+{
+  switch(index) {
+    case LIBRDF_STORAGE_TREES_INDEX_SOP:
+      return &graph->sop_tree;
+    case LIBRDF_STORAGE_TREES_INDEX_OPS:
+      return &graph->ops_tree;
+    case LIBRDF_STORAGE_TREES_INDEX_PSO:
+    case LIBRDF_STORAGE_TREES_INDEX_COUNT:
+    default:
+      return &graph->pso_tree;
+  }
+}
+
+
+/*
+ * librdf_storage_trees_graph_build_index:
+ * @graph: graph
+ * @index: optional order to build
+ *
+ * INTERNAL - Build a missing optional order from the spo tree.  The
+ * statements are shared with the spo tree as for orders created with
+ * the graph.
+ *
+ * Return value: non 0 on failure
+ */
+static int
+librdf_storage_trees_graph_build_index(librdf_storage_trees_graph* graph,
+                                       librdf_storage_trees_index index)
+{
+  static raptor_data_compare_handler const compare[LIBRDF_STORAGE_TREES_INDEX_COUNT] = {
+    librdf_statement_compare_sop,
+    librdf_statement_compare_ops,
+    librdf_statement_compare_pso
+  };
+  raptor_avltree** field = librdf_storage_trees_graph_index(graph, index);
+  raptor_avltree* tree;
+  raptor_avltree_iterator* iterator;
+
+  tree = raptor_new_avltree(compare[index], NULL, /* flags */ 0);
+  if(!tree)
+    return 1;
+
+  iterator = raptor_new_avltree_iterator(graph->spo_tree, NULL, NULL, 1);
+  if(iterator) {
+    for(; !raptor_avltree_iterator_is_end(iterator);
+        raptor_avltree_iterator_next(iterator)) {
+      void* statement = raptor_avltree_iterator_get(iterator);
+
+      if(raptor_avltree_add(tree, statement) < 0) {
+        raptor_free_avltree_iterator(iterator);
+        raptor_free_avltree(tree);
+        return 1;
+      }
+    }
+    raptor_free_avltree_iterator(iterator);
+  }
+
+  *field = tree;
+  return 0;
+}
+
+
 static int
 librdf_storage_trees_graph_compare(const void* data1, const void* data2)
 {
@@ -909,7 +2102,6 @@ librdf_storage_trees_graph_compare(const void* data1, const void* data2)
   librdf_storage_trees_graph* b = (librdf_storage_trees_graph*)data2;
   return librdf_storage_trees_node_compare(a->context, b->context);
 }
-#endif
 
 
 static void
@@ -917,9 +2109,7 @@ librdf_storage_trees_graph_free(void* data)
 {
   librdf_storage_trees_graph* graph = (librdf_storage_trees_graph*)data;
   
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   librdf_free_node(graph->context);
-#endif
   
   /* Extra index trees have null deleters (statements are shared) */
   if (graph->sop_tree)
@@ -954,7 +2144,6 @@ librdf_storage_trees_graph_free(void* data)
 static librdf_node*
 librdf_storage_trees_get_feature(librdf_storage* storage, librdf_uri* feature)
 {
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   librdf_storage_trees_instance* scontext=(librdf_storage_trees_instance*)storage->instance;
   unsigned char *uri_string;
 
@@ -972,7 +2161,6 @@ librdf_storage_trees_get_feature(librdf_storage* storage, librdf_uri* feature)
     return librdf_new_node_from_typed_literal(storage->world, 
                                               value, NULL, NULL);
   }
-#endif
 
   return NULL;
 }
@@ -1007,21 +2195,21 @@ librdf_storage_trees_register_factory(librdf_storage_factory *factory)
   factory->find_sources             = NULL;
   factory->find_arcs                = NULL;
   factory->find_targets             = NULL;
+  factory->has_arc_in               = librdf_storage_trees_has_arc_in;
+  factory->has_arc_out              = librdf_storage_trees_has_arc_out;
+  factory->get_arcs_in              = librdf_storage_trees_get_arcs_in;
+  factory->get_arcs_out             = librdf_storage_trees_get_arcs_out;
 
-#ifdef RDF_STORAGE_TREES_WITH_CONTEXTS
   factory->context_add_statement    = librdf_storage_trees_context_add_statement;
   factory->context_remove_statement = librdf_storage_trees_context_remove_statement;
+  factory->context_remove_statements = librdf_storage_trees_context_remove_statements;
   factory->context_serialise        = librdf_storage_trees_context_serialise;
+  factory->find_statements_in_context = librdf_storage_trees_find_statements_in_context;
   factory->get_contexts             = librdf_storage_trees_get_contexts;
-#else
-  factory->context_add_statement    = NULL;
-  factory->context_remove_statement = NULL;
-  factory->context_serialise        = NULL;
-  factory->get_contexts             = NULL;
-#endif
 
   factory->sync                     = NULL;
   factory->get_feature              = librdf_storage_trees_get_feature;
+  factory->estimate_statements      = librdf_storage_trees_estimate_statements;
 }
 
 
@@ -32,6 +32,7 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 #ifdef HAVE_STDLIB_H
 #include <stdlib.h>
@@ -102,11 +103,31 @@ librdf_new_stream(librdf_world *world,
 }
 
 
-/* helper function for deleting list map */
+/**
+ * librdf_stream_set_batch_method:
+ * @stream: #librdf_stream object
+ * @batch_method: pointer to function to get several statements at once
+ *
+ * INTERNAL - Set the optional batch method of a stream implementation.
+ *
+ * The batch method stores up to size SHARED statements, and their
+ * contexts when the contexts array is not NULL, starting at the
+ * current statement of the stream and moves past them.  It returns
+ * how many were stored, 0 at the end or <0 on failure.  The statements
+ * must stay valid until the next call on the stream context.
+ **/
+void
+librdf_stream_set_batch_method(librdf_stream* stream,
+                               int (*batch_method)(void*, librdf_statement**, librdf_node**, int))
+{
+  stream->batch_method=batch_method;
+}
+
+
+/* helper function for deleting a map */
 static void
-librdf_stream_free_stream_map(void *list_data, void *user_data) 
+librdf_stream_free_stream_map(librdf_stream_map* map)
 {
-  librdf_stream_map* map=(librdf_stream_map*)list_data;
   if(map->free_context)
     map->free_context(map->context);
   LIBRDF_FREE(librdf_stream_map, map);
@@ -124,16 +145,33 @@ librdf_stream_free_stream_map(void *list_data, void *user_data)
 void
 librdf_free_stream(librdf_stream* stream) 
 {
+  int i;
+
   if(!stream)
     return;
   
   if(stream->finished_method)
     stream->finished_method(stream->context);
 
-  if(stream->map_list) {
-    librdf_list_foreach(stream->map_list,
-                        librdf_stream_free_stream_map, NULL);
-    librdf_free_list(stream->map_list);
+  if(stream->maps) {
+    for(i = 0; i < stream->maps_count; i++)
+      librdf_stream_free_stream_map(stream->maps[i]);
+    LIBRDF_FREE(librdf_stream_map**, stream->maps);
+  }
+
+  if(stream->batch_statements) {
+    for(i = 0; i < stream->batch_size; i++)
+      librdf_statement_clear(&stream->batch_statements[i]);
+    LIBRDF_FREE(librdf_statement*, stream->batch_statements);
+  }
+  if(stream->batch_contexts) {
+    if(!stream->batch_method) {
+      for(i = 0; i < stream->batch_size; i++) {
+        if(stream->batch_contexts[i])
+          librdf_free_node(stream->batch_contexts[i]);
+      }
+    }
+    LIBRDF_FREE(librdf_node**, stream->batch_contexts);
   }
   
   LIBRDF_FREE(librdf_stream, stream);
@@ -161,34 +199,18 @@ librdf_stream_update_current_statement(librdf_stream* stream)
 
   /* find next statement subject to map */
   while(!stream->is_end_method(stream->context)) {
-    librdf_iterator* map_iterator; /* Iterator over stream->map_list librdf_list */
+    int i;
+
     statement=(librdf_statement*)stream->get_method(stream->context,
                                  LIBRDF_STREAM_GET_METHOD_GET_OBJECT);
     if(!statement)
       break;
 
-    if(!stream->map_list || !librdf_list_size(stream->map_list))
-      break;
-    
-    map_iterator=librdf_list_get_iterator(stream->map_list);
-    if(!map_iterator) {
-      statement=NULL;
-      break;
-    }
-    
-    while(!librdf_iterator_end(map_iterator)) {
-      librdf_stream_map *map=(librdf_stream_map*)librdf_iterator_get_object(map_iterator);
-      if(!map)
-        break;
-      
-      /* apply the map to the element  */
+    /* apply the maps to the element */
+    for(i = 0; statement && i < stream->maps_count; i++) {
+      librdf_stream_map *map=stream->maps[i];
       statement=map->fn(stream, map->context, statement);
-      if(!statement)
-        break;
-
-      librdf_iterator_next(map_iterator);
     }
-    librdf_free_iterator(map_iterator);
     
 
     /* found something, return it */
@@ -299,6 +321,10 @@ librdf_stream_get_context2(librdf_stream* stream)
   if(stream->is_finished)
     return NULL;
 
+  /* The statement being mapped in a batch is not the current one */
+  if(stream->is_mapping_batch)
+    return stream->mapping_context;
+
   /* Update current statement only if we are not already in the middle of the
      statement update process.
      Allows inspection of context nodes in stream map callbacks. */
@@ -361,13 +387,22 @@ librdf_stream_add_map(librdf_stream* stream,
 {
   librdf_stream_map *map;
   
-  if(!stream->map_list) {
-    stream->map_list=librdf_new_list(stream->world);
-    if(!stream->map_list) {
+  if(stream->maps_count == stream->maps_size) {
+    int new_size=stream->maps_size ? stream->maps_size * 2 : 2;
+    librdf_stream_map **new_maps;
+
+    new_maps=LIBRDF_MALLOC(librdf_stream_map**, new_size * sizeof(*new_maps));
+    if(!new_maps) {
       if(free_context && map_context)
         (*free_context)(map_context);
       return 1;
     }
+    if(stream->maps) {
+      memcpy(new_maps, stream->maps, stream->maps_count * sizeof(*new_maps));
+      LIBRDF_FREE(librdf_stream_map**, stream->maps);
+    }
+    stream->maps=new_maps;
+    stream->maps_size=new_size;
   }
 
   map = LIBRDF_CALLOC(librdf_stream_map*, 1, sizeof(*map));
@@ -381,17 +416,190 @@ librdf_stream_add_map(librdf_stream* stream,
   map->free_context=free_context;
   map->context=map_context;
 
-  if(librdf_list_add(stream->map_list, map)) {
-    LIBRDF_FREE(librdf_stream_map, map);
-    if(free_context && map_context)
-      (*free_context)(map_context);
-    return 1;
-  }
+  stream->maps[stream->maps_count++]=map;
   
   return 0;
 }
 
 
+/*
+ * librdf_stream_get_raw_batch:
+ * @stream: #librdf_stream object
+ * @statements: array for @size shared statements
+ * @size: size of the array, no more than stream->batch_size
+ *
+ * INTERNAL - Get the next statements before mapping, with their
+ * contexts in stream->batch_contexts, using the batch method or else
+ * copying them one by one into stream->batch_statements.
+ *
+ * Return value: number of statements, 0 at the end or <0 on failure
+ */
+static int
+librdf_stream_get_raw_batch(librdf_stream* stream,
+                            librdf_statement** statements, int size)
+{
+  int count;
+
+  if(stream->batch_method)
+    return stream->batch_method(stream->context, statements,
+                                stream->batch_contexts, size);
+
+  for(count = 0; count < size; count++) {
+    librdf_statement* batch_statement=&stream->batch_statements[count];
+    librdf_statement* statement;
+    librdf_node* context_node;
+
+    librdf_statement_clear(batch_statement);
+    if(stream->batch_contexts[count]) {
+      librdf_free_node(stream->batch_contexts[count]);
+      stream->batch_contexts[count]=NULL;
+    }
+
+    if(stream->is_end_method(stream->context))
+      break;
+
+    statement=(librdf_statement*)stream->get_method(stream->context,
+                                 LIBRDF_STREAM_GET_METHOD_GET_OBJECT);
+    if(!statement)
+      break;
+    context_node=(librdf_node*)stream->get_method(stream->context,
+                                 LIBRDF_STREAM_GET_METHOD_GET_CONTEXT);
+
+    /* copies only add references to the nodes */
+    if(statement->subject)
+      batch_statement->subject=librdf_new_node_from_node(statement->subject);
+    if(statement->predicate)
+      batch_statement->predicate=librdf_new_node_from_node(statement->predicate);
+    if(statement->object)
+      batch_statement->object=librdf_new_node_from_node(statement->object);
+    if(context_node)
+      stream->batch_contexts[count]=librdf_new_node_from_node(context_node);
+    statements[count]=batch_statement;
+
+    stream->next_method(stream->context);
+  }
+
+  return count;
+}
+
+
+/**
+ * librdf_stream_next_batch:
+ * @stream: #librdf_stream object
+ * @statements: array to store up to @size SHARED statements
+ * @contexts: array to store the context node (or NULL) of each statement, or NULL
+ * @size: size of the arrays
+ *
+ * Get the next statements in the stream and move past them.
+ *
+ * This gets statements from the stream implementation several at a
+ * time, applying each map of the stream to the whole batch, which
+ * avoids the per-statement calls of librdf_stream_end(),
+ * librdf_stream_get_object() and librdf_stream_next().
+ *
+ * The statements and contexts are SHARED and valid until the next call
+ * on the stream; they should be copied by the caller to preserve them.
+ * Fewer than @size statements may be returned before the end of the
+ * stream.
+ *
+ * Return value: number of statements stored, 0 at end of stream or <0 on failure
+ **/
+int
+librdf_stream_next_batch(librdf_stream* stream,
+                         librdf_statement** statements,
+                         librdf_node** contexts, int size)
+{
+  int count=0;
+  int i, j, n;
+
+  LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(statements, librdf_statement, -1);
+
+  if(!stream || stream->is_finished || size <= 0)
+    return 0;
+
+  if(size > stream->batch_size) {
+    librdf_node** new_contexts;
+
+    new_contexts=LIBRDF_CALLOC(librdf_node**, size, sizeof(librdf_node*));
+    if(!new_contexts)
+      return -1;
+
+    if(!stream->batch_method) {
+      librdf_statement* new_statements;
+
+      new_statements=LIBRDF_MALLOC(librdf_statement*,
+                                   size * sizeof(librdf_statement));
+      if(!new_statements) {
+        LIBRDF_FREE(librdf_node**, new_contexts);
+        return -1;
+      }
+      for(i = 0; i < size; i++)
+        librdf_statement_init(stream->world, &new_statements[i]);
+
+      if(stream->batch_statements) {
+        for(i = 0; i < stream->batch_size; i++) {
+          librdf_statement_clear(&stream->batch_statements[i]);
+          if(stream->batch_contexts[i])
+            librdf_free_node(stream->batch_contexts[i]);
+        }
+        LIBRDF_FREE(librdf_statement*, stream->batch_statements);
+      }
+      stream->batch_statements=new_statements;
+    }
+
+    if(stream->batch_contexts)
+      LIBRDF_FREE(librdf_node**, stream->batch_contexts);
+    stream->batch_contexts=new_contexts;
+    stream->batch_size=size;
+  }
+
+  /* the current statement has not been moved past so comes next */
+  stream->is_updated=0;
+  stream->current=NULL;
+
+  while(!count) {
+    n=librdf_stream_get_raw_batch(stream, statements, size);
+    if(n <= 0) {
+      stream->is_finished=1;
+      return n;
+    }
+
+    /* apply each map to the whole batch, dropping removed statements */
+    stream->is_mapping_batch=1;
+    for(j = 0; j < stream->maps_count; j++) {
+      librdf_stream_map *map=stream->maps[j];
+      int kept=0;
+
+      for(i = 0; i < n; i++) {
+        librdf_statement* statement;
+
+        stream->mapping_context=stream->batch_contexts[i];
+        statement=map->fn(stream, map->context, statements[i]);
+        if(statement) {
+          /* swap so that copied contexts are still freed */
+          librdf_node* context_node=stream->batch_contexts[kept];
+
+          statements[kept]=statement;
+          stream->batch_contexts[kept]=stream->batch_contexts[i];
+          stream->batch_contexts[i]=context_node;
+          kept++;
+        }
+      }
+      n=kept;
+    }
+    stream->is_mapping_batch=0;
+    stream->mapping_context=NULL;
+
+    count=n;
+  }
+
+  if(contexts)
+    memcpy(contexts, stream->batch_contexts, count * sizeof(librdf_node*));
+
+  return count;
+}
+
+
 
 static int librdf_stream_from_node_iterator_end_of_stream(void* context);
 static int librdf_stream_from_node_iterator_next_statement(void* context);
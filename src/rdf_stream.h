@@ -96,6 +96,8 @@ REDLAND_API
 librdf_node* librdf_stream_get_context2(librdf_stream* stream);
 REDLAND_API REDLAND_DEPRECATED
 void* librdf_stream_get_context(librdf_stream* stream);
+REDLAND_API
+int librdf_stream_next_batch(librdf_stream* stream, librdf_statement** statements, librdf_node** contexts, int size);
 
 REDLAND_API
 int librdf_stream_add_map(librdf_stream* stream, librdf_stream_map_handler map_function, librdf_stream_map_free_context_handler free_context, void *map_context);
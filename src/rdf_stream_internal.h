@@ -30,7 +30,7 @@
 extern "C" {
 #endif
 
-/* used in map_list below */
+/* used in maps below */
 typedef struct {
   void *context; /* context to pass on to map */
   librdf_stream_map_handler fn;
@@ -47,16 +47,33 @@ struct librdf_stream_s {
   
   /* Used when mapping */
   librdf_statement *current;
-  librdf_list *map_list; /* non-empty means there is a list of maps */
+  librdf_stream_map **maps; /* maps applied in order */
+  int maps_count;
+  int maps_size;
+
+  /* Used when getting batches */
+  librdf_node **batch_contexts; /* contexts of the batch */
+  librdf_statement *batch_statements; /* copies without a batch_method */
+  int batch_size;
+  int is_mapping_batch; /* 1 when mapping a batch */
+  librdf_node *mapping_context; /* context of the statement being mapped */
   
   int (*is_end_method)(void*);
   int (*next_method)(void*);
   void* (*get_method)(void*, int); /* flags: type of get */
   void (*finished_method)(void*);
+
+  /* Optional: store up to size shared statements and contexts from the
+   * current one on, move past them and return how many or <0 on failure.
+   * They must stay valid until the next call on the context.
+   */
+  int (*batch_method)(void*, librdf_statement**, librdf_node**, int);
 };
 
 librdf_statement* librdf_stream_statement_find_map(librdf_stream *stream, void* context, librdf_statement* statement);
 
+void librdf_stream_set_batch_method(librdf_stream* stream, int (*batch_method)(void*, librdf_statement**, librdf_node**, int));
+
 #ifdef __cplusplus
 }
 #endif
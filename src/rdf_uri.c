@@ -96,8 +96,13 @@ librdf_new_uri2(librdf_world *world,
                 const unsigned char *uri_string,
                 size_t length)
 {
-  return raptor_new_uri_from_counted_string(world->raptor_world_ptr,
-                                            uri_string, length);
+  librdf_uri* new_uri;
+
+  LIBRDF_REFERENCES_LOCK();
+  new_uri = raptor_new_uri_from_counted_string(world->raptor_world_ptr,
+                                               uri_string, length);
+  LIBRDF_REFERENCES_UNLOCK();
+  return new_uri;
 }
 
 
@@ -137,10 +142,14 @@ librdf_new_uri(librdf_world *world,
 librdf_uri*
 librdf_new_uri_from_uri (librdf_uri* old_uri)
 {
+  librdf_uri* new_uri;
 
   LIBRDF_ASSERT_OBJECT_POINTER_RETURN_VALUE(old_uri, librdf_uri, NULL);
 
-  return raptor_uri_copy(old_uri);
+  LIBRDF_REFERENCES_LOCK();
+  new_uri = raptor_uri_copy(old_uri);
+  LIBRDF_REFERENCES_UNLOCK();
+  return new_uri;
 }
 
 
@@ -157,8 +166,13 @@ librdf_uri*
 librdf_new_uri_from_uri_local_name (librdf_uri* old_uri, 
                                     const unsigned char *local_name)
 {
-  return raptor_new_uri_from_uri_local_name(raptor_uri_get_world(old_uri),
-                                            old_uri, local_name);
+  librdf_uri* new_uri;
+
+  LIBRDF_REFERENCES_LOCK();
+  new_uri = raptor_new_uri_from_uri_local_name(raptor_uri_get_world(old_uri),
+                                               old_uri, local_name);
+  LIBRDF_REFERENCES_UNLOCK();
+  return new_uri;
 }
 
 
@@ -194,9 +208,8 @@ librdf_new_uri_normalised_to_base(const unsigned char *uri_string,
     return NULL;
 
   /* empty URI - easy, just make from base_uri */
-  if(!*uri_string && base_uri) {
-    return raptor_uri_copy(base_uri);
-  }
+  if(!*uri_string && base_uri)
+    return librdf_new_uri_from_uri(base_uri);
   
   source_uri_string = librdf_uri_as_counted_string(source_uri,
                                                    &source_uri_string_length);
@@ -208,7 +221,11 @@ librdf_new_uri_normalised_to_base(const unsigned char *uri_string,
      strncmp((const char*)uri_string, (const char*)source_uri_string,
              source_uri_string_length)) {
     raptor_world* rworld = raptor_uri_get_world(base_uri);
-    return raptor_new_uri(rworld, uri_string);
+
+    LIBRDF_REFERENCES_LOCK();
+    new_uri = raptor_new_uri(rworld, uri_string);
+    LIBRDF_REFERENCES_UNLOCK();
+    return new_uri;
   }
 
   /* darn - is a fragment or matches, is a prefix of the source URI */
@@ -235,7 +252,9 @@ librdf_new_uri_normalised_to_base(const unsigned char *uri_string,
   strcpy((char*)new_uri_string + base_uri_string_length,
          (const char*)uri_string);
   
+  LIBRDF_REFERENCES_LOCK();
   new_uri = raptor_new_uri(raptor_uri_get_world(source_uri), new_uri_string);
+  LIBRDF_REFERENCES_UNLOCK();
   LIBRDF_FREE(char*, new_uri_string); /* always free this even on failure */
 
   return new_uri; /* new URI or NULL from librdf_new_uri failure */
@@ -259,9 +278,14 @@ librdf_uri*
 librdf_new_uri_relative_to_base(librdf_uri* base_uri,
                                 const unsigned char *uri_string)
 {
-  return raptor_new_uri_relative_to_base(raptor_uri_get_world(base_uri),
-                                         base_uri,
-                                         uri_string);
+  librdf_uri* new_uri;
+
+  LIBRDF_REFERENCES_LOCK();
+  new_uri = raptor_new_uri_relative_to_base(raptor_uri_get_world(base_uri),
+                                            base_uri,
+                                            uri_string);
+  LIBRDF_REFERENCES_UNLOCK();
+  return new_uri;
 }
 
 
@@ -308,7 +332,9 @@ librdf_free_uri(librdf_uri* uri)
   if(!uri)
     return;
   
+  LIBRDF_REFERENCES_LOCK();
   raptor_free_uri(uri);
+  LIBRDF_REFERENCES_UNLOCK();
 }
 
 
@@ -87,7 +87,8 @@ enum command_type {
   CMD_REMOVE_CONTEXT,
   CMD_CONTEXTS,
   CMD_MATCH,
-  CMD_SIZE
+  CMD_SIZE,
+  CMD_SNAPSHOT
 };
 
 typedef struct
@@ -127,6 +128,7 @@ static command commands[]={
   {CMD_CONTEXTS, "contexts", 0, 0, 0},
   {CMD_MATCH, "match", 3, 4, 0},
   {CMD_SIZE, "size", 0, 0, 0},
+  {CMD_SNAPSHOT, "snapshot", 1, 1, 0},
   {(enum command_type)-1, NULL, 0, 0, 0}  
 };
  
@@ -140,7 +142,7 @@ static command commands[]={
 #endif
 
 
-#define GETOPT_STRING "chno:pqr:s:t:TvV"
+#define GETOPT_STRING "chj:no:pqr:s:t:TvV"
 
 #ifdef HAVE_GETOPT_LONG
 static struct option long_options[] =
@@ -148,6 +150,7 @@ static struct option long_options[] =
   /* name, has_arg, flag, val */
   {"contexts", 0, 0, 'c'},
   {"help", 0, 0, 'h'},
+  {"threads", 1, 0, 'j'},
   {"new", 0, 0, 'n'},
   {"output", 1, 0, 'o'},
   {"password", 0, 0, 'p'},
@@ -279,6 +282,7 @@ main(int argc, char *argv[])
   unsigned int i;
   int rc;
   int transactions=0;
+  int threads=0;
   char *storage_name=(char*)default_storage_name;
   char *storage_options=(char*)default_storage_options;
   char *storage_password=NULL;
@@ -345,6 +349,14 @@ main(int argc, char *argv[])
         help=1;
         break;
 
+      case 'j':
+        threads=atoi(optarg);
+        if(threads < 1) {
+          fprintf(stderr, "%s: invalid argument `%s' for `" HELP_ARG(j, threads) "'\n", program, optarg);
+          usage=1;
+        }
+        break;
+
       case 'n':
         is_new=1;
         break;
@@ -580,6 +592,7 @@ main(int argc, char *argv[])
     puts("\nOptions:");
     puts(HELP_TEXT(c, "contexts        ", "Use Redland contexts"));
     puts(HELP_TEXT(h, "help            ", "Print this help, then exit"));
+    puts(HELP_TEXT(j, "threads N       ", "Parse N-Triples/N-Quads files with N threads"));
     puts(HELP_TEXT(n, "new             ", "Create a new store (default no)"));
     puts(HELP_TEXT(o, "output FORMAT   ", "Set the triple output format"));
     for(i = 0; 1; i++) {
@@ -647,6 +660,7 @@ main(int argc, char *argv[])
     puts("  arcs-in | arcs-out NODE                   Show properties in/out of NODE");
     puts("  has-arc-in | has-arc-out NODE ARC         Check for property in/out of NODE.");
     puts("  size                                      Print the number of triples in the graph.");
+    puts("  snapshot FILE                             Write the graph to a snapshot FILE.");
     puts("\nNotation:");
     puts("  nodes are either blank node identifiers like _:ABC,");
     puts("    URIs like http://example.org otherwise are literal strings.");
@@ -744,6 +758,18 @@ main(int argc, char *argv[])
         librdf_free_uri(uri);
         break;
       }
+      if(threads) {
+        librdf_uri* threads_uri=librdf_new_uri(world, (const unsigned char*)LIBRDF_PARSER_FEATURE_THREADS);
+        char threads_string[20];
+        librdf_node* threads_node;
+
+        sprintf(threads_string, "%d", threads);
+        threads_node=librdf_new_node_from_literal(world, (const unsigned char*)threads_string, NULL, 0);
+        librdf_parser_set_feature(parser, threads_uri, threads_node);
+        librdf_free_node(threads_node);
+        librdf_free_uri(threads_uri);
+      }
+
       if(verbosity)
         fprintf(stderr, "%s: Parsing URI %s with %s parser\n", program,
                 librdf_uri_as_string(uri), 
@@ -1565,6 +1591,14 @@ main(int argc, char *argv[])
         fprintf(stdout, "%s: graph has unknown number of triples\n", program);
       break;
 
+    case CMD_SNAPSHOT:
+      if(librdf_storage_write_snapshot(storage, argv[0]))
+        fprintf(stderr, "%s: Failed to write snapshot file %s\n", program,
+                argv[0]);
+      else if(verbosity)
+        fprintf(stderr, "%s: wrote snapshot file %s\n", program, argv[0]);
+      break;
+
     default:
       fprintf(stderr, "%s: Unknown command %d\n", program, type);
       return(1);